@@ -0,0 +1,493 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+#include "kerncompat.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "common/defs.h"
+#include "common/extent-cache.h"
+#include "common/messages.h"
+#include "check/checkpoint.h"
+
+/*
+ * The state file is plain text, one record per line:
+ *
+ *   btrfs-check-checkpoint 1
+ *   fsid <uuid>
+ *   generation <super generation>
+ *   mode <check mode> <check data csum>
+ *   phase <task position> <ret> <counter deltas...>
+ *   state <task position> <text>
+ *   root <objectid> <ret> <counter deltas...>
+ *
+ * The counter deltas are the contributions of the finished phase or root to
+ * the statistics printed at the end, they're added back when it's skipped.
+ * The deltas are the differences of the global counters, so the check must
+ * be serial. The state lines hold the results of a finished phase needed by
+ * the following ones, they're defined by the mode. The file is replaced by
+ * rename so it's always consistent.
+ */
+#define CHECKPOINT_MAGIC	"btrfs-check-checkpoint"
+#define CHECKPOINT_VERSION	2
+/* Minimum seconds between saves after a root is finished */
+#define CHECKPOINT_INTERVAL	30
+
+enum {
+	STAT_BYTES_USED,
+	STAT_CSUM_BYTES,
+	STAT_BTREE_BYTES,
+	STAT_FS_TREE_BYTES,
+	STAT_EXTENT_TREE_BYTES,
+	STAT_BTREE_SPACE_WASTE,
+	STAT_DATA_ALLOCATED,
+	STAT_DATA_REFERENCED,
+	STAT_NR,
+};
+
+struct checkpoint_record {
+	struct cache_extent cache;
+	bool done;
+	int ret;
+	u64 delta[STAT_NR];
+};
+
+struct checkpoint_state {
+	struct list_head list;
+	char line[];
+};
+
+static struct {
+	char *path;
+	char *tmp_path;
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+	int mode;
+	struct checkpoint_record phases[TASK_NOTHING];
+	struct list_head states[TASK_NOTHING];
+	struct cache_tree roots;
+	u64 phase_start[STAT_NR];
+	u64 root_start[STAT_NR];
+	time_t last_save;
+	bool warned;
+} cp;
+
+static u64 * const stats[STAT_NR] = {
+	[STAT_BYTES_USED]		= &bytes_used,
+	[STAT_CSUM_BYTES]		= &total_csum_bytes,
+	[STAT_BTREE_BYTES]		= &total_btree_bytes,
+	[STAT_FS_TREE_BYTES]		= &total_fs_tree_bytes,
+	[STAT_EXTENT_TREE_BYTES]	= &total_extent_tree_bytes,
+	[STAT_BTREE_SPACE_WASTE]	= &btree_space_waste,
+	[STAT_DATA_ALLOCATED]		= &data_bytes_allocated,
+	[STAT_DATA_REFERENCED]		= &data_bytes_referenced,
+};
+
+static inline bool checkpoint_enabled(void)
+{
+	return cp.path != NULL;
+}
+
+static void read_stats(u64 *values)
+{
+	int i;
+
+	for (i = 0; i < STAT_NR; i++)
+		values[i] = *stats[i];
+}
+
+static void finish_record(struct checkpoint_record *rec, const u64 *start,
+			  int ret)
+{
+	int i;
+
+	for (i = 0; i < STAT_NR; i++)
+		rec->delta[i] = *stats[i] - start[i];
+	rec->ret = ret;
+	rec->done = true;
+}
+
+static void apply_record(struct checkpoint_record *rec)
+{
+	int i;
+
+	for (i = 0; i < STAT_NR; i++)
+		*stats[i] += rec->delta[i];
+}
+
+static void print_record(FILE *file, const char *type, u64 id,
+			 struct checkpoint_record *rec)
+{
+	int i;
+
+	fprintf(file, "%s %llu %d", type, id, rec->ret);
+	for (i = 0; i < STAT_NR; i++)
+		fprintf(file, " %llu", rec->delta[i]);
+	fprintf(file, "\n");
+}
+
+static int parse_record(char *line, struct checkpoint_record *rec)
+{
+	char *end;
+	int i;
+
+	rec->ret = strtol(line, &end, 10);
+	if (end == line)
+		return -EINVAL;
+	for (i = 0; i < STAT_NR; i++) {
+		line = end;
+		rec->delta[i] = strtoull(line, &end, 10);
+		if (end == line)
+			return -EINVAL;
+	}
+	rec->done = true;
+	return 0;
+}
+
+static int save_checkpoint(void)
+{
+	struct cache_extent *cache;
+	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
+	FILE *file;
+	int i;
+
+	file = fopen(cp.tmp_path, "w");
+	if (!file)
+		return -errno;
+
+	uuid_unparse(cp.fsid, uuidbuf);
+	fprintf(file, "%s %d\n", CHECKPOINT_MAGIC, CHECKPOINT_VERSION);
+	fprintf(file, "fsid %s\n", uuidbuf);
+	fprintf(file, "generation %llu\n", cp.generation);
+	fprintf(file, "mode %d %d\n", cp.mode, check_data_csum);
+	for (i = 0; i < TASK_NOTHING; i++) {
+		struct checkpoint_state *state;
+
+		if (!cp.phases[i].done)
+			continue;
+		print_record(file, "phase", i, &cp.phases[i]);
+		list_for_each_entry(state, &cp.states[i], list)
+			fprintf(file, "state %d %s\n", i, state->line);
+	}
+	for (cache = first_cache_extent(&cp.roots); cache;
+	     cache = next_cache_extent(cache))
+		print_record(file, "root", cache->start,
+			     container_of(cache, struct checkpoint_record, cache));
+
+	if (fflush(file) || fsync(fileno(file))) {
+		fclose(file);
+		return -errno;
+	}
+	if (fclose(file))
+		return -errno;
+	if (rename(cp.tmp_path, cp.path) < 0)
+		return -errno;
+	cp.last_save = time(NULL);
+	return 0;
+}
+
+static void update_checkpoint(bool force)
+{
+	int ret;
+
+	if (!force && time(NULL) - cp.last_save < CHECKPOINT_INTERVAL)
+		return;
+	ret = save_checkpoint();
+	if (ret < 0 && !cp.warned) {
+		errno = -ret;
+		warning("cannot save checkpoint to %s: %m", cp.path);
+		cp.warned = true;
+	}
+}
+
+static struct checkpoint_record *add_root_record(u64 objectid)
+{
+	struct checkpoint_record *rec;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+	rec->cache.start = objectid;
+	rec->cache.size = 1;
+	if (insert_cache_extent(&cp.roots, &rec->cache)) {
+		free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+static int add_state(enum task_position phase, const char *line)
+{
+	struct checkpoint_state *state;
+
+	state = malloc(sizeof(*state) + strlen(line) + 1);
+	if (!state)
+		return -ENOMEM;
+	strcpy(state->line, line);
+	list_add_tail(&state->list, &cp.states[phase]);
+	return 0;
+}
+
+static int load_checkpoint(FILE *file)
+{
+	struct checkpoint_record *rec;
+	char line[1024];
+	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
+	u8 fsid[BTRFS_FSID_SIZE];
+	unsigned long long id;
+	int version;
+	int mode;
+	int data_csum;
+	int pos;
+
+	if (!fgets(line, sizeof(line), file) ||
+	    sscanf(line, CHECKPOINT_MAGIC " %d", &version) != 1)
+		return -EINVAL;
+	if (version != CHECKPOINT_VERSION) {
+		error("unsupported checkpoint version %d", version);
+		return -ESTALE;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "fsid %36s", uuidbuf) == 1) {
+			if (uuid_parse(uuidbuf, fsid))
+				return -EINVAL;
+			if (memcmp(fsid, cp.fsid, BTRFS_FSID_SIZE)) {
+				error("checkpoint is for a different filesystem %s",
+				      uuidbuf);
+				return -ESTALE;
+			}
+		} else if (sscanf(line, "generation %llu", &id) == 1) {
+			if (id != cp.generation) {
+				error(
+		"filesystem changed since the checkpoint, generation %llu expected %llu",
+				      cp.generation, id);
+				return -ESTALE;
+			}
+		} else if (sscanf(line, "mode %d %d", &mode, &data_csum) == 2) {
+			if (mode != cp.mode || data_csum != check_data_csum) {
+				error(
+		"checkpoint was created with a different mode or --check-data-csum");
+				return -ESTALE;
+			}
+		} else if (sscanf(line, "phase %llu %n", &id, &pos) == 1) {
+			if (id >= TASK_NOTHING ||
+			    parse_record(line + pos, &cp.phases[id]))
+				return -EINVAL;
+		} else if (sscanf(line, "state %llu %n", &id, &pos) == 1) {
+			if (id >= TASK_NOTHING)
+				return -EINVAL;
+			line[strcspn(line, "\n")] = 0;
+			if (add_state(id, line + pos))
+				return -ENOMEM;
+		} else if (sscanf(line, "root %llu %n", &id, &pos) == 1) {
+			rec = add_root_record(id);
+			if (!rec || parse_record(line + pos, rec))
+				return -EINVAL;
+		} else {
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start saving the progress to @path, if @resume is set load the progress
+ * saved there by a previous run of the same check on the same filesystem
+ * first.
+ */
+int checkpoint_open(const char *path, bool resume, struct btrfs_fs_info *fs_info,
+		    int mode)
+{
+	FILE *file;
+	int ret;
+	int i;
+
+	cache_tree_init(&cp.roots);
+	for (i = 0; i < TASK_NOTHING; i++)
+		INIT_LIST_HEAD(&cp.states[i]);
+	memcpy(cp.fsid, fs_info->super_copy->fsid, BTRFS_FSID_SIZE);
+	cp.generation = btrfs_super_generation(fs_info->super_copy);
+	cp.mode = mode;
+	cp.path = strdup(path);
+	if (!cp.path || asprintf(&cp.tmp_path, "%s.tmp", path) < 0) {
+		cp.tmp_path = NULL;
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	if (resume) {
+		file = fopen(path, "r");
+		if (!file) {
+			ret = -errno;
+			error("cannot open checkpoint %s: %m", path);
+			goto fail;
+		}
+		ret = load_checkpoint(file);
+		fclose(file);
+		if (ret < 0) {
+			if (ret == -EINVAL)
+				error("invalid checkpoint %s", path);
+			goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	checkpoint_close();
+	return ret;
+}
+
+void checkpoint_close(void)
+{
+	struct cache_extent *cache;
+	struct checkpoint_state *state;
+	int i;
+
+	while ((cache = first_cache_extent(&cp.roots))) {
+		remove_cache_extent(&cp.roots, cache);
+		free(container_of(cache, struct checkpoint_record, cache));
+	}
+	for (i = 0; i < TASK_NOTHING && cp.path; i++) {
+		while (!list_empty(&cp.states[i])) {
+			state = list_first_entry(&cp.states[i],
+					struct checkpoint_state, list);
+			list_del(&state->list);
+			free(state);
+		}
+	}
+	free(cp.path);
+	free(cp.tmp_path);
+	cp.path = NULL;
+	cp.tmp_path = NULL;
+}
+
+/*
+ * Return true if @phase was finished in the previous run, its statistics are
+ * added and its result is returned in @ret.
+ */
+bool checkpoint_phase_done(enum task_position phase, int *ret)
+{
+	if (!checkpoint_enabled() || !cp.phases[phase].done)
+		return false;
+	apply_record(&cp.phases[phase]);
+	*ret = cp.phases[phase].ret;
+	return true;
+}
+
+/*
+ * Save a line of the state of @phase, the lines are written together with the
+ * finished phase and can be read by checkpoint_phase_for_each_state() when it
+ * is skipped after resume.
+ */
+int checkpoint_phase_add_state(enum task_position phase, const char *fmt, ...)
+{
+	va_list args;
+	char *line;
+	int ret;
+
+	if (!checkpoint_enabled())
+		return 0;
+	va_start(args, fmt);
+	ret = vasprintf(&line, fmt, args);
+	va_end(args);
+	if (ret < 0)
+		return -ENOMEM;
+	ret = add_state(phase, line);
+	free(line);
+	return ret;
+}
+
+/* Call @fn for each state line of @phase saved in the previous run */
+int checkpoint_phase_for_each_state(enum task_position phase,
+				    int (*fn)(const char *line, void *data),
+				    void *data)
+{
+	struct checkpoint_state *state;
+	int ret;
+
+	if (!checkpoint_enabled())
+		return 0;
+	list_for_each_entry(state, &cp.states[phase], list) {
+		ret = fn(state->line, data);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* Return true if @phase was finished in the previous run, no side effects */
+bool checkpoint_phase_saved(enum task_position phase)
+{
+	return checkpoint_enabled() && cp.phases[phase].done;
+}
+
+void checkpoint_phase_start(enum task_position phase)
+{
+	if (checkpoint_enabled())
+		read_stats(cp.phase_start);
+}
+
+void checkpoint_phase_finish(enum task_position phase, int ret)
+{
+	if (!checkpoint_enabled())
+		return;
+	finish_record(&cp.phases[phase], cp.phase_start, ret);
+	update_checkpoint(true);
+}
+
+/* Same as checkpoint_phase_done() for one root of the fs roots phase */
+bool checkpoint_root_done(u64 objectid, int *ret)
+{
+	struct cache_extent *cache;
+	struct checkpoint_record *rec;
+
+	if (!checkpoint_enabled())
+		return false;
+	cache = lookup_cache_extent(&cp.roots, objectid, 1);
+	if (!cache)
+		return false;
+	rec = container_of(cache, struct checkpoint_record, cache);
+	apply_record(rec);
+	*ret = rec->ret;
+	return true;
+}
+
+void checkpoint_root_start(u64 objectid)
+{
+	if (checkpoint_enabled())
+		read_stats(cp.root_start);
+}
+
+void checkpoint_root_finish(u64 objectid, int ret)
+{
+	struct checkpoint_record *rec;
+
+	if (!checkpoint_enabled())
+		return;
+	rec = add_root_record(objectid);
+	if (!rec)
+		return;
+	finish_record(rec, cp.root_start, ret);
+	update_checkpoint(false);
+}
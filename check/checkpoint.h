@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Progress of a read-only check saved to a file so an interrupted check can
+ * be resumed, without the need to redo the finished phases and roots.
+ */
+#ifndef __BTRFS_CHECK_CHECKPOINT_H__
+#define __BTRFS_CHECK_CHECKPOINT_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include "check/mode-common.h"
+
+struct btrfs_fs_info;
+
+int checkpoint_open(const char *path, bool resume, struct btrfs_fs_info *fs_info,
+		    int mode);
+void checkpoint_close(void);
+bool checkpoint_phase_done(enum task_position phase, int *ret);
+bool checkpoint_phase_saved(enum task_position phase);
+__attribute__ ((format (printf, 2, 3)))
+int checkpoint_phase_add_state(enum task_position phase, const char *fmt, ...);
+int checkpoint_phase_for_each_state(enum task_position phase,
+				    int (*fn)(const char *line, void *data),
+				    void *data);
+void checkpoint_phase_start(enum task_position phase);
+void checkpoint_phase_finish(enum task_position phase, int ret);
+bool checkpoint_root_done(u64 objectid, int *ret);
+void checkpoint_root_start(u64 objectid);
+void checkpoint_root_finish(u64 objectid, int ret);
+
+#endif
@@ -27,6 +27,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include "kernel-lib/list.h"
 #include "kernel-lib/rbtree.h"
@@ -52,6 +53,11 @@
 #include "common/help.h"
 #include "common/open-utils.h"
 #include "common/string-utils.h"
+#include "common/units.h"
+#include "common/mem-limit.h"
+#include "common/parse-utils.h"
+#include "common/workqueue.h"
+#include "common/slab.h"
 #include "cmds/commands.h"
 #include "mkfs/common.h"
 #include "check/common.h"
@@ -61,6 +67,7 @@
 #include "check/mode-lowmem.h"
 #include "check/qgroup-verify.h"
 #include "check/clear-cache.h"
+#include "check/checkpoint.h"
 #include "ioctl.h"
 
 /* Global context variables */
@@ -80,6 +87,7 @@ int no_holes = 0;
 static int is_free_space_tree = 0;
 int init_extent_tree = 0;
 int check_data_csum = 0;
+int nr_check_threads = 1;
 struct cache_tree *roots_info_cache = NULL;
 
 enum btrfs_check_mode {
@@ -212,11 +220,13 @@ static void print_status_check_line(void *p)
 		"[7/7] checking quota groups                   ",
 	};
 	time_t elapsed;
+	time_t total;
 	int hours;
 	int minutes;
 	int seconds;
 
 	elapsed = time(NULL) - priv->start_time;
+	total = elapsed;
 	hours   = elapsed  / 3600;
 	elapsed -= hours   * 3600;
 	minutes = elapsed  / 60;
@@ -225,6 +235,11 @@ static void print_status_check_line(void *p)
 
 	printf("%s (%d:%02d:%02d elapsed", task_position_string[priv->tp],
 			hours, minutes, seconds);
+	if (priv->tp == TASK_CSUMS && priv->data_bytes > 0) {
+		printf(", %s verified", pretty_size(priv->data_bytes));
+		if (total > 0)
+			printf(" at %s/s", pretty_size(priv->data_bytes / total));
+	}
 	if (priv->item_count > 0)
 		printf(", %llu items checked)\r", priv->item_count);
 	else
@@ -488,6 +503,61 @@ static int device_record_compare(struct rb_node *node1, struct rb_node *node2)
 		return 0;
 }
 
+/*
+ * The original mode keeps one of the records below for each inode and extent.
+ * They're packed into slabs that are accounted against the global memory
+ * limit, growing them may shrink the tree block cache. This only saves the
+ * malloc() overhead, the records keep their layout and lookup structures.
+ */
+static struct btrfs_slab inode_rec_slab =
+	BTRFS_SLAB_INIT(inode_rec_slab, struct inode_record,
+			BTRFS_MEM_CHECK_INODES);
+static struct btrfs_slab ptr_node_slab =
+	BTRFS_SLAB_INIT(ptr_node_slab, struct ptr_node,
+			BTRFS_MEM_CHECK_INODES);
+static struct btrfs_slab shared_node_slab =
+	BTRFS_SLAB_INIT(shared_node_slab, struct shared_node,
+			BTRFS_MEM_CHECK_INODES);
+static struct btrfs_slab extent_rec_slab =
+	BTRFS_SLAB_INIT(extent_rec_slab, struct extent_record,
+			BTRFS_MEM_CHECK_EXTENTS);
+static struct btrfs_slab tree_backref_slab =
+	BTRFS_SLAB_INIT(tree_backref_slab, struct tree_backref,
+			BTRFS_MEM_CHECK_EXTENTS);
+static struct btrfs_slab data_backref_slab =
+	BTRFS_SLAB_INIT(data_backref_slab, struct data_backref,
+			BTRFS_MEM_CHECK_EXTENTS);
+
+static void destroy_record_slabs(void)
+{
+	btrfs_slab_destroy(&inode_rec_slab);
+	btrfs_slab_destroy(&ptr_node_slab);
+	btrfs_slab_destroy(&shared_node_slab);
+	btrfs_slab_destroy(&extent_rec_slab);
+	btrfs_slab_destroy(&tree_backref_slab);
+	btrfs_slab_destroy(&data_backref_slab);
+}
+
+static struct inode_record *__alloc_inode_rec(void)
+{
+	return btrfs_slab_zalloc(&inode_rec_slab);
+}
+
+static void __free_inode_rec(struct inode_record *rec)
+{
+	btrfs_slab_free(&inode_rec_slab, rec);
+}
+
+static struct ptr_node *alloc_ptr_node(void)
+{
+	return btrfs_slab_alloc(&ptr_node_slab);
+}
+
+static void free_ptr_node(struct ptr_node *node)
+{
+	btrfs_slab_free(&ptr_node_slab, node);
+}
+
 static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 {
 	struct inode_record *rec;
@@ -502,7 +572,7 @@ static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 	size_t size;
 	int ret;
 
-	rec = malloc(sizeof(*rec));
+	rec = __alloc_inode_rec();
 	if (!rec)
 		return ERR_PTR(-ENOMEM);
 	memcpy(rec, orig_rec, sizeof(*rec));
@@ -580,7 +650,7 @@ cleanup:
 			free(src);
 		}
 
-	free(rec);
+	__free_inode_rec(rec);
 
 	return ERR_PTR(ret);
 }
@@ -748,7 +818,7 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 			rec = node->data;
 		}
 	} else if (mod) {
-		rec = calloc(1, sizeof(*rec));
+		rec = __alloc_inode_rec();
 		if (!rec)
 			return ERR_PTR(-ENOMEM);
 		rec->ino = ino;
@@ -759,9 +829,9 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 		INIT_LIST_HEAD(&rec->unaligned_extent_recs);
 		rec->holes = RB_ROOT;
 
-		node = malloc(sizeof(*node));
+		node = alloc_ptr_node();
 		if (!node) {
-			free(rec);
+			__free_inode_rec(rec);
 			return ERR_PTR(-ENOMEM);
 		}
 		node->cache.start = ino;
@@ -808,7 +878,7 @@ static void free_inode_rec(struct inode_record *rec)
 		free(hash);
 	free_unaligned_extent_recs(&rec->unaligned_extent_recs);
 	free_file_extent_holes(&rec->holes);
-	free(rec);
+	__free_inode_rec(rec);
 }
 
 static int can_free_inode_rec(struct inode_record *rec)
@@ -879,7 +949,7 @@ static void maybe_free_inode_rec(struct cache_tree *inode_cache,
 		node = container_of(cache, struct ptr_node, cache);
 		BUG_ON(node->data != rec);
 		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
+		free_ptr_node(node);
 		free_inode_rec(rec);
 	}
 }
@@ -1149,7 +1219,7 @@ again:
 			remove_cache_extent(src, &node->cache);
 			ins = node;
 		} else {
-			ins = malloc(sizeof(*ins));
+			ins = alloc_ptr_node();
 			BUG_ON(!ins);
 			ins->cache.start = node->cache.start;
 			ins->cache.size = node->cache.size;
@@ -1168,7 +1238,7 @@ again:
 			}
 			maybe_free_inode_rec(dst, conflict);
 			free_inode_rec(rec);
-			free(ins);
+			free_ptr_node(ins);
 		} else {
 			BUG_ON(ret);
 		}
@@ -1200,7 +1270,7 @@ static void free_inode_ptr(struct cache_extent *cache)
 	node = container_of(cache, struct ptr_node, cache);
 	rec = node->data;
 	free_inode_rec(rec);
-	free(node);
+	free_ptr_node(node);
 }
 
 FREE_EXTENT_CACHE_BASED_TREE(inode_recs, free_inode_ptr);
@@ -1219,12 +1289,24 @@ static struct shared_node *find_shared_node(struct cache_tree *shared,
 	return NULL;
 }
 
+static void free_shared_node(struct shared_node *node)
+{
+	btrfs_slab_free(&shared_node_slab, node);
+}
+
+static void free_shared_node_cache(struct cache_extent *cache)
+{
+	free_shared_node(container_of(cache, struct shared_node, cache));
+}
+
+FREE_EXTENT_CACHE_BASED_TREE(shared_nodes, free_shared_node_cache);
+
 static int add_shared_node(struct cache_tree *shared, u64 bytenr, u32 refs)
 {
 	int ret;
 	struct shared_node *node;
 
-	node = calloc(1, sizeof(*node));
+	node = btrfs_slab_zalloc(&shared_node_slab);
 	if (!node)
 		return -ENOMEM;
 	node->cache.start = bytenr;
@@ -1265,7 +1347,7 @@ static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 			free_inode_recs_tree(&node->root_cache);
 			free_inode_recs_tree(&node->inode_cache);
 			remove_cache_extent(&wc->shared, &node->cache);
-			free(node);
+			free_shared_node(node);
 		}
 		return 1;
 	}
@@ -1274,7 +1356,7 @@ static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 	splice_shared_node(node, dest);
 	if (node->refs == 0) {
 		remove_cache_extent(&wc->shared, &node->cache);
-		free(node);
+		free_shared_node(node);
 	}
 	return 1;
 }
@@ -3067,7 +3149,7 @@ static int check_inode_recs(struct btrfs_root *root,
 			/* Need to free everything up and rescan */
 			if (stage == 3) {
 				remove_cache_extent(inode_cache, &node->cache);
-				free(node);
+				free_ptr_node(node);
 				free_inode_rec(rec);
 				continue;
 			}
@@ -3138,7 +3220,7 @@ static int check_inode_recs(struct btrfs_root *root,
 		node = container_of(cache, struct ptr_node, cache);
 		rec = node->data;
 		remove_cache_extent(inode_cache, &node->cache);
-		free(node);
+		free_ptr_node(node);
 		if (rec->ino == root_dirid ||
 		    rec->ino == BTRFS_ORPHAN_OBJECTID) {
 			free_inode_rec(rec);
@@ -3333,7 +3415,7 @@ static int merge_root_recs(struct btrfs_root *root,
 		node = container_of(cache, struct ptr_node, cache);
 		rec = node->data;
 		remove_cache_extent(src_cache, &node->cache);
-		free(node);
+		free_ptr_node(node);
 
 		ret = is_child_root(root, root->objectid, rec->ino);
 		if (ret < 0)
@@ -3479,6 +3561,126 @@ static int check_root_refs(struct btrfs_root *root,
 	return errors > 0 ? 1 : 0;
 }
 
+/*
+ * Save the root records collected by the fs roots walk to the checkpoint, the
+ * root refs check needs them when the walk is skipped after resume.
+ */
+static int save_root_recs(struct cache_tree *root_cache)
+{
+	struct cache_extent *cache;
+	struct root_record *rec;
+	struct root_backref *backref;
+	char *name;
+	int ret;
+	int i;
+
+	for (cache = first_cache_extent(root_cache); cache;
+	     cache = next_cache_extent(cache)) {
+		rec = container_of(cache, struct root_record, cache);
+		ret = checkpoint_phase_add_state(TASK_FS_ROOTS,
+				"root_rec %llu %u %u", rec->objectid,
+				rec->found_root_item, rec->found_ref);
+		if (ret < 0)
+			goto fail;
+
+		list_for_each_entry(backref, &rec->backrefs, list) {
+			/* The name is not limited to printable characters */
+			name = malloc(backref->namelen * 2 + 1);
+			if (!name) {
+				ret = -ENOMEM;
+				goto fail;
+			}
+			name[0] = 0;
+			for (i = 0; i < backref->namelen; i++)
+				sprintf(name + i * 2, "%02x",
+					(u8)backref->name[i]);
+			ret = checkpoint_phase_add_state(TASK_FS_ROOTS,
+				"root_backref %llu %llu %llu %llu %u %u %u %u %u %d %u %s",
+				rec->objectid, backref->ref_root, backref->dir,
+				backref->index, backref->found_dir_item,
+				backref->found_dir_index, backref->found_back_ref,
+				backref->found_forward_ref, backref->reachable,
+				backref->errors, backref->namelen, name);
+			free(name);
+			if (ret < 0)
+				goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	errno = -ret;
+	error("cannot save the checkpoint state: %m");
+	return ret;
+}
+
+/* Add back a root record or its backref saved by save_root_recs() */
+static int load_root_rec(const char *line, void *data)
+{
+	struct cache_tree *root_cache = data;
+	struct root_record *rec;
+	struct root_backref *backref;
+	unsigned long long objectid, ref_root, dir, index;
+	unsigned int found_root_item, found_ref;
+	unsigned int dir_item, dir_index, back_ref, forward_ref, reachable;
+	unsigned int namelen;
+	unsigned int byte;
+	char name[BTRFS_NAME_LEN];
+	int errors;
+	int pos;
+	int i;
+
+	if (sscanf(line, "root_rec %llu %u %u", &objectid, &found_root_item,
+		   &found_ref) == 3) {
+		rec = get_root_rec(root_cache, objectid);
+		if (IS_ERR(rec))
+			return PTR_ERR(rec);
+		rec->found_root_item = found_root_item;
+		rec->found_ref = found_ref;
+		return 0;
+	}
+
+	if (sscanf(line, "root_backref %llu %llu %llu %llu %u %u %u %u %u %d %u %n",
+		   &objectid, &ref_root, &dir, &index, &dir_item, &dir_index,
+		   &back_ref, &forward_ref, &reachable, &errors, &namelen,
+		   &pos) != 11 || namelen > BTRFS_NAME_LEN)
+		return -EINVAL;
+	for (i = 0; i < namelen; i++) {
+		if (sscanf(line + pos + i * 2, "%2x", &byte) != 1)
+			return -EINVAL;
+		name[i] = byte;
+	}
+	rec = get_root_rec(root_cache, objectid);
+	if (IS_ERR(rec))
+		return PTR_ERR(rec);
+	backref = get_root_backref(rec, ref_root, dir, index, name, namelen);
+	if (!backref)
+		return -ENOMEM;
+	backref->index = index;
+	backref->found_dir_item = dir_item;
+	backref->found_dir_index = dir_index;
+	backref->found_back_ref = back_ref;
+	backref->found_forward_ref = forward_ref;
+	backref->reachable = reachable;
+	backref->errors = errors;
+	return 0;
+}
+
+/* Load the state of a @phase skipped after resume by @fn */
+static int load_checkpoint_state(enum task_position phase,
+				 int (*fn)(const char *line, void *data),
+				 void *data)
+{
+	int ret;
+
+	ret = checkpoint_phase_for_each_state(phase, fn, data);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot load the checkpoint state: %m");
+	}
+	return ret;
+}
+
 static int process_root_ref(struct extent_buffer *eb, int slot,
 			    struct btrfs_key *key,
 			    struct cache_tree *root_cache)
@@ -3613,25 +3815,42 @@ out:
 	return ret;
 }
 
-static int check_fs_root(struct btrfs_root *root,
-			 struct cache_tree *root_cache,
-			 struct walk_control *wc)
-{
-	int ret = 0;
-	int err = 0;
-	bool generation_err = false;
-	int wret;
-	int level;
-	u64 super_generation;
-	struct btrfs_path path;
+/*
+ * State of one fs tree between the walk, that collects the inode and root
+ * records and may run in a worker thread, and the check of the records.
+ */
+struct fs_root_walk {
+	struct btrfs_work work;
+	struct list_head list;
+	struct list_head group_list;
+	struct fs_roots_walker *walker;
+	struct fs_root_group *group;
+	struct btrfs_root *root;
+	struct walk_control *wc;
 	struct shared_node root_node;
-	struct root_record *rec;
-	struct btrfs_root_item *root_item = &root->root_item;
 	struct cache_tree corrupt_blocks;
+	bool generation_err;
+	/* The root block is invalid, there are no records to check */
+	bool bad_root;
+	bool done;
+	int ret;
+};
+
+static void walk_fs_root(struct fs_root_walk *walk)
+{
+	struct btrfs_root *root = walk->root;
+	struct walk_control *wc = walk->wc;
+	struct shared_node *root_node = &walk->root_node;
+	struct btrfs_root_item *root_item = &root->root_item;
+	struct btrfs_path path;
 	enum btrfs_tree_block_status status;
 	struct node_refs nrefs;
 	struct unaligned_extent_rec_t *urec;
 	struct unaligned_extent_rec_t *tmp;
+	u64 super_generation;
+	int level;
+	int wret;
+	int ret = 0;
 
 	super_generation = btrfs_super_generation(gfs_info->super_copy);
 	if (btrfs_root_generation(root_item) > super_generation + 1) {
@@ -3639,14 +3858,14 @@ static int check_fs_root(struct btrfs_root *root,
 	"invalid generation for root %llu, have %llu expect (0, %llu]",
 		      root->root_key.objectid, btrfs_root_generation(root_item),
 		      super_generation + 1);
-		generation_err = true;
+		walk->generation_err = true;
 		if (opt_check_repair) {
-			root->node->flags |= EXTENT_BAD_TRANSID;
+			extent_buffer_set_flags(root->node, EXTENT_BAD_TRANSID);
 			ret = recow_extent_buffer(root, root->node);
 			if (!ret) {
 				printf("Reset generation for root %llu\n",
 					root->root_key.objectid);
-				generation_err = false;
+				walk->generation_err = false;
 			}
 		}
 	}
@@ -3656,20 +3875,13 @@ static int check_fs_root(struct btrfs_root *root,
 	 * Unlike the usage in extent tree check, here we do it in a per
 	 * fs/subvol tree base.
 	 */
-	cache_tree_init(&corrupt_blocks);
-	gfs_info->corrupt_blocks = &corrupt_blocks;
-
-	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
-		rec = get_root_rec(root_cache, root->root_key.objectid);
-		BUG_ON(IS_ERR(rec));
-		if (btrfs_root_refs(root_item) > 0)
-			rec->found_root_item = 1;
-	}
+	cache_tree_init(&walk->corrupt_blocks);
+	btrfs_set_thread_corrupt_blocks(&walk->corrupt_blocks);
 
 	btrfs_init_path(&path);
-	memset(&root_node, 0, sizeof(root_node));
-	cache_tree_init(&root_node.root_cache);
-	cache_tree_init(&root_node.inode_cache);
+	memset(root_node, 0, sizeof(*root_node));
+	cache_tree_init(&root_node->root_cache);
+	cache_tree_init(&root_node->inode_cache);
 	memset(&nrefs, 0, sizeof(nrefs));
 
 	/* Mode unaligned extent recs to corresponding inode record */
@@ -3677,7 +3889,7 @@ static int check_fs_root(struct btrfs_root *root,
 			&root->unaligned_extent_recs, list) {
 		struct inode_record *inode;
 
-		inode = get_inode_rec(&root_node.inode_cache, urec->owner, 1);
+		inode = get_inode_rec(&root_node->inode_cache, urec->owner, 1);
 
 		if (IS_ERR_OR_NULL(inode)) {
 			fprintf(stderr,
@@ -3696,7 +3908,7 @@ static int check_fs_root(struct btrfs_root *root,
 
 	level = btrfs_header_level(root->node);
 	memset(wc->nodes, 0, sizeof(wc->nodes));
-	wc->nodes[level] = &root_node;
+	wc->nodes[level] = root_node;
 	wc->active_node = level;
 	wc->root_level = level;
 
@@ -3705,8 +3917,11 @@ static int check_fs_root(struct btrfs_root *root,
 		status = btrfs_check_leaf(gfs_info, NULL, root->node);
 	else
 		status = btrfs_check_node(gfs_info, NULL, root->node);
-	if (status != BTRFS_TREE_BLOCK_CLEAN)
-		return -EIO;
+	if (status != BTRFS_TREE_BLOCK_CLEAN) {
+		walk->bad_root = true;
+		ret = -EIO;
+		goto out;
+	}
 
 	if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
@@ -3735,7 +3950,7 @@ static int check_fs_root(struct btrfs_root *root,
 	}
 
 	while (1) {
-		g_task_ctx.item_count++;
+		check_stat_add(&g_task_ctx.item_count, 1);
 		wret = walk_down_tree(root, &path, wc, &level, &nrefs);
 		if (wret < 0)
 			ret = wret;
@@ -3750,14 +3965,41 @@ static int check_fs_root(struct btrfs_root *root,
 	}
 skip_walking:
 	btrfs_release_path(&path);
+out:
+	btrfs_set_thread_corrupt_blocks(NULL);
+	walk->ret = ret;
+}
 
-	if (!cache_tree_empty(&corrupt_blocks)) {
+/* Check the records collected by walk_fs_root() */
+static int finish_fs_root(struct fs_root_walk *walk,
+			  struct cache_tree *root_cache)
+{
+	struct btrfs_root *root = walk->root;
+	struct shared_node *root_node = &walk->root_node;
+	struct root_record *rec;
+	int ret = walk->ret;
+	int err;
+
+	btrfs_set_thread_corrupt_blocks(&walk->corrupt_blocks);
+	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
+		rec = get_root_rec(root_cache, root->root_key.objectid);
+		BUG_ON(IS_ERR(rec));
+		if (btrfs_root_refs(&root->root_item) > 0)
+			rec->found_root_item = 1;
+	}
+
+	if (walk->bad_root) {
+		free_inode_recs_tree(&root_node->inode_cache);
+		goto out;
+	}
+
+	if (!cache_tree_empty(&walk->corrupt_blocks)) {
 		struct cache_extent *cache;
 		struct btrfs_corrupt_block *corrupt;
 
 		printf("The following tree block(s) is corrupted in tree %llu:\n",
 		       root->root_key.objectid);
-		cache = first_cache_extent(&corrupt_blocks);
+		cache = first_cache_extent(&walk->corrupt_blocks);
 		while (cache) {
 			corrupt = container_of(cache,
 					       struct btrfs_corrupt_block,
@@ -3771,7 +4013,7 @@ skip_walking:
 		if (opt_check_repair) {
 			printf("Try to repair the btree for root %llu\n",
 			       root->root_key.objectid);
-			ret = repair_btree(root, &corrupt_blocks);
+			ret = repair_btree(root, &walk->corrupt_blocks);
 			if (ret < 0) {
 				errno = -ret;
 				fprintf(stderr, "Failed to repair btree: %m\n");
@@ -3782,27 +4024,353 @@ skip_walking:
 		}
 	}
 
-	err = merge_root_recs(root, &root_node.root_cache, root_cache);
+	err = merge_root_recs(root, &root_node->root_cache, root_cache);
 	if (err < 0)
 		ret = err;
 
-	if (root_node.current) {
-		root_node.current->checked = 1;
-		maybe_free_inode_rec(&root_node.inode_cache,
-				root_node.current);
+	if (root_node->current) {
+		root_node->current->checked = 1;
+		maybe_free_inode_rec(&root_node->inode_cache,
+				root_node->current);
 	}
 
-	err = check_inode_recs(root, &root_node.inode_cache);
+	err = check_inode_recs(root, &root_node->inode_cache);
 	if (!ret)
 		ret = err;
 
-	free_corrupt_blocks_tree(&corrupt_blocks);
-	gfs_info->corrupt_blocks = NULL;
-	if (!ret && generation_err)
+	if (!ret && walk->generation_err)
 		ret = -1;
+out:
+	free_corrupt_blocks_tree(&walk->corrupt_blocks);
+	btrfs_set_thread_corrupt_blocks(NULL);
+	return ret;
+}
+
+static int check_fs_root(struct btrfs_root *root,
+			 struct cache_tree *root_cache,
+			 struct walk_control *wc)
+{
+	struct fs_root_walk walk = {
+		.root = root,
+		.wc = wc,
+	};
+
+	walk_fs_root(&walk);
+	return finish_fs_root(&walk, root_cache);
+}
+
+/*
+ * Parallel walk of the fs trees, used in read-only mode.
+ *
+ * The trees are walked by worker threads and the records are checked by the
+ * main thread in the tree order, so the output is the same as of the serial
+ * check. Snapshots share subtrees with their source, the records of a shared
+ * subtree are cached in the walk control and reused by the other roots. To
+ * keep that, a snapshot is put into the same group as its source (found by
+ * the parent uuid) and the roots of one group are walked one by one using the
+ * group's walk control. The next root of a group is walked only after the
+ * previous one has been checked, the cached records are shared with it.
+ *
+ * A group is never split between threads even if it has many snapshots. The
+ * records of a shared node are checked with the last root referencing it, a
+ * root walked with another walk control would leave them unchecked.
+ */
+struct fs_root_group {
+	struct list_head list;
+	struct walk_control wc;
+	/* Queued walks of the group in the tree order */
+	struct list_head walks;
+	bool busy;
+};
+
+/* Lookup of the group of a root by its objectid and uuid */
+struct fs_root_index {
+	struct cache_extent cache;
+	struct rb_node uuid_node;
+	u8 uuid[BTRFS_UUID_SIZE];
+	struct fs_root_group *group;
+};
+
+struct fs_roots_walker {
+	struct btrfs_workqueue *wq;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	/* Queued walks in the tree order */
+	struct list_head pending;
+	int nr_pending;
+	int max_pending;
+	struct list_head groups;
+	struct fs_root_group *unknown_group;
+	struct cache_tree index;
+	struct rb_root uuid_index;
+};
+
+static int compare_root_index_uuid(struct rb_node *node, void *key)
+{
+	struct fs_root_index *entry = rb_entry(node, struct fs_root_index,
+					       uuid_node);
+
+	return memcmp(key, entry->uuid, BTRFS_UUID_SIZE);
+}
+
+static int compare_root_index_nodes(struct rb_node *node1,
+				    struct rb_node *node2)
+{
+	struct fs_root_index *entry = rb_entry(node1, struct fs_root_index,
+					       uuid_node);
+
+	return compare_root_index_uuid(node2, entry->uuid);
+}
+
+static void fs_root_walk_work(struct btrfs_work *work)
+{
+	struct fs_root_walk *walk = container_of(work, struct fs_root_walk,
+						 work);
+	struct fs_roots_walker *walker = walk->walker;
+
+	walk_fs_root(walk);
+
+	pthread_mutex_lock(&walker->lock);
+	walk->done = true;
+	pthread_cond_broadcast(&walker->done_cond);
+	pthread_mutex_unlock(&walker->lock);
+}
+
+static struct fs_roots_walker *alloc_fs_roots_walker(int nr_threads)
+{
+	struct fs_roots_walker *walker;
+
+	walker = calloc(1, sizeof(*walker));
+	if (!walker)
+		return NULL;
+	walker->wq = btrfs_alloc_workqueue(nr_threads);
+	if (!walker->wq) {
+		free(walker);
+		return NULL;
+	}
+	pthread_mutex_init(&walker->lock, NULL);
+	pthread_cond_init(&walker->done_cond, NULL);
+	INIT_LIST_HEAD(&walker->pending);
+	INIT_LIST_HEAD(&walker->groups);
+	cache_tree_init(&walker->index);
+	walker->uuid_index = RB_ROOT;
+	/* Keep the workers busy while the main thread checks the records */
+	walker->max_pending = nr_threads * 2;
+	return walker;
+}
+
+static bool root_has_uuid(struct btrfs_root_item *root_item)
+{
+	static const u8 empty_uuid[BTRFS_UUID_SIZE];
+
+	/* Older kernels did not set the uuids nor the generation_v2 */
+	if (btrfs_root_generation_v2(root_item) !=
+	    btrfs_root_generation(root_item))
+		return false;
+	return memcmp(root_item->uuid, empty_uuid, BTRFS_UUID_SIZE) != 0;
+}
+
+static struct fs_root_group *alloc_fs_root_group(struct fs_roots_walker *walker)
+{
+	struct fs_root_group *group;
+
+	group = calloc(1, sizeof(*group));
+	if (!group)
+		return NULL;
+	cache_tree_init(&group->wc.shared);
+	INIT_LIST_HEAD(&group->walks);
+	list_add_tail(&group->list, &walker->groups);
+	return group;
+}
+
+/*
+ * Find the group of the root, or start a new one. The snapshots have the
+ * transid of their creation in the root item key offset.
+ */
+static struct fs_root_group *get_fs_root_group(struct fs_roots_walker *walker,
+					       struct btrfs_root *root,
+					       bool snapshot)
+{
+	struct btrfs_root_item *root_item = &root->root_item;
+	struct fs_root_group *group = NULL;
+	struct fs_root_index *entry;
+	struct cache_extent *cache;
+	struct rb_node *node;
+	bool has_uuid = root_has_uuid(root_item);
+
+	/* The relocation tree shares blocks with the tree being relocated */
+	if (root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
+		cache = lookup_cache_extent(&walker->index,
+					    root->root_key.offset, 1);
+		if (cache)
+			group = container_of(cache, struct fs_root_index,
+					     cache)->group;
+	} else if (has_uuid && snapshot) {
+		node = rb_search(&walker->uuid_index, root_item->parent_uuid,
+				 compare_root_index_uuid, NULL);
+		if (node)
+			group = rb_entry(node, struct fs_root_index,
+					 uuid_node)->group;
+	}
+
+	/*
+	 * The source of a snapshot is not known if it has been deleted or
+	 * created by an old kernel without the uuids, all such roots are put
+	 * into one group.
+	 */
+	if (!group && root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID &&
+	    (!has_uuid || snapshot)) {
+		if (!walker->unknown_group)
+			walker->unknown_group = alloc_fs_root_group(walker);
+		group = walker->unknown_group;
+	}
+	if (!group)
+		group = alloc_fs_root_group(walker);
+	if (!group)
+		return NULL;
+	if (root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+		return group;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return group;
+	entry->cache.start = root->root_key.objectid;
+	entry->cache.size = 1;
+	entry->group = group;
+	if (insert_cache_extent(&walker->index, &entry->cache)) {
+		free(entry);
+		return group;
+	}
+	if (has_uuid) {
+		memcpy(entry->uuid, root_item->uuid, BTRFS_UUID_SIZE);
+		rb_insert(&walker->uuid_index, &entry->uuid_node,
+			  compare_root_index_nodes);
+	}
+	return group;
+}
+
+/* Start the walk of the first queued root of the group */
+static void start_fs_root_group(struct fs_roots_walker *walker,
+				struct fs_root_group *group)
+{
+	struct fs_root_walk *walk;
+
+	if (group->busy || list_empty(&group->walks))
+		return;
+	walk = list_first_entry(&group->walks, struct fs_root_walk,
+				group_list);
+	walk->wc = &group->wc;
+	group->busy = true;
+	btrfs_queue_work(walker->wq, &walk->work);
+}
+
+/* Wait for the oldest walk and check its records */
+static int finish_oldest_fs_root(struct fs_roots_walker *walker,
+				 struct cache_tree *root_cache)
+{
+	struct fs_root_walk *walk;
+	struct fs_root_group *group;
+	int ret;
+
+	walk = list_first_entry(&walker->pending, struct fs_root_walk, list);
+	pthread_mutex_lock(&walker->lock);
+	while (!walk->done)
+		pthread_cond_wait(&walker->done_cond, &walker->lock);
+	pthread_mutex_unlock(&walker->lock);
+
+	list_del(&walk->list);
+	walker->nr_pending--;
+	ret = finish_fs_root(walk, root_cache);
+	if (walk->root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+		btrfs_free_fs_root(walk->root);
+
+	group = walk->group;
+	list_del(&walk->group_list);
+	group->busy = false;
+	start_fs_root_group(walker, group);
+	free(walk);
+	return ret;
+}
+
+static int queue_fs_root_walk(struct fs_roots_walker *walker,
+			      struct btrfs_root *root, bool snapshot,
+			      struct cache_tree *root_cache)
+{
+	struct fs_root_walk *walk;
+	struct fs_root_group *group;
+	int ret = 0;
+
+	if (walker->nr_pending == walker->max_pending)
+		ret = finish_oldest_fs_root(walker, root_cache);
+
+	walk = calloc(1, sizeof(*walk));
+	group = get_fs_root_group(walker, root, snapshot);
+	if (!walk || !group) {
+		free(walk);
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	walk->walker = walker;
+	walk->root = root;
+	walk->group = group;
+	btrfs_init_work(&walk->work, fs_root_walk_work);
+	list_add_tail(&walk->list, &walker->pending);
+	list_add_tail(&walk->group_list, &group->walks);
+	walker->nr_pending++;
+	start_fs_root_group(walker, group);
 	return ret;
 }
 
+static void free_root_index(struct cache_extent *cache)
+{
+	free(container_of(cache, struct fs_root_index, cache));
+}
+
+FREE_EXTENT_CACHE_BASED_TREE(root_index, free_root_index);
+
+/*
+ * Finish all queued walks and free the walker, returns 1 if any of the roots
+ * had errors.
+ */
+static int free_fs_roots_walker(struct fs_roots_walker *walker,
+				struct cache_tree *root_cache)
+{
+	struct fs_root_group *group;
+	struct shared_node *node;
+	struct cache_extent *cache;
+	int err = 0;
+
+	while (walker->nr_pending) {
+		if (finish_oldest_fs_root(walker, root_cache))
+			err = 1;
+	}
+	btrfs_destroy_workqueue(walker->wq);
+
+	while (!list_empty(&walker->groups)) {
+		group = list_first_entry(&walker->groups, struct fs_root_group,
+					 list);
+		/*
+		 * Shared nodes are left only if the roots sharing them were
+		 * put into different groups, ie. the source of a snapshot has
+		 * been deleted.
+		 */
+		while ((cache = search_cache_extent(&group->wc.shared, 0))) {
+			node = container_of(cache, struct shared_node, cache);
+			free_inode_recs_tree(&node->root_cache);
+			free_inode_recs_tree(&node->inode_cache);
+			remove_cache_extent(&group->wc.shared, &node->cache);
+			free_shared_node(node);
+		}
+		list_del(&group->list);
+		free(group);
+	}
+	free_root_index_tree(&walker->index);
+	pthread_mutex_destroy(&walker->lock);
+	pthread_cond_destroy(&walker->done_cond);
+	free(walker);
+	return err;
+}
+
 static int check_fs_roots(struct cache_tree *root_cache)
 {
 	struct btrfs_path path;
@@ -3811,6 +4379,8 @@ static int check_fs_roots(struct cache_tree *root_cache)
 	struct extent_buffer *leaf, *tree_node;
 	struct btrfs_root *tmp_root;
 	struct btrfs_root *tree_root = gfs_info->tree_root;
+	struct fs_roots_walker *walker = NULL;
+	bool snapshot;
 	u64 skip_root = 0;
 	int ret;
 	int err = 0;
@@ -3825,6 +4395,13 @@ static int check_fs_roots(struct cache_tree *root_cache)
 	cache_tree_init(&wc.shared);
 	btrfs_init_path(&path);
 
+	/* The repair may restart the walk, keep it serial */
+	if (nr_check_threads > 1 && !opt_check_repair) {
+		walker = alloc_fs_roots_walker(nr_check_threads);
+		if (!walker)
+			warning("cannot start the check threads, checking serially");
+	}
+
 again:
 	key.offset = 0;
 	if (skip_root)
@@ -3858,6 +4435,7 @@ again:
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
+			snapshot = key.offset != 0;
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
 				tmp_root = btrfs_read_fs_root_no_cache(
 						gfs_info, &key);
@@ -3870,6 +4448,12 @@ again:
 				err = 1;
 				goto next;
 			}
+			if (walker) {
+				if (queue_fs_root_walk(walker, tmp_root,
+						       snapshot, root_cache))
+					err = 1;
+				goto next;
+			}
 			ret = check_fs_root(tmp_root, root_cache, &wc);
 			if (ret == -EAGAIN) {
 				free_root_recs_tree(root_cache);
@@ -3911,8 +4495,10 @@ next:
 	}
 out:
 	btrfs_release_path(&path);
+	if (walker && free_fs_roots_walker(walker, root_cache))
+		err = 1;
 	if (err)
-		free_extent_cache_tree(&wc.shared);
+		free_shared_nodes_tree(&wc.shared);
 	if (!cache_tree_empty(&wc.shared))
 		fprintf(stderr, "warning line %d\n", __LINE__);
 
@@ -4103,11 +4689,29 @@ out:
 	return err;
 }
 
+static struct extent_record *alloc_extent_rec(void)
+{
+	return btrfs_slab_alloc(&extent_rec_slab);
+}
+
+static void free_extent_rec(struct extent_record *rec)
+{
+	btrfs_slab_free(&extent_rec_slab, rec);
+}
+
+static void free_extent_backref(struct extent_backref *back)
+{
+	if (back->is_data)
+		btrfs_slab_free(&data_backref_slab, to_data_backref(back));
+	else
+		btrfs_slab_free(&tree_backref_slab, to_tree_backref(back));
+}
+
 static void __free_one_backref(struct rb_node *node)
 {
 	struct extent_backref *back = rb_node_to_extent_backref(node);
 
-	free(back);
+	free_extent_backref(back);
 }
 
 static void free_all_extent_backrefs(struct extent_record *rec)
@@ -4127,7 +4731,7 @@ static void free_extent_record_cache(struct cache_tree *extent_cache)
 		rec = container_of(cache, struct extent_record, cache);
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
-		free(rec);
+		free_extent_rec(rec);
 	}
 }
 
@@ -4145,7 +4749,7 @@ static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 		remove_cache_extent(extent_cache, &rec->cache);
 		free_all_extent_backrefs(rec);
 		list_del_init(&rec->list);
-		free(rec);
+		free_extent_rec(rec);
 	}
 	return 0;
 }
@@ -4589,7 +5193,7 @@ static int check_block(struct btrfs_root *root,
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
+	struct tree_backref *ref = btrfs_slab_alloc(&tree_backref_slab);
 
 	if (!ref)
 		return NULL;
@@ -4610,7 +5214,7 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
+	struct data_backref *ref = btrfs_slab_alloc(&data_backref_slab);
 
 	if (!ref)
 		return NULL;
@@ -4697,7 +5301,7 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	int ret = 0;
 
 	BUG_ON(tmpl->max_size == 0);
-	rec = malloc(sizeof(*rec));
+	rec = alloc_extent_rec();
 	if (!rec)
 		return -ENOMEM;
 	rec->start = tmpl->start;
@@ -4726,7 +5330,7 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	rec->cache.size = tmpl->nr;
 	ret = insert_cache_extent(extent_cache, &rec->cache);
 	if (ret) {
-		free(rec);
+		free_extent_rec(rec);
 		return ret;
 	}
 	bytes_used += rec->nr;
@@ -4784,7 +5388,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				 * our current extent record but does not have
 				 * the same objectid.
 				 */
-				tmp = malloc(sizeof(*tmp));
+				tmp = alloc_extent_rec();
 				if (!tmp)
 					return -ENOMEM;
 				tmp->start = tmpl->start;
@@ -5631,87 +6235,379 @@ out:
 }
 
 /*
- * Check data checksum for [@bytenr, @bytenr + @num_bytes).
- *
- * Return <0 for fatal error (fails to read checksum/data or allocate memory).
- * Return >0 for csum mismatch for any copy.
- * Return 0 if everything is OK.
+ * Data checksums are verified in jobs covering contiguous csum items, up to
+ * this size unless a single item is larger. The data of a job are read by
+ * one read per stripe and mirror.
  */
-static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb)
+#define CSUM_BATCH_SIZE		SZ_4M
+
+struct csum_mismatch {
+	u64 bytenr;
+	int mirror;
+	/* Index of the sector in the job */
+	u32 sector;
+	u8 found[BTRFS_CSUM_SIZE];
+};
+
+struct csum_job {
+	struct btrfs_work work;
+	struct list_head list;
+	struct csum_verifier *verifier;
+	u64 bytenr;
+	u64 num_bytes;
+	/* Read buffer and expected checksums, kept when the job is reused */
+	u8 *data;
+	u64 data_size;
+	u8 *csums;
+	/* Calculated checksums of the data read, same size as @csums */
+	u8 *results;
+	u64 csums_size;
+	/* Sector index where each of the csum items ends */
+	u32 *item_end;
+	u32 nr_items;
+	u32 max_items;
+	struct csum_mismatch *mismatches;
+	u32 nr_mismatches;
+	u32 max_mismatches;
+	int ret;
+	bool done;
+};
+
+/*
+ * Verifies the jobs in a workqueue with --threads, the results are reported
+ * in the order of the csum items. Without threads the jobs are verified
+ * right away.
+ */
+struct csum_verifier {
+	struct btrfs_workqueue *wq;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	struct list_head queued;
+	struct list_head free_jobs;
+	int nr_queued;
+	int max_queued;
+	/* Job being filled with contiguous items */
+	struct csum_job *cur;
+	/* Fatal error of a job, no more jobs are reported after it */
+	int ret;
+};
+
+static int add_csum_mismatch(struct csum_job *job, u64 bytenr, int mirror,
+			     u32 sector, u8 *found)
+{
+	struct csum_mismatch *tmp;
+
+	if (job->nr_mismatches == job->max_mismatches) {
+		tmp = realloc(job->mismatches, (job->max_mismatches + 16) *
+			      sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		job->mismatches = tmp;
+		job->max_mismatches += 16;
+	}
+	tmp = &job->mismatches[job->nr_mismatches++];
+	tmp->bytenr = bytenr;
+	tmp->mirror = mirror;
+	tmp->sector = sector;
+	memcpy(tmp->found, found, gfs_info->csum_size);
+	return 0;
+}
+
+/*
+ * Check data checksums of the job, all copies are read and the mismatches
+ * are recorded. Return <0 in job->ret for fatal errors (failed to read data
+ * or allocate memory).
+ */
+static void verify_csum_job(struct csum_job *job)
 {
+	const u32 sectorsize = gfs_info->sectorsize;
+	const u16 csum_size = gfs_info->csum_size;
+	const u16 csum_type = gfs_info->csum_type;
 	u64 offset = 0;
-	u16 csum_size = gfs_info->csum_size;
-	u16 csum_type = gfs_info->csum_type;
-	u8 *data;
-	unsigned long csum_offset;
-	u8 result[BTRFS_CSUM_SIZE];
-	u8 csum_expected[BTRFS_CSUM_SIZE];
 	u64 read_len;
-	u64 data_checked = 0;
-	u64 tmp;
-	int ret = 0;
-	int mirror;
+	u64 data_checked;
+	u32 sector;
+	u32 nr_sectors;
 	int num_copies;
-	bool csum_mismatch = false;
-
-	if (num_bytes % gfs_info->sectorsize)
-		return -EINVAL;
-
-	data = malloc(num_bytes);
-	if (!data)
-		return -ENOMEM;
+	int mirror;
+	int ret = 0;
 
-	num_copies = btrfs_num_copies(gfs_info, bytenr, num_bytes);
-	while (offset < num_bytes) {
+	num_copies = btrfs_num_copies(gfs_info, job->bytenr, job->num_bytes);
+	while (offset < job->num_bytes) {
 		/*
 		 * Mirror 0 means 'read from any valid copy', so it's skipped.
 		 * The indexes 1-N represent the n-th copy for levels with
 		 * redundancy.
 		 */
 		for (mirror = 1; mirror <= num_copies; mirror++) {
-			read_len = num_bytes - offset;
+			read_len = job->num_bytes - offset;
 			/* read as much space once a time */
-			ret = read_data_from_disk(gfs_info, (char *)data + offset,
-					bytenr + offset, &read_len, mirror);
+			ret = read_data_from_disk(gfs_info, job->data + offset,
+					job->bytenr + offset, &read_len, mirror);
 			if (ret)
 				goto out;
+			check_stat_add(&g_task_ctx.data_bytes, read_len);
 
-			data_checked = 0;
-			/* verify every 4k data's checksum */
-			while (data_checked < read_len) {
-				tmp = offset + data_checked;
-
-				btrfs_csum_data(gfs_info, csum_type, data + tmp,
-						result, gfs_info->sectorsize);
-
-				csum_offset = leaf_offset +
-					 tmp / gfs_info->sectorsize * csum_size;
-				read_extent_buffer(eb, (char *)&csum_expected,
-						   csum_offset, csum_size);
-				if (memcmp(result, csum_expected, csum_size) != 0) {
-					char found[BTRFS_CSUM_STRING_LEN];
-					char want[BTRFS_CSUM_STRING_LEN];
-
-					csum_mismatch = true;
-					btrfs_format_csum(csum_type, result, found);
-					btrfs_format_csum(csum_type,
-							  csum_expected, want);
-					fprintf(stderr,
-				"mirror %d bytenr %llu csum %s expected csum %s\n",
-						mirror, bytenr + tmp, found, want);
-				}
-				data_checked += gfs_info->sectorsize;
+			sector = offset / sectorsize;
+			nr_sectors = round_up(read_len, sectorsize) / sectorsize;
+			ret = btrfs_csum_data_many(csum_type, job->data + offset,
+					job->results + sector * csum_size,
+					sectorsize, nr_sectors);
+			if (ret < 0)
+				goto out;
+			/* Compare all at once, the mismatches are rare */
+			if (memcmp(job->results + sector * csum_size,
+				   job->csums + sector * csum_size,
+				   nr_sectors * csum_size) == 0)
+				continue;
+			for (data_checked = 0; data_checked < read_len;
+			     data_checked += sectorsize) {
+				u8 *result;
+
+				sector = (offset + data_checked) / sectorsize;
+				result = job->results + sector * csum_size;
+				if (memcmp(result, job->csums + sector * csum_size,
+					   csum_size) == 0)
+					continue;
+				ret = add_csum_mismatch(job,
+					job->bytenr + offset + data_checked,
+					mirror, sector, result);
+				if (ret)
+					goto out;
 			}
 		}
 		offset += read_len;
 	}
 out:
-	free(data);
-	if (!ret && csum_mismatch)
-		ret = 1;
-	return ret;
+	job->ret = ret;
+}
+
+static void csum_job_work_fn(struct btrfs_work *work)
+{
+	struct csum_job *job = container_of(work, struct csum_job, work);
+	struct csum_verifier *verifier = job->verifier;
+
+	verify_csum_job(job);
+
+	pthread_mutex_lock(&verifier->lock);
+	job->done = true;
+	pthread_cond_broadcast(&verifier->done_cond);
+	pthread_mutex_unlock(&verifier->lock);
+}
+
+static void free_csum_job(struct csum_job *job)
+{
+	free(job->data);
+	free(job->csums);
+	free(job->results);
+	free(job->item_end);
+	free(job->mismatches);
+	free(job);
+}
+
+static void init_csum_verifier(struct csum_verifier *verifier)
+{
+	memset(verifier, 0, sizeof(*verifier));
+	pthread_mutex_init(&verifier->lock, NULL);
+	pthread_cond_init(&verifier->done_cond, NULL);
+	INIT_LIST_HEAD(&verifier->queued);
+	INIT_LIST_HEAD(&verifier->free_jobs);
+	if (nr_check_threads > 1) {
+		verifier->wq = btrfs_alloc_workqueue(nr_check_threads);
+		if (!verifier->wq)
+			warning("cannot start threads, verifying data csums serially");
+	}
+	verifier->max_queued = verifier->wq ? nr_check_threads * 2 : 1;
+}
+
+/*
+ * Add the csum item at @slot of @leaf to the job being filled. Return <0
+ * if the job could not be allocated.
+ */
+static int add_csum_item(struct csum_verifier *verifier,
+			 struct extent_buffer *leaf, int slot, u64 bytenr,
+			 u32 num_entries)
+{
+	struct csum_job *job = verifier->cur;
+	const u16 csum_size = gfs_info->csum_size;
+	u64 data_len = (u64)num_entries * gfs_info->sectorsize;
+	u64 csums_len;
+	void *tmp;
+
+	if (!job) {
+		if (list_empty(&verifier->free_jobs)) {
+			job = calloc(1, sizeof(*job));
+			if (!job)
+				return -ENOMEM;
+			job->verifier = verifier;
+			btrfs_init_work(&job->work, csum_job_work_fn);
+		} else {
+			job = list_first_entry(&verifier->free_jobs,
+					       struct csum_job, list);
+			list_del(&job->list);
+		}
+		job->bytenr = bytenr;
+		job->num_bytes = 0;
+		job->nr_items = 0;
+		job->nr_mismatches = 0;
+		job->ret = 0;
+		job->done = false;
+		verifier->cur = job;
+	}
+
+	csums_len = job->num_bytes / gfs_info->sectorsize * csum_size;
+	if (job->num_bytes + data_len > job->data_size) {
+		tmp = realloc(job->data, job->num_bytes + data_len);
+		if (!tmp)
+			return -ENOMEM;
+		job->data = tmp;
+		job->data_size = job->num_bytes + data_len;
+	}
+	if (csums_len + num_entries * csum_size > job->csums_size) {
+		tmp = realloc(job->csums, csums_len + num_entries * csum_size);
+		if (!tmp)
+			return -ENOMEM;
+		job->csums = tmp;
+		tmp = realloc(job->results, csums_len + num_entries * csum_size);
+		if (!tmp)
+			return -ENOMEM;
+		job->results = tmp;
+		job->csums_size = csums_len + num_entries * csum_size;
+	}
+	if (job->nr_items == job->max_items) {
+		tmp = realloc(job->item_end,
+			      (job->max_items + 16) * sizeof(u32));
+		if (!tmp)
+			return -ENOMEM;
+		job->item_end = tmp;
+		job->max_items += 16;
+	}
+
+	/* All expected checksums of the item at once */
+	read_extent_buffer(leaf, job->csums + csums_len,
+			   btrfs_item_ptr_offset(leaf, slot),
+			   num_entries * csum_size);
+	job->num_bytes += data_len;
+	job->item_end[job->nr_items++] = job->num_bytes / gfs_info->sectorsize;
+	return 0;
+}
+
+/*
+ * Print the mismatches of a finished job, return the number of csum items
+ * with a mismatch.
+ */
+static int report_csum_job(struct csum_job *job)
+{
+	const u16 csum_type = gfs_info->csum_type;
+	const u16 csum_size = gfs_info->csum_size;
+	char found[BTRFS_CSUM_STRING_LEN];
+	char want[BTRFS_CSUM_STRING_LEN];
+	struct csum_mismatch *mismatch;
+	bool *bad_items;
+	int errors = 0;
+	u32 item;
+	u32 i;
+
+	if (!job->nr_mismatches)
+		return 0;
+
+	bad_items = calloc(job->nr_items, sizeof(bool));
+	for (i = 0; i < job->nr_mismatches; i++) {
+		mismatch = &job->mismatches[i];
+		btrfs_format_csum(csum_type, mismatch->found, found);
+		btrfs_format_csum(csum_type,
+				  job->csums + mismatch->sector * csum_size,
+				  want);
+		fprintf(stderr, "mirror %d bytenr %llu csum %s expected csum %s\n",
+			mismatch->mirror, mismatch->bytenr, found, want);
+
+		for (item = 0; mismatch->sector >= job->item_end[item]; item++)
+			;
+		if (!bad_items) {
+			errors = 1;
+		} else if (!bad_items[item]) {
+			bad_items[item] = true;
+			errors++;
+		}
+	}
+	free(bad_items);
+	return errors;
+}
+
+/*
+ * Report the finished jobs in the order they were queued. With @wait, wait
+ * for and report all of them. Return the number of items with mismatches.
+ */
+static int reap_csum_jobs(struct csum_verifier *verifier, bool wait)
+{
+	struct csum_job *job;
+	int errors = 0;
+
+	pthread_mutex_lock(&verifier->lock);
+	while (!list_empty(&verifier->queued)) {
+		job = list_first_entry(&verifier->queued, struct csum_job, list);
+		if (!job->done) {
+			if (!wait && verifier->nr_queued < verifier->max_queued)
+				break;
+			pthread_cond_wait(&verifier->done_cond, &verifier->lock);
+			continue;
+		}
+		list_move_tail(&job->list, &verifier->free_jobs);
+		verifier->nr_queued--;
+		if (verifier->ret < 0)
+			continue;
+		pthread_mutex_unlock(&verifier->lock);
+		errors += report_csum_job(job);
+		pthread_mutex_lock(&verifier->lock);
+		if (job->ret < 0)
+			verifier->ret = job->ret;
+	}
+	pthread_mutex_unlock(&verifier->lock);
+	return errors;
+}
+
+/*
+ * Start verification of the job being filled. Return the number of items
+ * with mismatches of the jobs that got reported meanwhile.
+ */
+static int submit_csum_job(struct csum_verifier *verifier)
+{
+	struct csum_job *job = verifier->cur;
+
+	if (!job)
+		return 0;
+	verifier->cur = NULL;
+
+	pthread_mutex_lock(&verifier->lock);
+	list_add_tail(&job->list, &verifier->queued);
+	verifier->nr_queued++;
+	pthread_mutex_unlock(&verifier->lock);
+
+	if (verifier->wq) {
+		btrfs_queue_work(verifier->wq, &job->work);
+	} else {
+		verify_csum_job(job);
+		job->done = true;
+	}
+	return reap_csum_jobs(verifier, false);
+}
+
+static void free_csum_verifier(struct csum_verifier *verifier)
+{
+	struct csum_job *job;
+
+	if (verifier->cur)
+		list_add(&verifier->cur->list, &verifier->free_jobs);
+	if (verifier->wq)
+		btrfs_destroy_workqueue(verifier->wq);
+	while (!list_empty(&verifier->free_jobs)) {
+		job = list_first_entry(&verifier->free_jobs, struct csum_job,
+				       list);
+		list_del(&job->list);
+		free_csum_job(job);
+	}
+	pthread_mutex_destroy(&verifier->lock);
+	pthread_cond_destroy(&verifier->done_cond);
 }
 
 static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
@@ -5862,13 +6758,14 @@ static int check_csum_root(struct btrfs_root *root)
 	struct btrfs_path path;
 	struct extent_buffer *leaf;
 	struct btrfs_key key;
+	struct csum_verifier verifier;
+	struct csum_job *job;
 	u64 last_data_end = 0;
 	u64 offset = 0, num_bytes = 0;
 	u16 csum_size = gfs_info->csum_size;
 	int errors = 0;
 	int ret;
 	u64 data_len;
-	unsigned long leaf_offset;
 	bool verify_csum = !!check_data_csum;
 	u16 num_entries, max_entries;
 
@@ -5904,6 +6801,8 @@ static int check_csum_root(struct btrfs_root *root)
 		printf("skip data csum verification for metadata dump\n");
 		verify_csum = false;
 	}
+	if (verify_csum)
+		init_csum_verifier(&verifier);
 
 	while (1) {
 		g_task_ctx.item_count++;
@@ -5924,6 +6823,21 @@ static int check_csum_root(struct btrfs_root *root)
 			path.slots[0]++;
 			continue;
 		}
+		num_entries = btrfs_item_size(leaf, path.slots[0]) / csum_size;
+		data_len = num_entries * gfs_info->sectorsize;
+
+		/*
+		 * Items are batched while they're contiguous, errors of the
+		 * item are reported after the previous items are verified.
+		 */
+		job = verify_csum ? verifier.cur : NULL;
+		if (job && (key.offset != job->bytenr + job->num_bytes ||
+			    job->num_bytes + data_len > CSUM_BATCH_SIZE ||
+			    num_entries > max_entries)) {
+			errors += submit_csum_job(&verifier);
+			if (verifier.ret < 0)
+				break;
+		}
 
 		if (key.offset < last_data_end) {
 			error(
@@ -5932,8 +6846,6 @@ static int check_csum_root(struct btrfs_root *root)
 				path.slots[0]);
 			errors++;
 		}
-		num_entries = btrfs_item_size(leaf, path.slots[0]) / csum_size;
-		data_len = num_entries * gfs_info->sectorsize;
 
 		if (num_entries > max_entries) {
 			error(
@@ -5943,19 +6855,14 @@ static int check_csum_root(struct btrfs_root *root)
 			errors++;
 		}
 
-		if (!verify_csum)
+		if (!verify_csum || !num_entries)
 			goto skip_csum_check;
-		leaf_offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
-		/*
-		 * Only break for fatal errors, if mismatch is found, continue
-		 * checking until all extents are checked.
-		 */
-		if (ret < 0)
+		ret = add_csum_item(&verifier, leaf, path.slots[0], key.offset,
+				    num_entries);
+		if (ret < 0) {
+			verifier.ret = ret;
 			break;
-		if (ret > 0)
-			errors++;
+		}
 skip_csum_check:
 		if (!num_bytes) {
 			offset = key.offset;
@@ -5975,6 +6882,16 @@ skip_csum_check:
 		path.slots[0]++;
 	}
 
+	if (verify_csum) {
+		/*
+		 * Only stop for fatal errors, if mismatch is found, continue
+		 * checking until all extents are checked.
+		 */
+		if (verifier.ret >= 0)
+			errors += submit_csum_job(&verifier);
+		errors += reap_csum_jobs(&verifier, true);
+		free_csum_verifier(&verifier);
+	}
 	btrfs_release_path(&path);
 	return errors;
 }
@@ -6611,7 +7528,7 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	} else {
 		struct tree_backref *back;
@@ -6631,7 +7548,7 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 		}
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -7315,11 +8232,11 @@ static int process_duplicates(struct cache_tree *extent_cache,
 		good->refs += tmp->refs;
 		list_splice_init(&tmp->backrefs, &good->backrefs);
 		remove_cache_extent(extent_cache, &tmp->cache);
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
-	free(rec);
+	free_extent_rec(rec);
 	return good->num_duplicates ? 0 : 1;
 }
 
@@ -7405,13 +8322,13 @@ out:
 		list_del_init(&tmp->list);
 		if (tmp == rec)
 			continue;
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 
 	while (!list_empty(&rec->dups)) {
 		tmp = to_extent_record(rec->dups.next);
 		list_del_init(&tmp->list);
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 
 	btrfs_release_path(&path);
@@ -7927,11 +8844,47 @@ static int record_unaligned_extent_rec(struct extent_record *rec)
 			return ret;
 		}
 		list_add(&urec->list, &dest_root->unaligned_extent_recs);
+		ret = checkpoint_phase_add_state(TASK_EXTENTS,
+				"unaligned %llu %llu %llu %llu", urec->objectid,
+				urec->owner, urec->offset, urec->bytenr);
+		if (ret < 0)
+			return ret;
 	}
 
 	return ret;
 }
 
+/* Add back an unaligned extent record saved to the checkpoint */
+static int load_unaligned_extent_rec(const char *line, void *data)
+{
+	struct unaligned_extent_rec_t *urec;
+	struct btrfs_root *dest_root;
+	struct btrfs_key key;
+	unsigned long long objectid, owner, offset, bytenr;
+
+	if (sscanf(line, "unaligned %llu %llu %llu %llu", &objectid, &owner,
+		   &offset, &bytenr) != 4)
+		return -EINVAL;
+
+	key.objectid = objectid;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = (u64)-1;
+	dest_root = btrfs_read_fs_root(gfs_info, &key);
+	if (IS_ERR_OR_NULL(dest_root))
+		return -ENOENT;
+
+	urec = malloc(sizeof(struct unaligned_extent_rec_t));
+	if (!urec)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&urec->list);
+	urec->objectid = objectid;
+	urec->owner = owner;
+	urec->offset = offset;
+	urec->bytenr = bytenr;
+	list_add(&urec->list, &dest_root->unaligned_extent_recs);
+	return 0;
+}
+
 static int repair_extent_item_generation(struct extent_record *rec)
 {
 	struct btrfs_trans_handle *trans;
@@ -8176,7 +9129,7 @@ next:
 			clear_extent_dirty(gfs_info->excluded_extents,
 					   rec->start,
 					   rec->start + rec->max_size - 1);
-		free(rec);
+		free_extent_rec(rec);
 	}
 repair_abort:
 	if (opt_check_repair) {
@@ -9911,6 +10864,14 @@ static const char * const cmd_check_usage[] = {
 	"                                              more memory, does less IO)",
 	"                                   lowmem   - try to use less memory but read blocks again",
 	"                                              when needed (experimental)",
+	"       --mem-limit <SIZE>          limit the memory used for caches and records,",
+	"                                   caches are shrunk to stay below the limit",
+	"       --threads <N>               check the trees in N threads, 0 for the",
+	"                                   number of CPUs (read-only mode)",
+	"       --spill-dir <DIR>           store records over the memory limit in a",
+	"                                   temporary file in DIR (original mode)",
+	"       --checkpoint <FILE>         save the progress to FILE (read-only mode)",
+	"       --resume <FILE>             resume the check from progress saved in FILE",
 	"  repair options:",
 	"       --init-csum-tree            create a new CRC tree",
 	"       --init-extent-tree          create a new extent tree",
@@ -9922,6 +10883,7 @@ static const char * const cmd_check_usage[] = {
 	"       -E|--subvol-extents <subvolid>",
 	"                                   print subvolume extents and sharing state",
 	"       -p|--progress               indicate progress",
+	"       --cache-stats               print metadata cache statistics at the end",
 	NULL
 };
 
@@ -9948,6 +10910,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	unsigned ctree_flags = OPEN_CTREE_EXCLUSIVE |
 			       OPEN_CTREE_ALLOW_TRANSID_MISMATCH;
 	int force = 0;
+	bool cache_stats = false;
+	bool mem_report = false;
+	const char *checkpoint_path = NULL;
+	bool resume = false;
 
 	while(1) {
 		int c;
@@ -9955,7 +10921,10 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_INIT_EXTENT, GETOPT_VAL_CHECK_CSUM,
 			GETOPT_VAL_READONLY, GETOPT_VAL_CHUNK_TREE,
 			GETOPT_VAL_MODE, GETOPT_VAL_CLEAR_SPACE_CACHE,
-			GETOPT_VAL_CLEAR_INO_CACHE, GETOPT_VAL_FORCE };
+			GETOPT_VAL_CLEAR_INO_CACHE, GETOPT_VAL_FORCE,
+			GETOPT_VAL_CACHE_STATS, GETOPT_VAL_MEM_LIMIT,
+			GETOPT_VAL_THREADS, GETOPT_VAL_SPILL_DIR,
+			GETOPT_VAL_CHECKPOINT, GETOPT_VAL_RESUME };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, GETOPT_VAL_REPAIR },
@@ -9980,6 +10949,18 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "clear-ino-cache", no_argument , NULL,
 				GETOPT_VAL_CLEAR_INO_CACHE},
 			{ "force", no_argument, NULL, GETOPT_VAL_FORCE },
+			{ "cache-stats", no_argument, NULL,
+				GETOPT_VAL_CACHE_STATS },
+			{ "mem-limit", required_argument, NULL,
+				GETOPT_VAL_MEM_LIMIT },
+			{ "threads", required_argument, NULL,
+				GETOPT_VAL_THREADS },
+			{ "spill-dir", required_argument, NULL,
+				GETOPT_VAL_SPILL_DIR },
+			{ "checkpoint", required_argument, NULL,
+				GETOPT_VAL_CHECKPOINT },
+			{ "resume", required_argument, NULL,
+				GETOPT_VAL_RESUME },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -10071,6 +11052,36 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			case GETOPT_VAL_FORCE:
 				force = 1;
 				break;
+			case GETOPT_VAL_CACHE_STATS:
+				cache_stats = true;
+				break;
+			case GETOPT_VAL_MEM_LIMIT:
+				btrfs_mem_set_limit(parse_size_from_string(optarg));
+				mem_report = true;
+				break;
+			case GETOPT_VAL_THREADS:
+				num = arg_strtou64(optarg);
+				if (num == 0)
+					num = btrfs_default_nr_threads();
+				nr_check_threads = min_t(u64, num,
+						BTRFS_WORKQUEUE_MAX_THREADS);
+				break;
+			case GETOPT_VAL_SPILL_DIR:
+				ret = btrfs_slab_set_spill_dir(optarg);
+				if (ret < 0) {
+					errno = -ret;
+					error("cannot create spill file in %s: %m",
+					      optarg);
+					exit(1);
+				}
+				break;
+			case GETOPT_VAL_CHECKPOINT:
+				checkpoint_path = optarg;
+				break;
+			case GETOPT_VAL_RESUME:
+				checkpoint_path = optarg;
+				resume = true;
+				break;
 		}
 	}
 
@@ -10088,6 +11099,17 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		exit(1);
 	}
 
+	if (checkpoint_path && opt_check_repair) {
+		error("--checkpoint and --resume are not compatible with repair options");
+		exit(1);
+	}
+
+	/* The progress of the parallel checks can't be attributed to roots */
+	if (checkpoint_path && nr_check_threads > 1) {
+		error("--checkpoint and --resume work only with --threads 1");
+		exit(1);
+	}
+
 	if (opt_check_repair && !force) {
 		int delay = 10;
 
@@ -10285,6 +11307,15 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		goto close_out;
 	}
 
+	if (checkpoint_path) {
+		ret = checkpoint_open(checkpoint_path, resume, gfs_info,
+				      check_mode);
+		if (ret < 0) {
+			err |= 1;
+			goto close_out;
+		}
+	}
+
 	if (!init_extent_tree) {
 		if (!g_task_ctx.progress_enabled) {
 			fprintf(stderr, "[1/7] checking root items\n");
@@ -10325,14 +11356,30 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		fprintf(stderr, "[1/7] checking root items... skipped\n");
 	}
 
-	if (!g_task_ctx.progress_enabled) {
-		fprintf(stderr, "[2/7] checking extents\n");
+	if (checkpoint_phase_done(TASK_EXTENTS, &ret)) {
+		fprintf(stderr, "[2/7] checking extents... done before resume\n");
+		/*
+		 * The original mode attaches the unaligned extent records found
+		 * by the extents check to the fs roots for the fs roots walk.
+		 */
+		if (check_mode != CHECK_MODE_LOWMEM &&
+		    load_checkpoint_state(TASK_EXTENTS,
+					  load_unaligned_extent_rec, NULL)) {
+			err |= 1;
+			goto out;
+		}
 	} else {
-		g_task_ctx.tp = TASK_EXTENTS;
-		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
+		if (!g_task_ctx.progress_enabled) {
+			fprintf(stderr, "[2/7] checking extents\n");
+		} else {
+			g_task_ctx.tp = TASK_EXTENTS;
+			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
+		}
+		checkpoint_phase_start(TASK_EXTENTS);
+		ret = do_check_chunks_and_extents();
+		task_stop(g_task_ctx.info);
+		checkpoint_phase_finish(TASK_EXTENTS, ret);
 	}
-	ret = do_check_chunks_and_extents();
-	task_stop(g_task_ctx.info);
 	err |= !!ret;
 	if (ret)
 		error(
@@ -10343,18 +11390,25 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 
 	is_free_space_tree = btrfs_fs_compat_ro(gfs_info, FREE_SPACE_TREE);
 
-	if (!g_task_ctx.progress_enabled) {
-		if (is_free_space_tree)
-			fprintf(stderr, "[3/7] checking free space tree\n");
-		else
-			fprintf(stderr, "[3/7] checking free space cache\n");
+	if (checkpoint_phase_done(TASK_FREE_SPACE, &ret)) {
+		fprintf(stderr, "[3/7] checking free space %s... done before resume\n",
+			is_free_space_tree ? "tree" : "cache");
 	} else {
-		g_task_ctx.tp = TASK_FREE_SPACE;
-		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
-	}
+		if (!g_task_ctx.progress_enabled) {
+			if (is_free_space_tree)
+				fprintf(stderr, "[3/7] checking free space tree\n");
+			else
+				fprintf(stderr, "[3/7] checking free space cache\n");
+		} else {
+			g_task_ctx.tp = TASK_FREE_SPACE;
+			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
+		}
 
-	ret = validate_free_space_cache(root);
-	task_stop(g_task_ctx.info);
+		checkpoint_phase_start(TASK_FREE_SPACE);
+		ret = validate_free_space_cache(root);
+		task_stop(g_task_ctx.info);
+		checkpoint_phase_finish(TASK_FREE_SPACE, ret);
+	}
 	err |= !!ret;
 
 	/*
@@ -10364,34 +11418,66 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	 * ignore it when this happens.
 	 */
 	no_holes = btrfs_fs_incompat(gfs_info, NO_HOLES);
-	if (!g_task_ctx.progress_enabled) {
-		fprintf(stderr, "[4/7] checking fs roots\n");
+	if (checkpoint_phase_done(TASK_FS_ROOTS, &ret)) {
+		fprintf(stderr, "[4/7] checking fs roots... done before resume\n");
+		/*
+		 * The original mode collects the root records for the root refs
+		 * check while walking the fs roots.
+		 */
+		if (check_mode != CHECK_MODE_LOWMEM &&
+		    load_checkpoint_state(TASK_FS_ROOTS, load_root_rec,
+					  &root_cache)) {
+			err |= 1;
+			goto out;
+		}
 	} else {
-		g_task_ctx.tp = TASK_FS_ROOTS;
-		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
-	}
+		if (!g_task_ctx.progress_enabled) {
+			fprintf(stderr, "[4/7] checking fs roots\n");
+		} else {
+			g_task_ctx.tp = TASK_FS_ROOTS;
+			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
+		}
 
-	ret = do_check_fs_roots(&root_cache);
-	task_stop(g_task_ctx.info);
+		checkpoint_phase_start(TASK_FS_ROOTS);
+		ret = do_check_fs_roots(&root_cache);
+		task_stop(g_task_ctx.info);
+		if (check_mode != CHECK_MODE_LOWMEM &&
+		    save_root_recs(&root_cache)) {
+			err |= 1;
+			goto out;
+		}
+		checkpoint_phase_finish(TASK_FS_ROOTS, ret);
+	}
 	err |= !!ret;
 	if (ret) {
 		error("errors found in fs roots");
 		goto out;
 	}
 
-	if (!g_task_ctx.progress_enabled) {
+	if (checkpoint_phase_done(TASK_CSUMS, &ret)) {
 		if (check_data_csum)
-			fprintf(stderr, "[5/7] checking csums against data\n");
+			fprintf(stderr,
+		"[5/7] checking csums against data... done before resume\n");
 		else
 			fprintf(stderr,
-		"[5/7] checking only csums items (without verifying data)\n");
+		"[5/7] checking only csums items (without verifying data)... done before resume\n");
 	} else {
-		g_task_ctx.tp = TASK_CSUMS;
-		task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
-	}
+		if (!g_task_ctx.progress_enabled) {
+			if (check_data_csum)
+				fprintf(stderr, "[5/7] checking csums against data\n");
+			else
+				fprintf(stderr,
+		"[5/7] checking only csums items (without verifying data)\n");
+		} else {
+			g_task_ctx.tp = TASK_CSUMS;
+			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
+		}
 
-	ret = check_csums();
-	task_stop(g_task_ctx.info);
+		checkpoint_phase_start(TASK_CSUMS);
+		ret = check_csums();
+		task_stop(g_task_ctx.info);
+		checkpoint_phase_finish(TASK_CSUMS, ret);
+	}
 	/*
 	 * Data csum error is not fatal, and it may indicate more serious
 	 * corruption, continue checking.
@@ -10402,15 +11488,22 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 
 	/* For low memory mode, check_fs_roots_v2 handles root refs */
         if (check_mode != CHECK_MODE_LOWMEM) {
-		if (!g_task_ctx.progress_enabled) {
-			fprintf(stderr, "[6/7] checking root refs\n");
+		if (checkpoint_phase_done(TASK_ROOT_REFS, &ret)) {
+			fprintf(stderr,
+				"[6/7] checking root refs... done before resume\n");
 		} else {
-			g_task_ctx.tp = TASK_ROOT_REFS;
-			task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
-		}
+			if (!g_task_ctx.progress_enabled) {
+				fprintf(stderr, "[6/7] checking root refs\n");
+			} else {
+				g_task_ctx.tp = TASK_ROOT_REFS;
+				task_start(g_task_ctx.info, &g_task_ctx.start_time, &g_task_ctx.item_count);
+			}
 
-		ret = check_root_refs(root, &root_cache);
-		task_stop(g_task_ctx.info);
+			checkpoint_phase_start(TASK_ROOT_REFS);
+			ret = check_root_refs(root, &root_cache);
+			task_stop(g_task_ctx.info);
+			checkpoint_phase_finish(TASK_ROOT_REFS, ret);
+		}
 		err |= !!ret;
 		if (ret) {
 			error("errors found in root refs");
@@ -10500,11 +11593,20 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	if (btrfs_slab_spill_peak())
+		printf("records spilled to disk: %llu\n",
+		       (unsigned long long)btrfs_slab_spill_peak());
+	if (cache_stats)
+		btrfs_print_cache_stats(gfs_info);
 
 	free_qgroup_counts();
 	free_root_recs_tree(&root_cache);
 close_out:
+	checkpoint_close();
 	close_ctree(root);
+	destroy_record_slabs();
+	if (mem_report)
+		btrfs_mem_print_usage();
 err_out:
 	if (g_task_ctx.progress_enabled)
 		task_deinit(g_task_ctx.info);
@@ -27,6 +27,7 @@
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/backref.h"
+#include "kernel-shared/reada.h"
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/utils.h"
@@ -516,25 +517,14 @@ void check_dev_size_alignment(u64 devid, u64 total_bytes, u32 sectorsize)
 	}
 }
 
+/*
+ * Read ahead the children of @node from @slot on, at all levels, so the walk
+ * down finds them already read.
+ */
 void reada_walk_down(struct btrfs_root *root, struct extent_buffer *node,
 		     int slot)
 {
-	u64 bytenr;
-	u64 ptr_gen;
-	u32 nritems;
-	int i;
-	int level;
-
-	level = btrfs_header_level(node);
-	if (level != 1)
-		return;
-
-	nritems = btrfs_header_nritems(node);
-	for (i = slot; i < nritems; i++) {
-		bytenr = btrfs_node_blockptr(node, i);
-		ptr_gen = btrfs_node_ptr_generation(node, i);
-		readahead_tree_block(gfs_info, bytenr, ptr_gen);
-	}
+	btrfs_reada_children(gfs_info, node, slot);
 }
 
 /*
@@ -1216,8 +1206,8 @@ static int populate_csum(struct btrfs_trans_handle *trans,
 					  &sectorsize, 0);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans, start + len, start + offset,
-					    buf, sectorsize);
+		ret = btrfs_csum_file_range(trans, start + offset, buf,
+					    sectorsize);
 		if (ret)
 			break;
 		offset += sectorsize;
@@ -64,6 +64,8 @@ struct task_ctx {
 	enum task_position tp;
 	time_t start_time;
 	u64 item_count;
+	/* Data read for checksum verification */
+	u64 data_bytes;
 
 	struct task_info *info;
 };
@@ -81,9 +83,16 @@ extern struct list_head delete_items;
 extern int no_holes;
 extern int init_extent_tree;
 extern int check_data_csum;
+extern int nr_check_threads;
 extern struct btrfs_fs_info *gfs_info;
 extern struct cache_tree *roots_info_cache;
 
+/* Update of the global counters, the trees may be checked in parallel */
+static inline void check_stat_add(u64 *counter, u64 value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
 static inline u8 imode_to_type(u32 imode)
 {
 #define S_SHIFT 12
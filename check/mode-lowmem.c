@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/ulist.h"
@@ -33,9 +34,11 @@
 #include "common/internal.h"
 #include "common/utils.h"
 #include "common/device-utils.h"
+#include "common/workqueue.h"
 #include "check/repair.h"
 #include "check/mode-common.h"
 #include "check/mode-lowmem.h"
+#include "check/checkpoint.h"
 
 static u64 last_allocated_chunk;
 static u64 total_used = 0;
@@ -785,18 +788,19 @@ static void account_bytes(struct btrfs_root *root, struct btrfs_path *path,
 	u32 free_nrs;
 	struct extent_buffer *eb = path->nodes[level];
 
-	total_btree_bytes += eb->len;
+	check_stat_add(&total_btree_bytes, eb->len);
 	if (fs_root_objectid(root->objectid))
-		total_fs_tree_bytes += eb->len;
+		check_stat_add(&total_fs_tree_bytes, eb->len);
 	if (btrfs_header_owner(eb) == BTRFS_EXTENT_TREE_OBJECTID)
-		total_extent_tree_bytes += eb->len;
+		check_stat_add(&total_extent_tree_bytes, eb->len);
 
 	if (level == 0) {
-		btree_space_waste += btrfs_leaf_free_space(eb);
+		check_stat_add(&btree_space_waste, btrfs_leaf_free_space(eb));
 	} else {
 		free_nrs = (BTRFS_NODEPTRS_PER_BLOCK(gfs_info) -
 			    btrfs_header_nritems(eb));
-		btree_space_waste += free_nrs * sizeof(struct btrfs_key_ptr);
+		check_stat_add(&btree_space_waste,
+			       free_nrs * sizeof(struct btrfs_key_ptr));
 	}
 }
 
@@ -3423,7 +3427,7 @@ static int check_extent_data_item(struct btrfs_root *root,
 			gfs_info->sectorsize);
 		err |= BYTES_UNALIGNED;
 	} else if (account_bytes) {
-		data_bytes_allocated += disk_num_bytes;
+		check_stat_add(&data_bytes_allocated, disk_num_bytes);
 	}
 	if (!IS_ALIGNED(extent_num_bytes, gfs_info->sectorsize)) {
 		error(
@@ -3432,7 +3436,7 @@ static int check_extent_data_item(struct btrfs_root *root,
 			gfs_info->sectorsize);
 		err |= BYTES_UNALIGNED;
 	} else if (account_bytes) {
-		data_bytes_referenced += extent_num_bytes;
+		check_stat_add(&data_bytes_referenced, extent_num_bytes);
 	}
 	owner = btrfs_header_owner(eb);
 
@@ -3674,7 +3678,7 @@ next:
 out:
 	btrfs_release_path(&path);
 
-	total_used += used;
+	check_stat_add(&total_used, used);
 
 	if (total != used) {
 		error(
@@ -4265,10 +4269,10 @@ static int check_extent_item(struct btrfs_path *path)
 
 	btrfs_item_key_to_cpu(eb, &key, slot);
 	if (key.type == BTRFS_EXTENT_ITEM_KEY) {
-		bytes_used += key.offset;
+		check_stat_add(&bytes_used, key.offset);
 		num_bytes = key.offset;
 	} else {
-		bytes_used += nodesize;
+		check_stat_add(&bytes_used, nodesize);
 		num_bytes = nodesize;
 	}
 
@@ -4883,7 +4887,7 @@ again:
 		err |= ret;
 		break;
 	case BTRFS_EXTENT_CSUM_KEY:
-		total_csum_bytes += btrfs_item_size(eb, slot);
+		check_stat_add(&total_csum_bytes, btrfs_item_size(eb, slot));
 		err |= ret;
 		break;
 	case BTRFS_TREE_BLOCK_REF_KEY:
@@ -5085,15 +5089,24 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 	return err;
 }
 
+/*
+ * @end_slot	the walk stops before this slot of the root node, used when
+ *		the tree is checked in ranges
+ */
 static int walk_up_tree(struct btrfs_root *root, struct btrfs_path *path,
-			int *level)
+			int *level, u32 end_slot)
 {
+	int root_level = btrfs_header_level(root->node);
 	int i;
 	struct extent_buffer *leaf;
+	u32 nritems;
 
 	for (i = *level; i < BTRFS_MAX_LEVEL - 1 && path->nodes[i]; i++) {
 		leaf = path->nodes[i];
-		if (path->slots[i] + 1 < btrfs_header_nritems(leaf)) {
+		nritems = btrfs_header_nritems(leaf);
+		if (i == root_level && leaf == root->node)
+			nritems = min(nritems, end_slot);
+		if (path->slots[i] + 1 < nritems) {
 			path->slots[i]++;
 			*level = i;
 			return 0;
@@ -5248,7 +5261,8 @@ out:
  * Returns 0      represents OK.
  * Returns >0     represents error bits.
  */
-static int check_btrfs_root(struct btrfs_root *root, int check_all)
+static int __check_btrfs_root(struct btrfs_root *root, int check_all,
+			      u32 start_slot, u32 end_slot)
 {
 	struct btrfs_path path;
 	struct node_refs nrefs;
@@ -5275,14 +5289,15 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 	level = btrfs_header_level(root->node);
 	btrfs_init_path(&path);
 
-	if (btrfs_root_generation(root_item) > super_generation + 1) {
+	if (start_slot == 0 &&
+	    btrfs_root_generation(root_item) > super_generation + 1) {
 		error(
 	"invalid root generation for root %llu, have %llu expect (0, %llu)",
 		      root->root_key.objectid, btrfs_root_generation(root_item),
 		      super_generation + 1);
 		err |= INVALID_GENERATION;
 		if (opt_check_repair) {
-			root->node->flags |= EXTENT_BAD_TRANSID;
+			extent_buffer_set_flags(root->node, EXTENT_BAD_TRANSID);
 			ret = recow_extent_buffer(root, root->node);
 			if (!ret) {
 				printf("Reset generation for root %llu\n",
@@ -5294,8 +5309,13 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 	if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
 		path.nodes[level] = root->node;
-		path.slots[level] = 0;
+		path.slots[level] = start_slot;
 		extent_buffer_get(root->node);
+		/* The root block itself is checked with the first range */
+		if (start_slot &&
+		    update_nodes_refs(root, root->node->start, root->node,
+				      &nrefs, level, check_all) == 0)
+			nrefs.checked[level] = 1;
 	} else {
 		struct btrfs_key key;
 
@@ -5309,7 +5329,7 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 	}
 
 	while (1) {
-		g_task_ctx.item_count++;
+		check_stat_add(&g_task_ctx.item_count, 1);
 		ret = walk_down_tree(root, &path, &level, &nrefs, check_all);
 
 		if (ret > 0)
@@ -5320,7 +5340,7 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 			break;
 		}
 
-		ret = walk_up_tree(root, &path, &level);
+		ret = walk_up_tree(root, &path, &level, end_slot);
 		if (ret != 0) {
 			/* Normal exit, reset ret to err */
 			ret = err;
@@ -5333,6 +5353,159 @@ out:
 	return ret;
 }
 
+static int check_btrfs_root(struct btrfs_root *root, int check_all)
+{
+	return __check_btrfs_root(root, check_all, 0, (u32)-1);
+}
+
+/*
+ * Parallel check, used in read-only mode.
+ *
+ * The lowmem mode keeps no state between the trees, so each tree is checked
+ * by a worker with its own path and the error bits are merged at the end. The
+ * trees walked with @check_all are further split into ranges of the slots of
+ * the root node. The messages of different trees are not ordered.
+ */
+struct lowmem_checker {
+	struct btrfs_workqueue *wq;
+	pthread_mutex_t lock;
+	int err;
+};
+
+struct lowmem_check_work {
+	struct btrfs_work work;
+	struct lowmem_checker *checker;
+	struct btrfs_root *root;
+	int check_all;
+	u32 start_slot;
+	u32 end_slot;
+	/* The root is not cached, free it after the check */
+	bool free_root;
+};
+
+static void lowmem_check_work_fn(struct btrfs_work *work)
+{
+	struct lowmem_check_work *cw = container_of(work,
+					struct lowmem_check_work, work);
+	struct lowmem_checker *checker = cw->checker;
+	int ret;
+
+	ret = __check_btrfs_root(cw->root, cw->check_all, cw->start_slot,
+				 cw->end_slot);
+	if (cw->free_root)
+		btrfs_free_fs_root(cw->root);
+
+	pthread_mutex_lock(&checker->lock);
+	checker->err |= ret;
+	pthread_mutex_unlock(&checker->lock);
+	free(cw);
+}
+
+static struct lowmem_checker *alloc_lowmem_checker(void)
+{
+	struct lowmem_checker *checker;
+
+	if (nr_check_threads <= 1 || opt_check_repair)
+		return NULL;
+	checker = calloc(1, sizeof(*checker));
+	if (!checker)
+		goto fail;
+	checker->wq = btrfs_alloc_workqueue(nr_check_threads);
+	if (!checker->wq) {
+		free(checker);
+		goto fail;
+	}
+	pthread_mutex_init(&checker->lock, NULL);
+	/* The block groups are not touched again without repair */
+	reset_cached_block_groups();
+	return checker;
+fail:
+	warning("cannot start the check threads, checking serially");
+	return NULL;
+}
+
+/* Wait for all the queued checks, returns their merged errors */
+static int free_lowmem_checker(struct lowmem_checker *checker)
+{
+	int err;
+
+	btrfs_flush_workqueue(checker->wq);
+	btrfs_destroy_workqueue(checker->wq);
+	err = checker->err;
+	pthread_mutex_destroy(&checker->lock);
+	free(checker);
+	return err;
+}
+
+static bool queue_lowmem_check_range(struct lowmem_checker *checker,
+				     struct btrfs_root *root, int check_all,
+				     u32 start_slot, u32 end_slot,
+				     bool free_root)
+{
+	struct lowmem_check_work *cw;
+
+	cw = calloc(1, sizeof(*cw));
+	if (!cw)
+		return false;
+	cw->checker = checker;
+	cw->root = root;
+	cw->check_all = check_all;
+	cw->start_slot = start_slot;
+	cw->end_slot = end_slot;
+	cw->free_root = free_root;
+	btrfs_init_work(&cw->work, lowmem_check_work_fn);
+	btrfs_queue_work(checker->wq, &cw->work);
+	return true;
+}
+
+/*
+ * Queue the check of the whole tree, or of ranges of it if possible. What
+ * can't be queued is checked right away and its errors are returned.
+ */
+static int queue_lowmem_check(struct lowmem_checker *checker,
+			      struct btrfs_root *root, int check_all,
+			      bool free_root)
+{
+	struct extent_buffer *node = root->node;
+	u32 nritems = btrfs_header_nritems(node);
+	u32 nr_ranges = 1;
+	u32 start;
+	u32 end;
+	u32 i;
+	int ret;
+
+	/*
+	 * Only a valid root node of a live tree is split, otherwise the walk
+	 * starts elsewhere or the error would be reported by each range. The
+	 * reloc trees are short lived and freed after the check.
+	 */
+	if (check_all && !free_root && btrfs_header_level(node) > 0 &&
+	    (btrfs_root_refs(&root->root_item) > 0 ||
+	     btrfs_disk_key_objectid(&root->root_item.drop_progress) == 0) &&
+	    btrfs_check_node(gfs_info, NULL, node) == BTRFS_TREE_BLOCK_CLEAN)
+		nr_ranges = min_t(u32, nritems, nr_check_threads * 4);
+
+	if (nr_ranges <= 1) {
+		if (queue_lowmem_check_range(checker, root, check_all, 0,
+					     (u32)-1, free_root))
+			return 0;
+		ret = check_btrfs_root(root, check_all);
+		if (free_root)
+			btrfs_free_fs_root(root);
+		return ret;
+	}
+
+	for (i = 0; i < nr_ranges; i++) {
+		start = (u64)nritems * i / nr_ranges;
+		end = (u64)nritems * (i + 1) / nr_ranges;
+		if (!queue_lowmem_check_range(checker, root, check_all, start,
+					      end, false))
+			return __check_btrfs_root(root, check_all, start,
+						  (u32)-1);
+	}
+	return 0;
+}
+
 /*
  * Iterate all items in the tree and call check_inode_item() to check.
  *
@@ -5450,6 +5623,7 @@ int check_fs_roots_lowmem(void)
 {
 	struct btrfs_root *tree_root = gfs_info->tree_root;
 	struct btrfs_root *cur_root = NULL;
+	struct lowmem_checker *checker;
 	struct btrfs_path path;
 	struct btrfs_key key;
 	struct extent_buffer *node;
@@ -5457,6 +5631,7 @@ int check_fs_roots_lowmem(void)
 	int ret;
 	int err = 0;
 
+	checker = alloc_lowmem_checker();
 	btrfs_init_path(&path);
 	key.objectid = BTRFS_FS_TREE_OBJECTID;
 	key.offset = 0;
@@ -5490,6 +5665,12 @@ int check_fs_roots_lowmem(void)
 		}
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
+			/* There can be more reloc trees, they're always checked */
+			if (key.objectid != BTRFS_TREE_RELOC_OBJECTID &&
+			    checkpoint_root_done(key.objectid, &ret)) {
+				err |= ret;
+				goto next;
+			}
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
 				cur_root = btrfs_read_fs_root_no_cache(gfs_info,
 								       &key);
@@ -5505,11 +5686,19 @@ int check_fs_roots_lowmem(void)
 				goto next;
 			}
 
+			if (checker) {
+				err |= queue_lowmem_check(checker, cur_root, 0,
+					key.objectid == BTRFS_TREE_RELOC_OBJECTID);
+				goto next;
+			}
+			checkpoint_root_start(key.objectid);
 			ret = check_fs_root(cur_root);
 			err |= ret;
 
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
 				btrfs_free_fs_root(cur_root);
+			else
+				checkpoint_root_finish(key.objectid, ret);
 		} else if (key.type == BTRFS_ROOT_REF_KEY ||
 				key.type == BTRFS_ROOT_BACKREF_KEY) {
 			ret = check_root_ref(tree_root, &key, node, slot);
@@ -5548,6 +5737,8 @@ next:
 
 out:
 	btrfs_release_path(&path);
+	if (checker)
+		err |= free_lowmem_checker(checker);
 	return err;
 }
 
@@ -5556,6 +5747,7 @@ out:
  */
 int check_chunks_and_extents_lowmem(void)
 {
+	struct lowmem_checker *checker;
 	struct btrfs_path path;
 	struct btrfs_key old_key;
 	struct btrfs_key key;
@@ -5564,12 +5756,19 @@ int check_chunks_and_extents_lowmem(void)
 	int err = 0;
 	int ret;
 
+	checker = alloc_lowmem_checker();
 	root = gfs_info->chunk_root;
-	ret = check_btrfs_root(root, 1);
+	if (checker)
+		ret = queue_lowmem_check(checker, root, 1, false);
+	else
+		ret = check_btrfs_root(root, 1);
 	err |= ret;
 
 	root = gfs_info->tree_root;
-	ret = check_btrfs_root(root, 1);
+	if (checker)
+		ret = queue_lowmem_check(checker, root, 1, false);
+	else
+		ret = check_btrfs_root(root, 1);
 	err |= ret;
 
 	btrfs_init_path(&path);
@@ -5600,12 +5799,16 @@ int check_chunks_and_extents_lowmem(void)
 			goto next;
 		}
 
-		ret = check_btrfs_root(cur_root, 1);
+		if (checker) {
+			ret = queue_lowmem_check(checker, cur_root, 1,
+					key.objectid == BTRFS_TREE_RELOC_OBJECTID);
+		} else {
+			ret = check_btrfs_root(cur_root, 1);
+			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+				btrfs_free_fs_root(cur_root);
+		}
 		err |= ret;
 
-		if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
-			btrfs_free_fs_root(cur_root);
-
 		btrfs_release_path(&path);
 		ret = btrfs_search_slot(NULL, gfs_info->tree_root,
 					&old_key, &path, 0, 0);
@@ -5617,6 +5820,8 @@ next:
 			goto out;
 	}
 out:
+	if (checker)
+		err |= free_lowmem_checker(checker);
 
 	if (total_used != btrfs_super_bytes_used(gfs_info->super_copy)) {
 		fprintf(stderr,
@@ -73,13 +73,17 @@ static inline struct tree_backref* to_tree_backref(struct extent_backref *back)
 /* Explicit initialization for extent_record::flag_block_full_backref */
 enum { FLAG_UNSET = 2 };
 
+/*
+ * The records are allocated from slabs but still linked in the extent cache
+ * rb-tree, with the backrefs in a list and an rb-tree, the repair code looks
+ * them up and changes them in place.
+ */
 struct extent_record {
 	struct list_head backrefs;
 	struct list_head dups;
 	struct rb_root backref_tree;
 	struct list_head list;
 	struct cache_extent cache;
-	struct btrfs_key parent_key;
 	u64 start;
 	u64 max_size;
 	u64 nr;
@@ -99,6 +103,8 @@ struct extent_record {
 	unsigned int bad_full_backref:1;
 	unsigned int crossing_stripes:1;
 	unsigned int wrong_chunk_type:1;
+	/* Packed, placed last to fill the tail padding */
+	struct btrfs_key parent_key;
 };
 
 static inline struct extent_record* to_extent_record(struct list_head *entry)
@@ -210,13 +216,12 @@ struct inode_record {
 	u64 nbytes;
 
 	u32 found_link;
+	u32 refs;
 	u64 found_size;
 	u64 extent_start;
 	u64 extent_end;
 	struct rb_root holes;
 	struct list_head mismatch_dir_hash;
-
-	u32 refs;
 };
 
 /*
@@ -32,6 +32,17 @@
 
 int opt_check_repair = 0;
 
+/*
+ * Trees walked in parallel record their corrupted blocks separately, this
+ * takes precedence over fs_info::corrupt_blocks in the calling thread.
+ */
+static __thread struct cache_tree *thread_corrupt_blocks;
+
+void btrfs_set_thread_corrupt_blocks(struct cache_tree *corrupt_blocks)
+{
+	thread_corrupt_blocks = corrupt_blocks;
+}
+
 int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
 				    struct btrfs_key *first_key,
 				    u64 start, u64 len, int level)
@@ -39,8 +50,10 @@ int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
 {
 	int ret = 0;
 	struct btrfs_corrupt_block *corrupt;
+	struct cache_tree *corrupt_blocks;
 
-	if (!info->corrupt_blocks)
+	corrupt_blocks = thread_corrupt_blocks ?: info->corrupt_blocks;
+	if (!corrupt_blocks)
 		return 0;
 
 	corrupt = malloc(sizeof(*corrupt));
@@ -52,7 +65,7 @@ int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
 	corrupt->cache.size = len;
 	corrupt->level = level;
 
-	ret = insert_cache_extent(info->corrupt_blocks, &corrupt->cache);
+	ret = insert_cache_extent(corrupt_blocks, &corrupt->cache);
 	if (ret)
 		free(corrupt);
 	BUG_ON(ret && ret != -EEXIST);
@@ -23,21 +23,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <mntent.h>
+#include <pthread.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
-#include "kernel-lib/interval_tree_generic.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
+#include "ioctl.h"
 #include "common/utils.h"
 #include "common/open-utils.h"
 #include "common/units.h"
 #include "common/help.h"
 #include "common/messages.h"
+#include "common/string-utils.h"
 #include "common/fsfeatures.h"
+#include "common/workqueue.h"
 #include "cmds/commands.h"
 
 #if !defined(FIEMAP_EXTENT_SHARED) && (HAVE_OWN_FIEMAP_EXTENT_SHARED_DEFINE == 1)
@@ -49,112 +55,88 @@ static unsigned unit_mode = UNITS_RAW;
 static char path[PATH_MAX] = { 0, };
 static char *pathp = path;
 static char *path_max = &path[PATH_MAX - 1];
-
-struct shared_extent {
-	struct rb_node	rb;
-	u64	start;	/* Start of interval */
-	u64	last;	/* Last location _in_ interval */
-	u64	__subtree_last;
-};
+/* Threads walking the directories, 1 for the walk in the main thread */
+static int nr_threads = 1;
 
 /*
- * extent_tree_* functions are defined in the massive interval tree
- * macro below. This serves to illustrate the api in human-readable
- * terms.
+ * Physical ranges of the shared extents, the bytes covered by at least one of
+ * them are counted once by du_extent_set_bytes().
  */
-static void
-extent_tree_insert(struct shared_extent *node, struct rb_root *root);
-
-static void
-extent_tree_remove(struct shared_extent *node, struct rb_root *root);
-
-static struct shared_extent *
-extent_tree_iter_first(struct rb_root *root,
-		       u64 start, u64 last);
-
-static struct shared_extent *
-extent_tree_iter_next(struct shared_extent *node,
-			u64 start, u64 last);
-
-#define START(node) ((node)->start)
-#define LAST(node)  ((node)->last)
+struct du_extent {
+	u64 start;
+	u64 len;
+};
 
-INTERVAL_TREE_DEFINE(struct shared_extent, rb,
-		     u64, __subtree_last,
-		     START, LAST, static, extent_tree)
+struct du_extent_set {
+	struct du_extent *extents;
+	size_t nr;
+	size_t max;
+};
 
-static int add_shared_extent(u64 start, u64 len, struct rb_root *root)
+static int du_extent_set_add(struct du_extent_set *set, u64 start, u64 len)
 {
-	struct shared_extent *sh;
-
 	ASSERT(len != 0);
 
-	sh = calloc(1, sizeof(*sh));
-	if (!sh)
-		return -ENOMEM;
-
-	sh->start = start;
-	sh->last = (start + len - 1);
+	if (set->nr == set->max) {
+		struct du_extent *tmp;
+		size_t max = max_t(size_t, set->max * 2, 1024);
 
-	extent_tree_insert(sh, root);
+		tmp = realloc(set->extents, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		set->extents = tmp;
+		set->max = max;
+	}
+	set->extents[set->nr].start = start;
+	set->extents[set->nr].len = len;
+	set->nr++;
 
 	return 0;
 }
 
-static void cleanup_shared_extents(struct rb_root *root)
+/* Move all extents of @src to @dst */
+static int du_extent_set_splice(struct du_extent_set *dst,
+				struct du_extent_set *src)
 {
-	struct shared_extent *s;
-	struct shared_extent *tmp;
+	struct du_extent *tmp;
 
-	if (!root)
-		return;
-
-	s = extent_tree_iter_first(root, 0, -1ULL);
-	while (s) {
-		tmp = extent_tree_iter_next(s, 0, -1ULL);
-		extent_tree_remove(s, root);
-
-		free(s);
-		s = tmp;
+	if (!src->nr)
+		return 0;
+	if (dst->nr + src->nr > dst->max) {
+		size_t max = max_t(size_t, dst->max * 2, dst->nr + src->nr);
+
+		tmp = realloc(dst->extents, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		dst->extents = tmp;
+		dst->max = max;
 	}
+	memcpy(dst->extents + dst->nr, src->extents,
+	       src->nr * sizeof(struct du_extent));
+	dst->nr += src->nr;
+	src->nr = 0;
+
+	return 0;
 }
 
-/*
- * Find all extents which overlap 'n', calculate the space
- * covered by them and remove those nodes from the tree.
- */
-static u64 count_unique_bytes(struct rb_root *root, struct shared_extent *n)
+static void du_extent_set_release(struct du_extent_set *set)
 {
-	struct shared_extent *tmp;
-	u64 wstart = n->start;
-	u64 wlast = n->last;
-
-	pr_verbose(LOG_DEBUG, "Count overlaps:");
-
-	do {
-		/*
-		 * Expand our search window based on the latest
-		 * overlapping extent. Doing this will allow us to
-		 * find all possible overlaps
-		 */
-		if (wstart > n->start)
-			wstart = n->start;
-		if (wlast < n->last)
-			wlast = n->last;
-
-		pr_verbose(LOG_DEBUG, " (%llu, %llu)", n->start, n->last);
-
-		tmp = n;
-		n = extent_tree_iter_next(n, wstart, wlast);
-
-		extent_tree_remove(tmp, root);
-		free(tmp);
-	} while (n);
+	free(set->extents);
+	set->extents = NULL;
+	set->nr = 0;
+	set->max = 0;
+}
 
-	pr_verbose(LOG_DEBUG, "; wstart: %llu wlast: %llu total: %llu\n", wstart,
-		wlast, wlast - wstart + 1);
+static int cmp_du_extent(const void *a, const void *b)
+{
+	const struct du_extent *ea = a;
+	const struct du_extent *eb = b;
 
-	return wlast - wstart + 1;
+	if (ea->start < eb->start)
+		return -1;
+	if (ea->start > eb->start)
+		return 1;
+	return 0;
 }
 
 /*
@@ -163,37 +145,41 @@ static u64 count_unique_bytes(struct rb_root *root, struct shared_extent *n)
  * count any byte more than once, so just adding them up doesn't
  * work.
  *
- * For each set of overlapping extents we find the lowest start and
- * highest end. From there we have the actual number of bytes which is
- * shared across all of the extents in our set. A sum of each sets
- * extent length is returned.
+ * The extents are sorted by start and each run of overlapping extents is
+ * merged, the sum of the merged lengths is returned. The set is emptied.
  */
-static void count_shared_bytes(struct rb_root *root, u64 *ret_cnt)
+static u64 du_extent_set_bytes(struct du_extent_set *set)
 {
 	u64 count = 0;
-	struct shared_extent *s = extent_tree_iter_first(root,
-							 0, -1ULL);
+	u64 wstart;
+	u64 wend;
+	size_t i;
 
-	if (!s)
+	if (!set->nr)
 		goto out;
 
-	while (s) {
-		/*
-		 * Find all extents which overlap 's', calculate the space
-		 * covered by them and remove those nodes from the tree.
-		 */
-		count += count_unique_bytes(root, s);
+	qsort(set->extents, set->nr, sizeof(struct du_extent), cmp_du_extent);
+	wstart = set->extents[0].start;
+	wend = wstart + set->extents[0].len;
+	for (i = 1; i < set->nr; i++) {
+		struct du_extent *ext = &set->extents[i];
 
-		/*
-		 * Since count_unique_bytes will be emptying the tree,
-		 * we can grab the first node here
-		 */
-		s = extent_tree_iter_first(root, 0, -1ULL);
+		if (ext->start < wend) {
+			wend = max(wend, ext->start + ext->len);
+			continue;
+		}
+		pr_verbose(LOG_DEBUG, "Shared range: (%llu, %llu) total: %llu\n",
+			   wstart, wend - 1, wend - wstart);
+		count += wend - wstart;
+		wstart = ext->start;
+		wend = wstart + ext->len;
 	}
-
-	BUG_ON(!RB_EMPTY_ROOT(root));
+	pr_verbose(LOG_DEBUG, "Shared range: (%llu, %llu) total: %llu\n",
+		   wstart, wend - 1, wend - wstart);
+	count += wend - wstart;
 out:
-	*ret_cnt = count;
+	du_extent_set_release(set);
+	return count;
 }
 
 /* Track which inodes we've seen for the purposes of hardlink detection. */
@@ -285,13 +271,485 @@ static void clear_seen_inodes(void)
 	}
 }
 
+/*
+ * Cache of the space used by the files, kept in a file between runs
+ * (--cache). A file is examined again if its inode generation or ctime
+ * changed, or if its subvolume was snapshotted since. The entries of the
+ * files not seen by a run are dropped. Extents that stop being shared
+ * because the other references are gone, e.g. by deleting a snapshot, are
+ * not noticed.
+ */
+#define DU_CACHE_MAGIC		"btrfs-du-cache"
+#define DU_CACHE_VERSION	2
+
+struct du_cache_header {
+	char magic[16];
+	__le32 version;
+	__le32 reserved;
+	__le64 nr_items;
+} __attribute__ ((__packed__));
+
+/* Followed by nr_extents of struct du_cache_extent */
+struct du_cache_item {
+	u8 fsid[BTRFS_FSID_SIZE];
+	__le64 subvol;
+	__le64 ino;
+	__le64 generation;
+	__le64 snapshot_gen;
+	__le64 ctime_sec;
+	__le32 ctime_nsec;
+	__le32 nr_extents;
+	__le64 total;
+	__le64 shared;
+} __attribute__ ((__packed__));
+
+struct du_cache_extent {
+	__le64 start;
+	__le64 len;
+} __attribute__ ((__packed__));
+
+struct du_cache_entry {
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 subvol;
+	u64 ino;
+	u64 generation;
+	u64 snapshot_gen;
+	u64 ctime_sec;
+	u32 ctime_nsec;
+	bool used;
+	u64 total;
+	u64 shared;
+	/* The shared extents of the file */
+	u32 nr_extents;
+	struct du_extent *extents;
+};
+
+struct du_cache {
+	const char *filename;
+	pthread_mutex_t lock;
+	/* Read from the file, sorted by key */
+	struct du_cache_entry *entries;
+	size_t nr;
+	/* Files examined by this run */
+	struct du_cache_entry *added;
+	size_t nr_added;
+	size_t max_added;
+};
+
+static struct du_cache cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Each subvolume has its own st_dev, so the subvolume id and the fsid are
+ * looked up once for each device and not for every file.
+ */
+struct du_dev {
+	dev_t dev;
+	int ret;
+	u64 subvol;
+	u8 fsid[BTRFS_FSID_SIZE];
+	/* See du_subvol_snapshot_gen() */
+	u64 snapshot_gen;
+};
+
+/* The cache is not used for the files of the subvolume */
+#define DU_NO_SNAPSHOT_GEN	((u64)-1)
+
+static struct du_dev *du_devs;
+static int du_nr_devs;
+static pthread_mutex_t du_devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The extents of a subvolume become shared when it's snapshotted, without a
+ * change of its files. A snapshot sets the last_snapshot of the root item of
+ * the subvolume, reading it needs CAP_SYS_ADMIN. Otherwise the generation of
+ * the subvolume is used, a snapshot changes it too, but so does any other
+ * change in the subvolume.
+ */
+static int du_subvol_snapshot_gen(int fd, u64 subvol, u64 *ret_gen)
+{
+	struct btrfs_ioctl_get_subvol_info_args info;
+	struct btrfs_ioctl_search_args args = { 0 };
+	struct btrfs_ioctl_search_key *sk = &args.key;
+	struct btrfs_ioctl_search_header *sh;
+
+	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk->min_objectid = subvol;
+	sk->max_objectid = subvol;
+	sk->min_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+	sk->nr_items = 1;
+	if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) == 0 && sk->nr_items == 1) {
+		sh = (struct btrfs_ioctl_search_header *)args.buf;
+		*ret_gen = btrfs_root_last_snapshot((struct btrfs_root_item *)(sh + 1));
+		return 0;
+	}
+
+	if (ioctl(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0)
+		return -errno;
+	*ret_gen = info.generation;
+	return 0;
+}
+
+static int du_lookup_dev(int fd, const struct stat *st, u64 *subvol, u8 *fsid,
+			 u64 *snapshot_gen)
+{
+	struct btrfs_ioctl_fs_info_args fi_args = { 0 };
+	struct du_dev *dev;
+	int ret;
+	int i;
+
+	pthread_mutex_lock(&du_devs_lock);
+	for (i = 0; i < du_nr_devs; i++) {
+		if (du_devs[i].dev == st->st_dev)
+			break;
+	}
+	if (i == du_nr_devs) {
+		dev = realloc(du_devs, (du_nr_devs + 1) * sizeof(*dev));
+		if (!dev) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		du_devs = dev;
+		dev = &du_devs[du_nr_devs++];
+		memset(dev, 0, sizeof(*dev));
+		dev->dev = st->st_dev;
+		dev->ret = lookup_path_rootid(fd, &dev->subvol);
+		if (!dev->ret) {
+			if (ioctl(fd, BTRFS_IOC_FS_INFO, &fi_args) < 0)
+				dev->ret = -errno;
+			else
+				memcpy(dev->fsid, fi_args.fsid, BTRFS_FSID_SIZE);
+		}
+		dev->snapshot_gen = DU_NO_SNAPSHOT_GEN;
+		if (!dev->ret && cache.filename)
+			du_subvol_snapshot_gen(fd, dev->subvol,
+					       &dev->snapshot_gen);
+	}
+	dev = &du_devs[i];
+	ret = dev->ret;
+	*subvol = dev->subvol;
+	memcpy(fsid, dev->fsid, BTRFS_FSID_SIZE);
+	*snapshot_gen = dev->snapshot_gen;
+out:
+	pthread_mutex_unlock(&du_devs_lock);
+	return ret;
+}
+
+static int cmp_du_cache_entry(const void *a, const void *b)
+{
+	const struct du_cache_entry *ea = a;
+	const struct du_cache_entry *eb = b;
+	int ret;
+
+	ret = memcmp(ea->fsid, eb->fsid, BTRFS_FSID_SIZE);
+	if (ret)
+		return ret;
+	if (ea->subvol < eb->subvol)
+		return -1;
+	if (ea->subvol > eb->subvol)
+		return 1;
+	if (ea->ino < eb->ino)
+		return -1;
+	if (ea->ino > eb->ino)
+		return 1;
+	return 0;
+}
+
+static void du_cache_free_entries(struct du_cache_entry *entries, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		free(entries[i].extents);
+	free(entries);
+}
+
+static int du_cache_read_entry(FILE *file, off_t *left,
+			       struct du_cache_entry *entry)
+{
+	struct du_cache_item item;
+	struct du_cache_extent ext;
+	u32 i;
+
+	if (*left < sizeof(item) || fread(&item, sizeof(item), 1, file) != 1)
+		return -EUCLEAN;
+	*left -= sizeof(item);
+
+	memcpy(entry->fsid, item.fsid, BTRFS_FSID_SIZE);
+	entry->subvol = le64_to_cpu(item.subvol);
+	entry->ino = le64_to_cpu(item.ino);
+	entry->generation = le64_to_cpu(item.generation);
+	entry->snapshot_gen = le64_to_cpu(item.snapshot_gen);
+	entry->ctime_sec = le64_to_cpu(item.ctime_sec);
+	entry->ctime_nsec = le32_to_cpu(item.ctime_nsec);
+	entry->total = le64_to_cpu(item.total);
+	entry->shared = le64_to_cpu(item.shared);
+	entry->nr_extents = le32_to_cpu(item.nr_extents);
+	entry->used = false;
+	entry->extents = NULL;
+	if (!entry->nr_extents)
+		return 0;
+
+	if (*left / sizeof(ext) < entry->nr_extents)
+		return -EUCLEAN;
+	entry->extents = malloc(entry->nr_extents * sizeof(struct du_extent));
+	if (!entry->extents)
+		return -ENOMEM;
+	for (i = 0; i < entry->nr_extents; i++) {
+		if (fread(&ext, sizeof(ext), 1, file) != 1)
+			return -EUCLEAN;
+		entry->extents[i].start = le64_to_cpu(ext.start);
+		entry->extents[i].len = le64_to_cpu(ext.len);
+		if (!entry->extents[i].len)
+			return -EUCLEAN;
+	}
+	*left -= entry->nr_extents * sizeof(ext);
+
+	return 0;
+}
+
+/* A missing or unreadable cache file is not an error, all files are examined */
+static void du_cache_load(const char *filename)
+{
+	struct du_cache_header header;
+	struct stat st;
+	FILE *file;
+	off_t left;
+	u64 nr_items;
+	int ret = 0;
+
+	cache.filename = filename;
+	file = fopen(filename, "r");
+	if (!file) {
+		if (errno != ENOENT)
+			warning("cannot open cache file %s: %m", filename);
+		return;
+	}
+	if (fstat(fileno(file), &st) < 0 || st.st_size < sizeof(header) ||
+	    fread(&header, sizeof(header), 1, file) != 1 ||
+	    strncmp(header.magic, DU_CACHE_MAGIC, sizeof(header.magic)) ||
+	    le32_to_cpu(header.version) != DU_CACHE_VERSION) {
+		warning("cache file %s has unknown format, ignoring it",
+			filename);
+		goto out;
+	}
+	left = st.st_size - sizeof(header);
+	nr_items = le64_to_cpu(header.nr_items);
+	if (nr_items > left / sizeof(struct du_cache_item)) {
+		ret = -EUCLEAN;
+		goto out;
+	}
+
+	cache.entries = calloc(nr_items, sizeof(struct du_cache_entry));
+	if (!cache.entries) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (cache.nr = 0; cache.nr < nr_items; cache.nr++) {
+		ret = du_cache_read_entry(file, &left, &cache.entries[cache.nr]);
+		if (ret < 0) {
+			cache.nr++;
+			break;
+		}
+	}
+	qsort(cache.entries, cache.nr, sizeof(struct du_cache_entry),
+	      cmp_du_cache_entry);
+out:
+	if (ret < 0) {
+		errno = -ret;
+		warning("cannot read cache file %s, ignoring it: %m", filename);
+		du_cache_free_entries(cache.entries, cache.nr);
+		cache.entries = NULL;
+		cache.nr = 0;
+	}
+	fclose(file);
+}
+
+/*
+ * Return the cached entry of the file if it did not change since, or NULL.
+ * Safe to call from several threads.
+ */
+static struct du_cache_entry *du_cache_lookup(const u8 *fsid, u64 subvol,
+					      const struct stat *st,
+					      u64 generation, u64 snapshot_gen)
+{
+	struct du_cache_entry key = { .subvol = subvol, .ino = st->st_ino };
+	struct du_cache_entry *entry;
+
+	memcpy(key.fsid, fsid, BTRFS_FSID_SIZE);
+	entry = bsearch(&key, cache.entries, cache.nr,
+			sizeof(struct du_cache_entry), cmp_du_cache_entry);
+	if (!entry || entry->generation != generation ||
+	    entry->snapshot_gen != snapshot_gen ||
+	    entry->ctime_sec != st->st_ctim.tv_sec ||
+	    entry->ctime_nsec != st->st_ctim.tv_nsec)
+		return NULL;
+
+	pthread_mutex_lock(&cache.lock);
+	entry->used = true;
+	pthread_mutex_unlock(&cache.lock);
+
+	return entry;
+}
+
+/* Add the file to the cache, the extents of @shared_extents are taken over */
+static int du_cache_add(const u8 *fsid, u64 subvol, const struct stat *st,
+			u64 generation, u64 snapshot_gen, u64 total, u64 shared,
+			struct du_extent_set *shared_extents)
+{
+	struct du_cache_entry *entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache.lock);
+	if (cache.nr_added == cache.max_added) {
+		size_t max = max_t(size_t, cache.max_added * 2, 1024);
+
+		entry = realloc(cache.added, max * sizeof(*entry));
+		if (!entry) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		cache.added = entry;
+		cache.max_added = max;
+	}
+	entry = &cache.added[cache.nr_added++];
+	memcpy(entry->fsid, fsid, BTRFS_FSID_SIZE);
+	entry->subvol = subvol;
+	entry->ino = st->st_ino;
+	entry->generation = generation;
+	entry->snapshot_gen = snapshot_gen;
+	entry->ctime_sec = st->st_ctim.tv_sec;
+	entry->ctime_nsec = st->st_ctim.tv_nsec;
+	entry->used = true;
+	entry->total = total;
+	entry->shared = shared;
+	entry->nr_extents = shared_extents->nr;
+	entry->extents = shared_extents->extents;
+	shared_extents->extents = NULL;
+	shared_extents->nr = 0;
+	shared_extents->max = 0;
+out:
+	pthread_mutex_unlock(&cache.lock);
+	return ret;
+}
+
+static int du_cache_write_entry(FILE *file, const struct du_cache_entry *entry)
+{
+	struct du_cache_item item;
+	struct du_cache_extent ext;
+	u32 i;
+
+	memcpy(item.fsid, entry->fsid, BTRFS_FSID_SIZE);
+	item.subvol = cpu_to_le64(entry->subvol);
+	item.ino = cpu_to_le64(entry->ino);
+	item.generation = cpu_to_le64(entry->generation);
+	item.snapshot_gen = cpu_to_le64(entry->snapshot_gen);
+	item.ctime_sec = cpu_to_le64(entry->ctime_sec);
+	item.ctime_nsec = cpu_to_le32(entry->ctime_nsec);
+	item.nr_extents = cpu_to_le32(entry->nr_extents);
+	item.total = cpu_to_le64(entry->total);
+	item.shared = cpu_to_le64(entry->shared);
+	if (fwrite(&item, sizeof(item), 1, file) != 1)
+		return -errno;
+	for (i = 0; i < entry->nr_extents; i++) {
+		ext.start = cpu_to_le64(entry->extents[i].start);
+		ext.len = cpu_to_le64(entry->extents[i].len);
+		if (fwrite(&ext, sizeof(ext), 1, file) != 1)
+			return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Write the used and the added entries to a temporary file that replaces the
+ * cache file, and free the cache.
+ */
+static int du_cache_save(void)
+{
+	struct du_cache_header header = { 0 };
+	struct du_cache_entry *entries;
+	char tmpname[PATH_MAX];
+	FILE *file = NULL;
+	size_t nr = 0;
+	size_t nr_items = 0;
+	size_t i;
+	int ret = 0;
+
+	entries = malloc((cache.nr + cache.nr_added) * sizeof(*entries));
+	if (!entries && cache.nr + cache.nr_added) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < cache.nr; i++) {
+		if (cache.entries[i].used)
+			entries[nr++] = cache.entries[i];
+	}
+	memcpy(entries + nr, cache.added, cache.nr_added * sizeof(*entries));
+	nr += cache.nr_added;
+	qsort(entries, nr, sizeof(*entries), cmp_du_cache_entry);
+	/* Hardlinks could be added more than once */
+	for (i = 0; i < nr; i++) {
+		if (i && cmp_du_cache_entry(&entries[i], &entries[i - 1]) == 0)
+			continue;
+		entries[nr_items++] = entries[i];
+	}
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", cache.filename) >=
+	    sizeof(tmpname)) {
+		ret = -ENAMETOOLONG;
+		goto out;
+	}
+	file = fopen(tmpname, "w");
+	if (!file) {
+		ret = -errno;
+		goto out;
+	}
+	strncpy(header.magic, DU_CACHE_MAGIC, sizeof(header.magic));
+	header.version = cpu_to_le32(DU_CACHE_VERSION);
+	header.nr_items = cpu_to_le64(nr_items);
+	if (fwrite(&header, sizeof(header), 1, file) != 1) {
+		ret = -errno;
+		goto out;
+	}
+	for (i = 0; i < nr_items; i++) {
+		ret = du_cache_write_entry(file, &entries[i]);
+		if (ret < 0)
+			goto out;
+	}
+	ret = fclose(file);
+	file = NULL;
+	if (ret < 0 || rename(tmpname, cache.filename) < 0)
+		ret = -errno;
+
+out:
+	if (file) {
+		fclose(file);
+		unlink(tmpname);
+	}
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot write cache file %s: %m", cache.filename);
+	}
+	free(entries);
+	du_cache_free_entries(cache.entries, cache.nr);
+	du_cache_free_entries(cache.added, cache.nr_added);
+	cache.entries = NULL;
+	cache.added = NULL;
+	cache.nr = 0;
+	cache.nr_added = 0;
+	cache.max_added = 0;
+	return ret;
+}
+
 /*
  * Inline extents are skipped because they do not take data space,
  * delalloc and unknown are skipped because we do not know how much
  * space they will use yet.
  */
 #define	SKIP_FLAGS	(FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC|FIEMAP_EXTENT_DATA_INLINE)
-static int du_calc_file_space(int fd, struct rb_root *shared_extents,
+static int du_calc_file_space(int fd, struct du_extent_set *shared_extents,
 			      u64 *ret_total, u64 *ret_shared)
 {
 	char buf[16384];
@@ -343,9 +801,9 @@ static int du_calc_file_space(int fd, struct rb_root *shared_extents,
 				file_shared += ext_len;
 
 				if (shared_extents) {
-					ret = add_shared_extent(fm_ext[i].fe_physical,
-								ext_len,
-								shared_extents);
+					ret = du_extent_set_add(shared_extents,
+								fm_ext[i].fe_physical,
+								ext_len);
 					if (ret)
 						goto out;
 				}
@@ -364,19 +822,76 @@ out:
 	return ret;
 }
 
+/*
+ * Same as du_calc_file_space(), but the result is taken from the cache if
+ * the file did not change since the last run.
+ */
+static int du_file_space(int fd, const struct stat *st, u64 subvol,
+			 const u8 *fsid, u64 snapshot_gen,
+			 struct du_extent_set *shared_extents,
+			 u64 *ret_total, u64 *ret_shared)
+{
+	struct du_extent_set extents = { 0 };
+	struct du_cache_entry *entry;
+	unsigned int generation;
+	int ret;
+
+	if (!cache.filename || snapshot_gen == DU_NO_SNAPSHOT_GEN ||
+	    ioctl(fd, FS_IOC_GETVERSION, &generation) < 0)
+		return du_calc_file_space(fd, shared_extents, ret_total,
+					  ret_shared);
+
+	entry = du_cache_lookup(fsid, subvol, st, generation, snapshot_gen);
+	if (entry) {
+		u32 i;
+
+		for (i = 0; i < entry->nr_extents && shared_extents; i++) {
+			ret = du_extent_set_add(shared_extents,
+						entry->extents[i].start,
+						entry->extents[i].len);
+			if (ret < 0)
+				return ret;
+		}
+		*ret_total = entry->total;
+		*ret_shared = entry->shared;
+		return 0;
+	}
+
+	ret = du_calc_file_space(fd, &extents, ret_total, ret_shared);
+	if (ret < 0)
+		goto out;
+	if (shared_extents) {
+		size_t i;
+
+		for (i = 0; i < extents.nr; i++) {
+			ret = du_extent_set_add(shared_extents,
+						extents.extents[i].start,
+						extents.extents[i].len);
+			if (ret < 0)
+				goto out;
+		}
+	}
+	ret = du_cache_add(fsid, subvol, st, generation, snapshot_gen,
+			   *ret_total, *ret_shared, &extents);
+out:
+	du_extent_set_release(&extents);
+	return ret;
+}
+
 struct du_dir_ctxt {
 	u64		bytes_total;
 	u64		bytes_shared;
 	DIR		*dirstream;
-	struct rb_root	shared_extents;
+	struct du_extent_set shared_extents;
 };
-#define INIT_DU_DIR_CTXT	(struct du_dir_ctxt) { 0ULL, 0ULL, NULL, RB_ROOT }
+#define INIT_DU_DIR_CTXT	(struct du_dir_ctxt) { 0ULL, 0ULL, NULL, { 0 } }
 
 static int du_add_file(const char *filename, int dirfd,
-		       struct rb_root *shared_extents, u64 *ret_total,
+		       struct du_extent_set *shared_extents, u64 *ret_total,
 		       u64 *ret_shared, int top_level);
 
-static int du_walk_dir(struct du_dir_ctxt *ctxt, struct rb_root *shared_extents)
+static int du_walk_dir(struct du_dir_ctxt *ctxt,
+		       struct du_extent_set *shared_extents)
 {
 	int ret, type;
 	struct dirent *entry;
@@ -420,131 +935,1698 @@ static int du_walk_dir(struct du_dir_ctxt *ctxt, struct rb_root *shared_extents)
 	return ret;
 }
 
-static int du_add_file(const char *filename, int dirfd,
-		       struct rb_root *shared_extents, u64 *ret_total,
-		       u64 *ret_shared, int top_level)
-{
-	int ret, len = strlen(filename);
-	char *pathtmp;
-	struct stat st;
-	struct du_dir_ctxt dir = INIT_DU_DIR_CTXT;
-	int is_dir = 0;
-	u64 file_total = 0;
-	u64 file_shared = 0;
-	u64 dir_set_shared = 0;
-	int fd;
-	DIR *dirstream = NULL;
-
-	ret = fstatat(dirfd, filename, &st, 0);
-	if (ret)
-		return -errno;
+/*
+ * Parallel walk of the directory given on the command line (-j). The entries
+ * are examined by the worker threads into a tree of nodes, directories are
+ * listed and their entries examined by separate work items so idle threads
+ * pick up any pending subtree. With the tree search ioctl, one work item lists
+ * a directory and examines all its entries. The main thread follows the tree
+ * in the order of the sequential walk, waiting for the nodes not ready yet, so
+ * the output and hardlink detection stay the same.
+ */
 
-	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
-		return 0;
+/* Number of directory entries examined by one work item */
+#define DU_WALK_CHUNK		64
+
+struct du_node {
+	char *name;
+	struct du_node *parent;
+	/* Directories, the full path for the listing */
+	char *path;
+	u64 ino;
+	u64 subvol;
+	bool track;		/* Hardlink detection applies */
+	bool is_dir;
+	bool ignore;		/* Not a regular file or directory */
+	bool list;		/* Directory to be listed */
+	bool ready;		/* All fields are valid, protected by the lock */
+	int ret;
+	/* Regular files */
+	u64 total;
+	u64 shared;
+	/* Directories, the entries in the order of readdir */
+	struct du_node *children;
+	int nr_children;
+};
 
-	if (len > (path_max - pathp)) {
-		error("path too long: %s %s", path, filename);
-		return -ENAMETOOLONG;
-	}
+struct du_walk {
+	struct btrfs_workqueue *wq;
+	/* The directories are read by the tree search ioctl if not -1 */
+	int search_fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Shared extents of all the files, the sets of work items are merged */
+	struct du_extent_set *shared_extents;
+	/* Error not related to a particular entry */
+	int ret;
+	/* The main thread gave up, do not examine further entries */
+	bool stop;
+};
 
-	pathtmp = pathp;
-	if (pathp == path || *(pathp - 1) == '/')
-		ret = sprintf(pathp, "%s", filename);
-	else
-		ret = sprintf(pathp, "/%s", filename);
-	pathp += ret;
+struct du_walk_work {
+	struct btrfs_work work;
+	struct du_walk *walk;
+	struct du_node *dir;
+	int start;
+	int nr;
+};
 
-	fd = open_file_or_dir3(path, &dirstream, O_RDONLY);
-	if (fd < 0) {
-		ret = -errno;
-		goto out;
-	}
+static int du_path_join(const char *dir, const char *name, char **ret_path)
+{
+	size_t dir_len = strlen(dir);
+	size_t len = strlen(name);
+	char *p;
 
-	/*
-	 * If st.st_ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID ==2, there is no any
-	 * related tree
-	 */
-	if (st.st_ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
-		u64 subvol;
+	if (len > PATH_MAX - 1 - dir_len)
+		return -ENAMETOOLONG;
+	p = malloc(dir_len + len + 2);
+	if (!p)
+		return -ENOMEM;
+	if (dir_len == 0 || dir[dir_len - 1] == '/')
+		sprintf(p, "%s%s", dir, name);
+	else
+		sprintf(p, "%s/%s", dir, name);
+	*ret_path = p;
+	return 0;
+}
 
-		ret = lookup_path_rootid(fd, &subvol);
-		if (ret)
-			goto out_close;
+static void du_list_work_fn(struct btrfs_work *work);
+static void du_stat_work_fn(struct btrfs_work *work);
+static void du_search_list_work_fn(struct btrfs_work *work);
 
-		if (inode_seen(st.st_ino, subvol))
-			goto out_close;
+/* Must be called with the walk lock held */
+static int du_walk_queue(struct du_walk *walk, struct du_node *dir, int start,
+			 int nr, btrfs_work_func_t func)
+{
+	struct du_walk_work *ww;
 
-		ret = mark_inode_seen(st.st_ino, subvol);
-		if (ret)
-			goto out_close;
-	}
+	ww = malloc(sizeof(*ww));
+	if (!ww)
+		return -ENOMEM;
+	btrfs_init_work(&ww->work, func);
+	ww->walk = walk;
+	ww->dir = dir;
+	ww->start = start;
+	ww->nr = nr;
+	btrfs_queue_work(walk->wq, &ww->work);
+	return 0;
+}
 
-	if (S_ISREG(st.st_mode)) {
-		ret = du_calc_file_space(fd, shared_extents, &file_total,
-					 &file_shared);
-		if (ret)
-			goto out_close;
-	} else if (S_ISDIR(st.st_mode)) {
-		struct rb_root *root = shared_extents;
+/* Read the entries of a directory and queue the work items to examine them */
+static void du_list_work_fn(struct btrfs_work *work)
+{
+	struct du_walk_work *ww = container_of(work, struct du_walk_work, work);
+	struct du_walk *walk = ww->walk;
+	struct du_node *dir = ww->dir;
+	struct du_node *children = NULL;
+	struct dirent *entry;
+	DIR *dirstream;
+	bool stop;
+	int nr = 0;
+	int max = 0;
+	int ret = 0;
+	int i;
 
-		/*
-		 * We collect shared extents in an rb_root, the top
-		 * level caller will not pass a root down, so use the
-		 * one on our dir context.
-		 */
-		if (top_level)
-			root = &dir.shared_extents;
+	free(ww);
 
-		is_dir = 1;
+	pthread_mutex_lock(&walk->lock);
+	stop = walk->stop;
+	pthread_mutex_unlock(&walk->lock);
+	if (stop)
+		goto out;
 
-		dir.dirstream = dirstream;
-		ret = du_walk_dir(&dir, root);
-		*pathp = '\0';
+	dirstream = opendir(dir->path);
+	if (!dirstream) {
+		ret = -errno;
+		goto out;
+	}
+	while ((entry = readdir(dirstream))) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (entry->d_type != DT_REG && entry->d_type != DT_DIR)
+			continue;
+
+		if (nr == max) {
+			struct du_node *tmp;
+
+			max = max(max * 2, 64);
+			tmp = realloc(children, max * sizeof(*tmp));
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			children = tmp;
+		}
+		memset(&children[nr], 0, sizeof(children[nr]));
+		children[nr].parent = dir;
+		children[nr].name = strdup(entry->d_name);
+		if (!children[nr].name) {
+			ret = -ENOMEM;
+			break;
+		}
+		nr++;
+	}
+	closedir(dirstream);
+	if (ret < 0) {
+		for (i = 0; i < nr; i++)
+			free(children[i].name);
+		free(children);
+		children = NULL;
+		nr = 0;
+	}
+
+out:
+	pthread_mutex_lock(&walk->lock);
+	dir->children = children;
+	dir->nr_children = nr;
+	for (i = 0; i < nr && !ret; i += DU_WALK_CHUNK) {
+		int chunk = min(nr - i, DU_WALK_CHUNK);
+
+		ret = du_walk_queue(walk, dir, i, chunk, du_stat_work_fn);
+		if (ret < 0) {
+			/* The remaining entries fail */
+			for (; i < nr; i++) {
+				children[i].ret = ret;
+				children[i].ready = true;
+			}
+			ret = 0;
+			break;
+		}
+	}
+	dir->ret = ret;
+	dir->ready = true;
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+/*
+ * Examine one directory entry, like du_add_file() does, the shared extents
+ * of a regular file are added to @shared_extents. Directories get the path
+ * for the listing.
+ */
+static int du_stat_node(struct du_node *node,
+			struct du_extent_set *shared_extents)
+{
+	u8 fsid[BTRFS_FSID_SIZE] = { 0 };
+	u64 snapshot_gen = DU_NO_SNAPSHOT_GEN;
+	struct du_node *parent;
+	DIR *dirstream = NULL;
+	struct stat st;
+	char *p;
+	int ret;
+	int fd;
+
+	ret = du_path_join(node->parent->path, node->name, &p);
+	if (ret < 0)
+		return ret;
+
+	ret = fstatat(AT_FDCWD, p, &st, 0);
+	if (ret) {
+		ret = -errno;
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+		node->ignore = true;
+		goto out;
+	}
+
+	fd = open_file_or_dir3(p, &dirstream, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if (st.st_ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
+		ret = du_lookup_dev(fd, &st, &node->subvol, fsid,
+				    &snapshot_gen);
+		if (ret)
+			goto out_close;
+		node->ino = st.st_ino;
+		node->track = true;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		ret = du_file_space(fd, &st, node->subvol, fsid, snapshot_gen,
+				    shared_extents, &node->total, &node->shared);
+		goto out_close;
+	}
+
+	node->is_dir = true;
+	/*
+	 * A directory that is its own ancestor, through a bind mount, is not
+	 * listed. It's been seen by the time the main thread gets to it.
+	 */
+	for (parent = node->parent; parent && node->track;
+	     parent = parent->parent) {
+		if (parent->track && parent->ino == node->ino &&
+		    parent->subvol == node->subvol)
+			goto out_close;
+	}
+	node->path = p;
+	node->list = true;
+	p = NULL;
+
+out_close:
+	close_file_or_dir(fd, dirstream);
+out:
+	free(p);
+	return ret;
+}
+
+static void du_stat_work_fn(struct btrfs_work *work)
+{
+	struct du_walk_work *ww = container_of(work, struct du_walk_work, work);
+	struct du_walk *walk = ww->walk;
+	struct du_node *nodes = &ww->dir->children[ww->start];
+	struct du_extent_set shared_extents = { 0 };
+	int nr = ww->nr;
+	bool stop;
+	int ret;
+	int i;
+
+	free(ww);
+
+	for (i = 0; i < nr; i++) {
+		pthread_mutex_lock(&walk->lock);
+		stop = walk->stop;
+		pthread_mutex_unlock(&walk->lock);
+		if (stop) {
+			nodes[i].ret = -ECANCELED;
+			continue;
+		}
+		nodes[i].ret = du_stat_node(&nodes[i], walk->shared_extents ?
+					    &shared_extents : NULL);
+	}
+
+	/*
+	 * The nodes may be freed by the main thread as soon as they're ready,
+	 * so they're accessed only under the lock from now on.
+	 */
+	pthread_mutex_lock(&walk->lock);
+	if (walk->shared_extents) {
+		ret = du_extent_set_splice(walk->shared_extents,
+					   &shared_extents);
+		if (ret < 0 && !walk->ret)
+			walk->ret = ret;
+	}
+	for (i = 0; i < nr; i++) {
+		if (nodes[i].list) {
+			ret = du_walk_queue(walk, &nodes[i], 0, 0,
+					    du_list_work_fn);
+			if (ret == 0)
+				continue;
+			nodes[i].ret = ret;
+		}
+		nodes[i].ready = true;
+	}
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	du_extent_set_release(&shared_extents);
+}
+
+static void du_wait_node(struct du_walk *walk, struct du_node *node)
+{
+	pthread_mutex_lock(&walk->lock);
+	while (!node->ready)
+		pthread_cond_wait(&walk->cond, &walk->lock);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+/* Wait until nothing works on the subtree of @dir and free it */
+static void du_free_children(struct du_walk *walk, struct du_node *dir)
+{
+	int i;
+
+	for (i = 0; i < dir->nr_children; i++) {
+		struct du_node *node = &dir->children[i];
+
+		du_wait_node(walk, node);
+		du_free_children(walk, node);
+		free(node->name);
+		free(node->path);
+	}
+	free(dir->children);
+	dir->children = NULL;
+	dir->nr_children = 0;
+}
+
+static int du_print_node(struct du_walk *walk, struct du_node *node,
+			 u64 *ret_total, u64 *ret_shared);
+
+/* Same as du_walk_dir(), for the examined entries of @dir */
+static int du_print_children(struct du_walk *walk, struct du_node *dir,
+			     u64 *ret_total, u64 *ret_shared)
+{
+	int ret = 0;
+	int i;
+
+	du_wait_node(walk, dir);
+	if (dir->ret)
+		return dir->ret;
+
+	for (i = 0; i < dir->nr_children; i++) {
+		struct du_node *node = &dir->children[i];
+		u64 tot = 0;
+		u64 shr = 0;
+
+		ret = du_print_node(walk, node, &tot, &shr);
+		if (ret) {
+			errno = -ret;
+			warning("cannot access '%s': %m\n", node->name);
+			if (ret == -ENOTTY || ret == -EACCES) {
+				ret = 0;
+				continue;
+			}
+			pthread_mutex_lock(&walk->lock);
+			walk->stop = true;
+			pthread_mutex_unlock(&walk->lock);
+			break;
+		}
+		*ret_total += tot;
+		*ret_shared += shr;
+	}
+
+	return ret;
+}
+
+/* Same as du_add_file() for a node that is not the top level */
+static int du_print_node(struct du_walk *walk, struct du_node *node,
+			 u64 *ret_total, u64 *ret_shared)
+{
+	u64 file_total = 0;
+	u64 file_shared = 0;
+	char *pathtmp;
+	int ret;
+
+	du_wait_node(walk, node);
+	if (node->ret == -ENAMETOOLONG)
+		error("path too long: %s %s", path, node->name);
+	if (node->ret || node->ignore) {
+		ret = node->ret;
+		goto out_free;
+	}
+
+	pathtmp = pathp;
+	if (pathp == path || *(pathp - 1) == '/')
+		ret = sprintf(pathp, "%s", node->name);
+	else
+		ret = sprintf(pathp, "/%s", node->name);
+	pathp += ret;
+	ret = 0;
+
+	if (node->track) {
+		if (inode_seen(node->ino, node->subvol))
+			goto out;
+
+		ret = mark_inode_seen(node->ino, node->subvol);
+		if (ret)
+			goto out;
+	}
+
+	if (node->is_dir) {
+		ret = du_print_children(walk, node, &file_total, &file_shared);
+		*pathp = '\0';
+		if (ret)
+			goto out;
+	} else {
+		file_total = node->total;
+		file_shared = node->shared;
+	}
+
+	if (!summarize)
+		pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+			   pretty_size_mode(file_total, unit_mode),
+			   pretty_size_mode(file_total - file_shared, unit_mode),
+			   "-", path);
+
+	*ret_total = file_total;
+	*ret_shared = file_shared;
+
+out:
+	/* reset path to just before this element */
+	pathp = pathtmp;
+out_free:
+	du_free_children(walk, node);
+	return ret;
+}
+
+static int du_walk_dir_parallel(struct du_dir_ctxt *ctxt,
+				struct du_extent_set *shared_extents,
+				u64 ino, u64 subvol, int search_fd)
+{
+	struct du_walk walk = {
+		.search_fd = search_fd,
+		.shared_extents = shared_extents,
+	};
+	struct du_node root = {
+		.name = "",
+		.ino = ino,
+		.subvol = subvol,
+		.track = ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID,
+		.is_dir = true,
+	};
+	int ret;
+
+	root.path = strdup(path);
+	if (!root.path)
+		return -ENOMEM;
+	walk.wq = btrfs_alloc_workqueue(nr_threads);
+	if (!walk.wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	pthread_mutex_lock(&walk.lock);
+	ret = du_walk_queue(&walk, &root, 0, 0, search_fd >= 0 ?
+			    du_search_list_work_fn : du_list_work_fn);
+	pthread_mutex_unlock(&walk.lock);
+	if (ret == 0)
+		ret = du_print_children(&walk, &root, &ctxt->bytes_total,
+					&ctxt->bytes_shared);
+
+	pthread_mutex_lock(&walk.lock);
+	walk.stop = true;
+	root.ready = true;
+	pthread_mutex_unlock(&walk.lock);
+	du_free_children(&walk, &root);
+	btrfs_destroy_workqueue(walk.wq);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	if (!ret)
+		ret = walk.ret;
+out:
+	free(root.path);
+	return ret;
+}
+
+static int du_add_file(const char *filename, int dirfd,
+		       struct du_extent_set *shared_extents, u64 *ret_total,
+		       u64 *ret_shared, int top_level)
+{
+	int ret, len = strlen(filename);
+	char *pathtmp;
+	struct stat st;
+	struct du_dir_ctxt dir = INIT_DU_DIR_CTXT;
+	int is_dir = 0;
+	u64 file_total = 0;
+	u64 file_shared = 0;
+	u64 dir_set_shared = 0;
+	u64 subvol = 0;
+	u64 snapshot_gen = DU_NO_SNAPSHOT_GEN;
+	u8 fsid[BTRFS_FSID_SIZE] = { 0 };
+	int fd;
+	DIR *dirstream = NULL;
+
+	ret = fstatat(dirfd, filename, &st, 0);
+	if (ret)
+		return -errno;
+
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+		return 0;
+
+	if (len > (path_max - pathp)) {
+		error("path too long: %s %s", path, filename);
+		return -ENAMETOOLONG;
+	}
+
+	pathtmp = pathp;
+	if (pathp == path || *(pathp - 1) == '/')
+		ret = sprintf(pathp, "%s", filename);
+	else
+		ret = sprintf(pathp, "/%s", filename);
+	pathp += ret;
+
+	fd = open_file_or_dir3(path, &dirstream, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/*
+	 * If st.st_ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID ==2, there is no any
+	 * related tree
+	 */
+	if (st.st_ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
+		ret = du_lookup_dev(fd, &st, &subvol, fsid, &snapshot_gen);
+		if (ret)
+			goto out_close;
+
+		if (inode_seen(st.st_ino, subvol))
+			goto out_close;
+
+		ret = mark_inode_seen(st.st_ino, subvol);
+		if (ret)
+			goto out_close;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		ret = du_file_space(fd, &st, subvol, fsid, snapshot_gen,
+				    shared_extents, &file_total, &file_shared);
+		if (ret)
+			goto out_close;
+	} else if (S_ISDIR(st.st_mode)) {
+		struct du_extent_set *root = shared_extents;
+
+		/*
+		 * We collect shared extents in an extent set, the top
+		 * level caller will not pass a root down, so use the
+		 * one on our dir context.
+		 */
+		if (top_level)
+			root = &dir.shared_extents;
+
+		is_dir = 1;
+
+		dir.dirstream = dirstream;
+		if (top_level && nr_threads != 1)
+			ret = du_walk_dir_parallel(&dir, root, st.st_ino,
+						   subvol, -1);
+		else
+			ret = du_walk_dir(&dir, root);
+		*pathp = '\0';
 		if (ret) {
 			if (top_level)
-				cleanup_shared_extents(root);
+				du_extent_set_release(root);
 			goto out_close;
 		}
 
-		file_total = dir.bytes_total;
-		file_shared = dir.bytes_shared;
-		if (top_level)
-			count_shared_bytes(root, &dir_set_shared);
+		file_total = dir.bytes_total;
+		file_shared = dir.bytes_shared;
+		if (top_level)
+			dir_set_shared = du_extent_set_bytes(root);
+	}
+
+	if (!summarize || top_level) {
+		u64 excl = file_total - file_shared;
+
+		if (top_level) {
+			u64 set_shared = file_shared;
+
+			if (is_dir)
+				set_shared = dir_set_shared;
+
+			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+			       pretty_size_mode(file_total, unit_mode),
+			       pretty_size_mode(excl, unit_mode),
+			       pretty_size_mode(set_shared, unit_mode),
+			       path);
+		} else {
+			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+			       pretty_size_mode(file_total, unit_mode),
+			       pretty_size_mode(excl, unit_mode),
+			       "-", path);
+		}
+	}
+
+	if (ret_total)
+		*ret_total = file_total;
+	if (ret_shared)
+		*ret_shared = file_shared;
+
+out_close:
+	close_file_or_dir(fd, dirstream);
+out:
+	/* reset path to just before this element */
+	pathp = pathtmp;
+
+	return ret;
+}
+
+/*
+ * Alternative to FIEMAP, the file extent items are read directly from the
+ * subvolume trees by the tree search ioctl, many files per call, and the
+ * directories are listed from their DIR_INDEX items so the files do not need
+ * to be opened. This needs CAP_SYS_ADMIN, FIEMAP is used without it.
+ */
+#define DU_SEARCH_BUF_SIZE	SZ_64K
+/* Number of directory entries whose extents are looked up together */
+#define DU_SEARCH_BATCH		1024
+/* Files with inode numbers closer than this are searched in one key range */
+#define DU_SEARCH_INO_GAP	16
+/* Extent tree items further than this are skipped by a new search */
+#define DU_SEARCH_EXTENT_GAP	SZ_16M
+
+/* Search callback return value to start a new search at the next key */
+#define DU_SEARCH_RESTART	1
+#define DU_SEARCH_STOP		2
+
+struct du_subvol {
+	u64 id;
+	u64 last_snapshot;
+};
+
+struct du_search {
+	int fd;
+	struct btrfs_ioctl_search_args_v2 *args;
+	struct btrfs_data_container *inodes;
+	/* Shared extents of the top level directory */
+	struct du_extent_set *shared_extents;
+	/* Extents of the files of the directory being walked */
+	struct du_batch *batch;
+	struct du_subvol *subvols;
+	int nr_subvols;
+};
+
+struct du_dentry {
+	char *name;
+	u64 ino;		/* Inode number, or subvolume id */
+	bool subvol;
+	bool is_dir;
+	/* Regular files, the data extents are in the batch */
+	u64 total;
+	u64 shared;
+	int first_extent;
+	int nr_extents;
+	/* Another name of the same inode in the batch, that has the extents */
+	struct du_dentry *alias;
+};
+
+/* A data extent referenced by a file extent item */
+struct du_file_extent {
+	u64 bytenr;
+	u64 physical;
+	u64 len;
+	u64 transid;		/* Generation of the leaf with the item */
+	struct du_dentry *dentry;
+	bool shared;
+};
+
+struct du_batch {
+	struct du_dentry **files;
+	int nr_files;
+	int cur;
+	struct du_file_extent *extents;
+	int nr_extents;
+	int max_extents;
+};
+
+struct du_extent_ref {
+	u64 bytenr;
+	/* The file of the first reference, if there's one */
+	bool has_owner;
+	u64 root;
+	u64 ino;
+	/* Referenced by more than one file */
+	bool multi;
+	/* A reference not by a file, by a tree block or of unknown type */
+	bool full_backref;
+	int shared;		/* Resolved by LOGICAL_INO, -1 if not yet */
+};
+
+struct du_extent_refs {
+	struct du_extent_ref *refs;
+	int nr;
+	int cur;
+};
+
+typedef int (*du_search_fn)(const struct btrfs_key *key, void *item, u32 len,
+			    u64 transid, struct btrfs_key *next, void *priv);
+
+static bool du_next_key(struct btrfs_key *key)
+{
+	if (++key->offset)
+		return true;
+	if (++key->type)
+		return true;
+	return ++key->objectid != 0;
+}
+
+/*
+ * Call @fn for each item of the tree @tree_id in the key range [@min, @max].
+ * The callback returns 0 to continue, <0 on error, DU_SEARCH_STOP to end the
+ * search or DU_SEARCH_RESTART to search again from @next, which is the key
+ * after the current one unless changed by the callback.
+ */
+static int du_search_items(struct du_search *ds, u64 tree_id,
+			   const struct btrfs_key *min,
+			   const struct btrfs_key *max,
+			   du_search_fn fn, void *priv)
+{
+	struct btrfs_ioctl_search_args_v2 *args = ds->args;
+	struct btrfs_ioctl_search_key *sk = &args->key;
+	struct btrfs_key next = *min;
+	int ret;
+
+	while (btrfs_comp_cpu_keys(&next, max) <= 0) {
+		unsigned long off = 0;
+		bool more = true;
+		u32 i;
+
+		memset(sk, 0, sizeof(*sk));
+		sk->tree_id = tree_id;
+		sk->min_objectid = next.objectid;
+		sk->min_type = next.type;
+		sk->min_offset = next.offset;
+		sk->max_objectid = max->objectid;
+		sk->max_type = max->type;
+		sk->max_offset = max->offset;
+		sk->max_transid = (u64)-1;
+		sk->nr_items = UINT_MAX;
+		args->buf_size = DU_SEARCH_BUF_SIZE;
+
+		ret = ioctl(ds->fd, BTRFS_IOC_TREE_SEARCH_V2, args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		for (i = 0; i < sk->nr_items; i++) {
+			struct btrfs_ioctl_search_header *sh;
+			struct btrfs_key key;
+			u32 len;
+
+			sh = (struct btrfs_ioctl_search_header *)((char *)args->buf + off);
+			off += sizeof(*sh);
+			len = btrfs_search_header_len(sh);
+			key.objectid = btrfs_search_header_objectid(sh);
+			key.type = btrfs_search_header_type(sh);
+			key.offset = btrfs_search_header_offset(sh);
+			next = key;
+			more = du_next_key(&next);
+
+			ret = fn(&key, (char *)args->buf + off, len,
+				 btrfs_search_header_transid(sh), &next, priv);
+			if (ret < 0)
+				return ret;
+			if (ret == DU_SEARCH_STOP)
+				return 0;
+			if (ret == DU_SEARCH_RESTART)
+				break;
+			off += len;
+		}
+		if (!more)
+			break;
+	}
+	return 0;
+}
+
+static int du_root_item_fn(const struct btrfs_key *key, void *item, u32 len,
+			   u64 transid, struct btrfs_key *next, void *priv)
+{
+	u64 *last_snapshot = priv;
+
+	*last_snapshot = btrfs_root_last_snapshot(item);
+	return 0;
+}
+
+/*
+ * Data extents of the subvolume in leaves older than its last snapshot can
+ * be shared by the snapshot even with only one reference.
+ */
+static int du_subvol_last_snapshot(struct du_search *ds, u64 subvol,
+				   u64 *last_snapshot)
+{
+	struct btrfs_key min = { subvol, BTRFS_ROOT_ITEM_KEY, 0 };
+	struct btrfs_key max = { subvol, BTRFS_ROOT_ITEM_KEY, (u64)-1 };
+	struct du_subvol *tmp;
+	u64 found = 0;
+	int ret;
+	int i;
+
+	for (i = 0; i < ds->nr_subvols; i++) {
+		if (ds->subvols[i].id == subvol) {
+			*last_snapshot = ds->subvols[i].last_snapshot;
+			return 0;
+		}
+	}
+
+	ret = du_search_items(ds, BTRFS_ROOT_TREE_OBJECTID, &min, &max,
+			      du_root_item_fn, &found);
+	if (ret < 0)
+		return ret;
+
+	tmp = realloc(ds->subvols, (ds->nr_subvols + 1) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	ds->subvols = tmp;
+	ds->subvols[ds->nr_subvols].id = subvol;
+	ds->subvols[ds->nr_subvols].last_snapshot = found;
+	ds->nr_subvols++;
+	*last_snapshot = found;
+	return 0;
+}
+
+struct du_root_ref {
+	u64 dirid;
+	const char *name;
+	bool found;
+};
+
+static int du_root_ref_fn(const struct btrfs_key *key, void *item, u32 len,
+			  u64 transid, struct btrfs_key *next, void *priv)
+{
+	struct btrfs_root_ref *rref = item;
+	struct du_root_ref *ref = priv;
+	u16 name_len = btrfs_stack_root_ref_name_len(rref);
+
+	if (btrfs_stack_root_ref_dirid(rref) == ref->dirid &&
+	    name_len == strlen(ref->name) &&
+	    !memcmp(rref + 1, ref->name, name_len))
+		ref->found = true;
+	return DU_SEARCH_STOP;
+}
+
+/*
+ * A directory entry of a subvolume is only valid if the subvolume has a
+ * matching back reference, in a snapshot the entries of the subvolumes of the
+ * source are left as empty directories.
+ */
+static int du_subvol_ref_exists(struct du_search *ds, u64 parent, u64 subvol,
+				u64 dirid, const char *name)
+{
+	struct btrfs_key key = { parent, BTRFS_ROOT_REF_KEY, subvol };
+	struct du_root_ref ref = { dirid, name, false };
+	int ret;
+
+	ret = du_search_items(ds, BTRFS_ROOT_TREE_OBJECTID, &key, &key,
+			      du_root_ref_fn, &ref);
+	if (ret < 0)
+		return ret;
+	return ref.found;
+}
+
+struct du_dir_list {
+	struct du_dentry *dentries;
+	int nr;
+	int max;
+};
+
+static int du_dir_index_fn(const struct btrfs_key *key, void *item, u32 len,
+			   u64 transid, struct btrfs_key *next, void *priv)
+{
+	struct btrfs_dir_item *di = item;
+	struct du_dir_list *list = priv;
+	struct du_dentry *dentry;
+	struct btrfs_key location;
+	u8 type = btrfs_stack_dir_type(di);
+
+	if (type != BTRFS_FT_REG_FILE && type != BTRFS_FT_DIR)
+		return 0;
+
+	if (list->nr == list->max) {
+		struct du_dentry *tmp;
+		int max = max(list->max * 2, 64);
+
+		tmp = realloc(list->dentries, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		list->dentries = tmp;
+		list->max = max;
+	}
+	dentry = &list->dentries[list->nr];
+	memset(dentry, 0, sizeof(*dentry));
+	dentry->name = strndup((char *)(di + 1), btrfs_stack_dir_name_len(di));
+	if (!dentry->name)
+		return -ENOMEM;
+	btrfs_disk_key_to_cpu(&location, &di->location);
+	dentry->ino = location.objectid;
+	dentry->subvol = (location.type == BTRFS_ROOT_ITEM_KEY);
+	dentry->is_dir = (type == BTRFS_FT_DIR);
+	list->nr++;
+	return 0;
+}
+
+static int du_file_extent_fn(const struct btrfs_key *key, void *item, u32 len,
+			     u64 transid, struct btrfs_key *next, void *priv)
+{
+	struct btrfs_file_extent_item *fi = item;
+	struct du_batch *batch = priv;
+	struct du_file_extent *ext;
+	struct du_dentry *dentry;
+	u64 bytenr;
+	u64 num_bytes;
+
+	if (key->type != BTRFS_EXTENT_DATA_KEY)
+		return 0;
+	while (batch->cur < batch->nr_files &&
+	       batch->files[batch->cur]->ino < key->objectid)
+		batch->cur++;
+	if (batch->cur == batch->nr_files)
+		return DU_SEARCH_STOP;
+	dentry = batch->files[batch->cur];
+	if (dentry->ino != key->objectid)
+		return 0;
+
+	/* Inline extents do not take data space, holes have no extent */
+	if (btrfs_stack_file_extent_type(fi) == BTRFS_FILE_EXTENT_INLINE)
+		return 0;
+	bytenr = btrfs_stack_file_extent_disk_bytenr(fi);
+	if (bytenr == 0)
+		return 0;
+	num_bytes = btrfs_stack_file_extent_num_bytes(fi);
+	if (num_bytes == 0) {
+		warning("extent %llu has length 0, skipping", bytenr);
+		return 0;
+	}
+
+	if (batch->nr_extents == batch->max_extents) {
+		struct du_file_extent *tmp;
+		int max = max(batch->max_extents * 2, 1024);
+
+		tmp = realloc(batch->extents, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		batch->extents = tmp;
+		batch->max_extents = max;
+	}
+	if (!dentry->nr_extents)
+		dentry->first_extent = batch->nr_extents;
+	dentry->nr_extents++;
+	dentry->total += num_bytes;
+
+	ext = &batch->extents[batch->nr_extents++];
+	ext->bytenr = bytenr;
+	/* Same as the physical offset reported by FIEMAP */
+	ext->physical = bytenr;
+	if (btrfs_stack_file_extent_compression(fi) == BTRFS_COMPRESS_NONE)
+		ext->physical += btrfs_stack_file_extent_offset(fi);
+	ext->len = num_bytes;
+	ext->transid = transid;
+	ext->dentry = dentry;
+	ext->shared = false;
+	return 0;
+}
+
+static void du_extent_add_owner(struct du_extent_ref *ref, u64 root, u64 ino)
+{
+	if (!ref->has_owner) {
+		ref->has_owner = true;
+		ref->root = root;
+		ref->ino = ino;
+	} else if (ref->root != root || ref->ino != ino) {
+		ref->multi = true;
+	}
+}
+
+static void du_parse_extent_item(struct du_extent_ref *ref, void *item,
+				 u32 len)
+{
+	struct btrfs_extent_item *ei = item;
+	char *ptr = (char *)(ei + 1);
+	char *end = (char *)item + len;
+
+	if (len < sizeof(*ei) ||
+	    !(btrfs_stack_extent_flags(ei) & BTRFS_EXTENT_FLAG_DATA)) {
+		ref->full_backref = true;
+		return;
+	}
+
+	while (ptr < end) {
+		struct btrfs_extent_inline_ref *iref;
+		struct btrfs_extent_data_ref *dref;
+		u8 type;
+
+		iref = (struct btrfs_extent_inline_ref *)ptr;
+		type = btrfs_stack_extent_inline_ref_type(iref);
+		if (type == BTRFS_EXTENT_DATA_REF_KEY &&
+		    ptr + btrfs_extent_inline_ref_size(type) <= end) {
+			dref = (struct btrfs_extent_data_ref *)&iref->offset;
+			du_extent_add_owner(ref,
+				btrfs_stack_extent_data_ref_root(dref),
+				btrfs_stack_extent_data_ref_objectid(dref));
+		} else if (type == BTRFS_SHARED_DATA_REF_KEY) {
+			ref->full_backref = true;
+		} else {
+			/* The size of the rest is not known */
+			ref->full_backref = true;
+			break;
+		}
+		ptr += btrfs_extent_inline_ref_size(type);
+	}
+}
+
+/*
+ * Collect the owners of the extents from the inline references of the extent
+ * items and the keyed references after them.
+ */
+static int du_extent_ref_fn(const struct btrfs_key *key, void *item, u32 len,
+			    u64 transid, struct btrfs_key *next, void *priv)
+{
+	struct du_extent_refs *refs = priv;
+	struct du_extent_ref *ref;
+
+	while (refs->cur < refs->nr && refs->refs[refs->cur].bytenr < key->objectid)
+		refs->cur++;
+	if (refs->cur == refs->nr)
+		return DU_SEARCH_STOP;
+
+	ref = &refs->refs[refs->cur];
+	if (ref->bytenr == key->objectid) {
+		struct btrfs_extent_data_ref *dref = item;
+
+		if (key->type == BTRFS_EXTENT_ITEM_KEY)
+			du_parse_extent_item(ref, item, len);
+		else if (key->type == BTRFS_EXTENT_DATA_REF_KEY &&
+			 len >= sizeof(*dref))
+			du_extent_add_owner(ref,
+				btrfs_stack_extent_data_ref_root(dref),
+				btrfs_stack_extent_data_ref_objectid(dref));
+		else if (key->type == BTRFS_SHARED_DATA_REF_KEY)
+			ref->full_backref = true;
+		return 0;
 	}
 
-	if (!summarize || top_level) {
-		u64 excl = file_total - file_shared;
+	/* Skip the extents of other files if the next one is far away */
+	if (ref->bytenr > key->objectid + DU_SEARCH_EXTENT_GAP) {
+		next->objectid = ref->bytenr;
+		next->type = BTRFS_EXTENT_ITEM_KEY;
+		next->offset = 0;
+		return DU_SEARCH_RESTART;
+	}
+	return 0;
+}
 
-		if (top_level) {
-			u64 set_shared = file_shared;
+static int cmp_du_extent_ref(const void *a, const void *b)
+{
+	const struct du_extent_ref *ra = a;
+	const struct du_extent_ref *rb = b;
 
-			if (is_dir)
-				set_shared = dir_set_shared;
+	if (ra->bytenr < rb->bytenr)
+		return -1;
+	if (ra->bytenr > rb->bytenr)
+		return 1;
+	return 0;
+}
 
-			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
-			       pretty_size_mode(file_total, unit_mode),
-			       pretty_size_mode(excl, unit_mode),
-			       pretty_size_mode(set_shared, unit_mode),
-			       path);
-		} else {
-			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
-			       pretty_size_mode(file_total, unit_mode),
-			       pretty_size_mode(excl, unit_mode),
-			       "-", path);
+/*
+ * Check if the extent at @bytenr, referenced only by @ino of @subvol according
+ * to the extent tree, is also reachable from another subvolume or inode
+ * through tree blocks shared by a snapshot. Same as what FIEMAP does for all
+ * extents.
+ */
+static int du_extent_shared_by_tree(struct du_search *ds, u64 bytenr,
+				    u64 subvol, u64 ino)
+{
+	struct btrfs_ioctl_logical_ino_args loi = { 0 };
+	struct btrfs_data_container *inodes = ds->inodes;
+	u32 i;
+	int ret;
+
+	loi.logical = bytenr;
+	loi.size = DU_SEARCH_BUF_SIZE;
+	loi.flags = BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET;
+	loi.inodes = ptr_to_u64(inodes);
+	ret = ioctl(ds->fd, BTRFS_IOC_LOGICAL_INO_V2, &loi);
+	if (ret < 0)
+		return -errno;
+	if (inodes->elem_missed)
+		return 1;
+	for (i = 0; i + 2 < inodes->elem_cnt; i += 3) {
+		if (inodes->val[i] != ino || inodes->val[i + 2] != subvol)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Find out which of the extents of the batch are shared. Like FIEMAP, an
+ * extent is shared if it's referenced by another file, several references of
+ * the same file (e.g. cloned within the file) don't count. The references are
+ * read from the extent tree in bulk. Extents referenced through a tree block,
+ * or from a file extent item that may be in a tree block shared with a
+ * snapshot, are resolved by LOGICAL_INO.
+ */
+static int du_resolve_shared(struct du_search *ds, u64 subvol,
+			     struct du_batch *batch)
+{
+	struct du_extent_refs refs = { 0 };
+	struct btrfs_key min;
+	struct btrfs_key max;
+	u64 last_snapshot;
+	int ret;
+	int i;
+
+	if (!batch->nr_extents)
+		return 0;
+
+	ret = du_subvol_last_snapshot(ds, subvol, &last_snapshot);
+	if (ret < 0)
+		return ret;
+
+	refs.refs = malloc(batch->nr_extents * sizeof(struct du_extent_ref));
+	if (!refs.refs)
+		return -ENOMEM;
+	for (i = 0; i < batch->nr_extents; i++) {
+		memset(&refs.refs[i], 0, sizeof(refs.refs[i]));
+		refs.refs[i].bytenr = batch->extents[i].bytenr;
+		refs.refs[i].shared = -1;
+	}
+	qsort(refs.refs, batch->nr_extents, sizeof(struct du_extent_ref),
+	      cmp_du_extent_ref);
+	for (i = 1; i < batch->nr_extents; i++) {
+		if (refs.refs[i].bytenr != refs.refs[refs.nr].bytenr)
+			refs.refs[++refs.nr] = refs.refs[i];
+	}
+	refs.nr++;
+
+	min.objectid = refs.refs[0].bytenr;
+	min.type = BTRFS_EXTENT_ITEM_KEY;
+	min.offset = 0;
+	max.objectid = refs.refs[refs.nr - 1].bytenr;
+	max.type = (u8)-1;
+	max.offset = (u64)-1;
+	ret = du_search_items(ds, BTRFS_EXTENT_TREE_OBJECTID, &min, &max,
+			      du_extent_ref_fn, &refs);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < batch->nr_extents; i++) {
+		struct du_file_extent *ext = &batch->extents[i];
+		struct du_extent_ref key = { .bytenr = ext->bytenr };
+		struct du_extent_ref *ref;
+
+		ref = bsearch(&key, refs.refs, refs.nr, sizeof(*ref),
+			      cmp_du_extent_ref);
+		if (ref->multi || (ref->has_owner &&
+				   (ref->root != subvol ||
+				    ref->ino != ext->dentry->ino))) {
+			ext->shared = true;
+		} else if (ref->full_backref || ext->transid <= last_snapshot) {
+			if (ref->shared < 0) {
+				ret = du_extent_shared_by_tree(ds, ext->bytenr,
+						subvol, ext->dentry->ino);
+				if (ret < 0)
+					goto out;
+				ref->shared = ret;
+			}
+			ext->shared = ref->shared;
 		}
+		if (ext->shared)
+			ext->dentry->shared += ext->len;
 	}
+	ret = 0;
+out:
+	free(refs.refs);
+	return ret;
+}
 
-	if (ret_total)
-		*ret_total = file_total;
-	if (ret_shared)
-		*ret_shared = file_shared;
+static int cmp_du_dentry_ino(const void *a, const void *b)
+{
+	const struct du_dentry *da = *(const struct du_dentry **)a;
+	const struct du_dentry *db = *(const struct du_dentry **)b;
 
-out_close:
-	close_file_or_dir(fd, dirstream);
+	if (da->ino < db->ino)
+		return -1;
+	if (da->ino > db->ino)
+		return 1;
+	/* Keep the directory order for names of the same inode */
+	if (da < db)
+		return -1;
+	if (da > db)
+		return 1;
+	return 0;
+}
+
+/* Read the extents of all the regular files of @dentries into @batch */
+static int du_search_files(struct du_search *ds, u64 subvol,
+			   struct du_dentry *dentries, int nr,
+			   struct du_batch *batch)
+{
+	int ret;
+	int i;
+	int j;
+
+	batch->files = malloc(nr * sizeof(struct du_dentry *));
+	if (!batch->files)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++) {
+		if (!dentries[i].is_dir && !dentries[i].subvol)
+			batch->files[batch->nr_files++] = &dentries[i];
+	}
+	qsort(batch->files, batch->nr_files, sizeof(struct du_dentry *),
+	      cmp_du_dentry_ino);
+
+	for (i = 0; i < batch->nr_files; i = j) {
+		struct btrfs_key min;
+		struct btrfs_key max;
+
+		for (j = i + 1; j < batch->nr_files; j++) {
+			struct du_dentry *prev = batch->files[j - 1];
+
+			if (batch->files[j]->ino == prev->ino)
+				batch->files[j]->alias = prev->alias ?: prev;
+			else if (batch->files[j]->ino >
+				 prev->ino + DU_SEARCH_INO_GAP)
+				break;
+		}
+
+		min.objectid = batch->files[i]->ino;
+		min.type = BTRFS_EXTENT_DATA_KEY;
+		min.offset = 0;
+		max.objectid = batch->files[j - 1]->ino;
+		max.type = BTRFS_EXTENT_DATA_KEY;
+		max.offset = (u64)-1;
+		batch->cur = i;
+		ret = du_search_items(ds, subvol, &min, &max, du_file_extent_fn,
+				      batch);
+		if (ret < 0)
+			return ret;
+	}
+
+	return du_resolve_shared(ds, subvol, batch);
+}
+
+static void du_release_batch(struct du_batch *batch)
+{
+	free(batch->files);
+	free(batch->extents);
+	memset(batch, 0, sizeof(*batch));
+}
+
+static void du_print_line(u64 total, u64 shared, const u64 *set_shared)
+{
+	pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+		   pretty_size_mode(total, unit_mode),
+		   pretty_size_mode(total - shared, unit_mode),
+		   set_shared ? pretty_size_mode(*set_shared, unit_mode) : "-",
+		   path);
+}
+
+static int du_search_dir(struct du_search *ds, u64 subvol, u64 dir_ino,
+			 u64 *ret_total, u64 *ret_shared);
+
+static int du_search_dentry(struct du_search *ds, u64 subvol, u64 dir_ino,
+			    struct du_dentry *dentry, u64 *ret_total,
+			    u64 *ret_shared)
+{
+	int len = strlen(dentry->name);
+	u64 ino = dentry->ino;
+	u64 file_total = 0;
+	u64 file_shared = 0;
+	char *pathtmp;
+	int ret = 0;
+
+	if (len > (path_max - pathp)) {
+		error("path too long: %s %s", path, dentry->name);
+		return -ENAMETOOLONG;
+	}
+
+	pathtmp = pathp;
+	if (pathp == path || *(pathp - 1) == '/')
+		ret = sprintf(pathp, "%s", dentry->name);
+	else
+		ret = sprintf(pathp, "/%s", dentry->name);
+	pathp += ret;
+	ret = 0;
+
+	if (dentry->subvol) {
+		ret = du_subvol_ref_exists(ds, subvol, dentry->ino, dir_ino,
+					   dentry->name);
+		if (ret < 0)
+			goto out;
+		if (!ret) {
+			/* Empty directory, not tracked for hardlinks */
+			goto print;
+		}
+		ret = 0;
+		subvol = dentry->ino;
+		ino = BTRFS_FIRST_FREE_OBJECTID;
+	}
+
+	if (inode_seen(ino, subvol))
+		goto out;
+	ret = mark_inode_seen(ino, subvol);
+	if (ret)
+		goto out;
+
+	if (dentry->is_dir || dentry->subvol) {
+		ret = du_search_dir(ds, subvol, ino, &file_total, &file_shared);
+		*pathp = '\0';
+		if (ret)
+			goto out;
+	} else {
+		struct du_dentry *data = dentry->alias ?: dentry;
+		int i;
+
+		file_total = data->total;
+		file_shared = data->shared;
+		for (i = 0; i < data->nr_extents && ds->shared_extents; i++) {
+			struct du_file_extent *ext;
+
+			ext = &ds->batch->extents[data->first_extent + i];
+			if (!ext->shared)
+				continue;
+			ret = du_extent_set_add(ds->shared_extents,
+						ext->physical, ext->len);
+			if (ret)
+				goto out;
+		}
+	}
+
+print:
+	if (!summarize)
+		du_print_line(file_total, file_shared, NULL);
+	*ret_total = file_total;
+	*ret_shared = file_shared;
 out:
 	/* reset path to just before this element */
 	pathp = pathtmp;
+	return ret;
+}
+
+static int du_search_dir(struct du_search *ds, u64 subvol, u64 dir_ino,
+			 u64 *ret_total, u64 *ret_shared)
+{
+	struct btrfs_key min = { dir_ino, BTRFS_DIR_INDEX_KEY, 0 };
+	struct btrfs_key max = { dir_ino, BTRFS_DIR_INDEX_KEY, (u64)-1 };
+	struct du_dir_list list = { 0 };
+	struct du_batch *parent_batch = ds->batch;
+	struct du_batch batch = { 0 };
+	u64 total = 0;
+	u64 shared = 0;
+	int start;
+	int ret;
+	int i;
+
+	ret = du_search_items(ds, subvol, &min, &max, du_dir_index_fn, &list);
+	if (ret < 0)
+		goto out;
+
+	for (start = 0; start < list.nr; start += DU_SEARCH_BATCH) {
+		int end = min(list.nr, start + DU_SEARCH_BATCH);
+
+		ret = du_search_files(ds, subvol, list.dentries + start,
+				      end - start, &batch);
+		if (ret < 0)
+			goto out;
+
+		for (i = start; i < end; i++) {
+			u64 tot = 0;
+			u64 shr = 0;
+
+			ds->batch = &batch;
+			ret = du_search_dentry(ds, subvol, dir_ino,
+					       &list.dentries[i], &tot, &shr);
+			if (ret)
+				goto out;
+			total += tot;
+			shared += shr;
+		}
+		du_release_batch(&batch);
+	}
+	*ret_total = total;
+	*ret_shared = shared;
+out:
+	ds->batch = parent_batch;
+	du_release_batch(&batch);
+	for (i = 0; i < list.nr; i++)
+		free(list.dentries[i].name);
+	free(list.dentries);
+	return ret;
+}
+
+/*
+ * Fill the node of a directory entry found by the tree search, like
+ * du_stat_node() does. The shared extents of a regular file are added to
+ * @shared_extents, the name is taken over from @dentry.
+ */
+static int du_search_node(struct du_search *ds, struct du_node *dir,
+			  struct du_dentry *dentry, struct du_batch *batch,
+			  struct du_node *node,
+			  struct du_extent_set *shared_extents)
+{
+	struct du_dentry *data = dentry->alias ?: dentry;
+	int ret;
+	int i;
+
+	node->parent = dir;
+	node->name = dentry->name;
+	dentry->name = NULL;
+	node->subvol = dir->subvol;
+	node->ino = dentry->ino;
+	node->is_dir = dentry->is_dir || dentry->subvol;
+
+	if (dentry->subvol) {
+		ret = du_subvol_ref_exists(ds, dir->subvol, dentry->ino,
+					   dir->ino, node->name);
+		if (ret < 0)
+			return ret;
+		/* Empty directory, not tracked for hardlinks */
+		if (!ret)
+			return 0;
+		node->subvol = dentry->ino;
+		node->ino = BTRFS_FIRST_FREE_OBJECTID;
+	}
+	node->track = true;
+	if (node->is_dir) {
+		node->list = true;
+		return 0;
+	}
+
+	node->total = data->total;
+	node->shared = data->shared;
+	/* The other names of the inode are not counted anyway */
+	if (!shared_extents || dentry->alias)
+		return 0;
+	for (i = 0; i < data->nr_extents; i++) {
+		struct du_file_extent *ext;
+
+		ext = &batch->extents[data->first_extent + i];
+		if (!ext->shared)
+			continue;
+		ret = du_extent_set_add(shared_extents, ext->physical,
+					ext->len);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Same as du_list_work_fn() with the tree search, the entries are examined in
+ * batches by the same work item as it needs no per-file calls.
+ */
+static void du_search_list_work_fn(struct btrfs_work *work)
+{
+	struct du_walk_work *ww = container_of(work, struct du_walk_work, work);
+	struct du_walk *walk = ww->walk;
+	struct du_node *dir = ww->dir;
+	struct btrfs_key min = { dir->ino, BTRFS_DIR_INDEX_KEY, 0 };
+	struct btrfs_key max = { dir->ino, BTRFS_DIR_INDEX_KEY, (u64)-1 };
+	struct du_search ds = { .fd = walk->search_fd };
+	struct du_extent_set shared_extents = { 0 };
+	struct du_dir_list list = { 0 };
+	struct du_batch batch = { 0 };
+	struct du_node *children = NULL;
+	bool stop;
+	int start;
+	int ret = 0;
+	int i;
+
+	free(ww);
+
+	pthread_mutex_lock(&walk->lock);
+	stop = walk->stop;
+	pthread_mutex_unlock(&walk->lock);
+	if (stop)
+		goto out;
+
+	ds.args = malloc(sizeof(*ds.args) + DU_SEARCH_BUF_SIZE);
+	ds.inodes = malloc(DU_SEARCH_BUF_SIZE);
+	if (!ds.args || !ds.inodes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = du_search_items(&ds, dir->subvol, &min, &max, du_dir_index_fn,
+			      &list);
+	if (ret < 0)
+		goto out;
+	children = calloc(list.nr, sizeof(*children));
+	if (!children && list.nr) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (start = 0; start < list.nr && !ret; start += DU_SEARCH_BATCH) {
+		int end = min(list.nr, start + DU_SEARCH_BATCH);
+
+		ret = du_search_files(&ds, dir->subvol, list.dentries + start,
+				      end - start, &batch);
+		for (i = start; i < end && !ret; i++)
+			ret = du_search_node(&ds, dir, &list.dentries[i], &batch,
+					     &children[i],
+					     walk->shared_extents ?
+					     &shared_extents : NULL);
+		du_release_batch(&batch);
+	}
+
+out:
+	if (ret < 0 && children) {
+		for (i = 0; i < list.nr; i++)
+			free(children[i].name);
+		free(children);
+		children = NULL;
+	}
+	for (i = 0; i < list.nr; i++)
+		free(list.dentries[i].name);
+	free(list.dentries);
+	free(ds.subvols);
+	free(ds.inodes);
+	free(ds.args);
+
+	pthread_mutex_lock(&walk->lock);
+	if (walk->shared_extents && !ret) {
+		ret = du_extent_set_splice(walk->shared_extents,
+					   &shared_extents);
+		if (ret < 0 && !walk->ret)
+			walk->ret = ret;
+		ret = 0;
+	}
+	dir->children = children;
+	dir->nr_children = children ? list.nr : 0;
+	for (i = 0; i < dir->nr_children; i++) {
+		if (children[i].list) {
+			int ret2;
+
+			ret2 = du_walk_queue(walk, &children[i], 0, 0,
+					     du_search_list_work_fn);
+			if (ret2 == 0)
+				continue;
+			children[i].ret = ret2;
+		}
+		children[i].ready = true;
+	}
+	dir->ret = ret;
+	dir->ready = true;
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	du_extent_set_release(&shared_extents);
+}
+
+/*
+ * The tree search walk stays in the filesystem trees and does not see what's
+ * mounted in the directories, unlike FIEMAP. Return 1 if anything is mounted
+ * below @filename, 0 if not, -1 for error.
+ */
+static int du_has_submounts(const char *filename)
+{
+	char real[PATH_MAX];
+	struct mntent *mnt;
+	size_t len;
+	FILE *f;
+	int ret = 0;
+
+	if (!realpath(filename, real))
+		return -1;
+	len = strlen(real);
+	if (len && real[len - 1] == '/')
+		len--;
+
+	f = setmntent("/proc/self/mounts", "r");
+	if (f == NULL)
+		return -1;
+
+	while ((mnt = getmntent(f)) != NULL) {
+		if (strncmp(mnt->mnt_dir, real, len) ||
+		    mnt->mnt_dir[len] != '/' || mnt->mnt_dir[len + 1] == '\0')
+			continue;
+		ret = 1;
+		break;
+	}
+	endmntent(f);
+	return ret;
+}
+
+/*
+ * Same as du_add_file() for the top level argument, but with the tree search
+ * ioctl. Return 1 if it's not possible to use it for @filename.
+ */
+static int du_search_path(const char *filename)
+{
+	struct du_search ds = { 0 };
+	struct du_extent_set shared_extents = { 0 };
+	struct du_dentry dentry = { 0 };
+	struct du_batch batch = { 0 };
+	DIR *dirstream = NULL;
+	struct stat st;
+	u64 subvol;
+	u64 file_total = 0;
+	u64 file_shared = 0;
+	u64 set_shared;
+	int ret;
+
+	ret = stat(filename, &st);
+	if (ret)
+		return -errno;
+
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+		return 0;
+	if (st.st_ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID)
+		return 1;
+	if (S_ISDIR(st.st_mode) && du_has_submounts(filename) != 0)
+		return 1;
+
+	if (strlen(filename) > (path_max - pathp)) {
+		error("path too long: %s", filename);
+		return -ENAMETOOLONG;
+	}
 
+	ds.fd = open_file_or_dir3(filename, &dirstream, O_RDONLY);
+	if (ds.fd < 0)
+		return -errno;
+
+	if (btrfs_tree_search2_ioctl_supported(ds.fd) != 1) {
+		ret = 1;
+		goto out;
+	}
+	ret = lookup_path_rootid(ds.fd, &subvol);
+	if (ret)
+		goto out;
+
+	ds.args = malloc(sizeof(*ds.args) + DU_SEARCH_BUF_SIZE);
+	ds.inodes = malloc(DU_SEARCH_BUF_SIZE);
+	if (!ds.args || !ds.inodes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pathp = path + sprintf(path, "%s", filename);
+	ret = mark_inode_seen(st.st_ino, subvol);
+	if (ret)
+		goto out;
+
+	if (S_ISREG(st.st_mode)) {
+		dentry.ino = st.st_ino;
+		ret = du_search_files(&ds, subvol, &dentry, 1, &batch);
+		if (ret < 0)
+			goto out;
+		file_total = dentry.total;
+		file_shared = dentry.shared;
+		set_shared = file_shared;
+	} else if (nr_threads != 1) {
+		struct du_dir_ctxt dir = INIT_DU_DIR_CTXT;
+
+		ret = du_walk_dir_parallel(&dir, &shared_extents, st.st_ino,
+					   subvol, ds.fd);
+		*pathp = '\0';
+		if (ret)
+			goto out;
+		file_total = dir.bytes_total;
+		file_shared = dir.bytes_shared;
+		set_shared = du_extent_set_bytes(&shared_extents);
+	} else {
+		ds.shared_extents = &shared_extents;
+		ret = du_search_dir(&ds, subvol, st.st_ino, &file_total,
+				    &file_shared);
+		*pathp = '\0';
+		if (ret)
+			goto out;
+		set_shared = du_extent_set_bytes(&shared_extents);
+	}
+	du_print_line(file_total, file_shared, &set_shared);
+	ret = 0;
+
+out:
+	du_extent_set_release(&shared_extents);
+	du_release_batch(&batch);
+	free(ds.subvols);
+	free(ds.inodes);
+	free(ds.args);
+	close_file_or_dir(ds.fd, dirstream);
+	pathp = path;
+	*pathp = '\0';
 	return ret;
 }
 
@@ -553,6 +2635,10 @@ static const char * const cmd_filesystem_du_usage[] = {
 	"Summarize disk usage of each file.",
 	"",
 	"-s|--summarize     display only a total for each argument",
+	"-j N               walk the directories in N threads, 0 for the number",
+	"                   of CPUs (default: 1)",
+	"--cache <file>     reuse the results for files not changed since the",
+	"                   last run with the same cache file",
 	HELPINFO_UNITS_LONG,
 	NULL
 };
@@ -563,16 +2649,19 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	int ret = 0, err = 0;
 	int i;
 	u32 kernel_version;
+	const char *cache_file = NULL;
 
 	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
 
 	optind = 0;
 	while (1) {
+		enum { GETOPT_VAL_CACHE = GETOPT_VAL_FIRST };
 		static const struct option long_options[] = {
 			{ "summarize", no_argument, NULL, 's'},
+			{ "cache", required_argument, NULL, GETOPT_VAL_CACHE },
 			{ NULL, 0, NULL, 0 }
 		};
-		int c = getopt_long(argc, argv, "s", long_options, NULL);
+		int c = getopt_long(argc, argv, "sj:", long_options, NULL);
 
 		if (c < 0)
 			break;
@@ -580,6 +2669,13 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 		case 's':
 			summarize = true;
 			break;
+		case 'j':
+			nr_threads = min_t(u64, arg_strtou64(optarg),
+					   BTRFS_WORKQUEUE_MAX_THREADS);
+			break;
+		case GETOPT_VAL_CACHE:
+			cache_file = optarg;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -599,8 +2695,18 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n", "Total", "Exclusive", "Set shared",
 			"Filename");
 
+	if (cache_file)
+		du_cache_load(cache_file);
+
 	for (i = optind; i < argc; i++) {
-		ret = du_add_file(argv[i], AT_FDCWD, NULL, NULL, NULL, 1);
+		/* The cache holds the results of FIEMAP */
+		if (!cache_file)
+			ret = du_search_path(argv[i]);
+		else
+			ret = 1;
+		if (ret == 1)
+			ret = du_add_file(argv[i], AT_FDCWD, NULL, NULL, NULL,
+					  1);
 		if (ret) {
 			errno = -ret;
 			error("cannot check space of '%s': %m", argv[i]);
@@ -611,6 +2717,10 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 		clear_seen_inodes();
 	}
 
+	if (cache_file && du_cache_save() < 0)
+		err = 1;
+	free(du_devs);
+
 	return err;
 }
 DEFINE_SIMPLE_COMMAND(filesystem_du, "du");
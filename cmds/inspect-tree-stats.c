@@ -28,6 +28,7 @@
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/extent_io.h"
+#include "kernel-shared/reada.h"
 #include "common/utils.h"
 #include "common/help.h"
 #include "common/messages.h"
@@ -145,6 +146,8 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 	stat->node_counts[level]++;
 
 	last_block = btrfs_header_bytenr(b);
+	if (level > 1 || find_inline)
+		btrfs_reada_children(root->fs_info, b, 0);
 	for (i = 0; i < btrfs_header_nritems(b); i++) {
 		struct extent_buffer *tmp = NULL;
 		u64 cur_blocknr = btrfs_node_blockptr(b, i);
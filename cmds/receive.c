@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include <zlib.h>
 #if COMPRESSION_LZO
@@ -44,6 +45,7 @@
 #if COMPRESSION_ZSTD
 #include <zstd.h>
 #endif
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
 #include "common/defs.h"
 #include "common/messages.h"
@@ -53,17 +55,57 @@
 #include "common/help.h"
 #include "common/path-utils.h"
 #include "common/string-utils.h"
+#include "common/workqueue.h"
+#include "common/io-uring.h"
 #include "cmds/commands.h"
 #include "cmds/receive-dump.h"
 #include "ioctl.h"
 
+/*
+ * Reuse stream objects for encoded_write decompression fallback, one per
+ * thread applying the writes.
+ */
+struct receive_decompress {
+	struct list_head list;
+#if COMPRESSION_ZSTD
+	ZSTD_DStream *zstd_dstream;
+#endif
+	z_stream *zlib_stream;
+};
+
+struct receive_pipeline;
+struct receive_op;
+
+/* Number of files kept open for writing */
+#define RECEIVE_NR_WRITE_FDS		8
+
+struct receive_write_fd {
+	int fd;
+	u64 last_use;
+	char path[PATH_MAX];
+};
+
 struct btrfs_receive
 {
 	int mnt_fd;
 	int dest_dir_fd;
 
+	/* The last file opened by open_inode_for_write() */
 	int write_fd;
-	char write_path[PATH_MAX];
+	struct receive_write_fd write_fds[RECEIVE_NR_WRITE_FDS];
+	u64 write_fd_clock;
+
+	/* Data of adjacent WRITE commands to one file, not written yet */
+	struct receive_op *write_op;
+	u64 write_op_size;
+	char write_op_path[PATH_MAX];
+	/* Error of a write done after its command, see receive_take_error() */
+	int write_error;
+
+	/* Writes submitted through io_uring, from the main thread only */
+	bool use_uring;
+	struct btrfs_io_uring ring;
+	u64 uring_in_flight;
 
 	char *root_path;
 	char *dest_dir_path; /* relative to root_path */
@@ -83,12 +125,565 @@ struct btrfs_receive
 
 	bool force_decompress;
 
+	/* Decompression state of the main thread */
+	struct receive_decompress decompress;
+
+	/* Threads applying the file data, NULL when done in the main thread */
+	struct receive_pipeline *pipeline;
+	int nr_threads;
+};
+
+/*
+ * With more threads the file data are written by a workqueue while the main
+ * thread parses the stream and does the other commands. The commands of one
+ * inode are applied in the stream order by one work item at a time, the
+ * commands that change the namespace wait for the affected inodes first.
+ */
+
+/* Limit of the queued data not yet written */
+#define RECEIVE_MAX_IN_FLIGHT		SZ_64M
+/* Limit of the files kept open by the pipeline */
+#define RECEIVE_MAX_INODES		128
+/* Adjacent WRITE commands are collected up to this size */
+#define RECEIVE_WRITE_SIZE		SZ_1M
+/* Writes submitted at once through io_uring */
+#define RECEIVE_RING_ENTRIES		64
+
+enum receive_op_type {
+	RECEIVE_OP_WRITE,
+	RECEIVE_OP_ENCODED_WRITE,
+	RECEIVE_OP_TRUNCATE,
+	RECEIVE_OP_CHMOD,
+	RECEIVE_OP_CHOWN,
+	RECEIVE_OP_UTIMES,
+};
+
+/*
+ * Command queued for an inode, the data are copied as the stream buffer is
+ * reused for the next command.
+ */
+struct receive_op {
+	struct list_head list;
+	enum receive_op_type type;
+	u64 offset;
+	u64 len;
+	u64 unencoded_file_len;
+	u64 unencoded_len;
+	u64 unencoded_offset;
+	u32 compression;
+	u64 size;
+	u64 mode;
+	u64 uid;
+	u64 gid;
+	struct timespec times[2];
+	/* Submitted to io_uring, the data are written to @fd */
+	int fd;
+	char *path;
+	char data[];
+};
+
+/*
+ * Inode with queued commands, looked up by the path in the stream. The file
+ * is opened when the first command is queued.
+ */
+struct receive_inode {
+	struct list_head list;
+	struct list_head ops;
+	struct btrfs_work work;
+	struct btrfs_receive *rctx;
+	/* The work item is queued or running */
+	bool running;
+	int fd;
+	char path[PATH_MAX];
+};
+
+struct receive_pipeline {
+	struct btrfs_workqueue *wq;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head inodes;
+	int nr_inodes;
+	u64 in_flight;
+	/* First error of the workers not yet returned to the stream parser */
+	int error;
+	/* Skip the queued commands after an error ended the receive */
+	bool stop;
+	/* Decompression state for each worker thread */
+	struct list_head decompress;
+};
+
+static void receive_inode_work_fn(struct btrfs_work *work);
+
+static void free_decompress(struct receive_decompress *dctx)
+{
 #if COMPRESSION_ZSTD
-	/* Reuse stream objects for encoded_write decompression fallback */
-	ZSTD_DStream *zstd_dstream;
+	if (dctx->zstd_dstream)
+		ZSTD_freeDStream(dctx->zstd_dstream);
+	dctx->zstd_dstream = NULL;
 #endif
-	z_stream *zlib_stream;
-};
+	if (dctx->zlib_stream) {
+		inflateEnd(dctx->zlib_stream);
+		free(dctx->zlib_stream);
+	}
+	dctx->zlib_stream = NULL;
+}
+
+static struct receive_op *receive_alloc_op(enum receive_op_type type,
+					   const void *data, u64 len)
+{
+	struct receive_op *op;
+
+	op = malloc(sizeof(*op) + len);
+	if (!op) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->len = len;
+	if (len)
+		memcpy(op->data, data, len);
+	return op;
+}
+
+/* Close the file of an idle inode, called with the pipeline lock held */
+static void receive_drop_inode(struct receive_pipeline *pipeline,
+			       struct receive_inode *inode)
+{
+	list_del(&inode->list);
+	pipeline->nr_inodes--;
+	close(inode->fd);
+	free(inode);
+}
+
+static bool receive_path_match(const char *inode_path, const char *path,
+			       bool subtree)
+{
+	size_t len = strlen(path);
+
+	if (strncmp(inode_path, path, len) != 0)
+		return false;
+	if (inode_path[len] == 0)
+		return true;
+	return subtree && inode_path[len] == '/';
+}
+
+/*
+ * Return the first error of the workers since the last call, the error is
+ * reported with a later command as the command that failed was done already.
+ */
+static int receive_take_error(struct btrfs_receive *rctx)
+{
+	struct receive_pipeline *pipeline = rctx->pipeline;
+	int ret;
+
+	ret = rctx->write_error;
+	rctx->write_error = 0;
+	if (ret < 0 || !pipeline)
+		return ret;
+
+	pthread_mutex_lock(&pipeline->lock);
+	ret = pipeline->error;
+	pipeline->error = 0;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return ret;
+}
+
+/*
+ * Wait until the commands queued for @path are applied and close the file,
+ * with @subtree also for all paths under @path, or for all inodes if @path is
+ * NULL.
+ */
+static void receive_wait_inodes(struct btrfs_receive *rctx, const char *path,
+				bool subtree)
+{
+	struct receive_pipeline *pipeline = rctx->pipeline;
+	struct receive_inode *inode, *tmp;
+
+	if (!pipeline)
+		return;
+
+	pthread_mutex_lock(&pipeline->lock);
+	/* Only the main thread adds or removes inodes */
+	list_for_each_entry_safe(inode, tmp, &pipeline->inodes, list) {
+		if (path && !receive_path_match(inode->path, path, subtree))
+			continue;
+		while (inode->running)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		receive_drop_inode(pipeline, inode);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+/*
+ * Queue @op after the other commands of @path. The file is opened by
+ * @full_path if there's no inode for it yet, if @full_path is NULL the command
+ * is not queued.
+ *
+ * Return 1 if the caller has to do the command, otherwise 0 or the pending
+ * error of the workers as returned by receive_take_error(). The ownership of
+ * @op is taken in all cases.
+ */
+static int receive_queue_op(struct btrfs_receive *rctx, const char *path,
+			    const char *full_path, struct receive_op *op)
+{
+	struct receive_pipeline *pipeline = rctx->pipeline;
+	struct receive_inode *inode, *tmp;
+	bool found = false;
+	int ret;
+
+	pthread_mutex_lock(&pipeline->lock);
+	list_for_each_entry(inode, &pipeline->inodes, list) {
+		if (strcmp(inode->path, path) == 0) {
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		if (!full_path) {
+			pthread_mutex_unlock(&pipeline->lock);
+			free(op);
+			return 1;
+		}
+
+		while (pipeline->nr_inodes >= RECEIVE_MAX_INODES) {
+			list_for_each_entry_safe(inode, tmp, &pipeline->inodes,
+						 list) {
+				if (!inode->running)
+					receive_drop_inode(pipeline, inode);
+			}
+			if (pipeline->nr_inodes >= RECEIVE_MAX_INODES)
+				pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		}
+		pthread_mutex_unlock(&pipeline->lock);
+
+		inode = calloc(1, sizeof(*inode));
+		if (!inode) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			free(op);
+			return -ENOMEM;
+		}
+		inode->fd = open(full_path, O_RDWR);
+		if (inode->fd < 0) {
+			ret = -errno;
+			error("cannot open %s: %m", full_path);
+			free(inode);
+			free(op);
+			return ret;
+		}
+		INIT_LIST_HEAD(&inode->ops);
+		btrfs_init_work(&inode->work, receive_inode_work_fn);
+		inode->rctx = rctx;
+		strncpy_null(inode->path, path);
+
+		pthread_mutex_lock(&pipeline->lock);
+		list_add_tail(&inode->list, &pipeline->inodes);
+		pipeline->nr_inodes++;
+	}
+
+	while (pipeline->in_flight &&
+	       pipeline->in_flight + op->len > RECEIVE_MAX_IN_FLIGHT)
+		pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+	list_add_tail(&op->list, &inode->ops);
+	pipeline->in_flight += op->len;
+	if (!inode->running) {
+		inode->running = true;
+		btrfs_queue_work(pipeline->wq, &inode->work);
+	}
+	ret = pipeline->error;
+	pipeline->error = 0;
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return ret;
+}
+
+static int receive_pipeline_init(struct btrfs_receive *rctx)
+{
+	struct receive_pipeline *pipeline;
+	struct receive_decompress *dctx;
+	int i;
+
+	pipeline = calloc(1, sizeof(*pipeline));
+	if (!pipeline) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->cond, NULL);
+	INIT_LIST_HEAD(&pipeline->inodes);
+	INIT_LIST_HEAD(&pipeline->decompress);
+	rctx->pipeline = pipeline;
+
+	pipeline->wq = btrfs_alloc_workqueue(rctx->nr_threads);
+	if (!pipeline->wq)
+		return -ENOMEM;
+	for (i = 0; i < pipeline->wq->nr_threads; i++) {
+		dctx = calloc(1, sizeof(*dctx));
+		if (!dctx) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+		list_add_tail(&dctx->list, &pipeline->decompress);
+	}
+	return 0;
+}
+
+static void receive_pipeline_free(struct btrfs_receive *rctx)
+{
+	struct receive_pipeline *pipeline = rctx->pipeline;
+	struct receive_decompress *dctx;
+
+	if (!pipeline)
+		return;
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->stop = true;
+	pthread_mutex_unlock(&pipeline->lock);
+	receive_wait_inodes(rctx, NULL, false);
+	btrfs_destroy_workqueue(pipeline->wq);
+
+	while (!list_empty(&pipeline->decompress)) {
+		dctx = list_first_entry(&pipeline->decompress,
+					struct receive_decompress, list);
+		list_del(&dctx->list);
+		free_decompress(dctx);
+		free(dctx);
+	}
+	pthread_cond_destroy(&pipeline->cond);
+	pthread_mutex_destroy(&pipeline->lock);
+	free(pipeline);
+	rctx->pipeline = NULL;
+}
+
+static void receive_uring_drain(struct btrfs_receive *rctx);
+
+/*
+ * Make the file at @path the current rctx->write_fd. A few files stay open
+ * as the writes of several files can be interleaved in the stream, the least
+ * recently used is closed.
+ */
+static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
+{
+	struct receive_write_fd *wfd;
+	struct receive_write_fd *victim = NULL;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < RECEIVE_NR_WRITE_FDS; i++) {
+		wfd = &rctx->write_fds[i];
+		if (wfd->fd != -1 && strcmp(wfd->path, path) == 0)
+			goto out;
+		if (!victim || (victim->fd != -1 &&
+		    (wfd->fd == -1 || wfd->last_use < victim->last_use)))
+			victim = wfd;
+	}
+
+	wfd = victim;
+	if (wfd->fd != -1) {
+		/* The writes in flight may still use it */
+		receive_uring_drain(rctx);
+		close(wfd->fd);
+	}
+	wfd->fd = open(path, O_RDWR);
+	if (wfd->fd < 0) {
+		ret = -errno;
+		error("cannot open %s: %m", path);
+		rctx->write_fd = -1;
+		return ret;
+	}
+	strncpy_null(wfd->path, path);
+
+out:
+	wfd->last_use = ++rctx->write_fd_clock;
+	rctx->write_fd = wfd->fd;
+	return ret;
+}
+
+/*
+ * Close the files at @path, with @subtree also the files under @path, or all
+ * files if @path is NULL.
+ */
+static void close_inodes_for_write(struct btrfs_receive *rctx,
+				   const char *path, bool subtree)
+{
+	struct receive_write_fd *wfd;
+	int i;
+
+	for (i = 0; i < RECEIVE_NR_WRITE_FDS; i++) {
+		wfd = &rctx->write_fds[i];
+		if (wfd->fd == -1)
+			continue;
+		if (path && !receive_path_match(wfd->path, path, subtree))
+			continue;
+		receive_uring_drain(rctx);
+		if (rctx->write_fd == wfd->fd)
+			rctx->write_fd = -1;
+		close(wfd->fd);
+		wfd->fd = -1;
+		wfd->path[0] = 0;
+	}
+}
+
+static void close_inode_for_write(struct btrfs_receive *rctx)
+{
+	close_inodes_for_write(rctx, NULL, false);
+}
+
+static int write_data(int fd, const char *path, const char *data, u64 offset,
+		      u64 len)
+{
+	int ret;
+	u64 pos = 0;
+	int w;
+
+	while (pos < len) {
+		w = pwrite(fd, data + pos, len - pos, offset + pos);
+		if (w < 0) {
+			ret = -errno;
+			error("writing to %s failed: %m", path);
+			return ret;
+		}
+		pos += w;
+	}
+	return 0;
+}
+
+/* Finish one io_uring write, return 1 if one was found */
+static int receive_uring_reap(struct btrfs_receive *rctx, bool wait)
+{
+	struct receive_op *op;
+	u64 user_data;
+	int res;
+	int ret;
+
+	ret = btrfs_io_uring_reap(&rctx->ring, &user_data, &res, wait);
+	if (ret <= 0)
+		return ret;
+
+	op = (struct receive_op *)(uintptr_t)user_data;
+	if (res < 0) {
+		errno = -res;
+		error("writing to %s failed: %m", op->path);
+		ret = res;
+	} else if (res < op->len) {
+		ret = write_data(op->fd, op->path, op->data + res,
+				 op->offset + res, op->len - res);
+	} else {
+		ret = 0;
+	}
+	if (ret < 0 && !rctx->write_error)
+		rctx->write_error = ret;
+	rctx->uring_in_flight -= op->len;
+	free(op->path);
+	free(op);
+	return 1;
+}
+
+/* Wait for all io_uring writes */
+static void receive_uring_drain(struct btrfs_receive *rctx)
+{
+	int ret;
+
+	if (!rctx->use_uring)
+		return;
+
+	ret = btrfs_io_uring_submit(&rctx->ring, 0);
+	if (ret < 0 && !rctx->write_error)
+		rctx->write_error = ret;
+	while (rctx->ring.inflight && receive_uring_reap(rctx, true) > 0)
+		;
+}
+
+/* Submit the write of @op to rctx->write_fd, the ownership of @op is taken */
+static int receive_uring_write(struct btrfs_receive *rctx,
+			       struct receive_op *op, const char *path)
+{
+	int ret;
+
+	while (btrfs_io_uring_full(&rctx->ring) ||
+	       (rctx->uring_in_flight &&
+		rctx->uring_in_flight + op->len > RECEIVE_MAX_IN_FLIGHT)) {
+		if (receive_uring_reap(rctx, true) <= 0)
+			break;
+	}
+
+	op->fd = rctx->write_fd;
+	op->path = strdup(path);
+	if (!op->path ||
+	    btrfs_io_uring_queue_rw(&rctx->ring, WRITE, op->fd, op->data,
+				    op->len, op->offset,
+				    (u64)(uintptr_t)op) < 0) {
+		ret = write_data(op->fd, path, op->data, op->offset, op->len);
+		free(op->path);
+		free(op);
+		return ret;
+	}
+	rctx->uring_in_flight += op->len;
+
+	ret = btrfs_io_uring_submit(&rctx->ring, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot submit the writes to %s: %m", path);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Pass the collected data of WRITE commands on to be written, to the pipeline,
+ * to io_uring or write them now.
+ */
+static int submit_write(struct btrfs_receive *rctx)
+{
+	struct receive_op *op = rctx->write_op;
+	const char *path = rctx->write_op_path;
+	char full_path[PATH_MAX];
+	int ret;
+
+	if (!op)
+		return 0;
+	rctx->write_op = NULL;
+
+	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
+	if (ret < 0) {
+		error("write: path invalid: %s", path);
+		free(op);
+		return ret;
+	}
+
+	if (rctx->pipeline)
+		return receive_queue_op(rctx, path, full_path, op);
+
+	ret = open_inode_for_write(rctx, full_path);
+	if (ret < 0) {
+		free(op);
+		return ret;
+	}
+
+	if (rctx->use_uring)
+		return receive_uring_write(rctx, op, path);
+
+	ret = write_data(rctx->write_fd, path, op->data, op->offset, op->len);
+	free(op);
+	return ret;
+}
+
+/*
+ * Write the collected data of WRITE commands and wait for the writes in
+ * flight, called before any other command. An error is reported with a later
+ * command.
+ */
+static void flush_write(struct btrfs_receive *rctx)
+{
+	int ret;
+
+	ret = submit_write(rctx);
+	if (ret < 0 && !rctx->write_error)
+		rctx->write_error = ret;
+	receive_uring_drain(rctx);
+}
 
 static int finish_subvol(struct btrfs_receive *rctx)
 {
@@ -98,6 +693,14 @@ static int finish_subvol(struct btrfs_receive *rctx)
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	u64 flags;
 
+	/* The data must be written before the subvolume is made read-only */
+	flush_write(rctx);
+	receive_wait_inodes(rctx, NULL, false);
+	close_inode_for_write(rctx);
+	ret = receive_take_error(rctx);
+	if (ret < 0)
+		return ret;
+
 	if (rctx->cur_subvol_path[0] == 0)
 		return 0;
 
@@ -383,6 +986,8 @@ static int process_mkfile(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mkfile: path invalid: %s", path);
@@ -411,6 +1016,8 @@ static int process_mkdir(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mkdir: path invalid: %s", path);
@@ -436,6 +1043,8 @@ static int process_mknod(const char *path, u64 mode, u64 dev, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mknod: path invalid: %s", path);
@@ -462,6 +1071,8 @@ static int process_mkfifo(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mkfifo: path invalid: %s", path);
@@ -487,6 +1098,8 @@ static int process_mksock(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("mksock: path invalid: %s", path);
@@ -512,6 +1125,8 @@ static int process_symlink(const char *path, const char *lnk, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("symlink: path invalid: %s", path);
@@ -538,6 +1153,8 @@ static int process_rename(const char *from, const char *to, void *user)
 	char full_from[PATH_MAX];
 	char full_to[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_from, rctx->full_subvol_path, from);
 	if (ret < 0) {
 		error("rename: source path invalid: %s", from);
@@ -550,6 +1167,12 @@ static int process_rename(const char *from, const char *to, void *user)
 		goto out;
 	}
 
+	/* The inodes are looked up by path, wait for both names */
+	receive_wait_inodes(rctx, from, true);
+	receive_wait_inodes(rctx, to, true);
+	close_inodes_for_write(rctx, full_from, true);
+	close_inodes_for_write(rctx, full_to, true);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
@@ -570,6 +1193,8 @@ static int process_link(const char *path, const char *lnk, void *user)
 	char full_path[PATH_MAX];
 	char full_link_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("link: source path invalid: %s", full_path);
@@ -582,6 +1207,9 @@ static int process_link(const char *path, const char *lnk, void *user)
 		goto out;
 	}
 
+	/* Do not write to one inode by two paths */
+	receive_wait_inodes(rctx, lnk, false);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "link %s -> %s\n", path, lnk);
 
@@ -602,12 +1230,17 @@ static int process_unlink(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("unlink: path invalid: %s", path);
 		goto out;
 	}
 
+	receive_wait_inodes(rctx, path, false);
+	close_inodes_for_write(rctx, full_path, false);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "unlink %s\n", path);
 
@@ -627,12 +1260,17 @@ static int process_rmdir(const char *path, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("rmdir: path invalid: %s", path);
 		goto out;
 	}
 
+	receive_wait_inodes(rctx, path, true);
+	close_inodes_for_write(rctx, full_path, true);
+
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rmdir %s\n", path);
 
@@ -646,47 +1284,13 @@ out:
 	return ret;
 }
 
-static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
-{
-	int ret = 0;
-
-	if (rctx->write_fd != -1) {
-		if (strcmp(rctx->write_path, path) == 0)
-			goto out;
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
-	}
-
-	rctx->write_fd = open(path, O_RDWR);
-	if (rctx->write_fd < 0) {
-		ret = -errno;
-		error("cannot open %s: %m", path);
-		goto out;
-	}
-	strncpy_null(rctx->write_path, path);
-
-out:
-	return ret;
-}
-
-static void close_inode_for_write(struct btrfs_receive *rctx)
-{
-	if(rctx->write_fd == -1)
-		return;
-
-	close(rctx->write_fd);
-	rctx->write_fd = -1;
-	rctx->write_path[0] = 0;
-}
-
 static int process_write(const char *path, const void *data, u64 offset,
 			 u64 len, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_op *op = rctx->write_op;
 	char full_path[PATH_MAX];
-	u64 pos = 0;
-	int w;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -694,25 +1298,48 @@ static int process_write(const char *path, const void *data, u64 offset,
 		goto out;
 	}
 
-	ret = open_inode_for_write(rctx, full_path);
-	if (ret < 0)
-		goto out;
-
 	if (bconf.verbose >= 2)
 		fprintf(stderr, "write %s - offset=%llu length=%llu\n",
 			path, offset, len);
 
-	while (pos < len) {
-		w = pwrite(rctx->write_fd, (char*)data + pos, len - pos,
-				offset + pos);
-		if (w < 0) {
-			ret = -errno;
-			error("writing to %s failed: %m", path);
+	/* Append to the data of the previous command if they're adjacent */
+	if (op && (strcmp(rctx->write_op_path, path) != 0 ||
+		   op->offset + op->len != offset ||
+		   op->len + len > RECEIVE_WRITE_SIZE)) {
+		ret = submit_write(rctx);
+		if (ret < 0)
+			goto out;
+		op = NULL;
+	}
+
+	if (!op) {
+		op = receive_alloc_op(RECEIVE_OP_WRITE, data, len);
+		if (!op) {
+			ret = -ENOMEM;
 			goto out;
 		}
-		pos += w;
+		op->offset = offset;
+		rctx->write_op = op;
+		rctx->write_op_size = len;
+		strncpy_null(rctx->write_op_path, path);
+	} else {
+		if (op->len + len > rctx->write_op_size) {
+			/* Grow to the full size once more commands follow */
+			op = realloc(op, sizeof(*op) + RECEIVE_WRITE_SIZE);
+			if (!op) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				ret = -ENOMEM;
+				goto out;
+			}
+			rctx->write_op = op;
+			rctx->write_op_size = RECEIVE_WRITE_SIZE;
+		}
+		memcpy(op->data + op->len, data, len);
+		op->len += len;
 	}
 
+	ret = receive_take_error(rctx);
+
 out:
 	return ret;
 }
@@ -731,12 +1358,17 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	char full_clone_path[PATH_MAX];
 	int clone_fd = -1;
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("clone: source path invalid: %s", path);
 		goto out;
 	}
 
+	/* The source can be any file with data in flight */
+	receive_wait_inodes(rctx, NULL, false);
+
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		goto out;
@@ -822,12 +1454,16 @@ static int process_set_xattr(const char *path, const char *name,
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("set_xattr: path invalid: %s", path);
 		goto out;
 	}
 
+	receive_wait_inodes(rctx, path, false);
+
 	if (bconf.verbose >= 3) {
 		fprintf(stderr, "set_xattr %s - name=%s data_len=%d "
 				"data=%.*s\n", path, name, len,
@@ -852,12 +1488,16 @@ static int process_remove_xattr(const char *path, const char *name, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("remove_xattr: path invalid: %s", path);
 		goto out;
 	}
 
+	receive_wait_inodes(rctx, path, false);
+
 	if (bconf.verbose >= 3) {
 		fprintf(stderr, "remove_xattr %s - name=%s\n",
 				path, name);
@@ -878,8 +1518,11 @@ static int process_truncate(const char *path, u64 size, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_op *op;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("truncate: path invalid: %s", path);
@@ -889,6 +1532,18 @@ static int process_truncate(const char *path, u64 size, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "truncate %s size=%llu\n", path, size);
 
+	if (rctx->pipeline) {
+		op = receive_alloc_op(RECEIVE_OP_TRUNCATE, NULL, 0);
+		if (!op) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		op->size = size;
+		ret = receive_queue_op(rctx, path, NULL, op);
+		if (ret <= 0)
+			goto out;
+	}
+
 	ret = truncate(full_path, size);
 	if (ret < 0) {
 		ret = -errno;
@@ -904,8 +1559,11 @@ static int process_chmod(const char *path, u64 mode, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_op *op;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("chmod: path invalid: %s", path);
@@ -915,6 +1573,18 @@ static int process_chmod(const char *path, u64 mode, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "chmod %s - mode=0%o\n", path, (int)mode);
 
+	if (rctx->pipeline) {
+		op = receive_alloc_op(RECEIVE_OP_CHMOD, NULL, 0);
+		if (!op) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		op->mode = mode;
+		ret = receive_queue_op(rctx, path, NULL, op);
+		if (ret <= 0)
+			goto out;
+	}
+
 	ret = chmod(full_path, mode);
 	if (ret < 0) {
 		ret = -errno;
@@ -930,8 +1600,11 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_op *op;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("chown: path invalid: %s", path);
@@ -942,6 +1615,19 @@ static int process_chown(const char *path, u64 uid, u64 gid, void *user)
 		fprintf(stderr, "chown %s - uid=%llu, gid=%llu\n", path,
 				uid, gid);
 
+	if (rctx->pipeline) {
+		op = receive_alloc_op(RECEIVE_OP_CHOWN, NULL, 0);
+		if (!op) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		op->uid = uid;
+		op->gid = gid;
+		ret = receive_queue_op(rctx, path, NULL, op);
+		if (ret <= 0)
+			goto out;
+	}
+
 	ret = lchown(full_path, uid, gid);
 	if (ret < 0) {
 		ret = -errno;
@@ -958,9 +1644,12 @@ static int process_utimes(const char *path, struct timespec *at,
 {
 	int ret = 0;
 	struct btrfs_receive *rctx = user;
+	struct receive_op *op;
 	char full_path[PATH_MAX];
 	struct timespec tv[2];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("utimes: path invalid: %s", path);
@@ -972,6 +1661,18 @@ static int process_utimes(const char *path, struct timespec *at,
 
 	tv[0] = *at;
 	tv[1] = *mt;
+	if (rctx->pipeline) {
+		op = receive_alloc_op(RECEIVE_OP_UTIMES, NULL, 0);
+		if (!op) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		op->times[0] = tv[0];
+		op->times[1] = tv[1];
+		ret = receive_queue_op(rctx, path, NULL, op);
+		if (ret <= 0)
+			goto out;
+	}
 	ret = utimensat(AT_FDCWD, full_path, tv, AT_SYMLINK_NOFOLLOW);
 	if (ret < 0) {
 		ret = -errno;
@@ -997,42 +1698,42 @@ static int process_update_extent(const char *path, u64 offset, u64 len,
 	return 0;
 }
 
-static int decompress_zlib(struct btrfs_receive *rctx, const char *encoded_data,
-			   u64 encoded_len, char *unencoded_data,
-			   u64 unencoded_len)
+static int decompress_zlib(struct receive_decompress *dctx,
+			   const char *encoded_data, u64 encoded_len,
+			   char *unencoded_data, u64 unencoded_len)
 {
 	bool init = false;
 	int ret;
 
-	if (!rctx->zlib_stream) {
+	if (!dctx->zlib_stream) {
 		init = true;
-		rctx->zlib_stream = malloc(sizeof(z_stream));
-		if (!rctx->zlib_stream) {
+		dctx->zlib_stream = malloc(sizeof(z_stream));
+		if (!dctx->zlib_stream) {
 			error_msg(ERROR_MSG_MEMORY, "zlib stream: %m");
 			return -ENOMEM;
 		}
 	}
-	rctx->zlib_stream->next_in = (void *)encoded_data;
-	rctx->zlib_stream->avail_in = encoded_len;
-	rctx->zlib_stream->next_out = (void *)unencoded_data;
-	rctx->zlib_stream->avail_out = unencoded_len;
+	dctx->zlib_stream->next_in = (void *)encoded_data;
+	dctx->zlib_stream->avail_in = encoded_len;
+	dctx->zlib_stream->next_out = (void *)unencoded_data;
+	dctx->zlib_stream->avail_out = unencoded_len;
 
 	if (init) {
-		rctx->zlib_stream->zalloc = Z_NULL;
-		rctx->zlib_stream->zfree = Z_NULL;
-		rctx->zlib_stream->opaque = Z_NULL;
-		ret = inflateInit(rctx->zlib_stream);
+		dctx->zlib_stream->zalloc = Z_NULL;
+		dctx->zlib_stream->zfree = Z_NULL;
+		dctx->zlib_stream->opaque = Z_NULL;
+		ret = inflateInit(dctx->zlib_stream);
 	} else {
-		ret = inflateReset(rctx->zlib_stream);
+		ret = inflateReset(dctx->zlib_stream);
 	}
 	if (ret != Z_OK) {
 		error("zlib inflate init failed: %d", ret);
 		return -EIO;
 	}
 
-	while (rctx->zlib_stream->avail_in > 0 &&
-	       rctx->zlib_stream->avail_out > 0) {
-		ret = inflate(rctx->zlib_stream, Z_FINISH);
+	while (dctx->zlib_stream->avail_in > 0 &&
+	       dctx->zlib_stream->avail_out > 0) {
+		ret = inflate(dctx->zlib_stream, Z_FINISH);
 		if (ret == Z_STREAM_END) {
 			break;
 		} else if (ret != Z_OK) {
@@ -1044,9 +1745,9 @@ static int decompress_zlib(struct btrfs_receive *rctx, const char *encoded_data,
 }
 
 #if COMPRESSION_ZSTD
-static int decompress_zstd(struct btrfs_receive *rctx, const char *encoded_buf,
-			   u64 encoded_len, char *unencoded_buf,
-			   u64 unencoded_len)
+static int decompress_zstd(struct receive_decompress *dctx,
+			   const char *encoded_buf, u64 encoded_len,
+			   char *unencoded_buf, u64 unencoded_len)
 {
 	ZSTD_inBuffer in_buf = {
 		.src = encoded_buf,
@@ -1058,20 +1759,20 @@ static int decompress_zstd(struct btrfs_receive *rctx, const char *encoded_buf,
 	};
 	size_t ret;
 
-	if (!rctx->zstd_dstream) {
-		rctx->zstd_dstream = ZSTD_createDStream();
-		if (!rctx->zstd_dstream) {
+	if (!dctx->zstd_dstream) {
+		dctx->zstd_dstream = ZSTD_createDStream();
+		if (!dctx->zstd_dstream) {
 			error("failed to create zstd dstream");
 			return -ENOMEM;
 		}
 	}
-	ret = ZSTD_initDStream(rctx->zstd_dstream);
+	ret = ZSTD_initDStream(dctx->zstd_dstream);
 	if (ZSTD_isError(ret)) {
 		error("failed to init zstd stream: %s", ZSTD_getErrorName(ret));
 		return -EIO;
 	}
 	while (in_buf.pos < in_buf.size && out_buf.pos < out_buf.size) {
-		ret = ZSTD_decompressStream(rctx->zstd_dstream, &out_buf, &in_buf);
+		ret = ZSTD_decompressStream(dctx->zstd_dstream, &out_buf, &in_buf);
 		if (ret == 0) {
 			break;
 		} else if (ZSTD_isError(ret)) {
@@ -1148,7 +1849,7 @@ static int decompress_lzo(const char *encoded_data, u64 encoded_len,
 }
 #endif
 
-static int decompress_and_write(struct btrfs_receive *rctx,
+static int decompress_and_write(struct receive_decompress *dctx, int fd,
 				const char *encoded_data, u64 offset,
 				u64 encoded_len, u64 unencoded_file_len,
 				u64 unencoded_len, u64 unencoded_offset,
@@ -1168,14 +1869,14 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 
 	switch (compression) {
 	case BTRFS_ENCODED_IO_COMPRESSION_ZLIB:
-		ret = decompress_zlib(rctx, encoded_data, encoded_len,
+		ret = decompress_zlib(dctx, encoded_data, encoded_len,
 				      unencoded_data, unencoded_len);
 		if (ret)
 			goto out;
 		break;
 #if COMPRESSION_ZSTD
 	case BTRFS_ENCODED_IO_COMPRESSION_ZSTD:
-		ret = decompress_zstd(rctx, encoded_data, encoded_len,
+		ret = decompress_zstd(dctx, encoded_data, encoded_len,
 				      unencoded_data, unencoded_len);
 		if (ret)
 			goto out;
@@ -1211,7 +1912,7 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 
 	pos = unencoded_offset;
 	while (pos < unencoded_file_len) {
-		w = pwrite(rctx->write_fd, unencoded_data + pos,
+		w = pwrite(fd, unencoded_data + pos,
 			   unencoded_file_len - pos, offset);
 		if (w < 0) {
 			ret = -errno;
@@ -1226,14 +1927,13 @@ out:
 	return ret;
 }
 
-static int process_encoded_write(const char *path, const void *data, u64 offset,
-				 u64 len, u64 unencoded_file_len,
-				 u64 unencoded_len, u64 unencoded_offset,
-				 u32 compression, u32 encryption, void *user)
+static int encoded_write_data(struct receive_decompress *dctx, int fd,
+			      bool force_decompress, const char *path,
+			      const char *data, u64 offset, u64 len,
+			      u64 unencoded_file_len, u64 unencoded_len,
+			      u64 unencoded_offset, u32 compression)
 {
 	int ret;
-	struct btrfs_receive *rctx = user;
-	char full_path[PATH_MAX];
 	struct iovec iov = { (char *)data, len };
 	struct btrfs_ioctl_encoded_io_args encoded = {
 		.iov = &iov,
@@ -1243,9 +1943,37 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 		.unencoded_len = unencoded_len,
 		.unencoded_offset = unencoded_offset,
 		.compression = compression,
-		.encryption = encryption,
 	};
 
+	if (!force_decompress) {
+		ret = ioctl(fd, BTRFS_IOC_ENCODED_WRITE, &encoded);
+		if (ret >= 0)
+			return 0;
+		/* Fall back for these errors, fail hard for anything else. */
+		if (errno != ENOSPC && errno != ENOTTY && errno != EINVAL) {
+			ret = -errno;
+			error("encoded_write: writing to %s failed: %m", path);
+			return ret;
+		}
+	}
+
+	return decompress_and_write(dctx, fd, data, offset, len,
+				    unencoded_file_len, unencoded_len,
+				    unencoded_offset, compression);
+}
+
+static int process_encoded_write(const char *path, const void *data, u64 offset,
+				 u64 len, u64 unencoded_file_len,
+				 u64 unencoded_len, u64 unencoded_offset,
+				 u32 compression, u32 encryption, void *user)
+{
+	int ret;
+	struct btrfs_receive *rctx = user;
+	struct receive_op *op;
+	char full_path[PATH_MAX];
+
+	flush_write(rctx);
+
 	if (encryption) {
 		error("encoded_write: encryption not supported");
 		return -EOPNOTSUPP;
@@ -1257,25 +1985,112 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 		return ret;
 	}
 
+	if (rctx->pipeline) {
+		op = receive_alloc_op(RECEIVE_OP_ENCODED_WRITE, data, len);
+		if (!op)
+			return -ENOMEM;
+		op->offset = offset;
+		op->unencoded_file_len = unencoded_file_len;
+		op->unencoded_len = unencoded_len;
+		op->unencoded_offset = unencoded_offset;
+		op->compression = compression;
+		return receive_queue_op(rctx, path, full_path, op);
+	}
+
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		return ret;
 
-	if (!rctx->force_decompress) {
-		ret = ioctl(rctx->write_fd, BTRFS_IOC_ENCODED_WRITE, &encoded);
-		if (ret >= 0)
-			return 0;
-		/* Fall back for these errors, fail hard for anything else. */
-		if (errno != ENOSPC && errno != ENOTTY && errno != EINVAL) {
+	return encoded_write_data(&rctx->decompress, rctx->write_fd,
+				  rctx->force_decompress, path, data, offset,
+				  len, unencoded_file_len, unencoded_len,
+				  unencoded_offset, compression);
+}
+
+static int receive_apply_op(struct btrfs_receive *rctx,
+			    struct receive_decompress *dctx,
+			    struct receive_inode *inode, struct receive_op *op)
+{
+	const char *path = inode->path;
+	int ret = 0;
+
+	switch (op->type) {
+	case RECEIVE_OP_WRITE:
+		ret = write_data(inode->fd, path, op->data, op->offset, op->len);
+		break;
+	case RECEIVE_OP_ENCODED_WRITE:
+		ret = encoded_write_data(dctx, inode->fd, rctx->force_decompress,
+					 path, op->data, op->offset, op->len,
+					 op->unencoded_file_len,
+					 op->unencoded_len, op->unencoded_offset,
+					 op->compression);
+		break;
+	case RECEIVE_OP_TRUNCATE:
+		ret = ftruncate(inode->fd, op->size);
+		if (ret < 0) {
 			ret = -errno;
-			error("encoded_write: writing to %s failed: %m", path);
-			return ret;
+			error("truncate %s failed: %m", path);
 		}
+		break;
+	case RECEIVE_OP_CHMOD:
+		ret = fchmod(inode->fd, op->mode);
+		if (ret < 0) {
+			ret = -errno;
+			error("chmod %s failed: %m", path);
+		}
+		break;
+	case RECEIVE_OP_CHOWN:
+		ret = fchown(inode->fd, op->uid, op->gid);
+		if (ret < 0) {
+			ret = -errno;
+			error("chown %s failed: %m", path);
+		}
+		break;
+	case RECEIVE_OP_UTIMES:
+		ret = futimens(inode->fd, op->times);
+		if (ret < 0) {
+			ret = -errno;
+			error("utimes %s failed: %m", path);
+		}
+		break;
 	}
+	return ret;
+}
 
-	return decompress_and_write(rctx, data, offset, len, unencoded_file_len,
-				    unencoded_len, unencoded_offset,
-				    compression);
+/* Apply the queued commands of an inode until there are none left */
+static void receive_inode_work_fn(struct btrfs_work *work)
+{
+	struct receive_inode *inode = container_of(work, struct receive_inode,
+						   work);
+	struct btrfs_receive *rctx = inode->rctx;
+	struct receive_pipeline *pipeline = rctx->pipeline;
+	struct receive_decompress *dctx;
+	struct receive_op *op;
+	int ret = 0;
+
+	pthread_mutex_lock(&pipeline->lock);
+	/* There's one for each thread */
+	dctx = list_first_entry(&pipeline->decompress,
+				struct receive_decompress, list);
+	list_del(&dctx->list);
+	while (!list_empty(&inode->ops)) {
+		op = list_first_entry(&inode->ops, struct receive_op, list);
+		list_del(&op->list);
+		if (!pipeline->stop) {
+			pthread_mutex_unlock(&pipeline->lock);
+			ret = receive_apply_op(rctx, dctx, inode, op);
+			pthread_mutex_lock(&pipeline->lock);
+			if (ret < 0 && !pipeline->error)
+				pipeline->error = ret;
+		}
+		pipeline->in_flight -= op->len;
+		free(op);
+		pthread_cond_broadcast(&pipeline->cond);
+	}
+	list_add(&dctx->list, &pipeline->decompress);
+	inode->running = false;
+	pthread_cond_broadcast(&pipeline->cond);
+	pthread_mutex_unlock(&pipeline->lock);
 }
 
 static int process_fallocate(const char *path, int mode, u64 offset, u64 len,
@@ -1285,11 +2100,14 @@ static int process_fallocate(const char *path, int mode, u64 offset, u64 len,
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("fallocate: path invalid: %s", path);
 		return ret;
 	}
+	receive_wait_inodes(rctx, path, false);
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		return ret;
@@ -1308,11 +2126,14 @@ static int process_fileattr(const char *path, u64 attr, void *user)
 	struct btrfs_receive *rctx = user;
 	char full_path[PATH_MAX];
 
+	flush_write(rctx);
+
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
 		error("fileattr: path invalid: %s", path);
 		return ret;
 	}
+	receive_wait_inodes(rctx, path, false);
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		return ret;
@@ -1341,6 +2162,8 @@ static int process_enable_verity(const char *path, u8 algorithm, u32 block_size,
 		.block_size = block_size,
 	};
 
+	flush_write(rctx);
+
 	if (salt_len) {
 		verity_args.salt_size = salt_len;
 		verity_args.salt_ptr = (__u64)(uintptr_t)salt;
@@ -1357,6 +2180,8 @@ static int process_enable_verity(const char *path, u8 algorithm, u32 block_size,
 		goto out;
 	}
 
+	receive_wait_inodes(rctx, path, false);
+
 	ioctl_fd = open(full_path, O_RDONLY);
 	if (ioctl_fd < 0) {
 		ret = -errno;
@@ -1429,6 +2254,7 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	char root_subvol_path[PATH_MAX];
 	bool end = false;
 	int iterations = 0;
+	struct btrfs_send_stream *stream = NULL;
 
 	dest_dir_full_path = realpath(tomnt, NULL);
 	if (!dest_dir_full_path) {
@@ -1521,11 +2347,31 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 			rctx->dest_dir_path++;
 	}
 
+	/* With -e the rest of a pipe is left to the next receive */
+	stream = btrfs_send_stream_open(r_fd, rctx->honor_end_cmd);
+	if (!stream) {
+		ret = -ENOMEM;
+		error_msg(ERROR_MSG_MEMORY, "send stream read buffer");
+		goto out;
+	}
+
+	if (rctx->nr_threads != 1) {
+		ret = receive_pipeline_init(rctx);
+		if (ret < 0)
+			goto out;
+	} else if (rctx->use_uring) {
+		ret = btrfs_io_uring_init(&rctx->ring, RECEIVE_RING_ENTRIES);
+		if (ret < 0) {
+			errno = -ret;
+			warning("cannot use io_uring, writing synchronously: %m");
+			rctx->use_uring = false;
+		}
+	}
+
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops,
-							 rctx,
-							 rctx->honor_end_cmd,
-							 max_errors);
+		ret = btrfs_send_stream_process(stream, &send_ops, rctx,
+						rctx->honor_end_cmd,
+						max_errors);
 		if (ret < 0) {
 			if (ret != -ENODATA)
 				goto out;
@@ -1552,10 +2398,13 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	ret = 0;
 
 out:
-	if (rctx->write_fd != -1) {
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
-	}
+	receive_pipeline_free(rctx);
+	btrfs_send_stream_close(stream);
+	/* Not written after an error */
+	free(rctx->write_op);
+	rctx->write_op = NULL;
+	close_inode_for_write(rctx);
+	btrfs_io_uring_exit(&rctx->ring);
 
 	if (rctx->root_path != realmnt)
 		free(rctx->root_path);
@@ -1570,14 +2419,7 @@ out:
 		close(rctx->dest_dir_fd);
 		rctx->dest_dir_fd = -1;
 	}
-#if COMPRESSION_ZSTD
-	if (rctx->zstd_dstream)
-		ZSTD_freeDStream(rctx->zstd_dstream);
-#endif
-	if (rctx->zlib_stream) {
-		inflateEnd(rctx->zlib_stream);
-		free(rctx->zlib_stream);
-	}
+	free_decompress(&rctx->decompress);
 
 	return ret;
 }
@@ -1611,6 +2453,10 @@ static const char * const cmd_receive_usage[] = {
 	"--force-decompress",
 	"                 if the stream contains compressed data, always",
 	"                 decompress it instead of writing it with encoded I/O",
+	"-j N             write and decompress the file data in N threads while",
+	"                 the stream is parsed, 0 for the number of CPUs, default 1",
+	"--io-uring       submit the file data writes through io_uring and",
+	"                 continue with the stream meanwhile, with -j 1 only",
 	"--dump           dump stream metadata, one line per operation,",
 	"                 does not require the MOUNT parameter",
 	"-v               deprecated, alias for global -v option",
@@ -1644,12 +2490,18 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 	u64 max_errors = 1;
 	bool dump = false;
 	int ret = 0;
+	int i;
 
 	memset(&rctx, 0, sizeof(rctx));
 	rctx.mnt_fd = -1;
 	rctx.write_fd = -1;
+	for (i = 0; i < RECEIVE_NR_WRITE_FDS; i++)
+		rctx.write_fds[i].fd = -1;
 	rctx.dest_dir_fd = -1;
 	rctx.dest_dir_chroot = false;
+	rctx.nr_threads = 1;
+	/* Not set up yet, nothing to tear down on early errors */
+	rctx.ring.fd = -1;
 	realmnt[0] = 0;
 	fromfile[0] = 0;
 
@@ -1671,6 +2523,7 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		enum {
 			GETOPT_VAL_DUMP = GETOPT_VAL_FIRST,
 			GETOPT_VAL_FORCE_DECOMPRESS,
+			GETOPT_VAL_IO_URING,
 		};
 		static const struct option long_opts[] = {
 			{ "max-errors", required_argument, NULL, 'E' },
@@ -1678,10 +2531,11 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "dump", no_argument, NULL, GETOPT_VAL_DUMP },
 			{ "quiet", no_argument, NULL, 'q' },
 			{ "force-decompress", no_argument, NULL, GETOPT_VAL_FORCE_DECOMPRESS },
+			{ "io-uring", no_argument, NULL, GETOPT_VAL_IO_URING },
 			{ NULL, 0, NULL, 0 }
 		};
 
-		c = getopt_long(argc, argv, "Cevqf:m:E:", long_opts, NULL);
+		c = getopt_long(argc, argv, "Cevqf:m:E:j:", long_opts, NULL);
 		if (c < 0)
 			break;
 
@@ -1709,6 +2563,10 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		case 'E':
 			max_errors = arg_strtou64(optarg);
 			break;
+		case 'j':
+			rctx.nr_threads = min_t(u64, arg_strtou64(optarg),
+						BTRFS_WORKQUEUE_MAX_THREADS);
+			break;
 		case 'm':
 			if (arg_copy_path(realmnt, optarg, sizeof(realmnt))) {
 				error("mount point path too long (%zu)",
@@ -1723,6 +2581,9 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		case GETOPT_VAL_FORCE_DECOMPRESS:
 			rctx.force_decompress = true;
 			break;
+		case GETOPT_VAL_IO_URING:
+			rctx.use_uring = true;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -1732,6 +2593,11 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		usage(cmd);
 	if (!dump && check_argc_exact(argc - optind, 1))
 		usage(cmd);
+	if (rctx.use_uring && rctx.nr_threads != 1) {
+		error("--io-uring can be used only with -j 1");
+		ret = 1;
+		goto out;
+	}
 
 	tomnt = argv[optind];
 
@@ -1745,13 +2611,21 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 
 	if (dump) {
 		struct btrfs_dump_send_args dump_args;
+		struct btrfs_send_stream *stream;
 
 		dump_args.root_path[0] = '.';
 		dump_args.root_path[1] = '\0';
 		dump_args.full_subvol_path[0] = '.';
 		dump_args.full_subvol_path[1] = '\0';
-		ret = btrfs_read_and_process_send_stream(receive_fd,
-			&btrfs_print_send_ops, &dump_args, 0, max_errors);
+		stream = btrfs_send_stream_open(receive_fd, false);
+		if (stream) {
+			ret = btrfs_send_stream_process(stream,
+					&btrfs_print_send_ops, &dump_args, 0,
+					max_errors);
+			btrfs_send_stream_close(stream);
+		} else {
+			ret = -ENOMEM;
+		}
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to dump the send stream: %m");
@@ -25,7 +25,10 @@
 #include <errno.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include "kernel-lib/list.h"
+#include "kernel-lib/sizes.h"
+#include "kernel-lib/bitops.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
@@ -35,6 +38,9 @@
 #include "common/messages.h"
 #include "common/extent-cache.h"
 #include "common/utils.h"
+#include "common/mem-limit.h"
+#include "common/units.h"
+#include "common/workqueue.h"
 #include "cmds/rescue.h"
 #include "check/common.h"
 #include "ioctl.h"
@@ -61,7 +67,8 @@ struct recover_control {
 	struct list_head bad_chunks;
 	struct list_head rebuild_chunks;
 	struct list_head unrepaired_chunks;
-	pthread_mutex_t rc_lock;
+	/* Threads scanning the devices, 0 for the number of CPUs */
+	int nr_threads;
 };
 
 struct extent_record {
@@ -73,11 +80,13 @@ struct extent_record {
 	int nmirrors;
 };
 
+struct scan_control;
+
 struct device_scan {
-	struct recover_control *rc;
+	struct scan_control *sc;
 	struct btrfs_device *dev;
 	int fd;
-	u64 bytenr;
+	u64 size;
 };
 
 static struct extent_record *btrfs_new_extent_record(struct extent_buffer *eb)
@@ -89,6 +98,7 @@ static struct extent_record *btrfs_new_extent_record(struct extent_buffer *eb)
 		error_msg(ERROR_MSG_MEMORY, "extent record");
 		exit(1);
 	}
+	btrfs_mem_charge(BTRFS_MEM_CHUNK_RECOVER, sizeof(*rec));
 
 	rec->cache.start = btrfs_header_bytenr(eb);
 	rec->cache.size = eb->len;
@@ -98,16 +108,25 @@ static struct extent_record *btrfs_new_extent_record(struct extent_buffer *eb)
 	return rec;
 }
 
-static int process_extent_buffer(struct cache_tree *eb_cache,
-				 struct extent_buffer *eb,
-				 struct btrfs_device *device, u64 offset)
+static void btrfs_free_extent_record(struct extent_record *rec)
+{
+	btrfs_mem_uncharge(BTRFS_MEM_CHUNK_RECOVER, sizeof(*rec));
+	free(rec);
+}
+
+/*
+ * Add @rec to @eb_cache, unless a newer copy of the block is there already.
+ * The copies of the same generation are recorded as mirrors. The record is
+ * freed if not inserted.
+ */
+static int add_extent_record(struct cache_tree *eb_cache,
+			     struct extent_record *rec)
 {
-	struct extent_record *rec;
 	struct extent_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
+	int i;
 
-	rec = btrfs_new_extent_record(eb);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -125,36 +144,50 @@ again:
 			    memcmp(exist->csum, rec->csum, BTRFS_CSUM_SIZE)) {
 				ret = -EEXIST;
 			} else {
-				BUG_ON(exist->nmirrors >= BTRFS_MAX_MIRRORS);
-				exist->devices[exist->nmirrors] = device;
-				exist->offsets[exist->nmirrors] = offset;
-				exist->nmirrors++;
+				for (i = 0; i < rec->nmirrors; i++) {
+					BUG_ON(exist->nmirrors >= BTRFS_MAX_MIRRORS);
+					exist->devices[exist->nmirrors] =
+						rec->devices[i];
+					exist->offsets[exist->nmirrors] =
+						rec->offsets[i];
+					exist->nmirrors++;
+				}
 			}
 			goto free_out;
 		}
 		remove_cache_extent(eb_cache, cache);
-		free(exist);
+		btrfs_free_extent_record(exist);
 		goto again;
 	}
 
-	rec->devices[0] = device;
-	rec->offsets[0] = offset;
-	rec->nmirrors++;
 	ret = insert_cache_extent(eb_cache, &rec->cache);
 	BUG_ON(ret);
 out:
 	return ret;
 free_out:
-	free(rec);
+	btrfs_free_extent_record(rec);
 	goto out;
 }
 
+static int process_extent_buffer(struct cache_tree *eb_cache,
+				 struct extent_buffer *eb,
+				 struct btrfs_device *device, u64 offset)
+{
+	struct extent_record *rec;
+
+	rec = btrfs_new_extent_record(eb);
+	rec->devices[0] = device;
+	rec->offsets[0] = offset;
+	rec->nmirrors = 1;
+	return add_extent_record(eb_cache, rec);
+}
+
 static void free_extent_record(struct cache_extent *cache)
 {
 	struct extent_record *er;
 
 	er = container_of(cache, struct extent_record, cache);
-	free(er);
+	btrfs_free_extent_record(er);
 }
 
 FREE_EXTENT_CACHE_BASED_TREE(extent_record, free_extent_record);
@@ -206,7 +239,6 @@ static void init_recover_control(struct recover_control *rc, int yes)
 
 	rc->verbose = bconf.verbose;
 	rc->yes = yes;
-	pthread_mutex_init(&rc->rc_lock, NULL);
 }
 
 static void free_recover_control(struct recover_control *rc)
@@ -215,19 +247,15 @@ static void free_recover_control(struct recover_control *rc)
 	free_chunk_cache_tree(&rc->chunk);
 	free_device_extent_tree(&rc->devext);
 	free_extent_record_tree(&rc->eb_cache);
-	pthread_mutex_destroy(&rc->rc_lock);
 }
 
-static int process_block_group_item(struct block_group_tree *bg_cache,
-				    struct extent_buffer *leaf,
-				    struct btrfs_key *key, int slot)
+static int add_block_group_record(struct block_group_tree *bg_cache,
+				  struct block_group_record *rec)
 {
-	struct block_group_record *rec;
 	struct block_group_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
 
-	rec = btrfs_new_block_group_record(leaf, key, slot);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -274,16 +302,23 @@ free_out:
 	goto out;
 }
 
-static int process_chunk_item(struct cache_tree *chunk_cache,
-			      struct extent_buffer *leaf, struct btrfs_key *key,
-			      int slot)
+static int process_block_group_item(struct block_group_tree *bg_cache,
+				    struct extent_buffer *leaf,
+				    struct btrfs_key *key, int slot)
+{
+	struct block_group_record *rec;
+
+	rec = btrfs_new_block_group_record(leaf, key, slot);
+	return add_block_group_record(bg_cache, rec);
+}
+
+static int add_chunk_record(struct cache_tree *chunk_cache,
+			    struct chunk_record *rec)
 {
-	struct chunk_record *rec;
 	struct chunk_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
 
-	rec = btrfs_new_chunk_record(leaf, key, slot);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -318,16 +353,23 @@ free_out:
 	goto out;
 }
 
-static int process_device_extent_item(struct device_extent_tree *devext_cache,
-				      struct extent_buffer *leaf,
-				      struct btrfs_key *key, int slot)
+static int process_chunk_item(struct cache_tree *chunk_cache,
+			      struct extent_buffer *leaf, struct btrfs_key *key,
+			      int slot)
+{
+	struct chunk_record *rec;
+
+	rec = btrfs_new_chunk_record(leaf, key, slot);
+	return add_chunk_record(chunk_cache, rec);
+}
+
+static int add_device_extent_record(struct device_extent_tree *devext_cache,
+				    struct device_extent_record *rec)
 {
-	struct device_extent_record *rec;
 	struct device_extent_record *exist;
 	struct cache_extent *cache;
 	int ret = 0;
 
-	rec = btrfs_new_device_extent_record(leaf, key, slot);
 	if (!rec->cache.size)
 		goto free_out;
 again:
@@ -364,6 +406,16 @@ free_out:
 	goto out;
 }
 
+static int process_device_extent_item(struct device_extent_tree *devext_cache,
+				      struct extent_buffer *leaf,
+				      struct btrfs_key *key, int slot)
+{
+	struct device_extent_record *rec;
+
+	rec = btrfs_new_device_extent_record(leaf, key, slot);
+	return add_device_extent_record(devext_cache, rec);
+}
+
 static void print_block_group_info(struct block_group_record *rec, char *prefix)
 {
 	if (prefix)
@@ -682,7 +734,45 @@ static int check_all_chunks_by_metadata(struct recover_control *rc,
 	return ret;
 }
 
-static int extract_metadata_record(struct recover_control *rc,
+/*
+ * The devices are split into segments scanned in parallel. The records found
+ * in a segment are collected in its own trees without locking and merged to
+ * the global ones in the order of the segments, so the result does not
+ * depend on the timing of the threads.
+ */
+#define SCAN_SEGMENT_SIZE	SZ_256M
+/* Size of one read, large enough to keep the device streaming */
+#define SCAN_BUFFER_SIZE	SZ_8M
+
+struct scan_segment {
+	struct btrfs_work work;
+	struct device_scan *dev_scan;
+	u64 start;
+	u64 end;
+	bool done;
+
+	struct cache_tree eb_cache;
+	struct block_group_tree bg;
+	struct cache_tree chunk;
+	struct device_extent_tree devext;
+	int ret;
+};
+
+struct scan_control {
+	struct recover_control *rc;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	struct scan_segment *segments;
+	int nr_segments;
+	/* Segments before this one have been merged */
+	int next_merge;
+	int nr_done;
+	u64 total_bytes;
+	u64 scanned_bytes;
+	int ret;
+};
+
+static int extract_metadata_record(struct scan_segment *seg,
 				   struct extent_buffer *leaf)
 {
 	struct btrfs_key key;
@@ -695,20 +785,14 @@ static int extract_metadata_record(struct recover_control *rc,
 		btrfs_item_key_to_cpu(leaf, &key, i);
 		switch (key.type) {
 		case BTRFS_BLOCK_GROUP_ITEM_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
-			ret = process_block_group_item(&rc->bg, leaf, &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
+			ret = process_block_group_item(&seg->bg, leaf, &key, i);
 			break;
 		case BTRFS_CHUNK_ITEM_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
-			ret = process_chunk_item(&rc->chunk, leaf, &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
+			ret = process_chunk_item(&seg->chunk, leaf, &key, i);
 			break;
 		case BTRFS_DEV_EXTENT_KEY:
-			pthread_mutex_lock(&rc->rc_lock);
-			ret = process_device_extent_item(&rc->devext, leaf,
+			ret = process_device_extent_item(&seg->devext, leaf,
 							 &key, i);
-			pthread_mutex_unlock(&rc->rc_lock);
 			break;
 		}
 		if (ret)
@@ -728,74 +812,106 @@ static inline int is_super_block_address(u64 offset)
 	return 0;
 }
 
-static int scan_one_device(void *dev_scan_struct)
+/*
+ * Read the part of the device starting at @bytenr and ending at @end at most
+ * to @buf, the start is aligned down for direct IO. Return the offset of
+ * @bytenr in the buffer and the valid length in @len.
+ */
+static int read_scan_buffer(struct scan_control *sc, int fd, u8 *buf,
+			    u64 bytenr, u64 end, u64 *buf_start, u64 *len)
 {
-	struct extent_buffer *buf;
-	u64 bytenr;
-	int ret = 0;
-	struct device_scan *dev_scan = (struct device_scan *)dev_scan_struct;
-	struct recover_control *rc = dev_scan->rc;
-	struct btrfs_device *device = dev_scan->dev;
-	int fd = dev_scan->fd;
-	int oldtype;
+	ssize_t ret;
 
-	ret = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
-	if (ret)
-		return 1;
+	*buf_start = round_down(bytenr, BTRFS_SUPER_INFO_SIZE);
+	ret = pread(fd, buf, min_t(u64, SCAN_BUFFER_SIZE, end - *buf_start),
+		    *buf_start);
+	if (ret < 0)
+		return -errno;
+	*len = ret;
+	__atomic_add_fetch(&sc->scanned_bytes, ret, __ATOMIC_RELAXED);
+	return 0;
+}
 
-	buf = malloc(sizeof(*buf) + rc->nodesize);
-	if (!buf)
-		return -ENOMEM;
-	buf->len = rc->nodesize;
+static int scan_segment(struct scan_control *sc, struct scan_segment *seg)
+{
+	struct recover_control *rc = sc->rc;
+	struct device_scan *dev_scan = seg->dev_scan;
+	const u32 fsid_offset = offsetof(struct btrfs_header, fsid);
+	struct extent_buffer *eb;
+	u8 *buf;
+	u64 buf_start = 0;
+	u64 buf_len = 0;
+	u64 bytenr = seg->start;
+	/* The last block starting in the segment may end in the next one */
+	const u64 read_end = round_up(seg->end + rc->nodesize - rc->sectorsize,
+				      BTRFS_SUPER_INFO_SIZE);
+	u64 offset;
+	int ret = 0;
 
-	bytenr = 0;
-	while (1) {
-		dev_scan->bytenr = bytenr;
+	eb = calloc(1, sizeof(*eb) + rc->nodesize);
+	if (!eb)
+		return -ENOMEM;
+	eb->len = rc->nodesize;
+	if (posix_memalign((void **)&buf, BTRFS_SUPER_INFO_SIZE,
+			   SCAN_BUFFER_SIZE)) {
+		free(eb);
+		return -ENOMEM;
+	}
 
-		if (is_super_block_address(bytenr))
+	while (bytenr < seg->end) {
+		if (is_super_block_address(bytenr)) {
 			bytenr += rc->sectorsize;
+			if (bytenr >= seg->end)
+				break;
+		}
 
-		if (pread64(fd, buf->data, rc->nodesize, bytenr) <
-		    rc->nodesize)
-			break;
+		if (bytenr + rc->nodesize > buf_start + buf_len) {
+			ret = read_scan_buffer(sc, dev_scan->fd, buf, bytenr,
+					       read_end, &buf_start, &buf_len);
+			if (ret < 0)
+				goto out;
+			/* Nothing more, the end of the device */
+			if (bytenr + rc->nodesize > buf_start + buf_len)
+				break;
+		}
+		offset = bytenr - buf_start;
 
-		if (memcmp_extent_buffer(buf, rc->fs_devices->metadata_uuid,
-					 btrfs_header_fsid(),
-					 BTRFS_FSID_SIZE)) {
+		/* Filter by the fsid in memory, the checksum only if it matches */
+		if (memcmp(buf + offset + fsid_offset,
+			   rc->fs_devices->metadata_uuid, BTRFS_FSID_SIZE)) {
 			bytenr += rc->sectorsize;
 			continue;
 		}
-
-		if (verify_tree_block_csum_silent(buf, rc->csum_size,
+		memcpy(eb->data, buf + offset, rc->nodesize);
+		if (verify_tree_block_csum_silent(eb, rc->csum_size,
 						  rc->csum_type)) {
 			bytenr += rc->sectorsize;
 			continue;
 		}
 
-		pthread_mutex_lock(&rc->rc_lock);
-		ret = process_extent_buffer(&rc->eb_cache, buf, device, bytenr);
-		pthread_mutex_unlock(&rc->rc_lock);
+		ret = process_extent_buffer(&seg->eb_cache, eb, dev_scan->dev,
+					    bytenr);
 		if (ret)
 			goto out;
 
-		if (btrfs_header_level(buf) != 0)
+		if (btrfs_header_level(eb) != 0)
 			goto next_node;
 
-		switch (btrfs_header_owner(buf)) {
+		switch (btrfs_header_owner(eb)) {
 		case BTRFS_EXTENT_TREE_OBJECTID:
 		case BTRFS_DEV_TREE_OBJECTID:
 			/* different tree use different generation */
-			if (btrfs_header_generation(buf) > rc->generation)
+			if (btrfs_header_generation(eb) > rc->generation)
 				break;
-			ret = extract_metadata_record(rc, buf);
+			ret = extract_metadata_record(seg, eb);
 			if (ret)
 				goto out;
 			break;
 		case BTRFS_CHUNK_TREE_OBJECTID:
-			if (btrfs_header_generation(buf) >
+			if (btrfs_header_generation(eb) >
 			    rc->chunk_root_generation)
 				break;
-			ret = extract_metadata_record(rc, buf);
+			ret = extract_metadata_record(seg, eb);
 			if (ret)
 				goto out;
 			break;
@@ -804,116 +920,270 @@ next_node:
 		bytenr += rc->nodesize;
 	}
 out:
-	close(fd);
 	free(buf);
+	free(eb);
 	return ret;
 }
 
-static int scan_devices(struct recover_control *rc)
+static void init_scan_segment(struct scan_segment *seg)
+{
+	cache_tree_init(&seg->eb_cache);
+	cache_tree_init(&seg->chunk);
+	block_group_tree_init(&seg->bg);
+	device_extent_tree_init(&seg->devext);
+}
+
+static void free_scan_segment(struct scan_segment *seg)
+{
+	free_block_group_tree(&seg->bg);
+	free_chunk_cache_tree(&seg->chunk);
+	free_device_extent_tree(&seg->devext);
+	free_extent_record_tree(&seg->eb_cache);
+}
+
+/* Move the records of the segment to the global trees */
+static int merge_scan_segment(struct recover_control *rc,
+			      struct scan_segment *seg)
 {
+	struct block_group_record *bg;
+	struct device_extent_record *devext;
+	struct cache_extent *cache;
+	int ret;
+
+	while ((cache = first_cache_extent(&seg->eb_cache))) {
+		remove_cache_extent(&seg->eb_cache, cache);
+		ret = add_extent_record(&rc->eb_cache,
+				container_of(cache, struct extent_record, cache));
+		if (ret)
+			return ret;
+	}
+	/* The lists keep the order the records were found in */
+	while (!list_empty(&seg->bg.block_groups)) {
+		bg = list_first_entry(&seg->bg.block_groups,
+				      struct block_group_record, list);
+		list_del_init(&bg->list);
+		remove_cache_extent(&seg->bg.tree, &bg->cache);
+		ret = add_block_group_record(&rc->bg, bg);
+		if (ret)
+			return ret;
+	}
+	while ((cache = first_cache_extent(&seg->chunk))) {
+		remove_cache_extent(&seg->chunk, cache);
+		ret = add_chunk_record(&rc->chunk,
+				container_of(cache, struct chunk_record, cache));
+		if (ret)
+			return ret;
+	}
+	while (!list_empty(&seg->devext.no_chunk_orphans)) {
+		devext = list_first_entry(&seg->devext.no_chunk_orphans,
+					  struct device_extent_record,
+					  chunk_list);
+		list_del_init(&devext->chunk_list);
+		list_del_init(&devext->device_list);
+		remove_cache_extent(&seg->devext.tree, &devext->cache);
+		ret = add_device_extent_record(&rc->devext, devext);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void scan_segment_work_fn(struct btrfs_work *work)
+{
+	struct scan_segment *seg = container_of(work, struct scan_segment, work);
+	struct scan_control *sc = seg->dev_scan->sc;
 	int ret = 0;
+
+	/* Don't waste time after an error, the result is thrown away */
+	if (!__atomic_load_n(&sc->ret, __ATOMIC_RELAXED))
+		ret = scan_segment(sc, seg);
+
+	pthread_mutex_lock(&sc->lock);
+	seg->ret = ret;
+	seg->done = true;
+	while (sc->next_merge < sc->nr_segments &&
+	       sc->segments[sc->next_merge].done) {
+		struct scan_segment *next = &sc->segments[sc->next_merge];
+
+		if (!sc->ret) {
+			ret = next->ret;
+			if (!ret)
+				ret = merge_scan_segment(sc->rc, next);
+			__atomic_store_n(&sc->ret, ret, __ATOMIC_RELAXED);
+		}
+		free_scan_segment(next);
+		sc->next_merge++;
+	}
+	sc->nr_done++;
+	pthread_cond_signal(&sc->done_cond);
+	pthread_mutex_unlock(&sc->lock);
+}
+
+static void print_scan_progress(struct scan_control *sc, time_t start,
+				bool done)
+{
+	u64 scanned = __atomic_load_n(&sc->scanned_bytes, __ATOMIC_RELAXED);
+	time_t elapsed = time(NULL) - start;
+	u64 rate = elapsed ? scanned / elapsed : 0;
+
+	if (done)
+		scanned = sc->total_bytes;
+	printf("\rScanning: %s of %s (%llu%%)",
+	       pretty_size(scanned), pretty_size(sc->total_bytes),
+	       sc->total_bytes ? scanned * 100 / sc->total_bytes : 100);
+	if (rate)
+		printf(", %s/s", pretty_size(rate));
+	if (done) {
+		printf(", done in %ld:%02ld:%02ld", elapsed / 3600,
+		       elapsed / 60 % 60, elapsed % 60);
+	} else if (rate && sc->total_bytes > scanned) {
+		u64 eta = (sc->total_bytes - scanned) / rate;
+
+		printf(", ETA %llu:%02llu:%02llu", eta / 3600, eta / 60 % 60,
+		       eta % 60);
+	}
+	/* clear chars if exist in tail */
+	printf("                ");
+	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+	fflush(stdout);
+}
+
+/*
+ * Open the device for direct IO so the page cache is not thrashed by reading
+ * the whole device, if it's not supported fall back to buffered IO.
+ */
+static int open_scan_device(const char *path)
+{
+	void *buf;
 	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECT);
+	if (fd >= 0) {
+		if (posix_memalign(&buf, BTRFS_SUPER_INFO_SIZE,
+				   BTRFS_SUPER_INFO_SIZE)) {
+			close(fd);
+			return -ENOMEM;
+		}
+		if (pread(fd, buf, BTRFS_SUPER_INFO_SIZE, 0) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		free(buf);
+	}
+	if (fd < 0)
+		fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	return fd;
+}
+
+static int scan_devices(struct recover_control *rc)
+{
+	struct scan_control sc = { .rc = rc };
+	struct btrfs_workqueue *wq = NULL;
 	struct btrfs_device *dev;
 	struct device_scan *dev_scans;
-	pthread_t *t_scans;
-	long *t_rets;
+	struct timespec deadline;
+	u64 max_size = 0;
+	time_t start;
+	off_t size;
 	int devnr = 0;
 	int devidx = 0;
+	int ret = 0;
+	int fd;
 	int i;
-	bool all_done;
+	int seg;
 
 	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list)
 		devnr++;
-	dev_scans = (struct device_scan *)malloc(sizeof(struct device_scan)
-						 * devnr);
+	dev_scans = calloc(devnr, sizeof(struct device_scan));
 	if (!dev_scans)
 		return -ENOMEM;
-	t_scans = (pthread_t *)malloc(sizeof(pthread_t) * devnr);
-	if (!t_scans) {
-		free(dev_scans);
-		return -ENOMEM;
-	}
-	t_rets = (long *)malloc(sizeof(long) * devnr);
-	if (!t_rets) {
-		free(dev_scans);
-		free(t_scans);
-		return -ENOMEM;
-	}
+	pthread_mutex_init(&sc.lock, NULL);
+	pthread_cond_init(&sc.done_cond, NULL);
 
 	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list) {
-		fd = open(dev->name, O_RDONLY);
+		fd = open_scan_device(dev->name);
 		if (fd < 0) {
 			fprintf(stderr, "Failed to open device %s\n",
 				dev->name);
 			ret = 1;
-			goto out2;
+			goto out;
+		}
+		size = lseek(fd, 0, SEEK_END);
+		if (size < 0) {
+			error("cannot get size of %s: %m", dev->name);
+			close(fd);
+			ret = 1;
+			goto out;
 		}
-		dev_scans[devidx].rc = rc;
+		dev_scans[devidx].sc = &sc;
 		dev_scans[devidx].dev = dev;
 		dev_scans[devidx].fd = fd;
-		dev_scans[devidx].bytenr = -1;
+		dev_scans[devidx].size = size;
+		sc.total_bytes += size;
+		max_size = max_t(u64, max_size, size);
+		sc.nr_segments += DIV_ROUND_UP(size, SCAN_SEGMENT_SIZE);
 		devidx++;
 	}
 
-	for (i = 0; i < devidx; i++) {
-		ret = pthread_create(&t_scans[i], NULL,
-				     (void *)scan_one_device,
-				     (void *)&dev_scans[i]);
-		if (ret)
-			goto out1;
-
-		dev_scans[i].bytenr = 0;
+	sc.segments = calloc(sc.nr_segments, sizeof(struct scan_segment));
+	wq = btrfs_alloc_workqueue(rc->nr_threads);
+	if (!sc.segments || !wq) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	while (1) {
-		all_done = true;
-		for (i = 0; i < devidx; i++) {
-			if (dev_scans[i].bytenr == -1)
-				continue;
-			ret = pthread_tryjoin_np(t_scans[i],
-						 (void **)&t_rets[i]);
-			if (ret == EBUSY) {
-				all_done = false;
-				continue;
-			}
-			if (ret || t_rets[i]) {
-				ret = 1;
-				goto out1;
-			}
-			dev_scans[i].bytenr = -1;
-		}
+	/* Interleave the devices so they're all read at the same time */
+	i = 0;
+	for (seg = 0; seg < DIV_ROUND_UP(max_size, SCAN_SEGMENT_SIZE); seg++) {
+		int d;
 
-		printf("\rScanning: ");
-		for (i = 0; i < devidx; i++) {
-			if (dev_scans[i].bytenr == -1)
-				printf("%sDONE in dev%d",
-				       i ? ", " : "", i);
-			else
-				printf("%s%llu in dev%d",
-				       i ? ", " : "", dev_scans[i].bytenr, i);
-		}
-		/* clear chars if exist in tail */
-		printf("                ");
-		printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-		fflush(stdout);
+		for (d = 0; d < devidx; d++) {
+			struct scan_segment *segment;
+			u64 start = (u64)seg * SCAN_SEGMENT_SIZE;
 
-		if (all_done) {
-			printf("\n");
-			break;
+			if (start >= dev_scans[d].size)
+				continue;
+			segment = &sc.segments[i++];
+			segment->dev_scan = &dev_scans[d];
+			segment->start = start;
+			segment->end = min_t(u64, start + SCAN_SEGMENT_SIZE,
+					     dev_scans[d].size);
+			init_scan_segment(segment);
+			btrfs_init_work(&segment->work, scan_segment_work_fn);
 		}
-
-		sleep(1);
 	}
-out1:
-	for (i = 0; i < devidx; i++) {
-		if (dev_scans[i].bytenr == -1)
-			continue;
-		pthread_cancel(t_scans[i]);
+	for (i = 0; i < sc.nr_segments; i++)
+		btrfs_queue_work(wq, &sc.segments[i].work);
+
+	start = time(NULL);
+	pthread_mutex_lock(&sc.lock);
+	while (sc.nr_done < sc.nr_segments) {
+		pthread_mutex_unlock(&sc.lock);
+		print_scan_progress(&sc, start, false);
+		pthread_mutex_lock(&sc.lock);
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		pthread_cond_timedwait(&sc.done_cond, &sc.lock, &deadline);
 	}
-out2:
+	pthread_mutex_unlock(&sc.lock);
+	btrfs_flush_workqueue(wq);
+	ret = sc.ret;
+	if (!ret)
+		print_scan_progress(&sc, start, true);
+	printf("\n");
+
+out:
+	if (wq)
+		btrfs_destroy_workqueue(wq);
+	for (i = 0; i < devidx; i++)
+		close(dev_scans[i].fd);
+	free(sc.segments);
 	free(dev_scans);
-	free(t_scans);
-	free(t_rets);
+	pthread_cond_destroy(&sc.done_cond);
+	pthread_mutex_destroy(&sc.lock);
 	return !!ret;
 }
 
@@ -2288,7 +2558,7 @@ static void validate_rebuild_chunks(struct recover_control *rc)
 /*
  * Return 0 when successful, < 0 on error and > 0 if aborted by user
  */
-int btrfs_recover_chunk_tree(const char *path, int yes)
+int btrfs_recover_chunk_tree(const char *path, int yes, int nr_threads)
 {
 	int ret = 0;
 	struct btrfs_root *root = NULL;
@@ -2296,6 +2566,7 @@ int btrfs_recover_chunk_tree(const char *path, int yes)
 	struct recover_control rc;
 
 	init_recover_control(&rc, yes);
+	rc.nr_threads = nr_threads;
 
 	ret = recover_prepare(&rc, path);
 	if (ret) {
@@ -32,6 +32,8 @@
 #include "common/utils.h"
 #include "common/help.h"
 #include "common/open-utils.h"
+#include "common/string-utils.h"
+#include "common/workqueue.h"
 #include "cmds/commands.h"
 #include "cmds/rescue.h"
 
@@ -45,6 +47,7 @@ static const char * const cmd_rescue_chunk_recover_usage[] = {
 	"Recover the chunk tree by scanning the devices one by one.",
 	"",
 	"-y     Assume an answer of `yes' to all questions",
+	"-j N   Scan the devices in N threads, 0 for the number of CPUs (default)",
 	"-h     Help",
 	"-v     deprecated, alias for global -v option",
 	HELPINFO_INSERT_GLOBALS,
@@ -58,6 +61,7 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 	int ret = 0;
 	char *file;
 	bool yes = false;
+	int nr_threads = 0;
 
 	/* If verbose is unset, set it to 0 */
 	if (bconf.verbose == BTRFS_BCONF_UNSET)
@@ -65,13 +69,17 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 
 	optind = 0;
 	while (1) {
-		int c = getopt(argc, argv, "yvh");
+		int c = getopt(argc, argv, "yj:vh");
 		if (c < 0)
 			break;
 		switch (c) {
 		case 'y':
 			yes = true;
 			break;
+		case 'j':
+			nr_threads = min_t(u64, arg_strtou64(optarg),
+					   BTRFS_WORKQUEUE_MAX_THREADS);
+			break;
 		case 'v':
 			bconf.verbose++;
 			break;
@@ -95,7 +103,7 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 		return 1;
 	}
 
-	ret = btrfs_recover_chunk_tree(file, yes);
+	ret = btrfs_recover_chunk_tree(file, yes, nr_threads);
 	if (!ret) {
 		pr_verbose(LOG_DEFAULT, "Chunk tree recovered successfully\n");
 	} else if (ret > 0) {
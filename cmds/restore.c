@@ -20,6 +20,9 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,6 +33,8 @@
 #include <limits.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #if COMPRESSION_LZO
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
@@ -38,6 +43,8 @@
 #if COMPRESSION_ZSTD
 #include <zstd.h>
 #endif
+#include "kernel-lib/list_sort.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/print-tree.h"
@@ -48,6 +55,11 @@
 #include "common/open-utils.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
+#include "common/units.h"
+#include "common/workqueue.h"
+#include "common/io-uring.h"
+#include "common/mem-limit.h"
+#include "common/extent-cache.h"
 #include "cmds/commands.h"
 
 static char fs_name[PATH_MAX];
@@ -60,6 +72,9 @@ static int ignore_errors = 0;
 static int overwrite = 0;
 static int get_xattrs = 0;
 static int dry_run = 0;
+static int show_progress = 0;
+static int nr_threads = 1;
+static int use_uring = 0;
 
 #define LZO_LEN 4
 #define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
@@ -349,131 +364,6 @@ static int copy_one_inline(struct btrfs_root *root, int fd,
 	return 0;
 }
 
-static int copy_one_extent(struct btrfs_root *root, int fd,
-			   struct extent_buffer *leaf,
-			   struct btrfs_file_extent_item *fi, u64 pos)
-{
-	char *inbuf, *outbuf = NULL;
-	ssize_t done, total = 0;
-	u64 bytenr;
-	u64 ram_size;
-	u64 disk_size;
-	u64 num_bytes;
-	u64 length;
-	u64 size_left;
-	u64 offset;
-	u64 cur;
-	int compress;
-	int ret;
-	int mirror_num = 1;
-	int num_copies;
-
-	compress = btrfs_file_extent_compression(leaf, fi);
-	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
-	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	offset = btrfs_file_extent_offset(leaf, fi);
-	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
-	size_left = disk_size;
-	/* Hole, early exit */
-	if (disk_size == 0)
-		return 0;
-
-	/* Invalid file extent */
-	if ((compress == BTRFS_COMPRESS_NONE && offset >= disk_size) ||
-	    offset > ram_size) {
-		error(
-	"invalid data extent offset, offset %llu disk_size %llu ram_size %llu",
-		      offset, disk_size, ram_size);
-		return -EUCLEAN;
-	}
-
-	if (compress == BTRFS_COMPRESS_NONE && offset < disk_size) {
-		bytenr += offset;
-		size_left -= offset;
-	}
-
-	pr_verbose(offset ? 1 : 0, "offset is %llu\n", offset);
-
-	inbuf = malloc(size_left);
-	if (!inbuf) {
-		error_msg(ERROR_MSG_MEMORY, NULL);
-		return -ENOMEM;
-	}
-
-	if (compress != BTRFS_COMPRESS_NONE) {
-		outbuf = calloc(1, ram_size);
-		if (!outbuf) {
-			error_msg(ERROR_MSG_MEMORY, NULL);
-			free(inbuf);
-			return -ENOMEM;
-		}
-	}
-
-	num_copies = btrfs_num_copies(root->fs_info, bytenr, disk_size - offset);
-again:
-	cur = bytenr;
-	while (cur < bytenr + size_left) {
-		length = bytenr + size_left - cur;
-		ret = read_data_from_disk(root->fs_info, inbuf + cur - bytenr, cur,
-					  &length, mirror_num);
-		if (ret < 0) {
-			mirror_num++;
-			if (mirror_num > num_copies) {
-				ret = -1;
-				error("exhausted mirrors trying to read (%d > %d)",
-					mirror_num, num_copies);
-				goto out;
-			}
-			pr_stderr(LOG_DEFAULT, "trying another mirror\n");
-			continue;
-		}
-		cur += length;
-	}
-
-	if (compress == BTRFS_COMPRESS_NONE) {
-		while (total < num_bytes) {
-			done = pwrite(fd, inbuf+total, num_bytes-total,
-				      pos+total);
-			if (done < 0) {
-				ret = -1;
-				error("cannot write data: %d %m", errno);
-				goto out;
-			}
-			total += done;
-		}
-		ret = 0;
-		goto out;
-	}
-
-	ret = decompress(root, inbuf, outbuf, disk_size, &ram_size, compress);
-	if (ret) {
-		mirror_num++;
-		if (mirror_num > num_copies) {
-			ret = -1;
-			goto out;
-		}
-		pr_stderr(LOG_DEFAULT,
-			"trying another mirror due to decompression error\n");
-		goto again;
-	}
-
-	while (total < num_bytes) {
-		done = pwrite(fd, outbuf + offset + total,
-			      num_bytes - total,
-			      pos + total);
-		if (done < 0) {
-			ret = -1;
-			goto out;
-		}
-		total += done;
-	}
-out:
-	free(inbuf);
-	free(outbuf);
-	return ret;
-}
-
 static int set_file_xattrs(struct btrfs_root *root, u64 inode,
 			   int fd, const char *file_name)
 {
@@ -572,6 +462,884 @@ out:
 	return ret;
 }
 
+/*
+ * The data extents are not copied one by one while the files are searched,
+ * they're collected from several files and read in batches sorted by the
+ * device offset. The reads are done by a pool of threads (-j) or submitted
+ * through io_uring (--io-uring), the data are then decompressed and written
+ * by the threads or by the main thread. The buffers of the extents being
+ * processed are limited, each file stays open until all its extents are
+ * written.
+ *
+ * Data shared by several files (snapshots, reflinks, dedupe) are read only
+ * once. Extents of one batch reading the same data are written from the same
+ * buffer, and the ranges already written are kept in an index so later files
+ * can get them by FICLONERANGE or copy_file_range from the restored file, if
+ * the target filesystem supports that.
+ */
+#define RESTORE_BATCH_SIZE	SZ_256M
+#define RESTORE_MAX_FILES	256
+#define RESTORE_MAX_IN_FLIGHT	SZ_64M
+/* Uncompressed extents are read in pieces of at most this size */
+#define RESTORE_CHUNK_SIZE	SZ_1M
+#define RESTORE_RING_ENTRIES	64
+#define RESTORE_SUBMIT_BATCH	8
+#define RESTORE_MAX_INDEX_SIZE	SZ_128M
+
+/* Restored file with ranges in the index, kept until the end */
+struct restore_src {
+	struct list_head list;
+	char path[];
+};
+
+/*
+ * Restored data in the index. Uncompressed data are indexed by their logical
+ * address with objectid 0, compressed by the offset in the decompressed
+ * extent with the extent bytenr as the objectid.
+ */
+struct restore_range {
+	struct cache_extent cache;
+	struct restore_src *src;
+	u64 pos;
+};
+
+struct restore_file {
+	struct list_head list;
+	struct btrfs_root *root;
+	u64 ino;
+	int fd;
+	/* Extents not written yet, +1 while the file extents are searched */
+	int refs;
+	int ret;
+	u64 size;
+	struct restore_src *src;
+	bool times_ok;
+	struct timespec times[2];
+	char path[];
+};
+
+struct restore_extent {
+	struct list_head list;
+	struct btrfs_work work;
+	struct restore_file *file;
+	/* Logical address and length of the data read from disk */
+	u64 bytenr;
+	u64 disk_size;
+	/* Decompressed size and the offset of the written data in it */
+	u64 ram_size;
+	u64 offset;
+	u64 num_bytes;
+	u64 pos;
+	int compress;
+	/* First copy of the data, used for sorting and reads by io_uring */
+	int fd;
+	u64 physical;
+	bool one_stripe;
+	/* The first copy was read by io_uring */
+	bool read_done;
+	char *inbuf;
+	/* Accounted size of the buffers */
+	u64 mem;
+	/* Extents of the batch with the same data, written after this one */
+	struct list_head followers;
+	int nr_followers;
+	int ret;
+	/* Restored file in the index with the same data */
+	struct restore_src *clone_src;
+	u64 clone_pos;
+};
+
+struct restore_engine {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_workqueue *wq;
+	struct btrfs_io_uring ring;
+	bool use_uring;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Open files with extents not written yet */
+	struct list_head files;
+	int nr_files;
+	/* Files with all extents written, finished by the main thread */
+	struct list_head done_files;
+	/* Extents collected for the next batch */
+	struct list_head pending;
+	u64 pending_size;
+	/* Buffers of the extents being read, decompressed or written */
+	u64 in_flight;
+	u64 max_in_flight;
+	int nr_running;
+	/* Error of a file that stops the restore, without -i */
+	int ret;
+	/* Restored ranges that can be shared */
+	struct cache_tree index;
+	struct list_head srcs;
+	u64 index_size;
+	u64 max_index_size;
+	bool no_clone;
+	bool no_copy_range;
+	/* Progress */
+	time_t start;
+	time_t last_print;
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 bytes_shared;
+	u64 nr_files_done;
+};
+
+static struct restore_engine engine;
+
+static void restore_print_progress(bool done)
+{
+	u64 bytes_read = __atomic_load_n(&engine.bytes_read, __ATOMIC_RELAXED);
+	u64 written = __atomic_load_n(&engine.bytes_written, __ATOMIC_RELAXED);
+	u64 shared = __atomic_load_n(&engine.bytes_shared, __ATOMIC_RELAXED);
+	time_t now = time(NULL);
+	time_t elapsed = now - engine.start;
+	u64 rate = elapsed ? bytes_read / elapsed : 0;
+
+	if (!show_progress || (!done && now == engine.last_print))
+		return;
+	engine.last_print = now;
+	printf("\rRestored: %llu files, read %s", engine.nr_files_done,
+	       pretty_size(bytes_read));
+	printf(", written %s", pretty_size(written));
+	if (shared)
+		printf(", shared %s", pretty_size(shared));
+	if (rate)
+		printf(", %s/s", pretty_size(rate));
+	if (done)
+		printf(", done in %ld:%02ld:%02ld", elapsed / 3600,
+		       elapsed / 60 % 60, elapsed % 60);
+	/* clear chars if exist in tail */
+	printf("                ");
+	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+	fflush(stdout);
+}
+
+static int write_extent_data(int fd, const char *buf, u64 len, u64 pos)
+{
+	ssize_t done;
+	u64 total = 0;
+
+	while (total < len) {
+		done = pwrite(fd, buf + total, len - total, pos + total);
+		if (done < 0) {
+			error("cannot write data: %d %m", errno);
+			return -1;
+		}
+		total += done;
+	}
+	__atomic_add_fetch(&engine.bytes_written, len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int read_extent_data(char *buf, u64 bytenr, u64 len, int mirror)
+{
+	u64 cur = 0;
+	u64 length;
+	int ret;
+
+	while (cur < len) {
+		length = len - cur;
+		ret = read_data_from_disk(engine.fs_info, buf + cur, bytenr + cur,
+					  &length, mirror);
+		if (ret < 0)
+			return ret;
+		cur += length;
+	}
+	return 0;
+}
+
+/*
+ * Share the data of @ext from @src_pos of @src_fd, by a reflink or at least
+ * by a copy in the kernel. Return 0 if the whole range was shared, otherwise
+ * the data must be written.
+ */
+static int restore_share(struct restore_extent *ext, int src_fd, u64 src_pos)
+{
+	struct file_clone_range range;
+	struct stat st;
+	loff_t off_in = src_pos;
+	loff_t off_out = ext->pos;
+	u64 len = ext->num_bytes;
+	u64 left;
+	ssize_t ret;
+
+	/*
+	 * The source file could be truncated in the middle of the range, the
+	 * rest is enough if it's past the end of the restored file too.
+	 */
+	if (fstat(src_fd, &st) < 0)
+		return -errno;
+	if (src_pos + len > st.st_size) {
+		if (src_pos >= st.st_size ||
+		    ext->pos + st.st_size - src_pos < ext->file->size)
+			return -EINVAL;
+		len = st.st_size - src_pos;
+	}
+	left = len;
+
+	if (!__atomic_load_n(&engine.no_clone, __ATOMIC_RELAXED)) {
+		range.src_fd = src_fd;
+		range.src_offset = src_pos;
+		range.src_length = len;
+		range.dest_offset = ext->pos;
+		if (ioctl(ext->file->fd, FICLONERANGE, &range) == 0)
+			goto shared;
+		/* Other errors are for the range, eg. unaligned end of file */
+		if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+			__atomic_store_n(&engine.no_clone, true,
+					 __ATOMIC_RELAXED);
+	}
+	if (__atomic_load_n(&engine.no_copy_range, __ATOMIC_RELAXED))
+		return -EOPNOTSUPP;
+	while (left) {
+		ret = copy_file_range(src_fd, &off_in, ext->file->fd, &off_out,
+				      left, 0);
+		if (ret < 0 && (errno == ENOSYS || errno == EOPNOTSUPP ||
+				errno == EXDEV))
+			__atomic_store_n(&engine.no_copy_range, true,
+					 __ATOMIC_RELAXED);
+		/* Short copy at the end of the source file */
+		if (ret <= 0)
+			return -EIO;
+		left -= ret;
+	}
+shared:
+	__atomic_add_fetch(&engine.bytes_shared, len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Share the data of @ext from a file restored earlier */
+static int restore_clone_indexed(struct restore_extent *ext)
+{
+	int fd;
+	int ret;
+
+	fd = open(ext->clone_src->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = restore_share(ext, fd, ext->clone_pos);
+	close(fd);
+	return ret;
+}
+
+static void restore_index_key(const struct restore_extent *ext, u64 *objectid,
+			      u64 *start)
+{
+	if (ext->compress == BTRFS_COMPRESS_NONE) {
+		*objectid = 0;
+		*start = ext->bytenr;
+	} else {
+		*objectid = ext->bytenr;
+		*start = ext->offset;
+	}
+}
+
+/* Add the written data of @ext to the index, if it's not full */
+static void restore_index_extent(struct restore_extent *ext)
+{
+	struct restore_file *file = ext->file;
+	struct restore_range *range;
+	struct restore_src *src;
+	u64 size = sizeof(*range);
+
+	range = malloc(sizeof(*range));
+	if (!range)
+		return;
+	restore_index_key(ext, &range->cache.objectid, &range->cache.start);
+	range->cache.size = ext->num_bytes;
+	range->pos = ext->pos;
+
+	pthread_mutex_lock(&engine.lock);
+	if (!file->src)
+		size += sizeof(*src) + strlen(file->path) + 1;
+	if (engine.index_size + size > engine.max_index_size)
+		goto fail;
+	if (!file->src) {
+		src = malloc(sizeof(*src) + strlen(file->path) + 1);
+		if (!src)
+			goto fail;
+		strcpy(src->path, file->path);
+		list_add_tail(&src->list, &engine.srcs);
+		file->src = src;
+	}
+	range->src = file->src;
+	/* Overlapping data are already in the index */
+	if (insert_cache_extent2(&engine.index, &range->cache)) {
+		size -= sizeof(*range);
+		free(range);
+	}
+	engine.index_size += size;
+	btrfs_mem_charge(BTRFS_MEM_RESTORE, size);
+	pthread_mutex_unlock(&engine.lock);
+	return;
+
+fail:
+	pthread_mutex_unlock(&engine.lock);
+	free(range);
+}
+
+/* Find a restored range with the data of @ext */
+static void restore_lookup_index(struct restore_extent *ext)
+{
+	struct restore_range *range;
+	struct cache_extent *cache;
+	u64 objectid;
+	u64 start;
+
+	restore_index_key(ext, &objectid, &start);
+	pthread_mutex_lock(&engine.lock);
+	cache = lookup_cache_extent2(&engine.index, objectid, start,
+				     ext->num_bytes);
+	if (cache && cache->start <= start &&
+	    start + ext->num_bytes <= cache->start + cache->size) {
+		range = container_of(cache, struct restore_range, cache);
+		ext->clone_src = range->src;
+		ext->clone_pos = range->pos + start - cache->start;
+	}
+	pthread_mutex_unlock(&engine.lock);
+}
+
+/* Write the data of @ext read for @leader, or share them from its file */
+static int restore_follower(struct restore_extent *leader,
+			    struct restore_extent *ext, const char *data)
+{
+	if (ext->offset >= leader->offset &&
+	    ext->offset + ext->num_bytes <= leader->offset + leader->num_bytes &&
+	    restore_share(ext, leader->file->fd,
+			  leader->pos + ext->offset - leader->offset) == 0)
+		return 0;
+	return write_extent_data(ext->file->fd, data + ext->offset,
+				 ext->num_bytes, ext->pos);
+}
+
+/*
+ * Read, decompress and write the extent and its followers, the other copies
+ * are tried if the data can't be read or decompressed.
+ */
+static int restore_one_extent(struct restore_extent *ext)
+{
+	struct restore_extent *follower;
+	char *outbuf = NULL;
+	char *data;
+	u64 ram_size;
+	int mirror = 1;
+	int num_copies;
+	int ret;
+
+	if (ext->clone_src && restore_clone_indexed(ext) == 0)
+		return 0;
+
+	if (!ext->inbuf) {
+		ext->inbuf = malloc(ext->disk_size);
+		if (!ext->inbuf) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+	}
+	if (ext->compress != BTRFS_COMPRESS_NONE) {
+		outbuf = calloc(1, ext->ram_size);
+		if (!outbuf) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+	}
+
+	num_copies = btrfs_num_copies(engine.fs_info, ext->bytenr,
+				      ext->disk_size);
+again:
+	while (!ext->read_done) {
+		ret = read_extent_data(ext->inbuf, ext->bytenr, ext->disk_size,
+				       mirror);
+		if (ret == 0)
+			break;
+		mirror++;
+		if (mirror > num_copies) {
+			ret = -1;
+			error("exhausted mirrors trying to read (%d > %d)",
+				mirror, num_copies);
+			goto out;
+		}
+		pr_stderr(LOG_DEFAULT, "trying another mirror\n");
+	}
+	ext->read_done = false;
+	__atomic_add_fetch(&engine.bytes_read, ext->disk_size, __ATOMIC_RELAXED);
+
+	if (ext->compress == BTRFS_COMPRESS_NONE) {
+		data = ext->inbuf;
+	} else {
+		ram_size = ext->ram_size;
+		ret = decompress(ext->file->root, ext->inbuf, outbuf,
+				 ext->disk_size, &ram_size, ext->compress);
+		if (ret) {
+			mirror++;
+			if (mirror > num_copies) {
+				ret = -1;
+				goto out;
+			}
+			pr_stderr(LOG_DEFAULT,
+			"trying another mirror due to decompression error\n");
+			goto again;
+		}
+		data = outbuf;
+	}
+
+	ret = write_extent_data(ext->file->fd, data + ext->offset,
+				ext->num_bytes, ext->pos);
+	if (ret)
+		goto out;
+	restore_index_extent(ext);
+	list_for_each_entry(follower, &ext->followers, list)
+		follower->ret = restore_follower(ext, follower, data);
+out:
+	free(outbuf);
+	return ret;
+}
+
+static u64 restore_extent_mem(const struct restore_extent *ext)
+{
+	if (ext->compress == BTRFS_COMPRESS_NONE)
+		return ext->disk_size;
+	return ext->disk_size + ext->ram_size;
+}
+
+static void restore_extent_done(struct restore_extent *ext, int ret)
+{
+	struct restore_file *file = ext->file;
+
+	free(ext->inbuf);
+	btrfs_mem_uncharge(BTRFS_MEM_RESTORE, ext->mem);
+
+	pthread_mutex_lock(&engine.lock);
+	if (ret && !file->ret)
+		file->ret = ret;
+	if (--file->refs == 0)
+		list_move_tail(&file->list, &engine.done_files);
+	engine.in_flight -= ext->mem;
+	engine.nr_running--;
+	pthread_cond_broadcast(&engine.cond);
+	pthread_mutex_unlock(&engine.lock);
+	free(ext);
+}
+
+static void restore_extent_work_fn(struct btrfs_work *work)
+{
+	struct restore_extent *ext = container_of(work, struct restore_extent,
+						  work);
+	struct restore_extent *follower;
+	struct restore_extent *tmp;
+	int ret;
+
+	ret = restore_one_extent(ext);
+	list_for_each_entry_safe(follower, tmp, &ext->followers, list) {
+		list_del(&follower->list);
+		restore_extent_done(follower, ret ? ret : follower->ret);
+	}
+	restore_extent_done(ext, ret);
+}
+
+static void restore_dispatch_extent(struct restore_extent *ext)
+{
+	if (engine.wq)
+		btrfs_queue_work(engine.wq, &ext->work);
+	else
+		restore_extent_work_fn(&ext->work);
+}
+
+/* Submit the queued reads and pass the finished ones on */
+static void restore_reap(bool wait)
+{
+	struct restore_extent *ext;
+	u64 user_data;
+	int res;
+
+	if (engine.ring.to_submit)
+		btrfs_io_uring_submit(&engine.ring, 0);
+	while (btrfs_io_uring_reap(&engine.ring, &user_data, &res, wait) > 0) {
+		ext = (struct restore_extent *)(uintptr_t)user_data;
+		/* Errors and short reads are retried with all the copies */
+		ext->read_done = (res == ext->disk_size);
+		restore_dispatch_extent(ext);
+		wait = false;
+	}
+}
+
+/*
+ * Wait until @size more bytes of buffers fit into the limit, or until all
+ * extents are written if @size is 0.
+ */
+static void restore_wait(u64 size)
+{
+	struct timespec deadline;
+
+	pthread_mutex_lock(&engine.lock);
+	while (size ? (engine.in_flight &&
+		       engine.in_flight + size > engine.max_in_flight) :
+		      engine.nr_running) {
+		pthread_mutex_unlock(&engine.lock);
+		restore_print_progress(false);
+		if (engine.use_uring &&
+		    (engine.ring.inflight || engine.ring.to_submit)) {
+			restore_reap(true);
+			pthread_mutex_lock(&engine.lock);
+			continue;
+		}
+		pthread_mutex_lock(&engine.lock);
+		if (!engine.nr_running)
+			break;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		pthread_cond_timedwait(&engine.cond, &engine.lock, &deadline);
+	}
+	pthread_mutex_unlock(&engine.lock);
+}
+
+static void restore_submit_extent(struct restore_extent *ext)
+{
+	int ret;
+
+	ext->mem = restore_extent_mem(ext);
+	restore_wait(ext->mem);
+	pthread_mutex_lock(&engine.lock);
+	engine.in_flight += ext->mem;
+	engine.nr_running += 1 + ext->nr_followers;
+	pthread_mutex_unlock(&engine.lock);
+	btrfs_mem_charge(BTRFS_MEM_RESTORE, ext->mem);
+
+	if (engine.use_uring && ext->one_stripe && !ext->clone_src) {
+		ext->inbuf = malloc(ext->disk_size);
+		if (!ext->inbuf) {
+			/* Retried by the worker */
+			restore_dispatch_extent(ext);
+			return;
+		}
+		while (btrfs_io_uring_full(&engine.ring))
+			restore_reap(true);
+		ret = btrfs_io_uring_queue_rw(&engine.ring, READ, ext->fd,
+					      ext->inbuf, ext->disk_size,
+					      ext->physical, (uintptr_t)ext);
+		if (ret == 0) {
+			if (engine.ring.to_submit >= RESTORE_SUBMIT_BATCH)
+				restore_reap(false);
+			return;
+		}
+	}
+	restore_dispatch_extent(ext);
+}
+
+/* Finish the files that have all extents written, in the main thread */
+static void restore_finish_files(void)
+{
+	struct restore_file *file;
+	LIST_HEAD(done);
+	int ret;
+
+	pthread_mutex_lock(&engine.lock);
+	list_splice_init(&engine.done_files, &done);
+	pthread_mutex_unlock(&engine.lock);
+
+	while (!list_empty(&done)) {
+		file = list_first_entry(&done, struct restore_file, list);
+		list_del(&file->list);
+
+		ret = file->ret;
+		if (!ret && file->size)
+			ret = ftruncate(file->fd, (loff_t)file->size);
+		if (!ret && get_xattrs)
+			ret = set_file_xattrs(file->root, file->ino, file->fd,
+					      file->path);
+		if (!ret && restore_metadata && file->times_ok)
+			ret = futimens(file->fd, file->times);
+		close(file->fd);
+		if (ret) {
+			error("copying data for %s failed", file->path);
+			if (!ignore_errors && !engine.ret)
+				engine.ret = ret;
+		}
+		engine.nr_files--;
+		engine.nr_files_done++;
+		free(file);
+	}
+}
+
+static int cmp_restore_extent(void *priv, struct list_head *a,
+			      struct list_head *b)
+{
+	struct restore_extent *ea = list_entry(a, struct restore_extent, list);
+	struct restore_extent *eb = list_entry(b, struct restore_extent, list);
+
+	if (ea->fd != eb->fd)
+		return ea->fd < eb->fd ? -1 : 1;
+	if (ea->physical < eb->physical)
+		return -1;
+	if (ea->physical > eb->physical)
+		return 1;
+	return 0;
+}
+
+/* Read and write all the collected extents in the device offset order */
+static void restore_flush(void)
+{
+	struct restore_extent *ext;
+	struct restore_extent *next;
+
+	list_sort(NULL, &engine.pending, cmp_restore_extent);
+	while (!list_empty(&engine.pending)) {
+		ext = list_first_entry(&engine.pending, struct restore_extent,
+				       list);
+		list_del_init(&ext->list);
+		/* The extents with the same data are sorted next to each other */
+		while (!list_empty(&engine.pending) && !ext->clone_src) {
+			next = list_first_entry(&engine.pending,
+						struct restore_extent, list);
+			if (next->clone_src || next->bytenr != ext->bytenr ||
+			    next->disk_size != ext->disk_size ||
+			    next->compress != ext->compress)
+				break;
+			list_move_tail(&next->list, &ext->followers);
+			ext->nr_followers++;
+		}
+		restore_submit_extent(ext);
+	}
+	engine.pending_size = 0;
+	restore_wait(0);
+	restore_finish_files();
+	restore_print_progress(false);
+}
+
+/*
+ * Allocate an extent reading @len bytes at @bytenr, with @split the length
+ * is cut at the end of the first stripe.
+ */
+static struct restore_extent *restore_alloc_extent(struct restore_file *file,
+						   u64 bytenr, u64 len,
+						   u64 pos, bool split)
+{
+	struct restore_extent *ext;
+	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_device *device;
+	u64 map_len = len;
+
+	ext = calloc(1, sizeof(*ext));
+	if (!ext) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	ext->file = file;
+	ext->bytenr = bytenr;
+	ext->disk_size = len;
+	ext->num_bytes = len;
+	ext->pos = pos;
+	ext->compress = BTRFS_COMPRESS_NONE;
+	ext->fd = -1;
+	ext->physical = bytenr;
+	INIT_LIST_HEAD(&ext->list);
+	INIT_LIST_HEAD(&ext->followers);
+	btrfs_init_work(&ext->work, restore_extent_work_fn);
+
+	if (btrfs_map_block(engine.fs_info, READ, bytenr, &map_len, &multi, 1,
+			    NULL))
+		return ext;
+	device = multi->stripes[0].dev;
+	if (device->fd > 0) {
+		ext->fd = device->fd;
+		ext->physical = multi->stripes[0].physical;
+		if (split && map_len < len) {
+			ext->disk_size = map_len;
+			ext->num_bytes = map_len;
+		}
+		ext->one_stripe = (map_len >= ext->disk_size);
+	}
+	kfree(multi);
+	return ext;
+}
+
+static void restore_add_pending(struct restore_extent *ext)
+{
+	restore_lookup_index(ext);
+	pthread_mutex_lock(&engine.lock);
+	ext->file->refs++;
+	pthread_mutex_unlock(&engine.lock);
+	list_add_tail(&ext->list, &engine.pending);
+	engine.pending_size += ext->disk_size;
+}
+
+/* Queue the regular file extent at @pos to be read in the next batch */
+static int restore_add_extent(struct restore_file *file,
+			      struct extent_buffer *leaf,
+			      struct btrfs_file_extent_item *fi, u64 pos)
+{
+	struct restore_extent *ext;
+	u64 bytenr;
+	u64 ram_size;
+	u64 disk_size;
+	u64 num_bytes;
+	u64 offset;
+	u64 len;
+	u64 cur;
+	int compress;
+
+	compress = btrfs_file_extent_compression(leaf, fi);
+	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
+	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+	offset = btrfs_file_extent_offset(leaf, fi);
+	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+	/* Hole, early exit */
+	if (disk_size == 0)
+		return 0;
+
+	/* Invalid file extent */
+	if ((compress == BTRFS_COMPRESS_NONE && offset >= disk_size) ||
+	    offset > ram_size) {
+		error(
+	"invalid data extent offset, offset %llu disk_size %llu ram_size %llu",
+		      offset, disk_size, ram_size);
+		return -EUCLEAN;
+	}
+
+	pr_verbose(offset ? 1 : 0, "offset is %llu\n", offset);
+
+	if (compress != BTRFS_COMPRESS_NONE) {
+		ext = restore_alloc_extent(file, bytenr, disk_size, pos, false);
+		if (!ext)
+			return -ENOMEM;
+		ext->ram_size = ram_size;
+		ext->offset = offset;
+		ext->num_bytes = num_bytes;
+		ext->compress = compress;
+		restore_add_pending(ext);
+		return 0;
+	}
+
+	/* Only the referenced part of the extent is read */
+	len = min(num_bytes, disk_size - offset);
+	for (cur = 0; cur < len; cur += ext->disk_size) {
+		ext = restore_alloc_extent(file, bytenr + offset + cur,
+				min_t(u64, len - cur, RESTORE_CHUNK_SIZE),
+				pos + cur, true);
+		if (!ext)
+			return -ENOMEM;
+		restore_add_pending(ext);
+	}
+	return 0;
+}
+
+static void restore_engine_init(struct btrfs_fs_info *fs_info)
+{
+	engine.fs_info = fs_info;
+	pthread_mutex_init(&engine.lock, NULL);
+	pthread_cond_init(&engine.cond, NULL);
+	INIT_LIST_HEAD(&engine.files);
+	INIT_LIST_HEAD(&engine.done_files);
+	INIT_LIST_HEAD(&engine.pending);
+	INIT_LIST_HEAD(&engine.srcs);
+	cache_tree_init(&engine.index);
+	engine.max_in_flight = RESTORE_MAX_IN_FLIGHT;
+	engine.max_index_size = RESTORE_MAX_INDEX_SIZE;
+	if (btrfs_mem_get_limit()) {
+		engine.max_in_flight = min_t(u64, engine.max_in_flight,
+					     btrfs_mem_get_limit() / 4);
+		engine.max_index_size = min_t(u64, engine.max_index_size,
+					      btrfs_mem_get_limit() / 8);
+	}
+	engine.start = time(NULL);
+	engine.last_print = engine.start;
+
+	if (nr_threads != 1) {
+		engine.wq = btrfs_alloc_workqueue(nr_threads);
+		if (!engine.wq)
+			warning("cannot start threads, restoring data serially");
+	}
+	if (use_uring) {
+		int ret;
+
+		/* Zoned devices may need aligned direct IO */
+		if (btrfs_is_zoned(fs_info))
+			ret = -EOPNOTSUPP;
+		else
+			ret = btrfs_io_uring_init(&engine.ring,
+						  RESTORE_RING_ENTRIES);
+		if (ret < 0) {
+			errno = -ret;
+			warning("cannot use io_uring, reading synchronously: %m");
+		} else {
+			engine.use_uring = true;
+		}
+	}
+}
+
+/*
+ * Make the range of an overwritten file read as zeros, the holes are just
+ * skipped in new files.
+ */
+static int restore_punch_hole(int fd, u64 start, u64 len)
+{
+	static const char zeros[SZ_64K];
+	struct stat st;
+	ssize_t done;
+	u64 end;
+	int ret;
+
+	ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+			len);
+	if (ret == 0)
+		return 0;
+	if (errno != EOPNOTSUPP) {
+		ret = -errno;
+		error("cannot punch hole: %m");
+		return ret;
+	}
+
+	/* Only the old data before the end of file need to be zeroed */
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		error("cannot stat file: %m");
+		return ret;
+	}
+	end = min_t(u64, start + len, st.st_size);
+	while (start < end) {
+		done = pwrite(fd, zeros, min_t(u64, end - start, sizeof(zeros)),
+			      start);
+		if (done < 0) {
+			error("cannot write data: %d %m", errno);
+			return -1;
+		}
+		start += done;
+	}
+	return 0;
+}
+
+static void free_restore_range(struct cache_extent *cache)
+{
+	free(container_of(cache, struct restore_range, cache));
+}
+
+/* Write the remaining extents, return the error that stopped the restore */
+static int restore_engine_exit(void)
+{
+	struct restore_src *src;
+
+	restore_flush();
+	if (engine.wq)
+		btrfs_destroy_workqueue(engine.wq);
+	if (engine.use_uring)
+		btrfs_io_uring_exit(&engine.ring);
+	cache_tree_free_extents(&engine.index, free_restore_range);
+	while (!list_empty(&engine.srcs)) {
+		src = list_first_entry(&engine.srcs, struct restore_src, list);
+		list_del(&src->list);
+		free(src);
+	}
+	btrfs_mem_uncharge(BTRFS_MEM_RESTORE, engine.index_size);
+	if (show_progress) {
+		restore_print_progress(true);
+		printf("\n");
+	}
+	return engine.ret;
+}
+
 static int copy_metadata(struct btrfs_root *root, int fd,
 		struct btrfs_key *key)
 {
@@ -620,8 +1388,14 @@ out:
 	return ret;
 }
 
+/*
+ * Copy the data of the inode at @key to @fd, the regular extents are only
+ * queued and @fd is closed once they're all written. With @punch_holes the
+ * file existed before and the holes are punched. Return the error that stops
+ * the restore, the errors of the file itself are printed when it's finished.
+ */
 static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
-		     const char *file)
+		     const char *file, bool punch_holes)
 {
 	struct extent_buffer *leaf;
 	struct btrfs_path path;
@@ -629,19 +1403,41 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	struct btrfs_inode_item *inode_item;
 	struct btrfs_timespec *bts;
 	struct btrfs_key found_key;
+	struct restore_file *rfile;
+	u64 hole_start = 0;
 	int ret;
 	int extent_type;
 	int compression;
-	u64 found_size = 0;
-	struct timespec times[2];
-	bool times_ok = false;
+
+	if (engine.nr_files >= RESTORE_MAX_FILES) {
+		restore_flush();
+		if (engine.ret) {
+			close(fd);
+			return engine.ret;
+		}
+	}
+	rfile = calloc(1, sizeof(*rfile) + strlen(file) + 1);
+	if (!rfile) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		close(fd);
+		return -ENOMEM;
+	}
+	rfile->root = root;
+	rfile->ino = key->objectid;
+	rfile->fd = fd;
+	rfile->refs = 1;
+	strcpy(rfile->path, file);
+	pthread_mutex_lock(&engine.lock);
+	list_add_tail(&rfile->list, &engine.files);
+	pthread_mutex_unlock(&engine.lock);
+	engine.nr_files++;
 
 	btrfs_init_path(&path);
 	ret = btrfs_lookup_inode(NULL, root, &path, key, 0);
 	if (ret == 0) {
 		inode_item = btrfs_item_ptr(path.nodes[0], path.slots[0],
 				    struct btrfs_inode_item);
-		found_size = btrfs_inode_size(path.nodes[0], inode_item);
+		rfile->size = btrfs_inode_size(path.nodes[0], inode_item);
 
 		if (restore_metadata) {
 			/*
@@ -659,13 +1455,13 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 				goto out;
 
 			bts = btrfs_inode_atime(inode_item);
-			times[0].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
-			times[0].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
+			rfile->times[0].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
+			rfile->times[0].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
 
 			bts = btrfs_inode_mtime(inode_item);
-			times[1].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
-			times[1].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
-			times_ok = true;
+			rfile->times[1].tv_sec = btrfs_timespec_sec(path.nodes[0], bts);
+			rfile->times[1].tv_nsec = btrfs_timespec_nsec(path.nodes[0], bts);
+			rfile->times_ok = true;
 		}
 	}
 	btrfs_release_path(&path);
@@ -687,8 +1483,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 			goto out;
 		} else if (ret > 0) {
 			/* No more leaves to search */
-			ret = 0;
-			goto out;
+			goto done;
 		}
 		leaf = path.nodes[0];
 	}
@@ -702,8 +1497,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 					goto out;
 				} else if (ret) {
 					/* No more leaves to search */
-					btrfs_release_path(&path);
-					goto set_size;
+					goto done;
 				}
 				leaf = path.nodes[0];
 			} while (!leaf);
@@ -725,46 +1519,59 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 			goto out;
 		}
 
-		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC)
+		/* Preallocated extents and holes are left as holes */
+		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC ||
+		    (extent_type == BTRFS_FILE_EXTENT_REG &&
+		     btrfs_file_extent_disk_num_bytes(leaf, fi) == 0))
 			goto next;
+		if (punch_holes && found_key.offset > hole_start &&
+		    (extent_type == BTRFS_FILE_EXTENT_INLINE ||
+		     extent_type == BTRFS_FILE_EXTENT_REG)) {
+			ret = restore_punch_hole(fd, hole_start,
+						 found_key.offset - hole_start);
+			if (ret)
+				goto out;
+		}
 		if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
 			ret = copy_one_inline(root, fd, &path, found_key.offset);
 			if (ret)
 				goto out;
+			hole_start = found_key.offset +
+				     btrfs_file_extent_ram_bytes(leaf, fi);
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
-			ret = copy_one_extent(root, fd, leaf, fi,
-					      found_key.offset);
+			ret = restore_add_extent(rfile, leaf, fi,
+						 found_key.offset);
 			if (ret)
 				goto out;
+			hole_start = found_key.offset +
+				     btrfs_file_extent_num_bytes(leaf, fi);
+			if (engine.pending_size >= RESTORE_BATCH_SIZE) {
+				restore_flush();
+				if (engine.ret)
+					goto out;
+			}
 		} else {
 			warning("weird extent type %d", extent_type);
 		}
 next:
 		path.slots[0]++;
 	}
-
-	btrfs_release_path(&path);
-set_size:
-	if (found_size) {
-		ret = ftruncate(fd, (loff_t)found_size);
-		if (ret)
-			return ret;
-	}
-	if (get_xattrs) {
-		ret = set_file_xattrs(root, key->objectid, fd, file);
-		if (ret)
-			return ret;
-	}
-	if (restore_metadata && times_ok) {
-		ret = futimens(fd, times);
-		if (ret)
-			return ret;
-	}
-	return 0;
-
+done:
+	ret = 0;
+	if (punch_holes && rfile->size > hole_start)
+		ret = restore_punch_hole(fd, hole_start,
+					 rfile->size - hole_start);
 out:
 	btrfs_release_path(&path);
-	return ret;
+	pthread_mutex_lock(&engine.lock);
+	if (ret && !rfile->ret)
+		rfile->ret = ret;
+	if (--rfile->refs == 0)
+		list_move_tail(&rfile->list, &engine.done_files);
+	pthread_mutex_unlock(&engine.lock);
+	restore_finish_files();
+	restore_print_progress(false);
+	return engine.ret;
 }
 
 /*
@@ -826,6 +1633,7 @@ static int copy_symlink(struct btrfs_root *root, struct btrfs_key *key,
 	}
 
 	btrfs_init_path(&path);
+	path.reada = READA_FORWARD_ALL;
 	key->type = BTRFS_EXTENT_DATA_KEY;
 	key->offset = 0;
 	ret = btrfs_search_slot(NULL, root, key, &path, 0, 0);
@@ -929,6 +1737,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 	u8 type;
 
 	btrfs_init_path(&path);
+	path.reada = READA_FORWARD_ALL;
 	key->offset = 0;
 	key->type = BTRFS_DIR_INDEX_KEY;
 	ret = btrfs_search_slot(NULL, root, key, &path, 0, 0);
@@ -1008,13 +1817,15 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 		 * Restore directories, files, symlinks and metadata.
 		 */
 		if (type == BTRFS_FT_REG_FILE) {
-			if (!overwrite_ok(path_name))
+			int exists = overwrite_ok(path_name);
+
+			if (!exists)
 				goto next;
 
 			pr_verbose(LOG_INFO, "Restoring %s\n", path_name);
 			if (dry_run)
 				goto next;
-			fd = open(path_name, O_CREAT|O_WRONLY, 0644);
+			fd = open(path_name, O_CREAT|O_RDWR, 0644);
 			if (fd < 0) {
 				error("creating '%s' failed: %m", path_name);
 				if (ignore_errors)
@@ -1022,14 +1833,10 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 				ret = -1;
 				goto out;
 			}
-			ret = copy_file(root, fd, &location, path_name);
-			close(fd);
-			if (ret) {
-				error("copying data for %s failed", path_name);
-				if (ignore_errors)
-					goto next;
+			ret = copy_file(root, fd, &location, path_name,
+					exists == 2);
+			if (ret)
 				goto out;
-			}
 		} else if (type == BTRFS_FT_DIR) {
 			struct btrfs_root *search_root = root;
 			char *dir = strdup(fs_name);
@@ -1336,6 +2143,10 @@ static const char * const cmd_restore_usage[] = {
 	"       -D|--dry-run         dry run (only list files that would be recovered)",
 	"       -i|--ignore-errors   ignore errors",
 	"       -o|--overwrite       overwrite",
+	"       -j N                 decompress and write the file data in N threads,",
+	"                            0 for the number of CPUs, the default is 1",
+	"       --io-uring           read the file data through io_uring with a deep queue",
+	"       --progress           print the progress and throughput of the data copy",
 	"  restoration:",
 	"       -m|--metadata        restore owner, mode and times",
 	"       -S|--symlink         restore symbolic links",
@@ -1392,10 +2203,13 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	optind = 0;
 	while (1) {
 		int opt;
-		enum { GETOPT_VAL_PATH_REGEX = GETOPT_VAL_FIRST };
+		enum { GETOPT_VAL_PATH_REGEX = GETOPT_VAL_FIRST,
+		       GETOPT_VAL_PROGRESS, GETOPT_VAL_IO_URING };
 		static const struct option long_options[] = {
 			{ "path-regex", required_argument, NULL,
 				GETOPT_VAL_PATH_REGEX },
+			{ "progress", no_argument, NULL, GETOPT_VAL_PROGRESS },
+			{ "io-uring", no_argument, NULL, GETOPT_VAL_IO_URING },
 			{ "dry-run", no_argument, NULL, 'D'},
 			{ "metadata", no_argument, NULL, 'm'},
 			{ "symlinks", no_argument, NULL, 'S'},
@@ -1410,7 +2224,7 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			{ NULL, 0, NULL, 0}
 		};
 
-		opt = getopt_long(argc, argv, "sSxviot:u:dmf:r:lDc", long_options,
+		opt = getopt_long(argc, argv, "sSxviot:u:dmf:r:lDcj:", long_options,
 					NULL);
 		if (opt < 0)
 			break;
@@ -1474,6 +2288,16 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			case 'x':
 				get_xattrs = 1;
 				break;
+			case 'j':
+				nr_threads = min_t(u64, arg_strtou64(optarg),
+						   BTRFS_WORKQUEUE_MAX_THREADS);
+				break;
+			case GETOPT_VAL_PROGRESS:
+				show_progress = 1;
+				break;
+			case GETOPT_VAL_IO_URING:
+				use_uring = 1;
+				break;
 			default:
 				usage_unknown_option(cmd, argv);
 		}
@@ -1570,7 +2394,10 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	if (dry_run)
 		printf("This is a dry-run, no files are going to be restored\n");
 
+	restore_engine_init(root->fs_info);
 	ret = search_dir(root, &key, dir_name, "", mreg);
+	if (restore_engine_exit() && !ret)
+		ret = 1;
 
 out:
 	if (mreg)
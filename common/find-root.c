@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2011 Red Hat.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "kernel-lib/sizes.h"
+#include "kernel-lib/bitops.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/volumes.h"
+#include "kernel-shared/extent_io.h"
+#include "common/extent-cache.h"
+#include "common/workqueue.h"
+#include "common/find-root.h"
+
+/*
+ * The metadata block groups are split to segments that are scanned in
+ * parallel, each one is read in large buffers and the tree block headers are
+ * checked in place. Only the blocks passing the filter are checksummed.
+ */
+#define SCAN_SEGMENT_SIZE	SZ_64M
+#define SCAN_BUFFER_SIZE	SZ_4M
+
+struct find_root_segment {
+	struct btrfs_work work;
+	struct find_root_scan *scan;
+	u64 start;
+	u64 len;
+	/* Candidate tree blocks passing the filter, in bytenr order */
+	u64 *blocks;
+	int nr_blocks;
+	int max_blocks;
+	bool done;
+	int ret;
+};
+
+struct find_root_scan {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_find_root_filter *filter;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	struct find_root_segment *segments;
+	int nr_segments;
+	/* Set when the remaining segments need not be scanned */
+	bool stop;
+};
+
+enum {
+	BLOCK_BAD,		/* Not a valid tree block, try the next mirror */
+	BLOCK_FILTERED,		/* Valid block but not matching the filter */
+	BLOCK_FOUND,
+};
+
+void btrfs_find_root_free(struct cache_tree *result)
+{
+	struct btrfs_find_root_gen_cache *gen_cache;
+	struct cache_extent *cache;
+
+	cache = first_cache_extent(result);
+	while (cache) {
+		gen_cache = container_of(cache,
+				struct btrfs_find_root_gen_cache, cache);
+		free_extent_cache_tree(&gen_cache->eb_tree);
+		remove_cache_extent(result, cache);
+		free(gen_cache);
+		cache = first_cache_extent(result);
+	}
+}
+
+/*
+ * Read the candidate tree block at @bytenr found by the scan, all the checks
+ * of read_tree_block() apply so the result is the same as if each block was
+ * read that way.
+ *
+ * Return value is the same as btrfs_find_root_search().
+ */
+static int add_eb_to_result(struct btrfs_fs_info *fs_info, u64 bytenr,
+			    struct cache_tree *result,
+			    struct btrfs_find_root_filter *filter,
+			    struct cache_extent **match)
+{
+	struct extent_buffer *eb;
+	u32 nodesize = fs_info->nodesize;
+	u64 generation;
+	u64 level;
+	u64 owner;
+	u64 start = bytenr;
+	struct cache_extent *cache;
+	struct btrfs_find_root_gen_cache *gen_cache = NULL;
+	int ret = 0;
+
+	eb = read_tree_block(fs_info, bytenr, 0);
+	if (!eb || IS_ERR(eb))
+		return 0;
+	generation = btrfs_header_generation(eb);
+	level = btrfs_header_level(eb);
+	owner = btrfs_header_owner(eb);
+	free_extent_buffer(eb);
+
+	if (owner != filter->objectid || level < filter->level ||
+	    generation < filter->generation)
+		return ret;
+
+	/*
+	 * Get the generation cache or create one
+	 *
+	 * NOTE: search_cache_extent() may return cache that doesn't cover
+	 * the range. So we need an extra check to make sure it's the right one.
+	 */
+	cache = search_cache_extent(result, generation);
+	if (!cache || cache->start != generation) {
+		gen_cache = malloc(sizeof(*gen_cache));
+		BUG_ON(!gen_cache);
+		cache = &gen_cache->cache;
+		cache->start = generation;
+		cache->size = 1;
+		cache->objectid = 0;
+		gen_cache->highest_level = 0;
+		cache_tree_init(&gen_cache->eb_tree);
+
+		ret = insert_cache_extent(result, cache);
+		if (ret < 0)
+			return ret;
+	}
+	gen_cache = container_of(cache, struct btrfs_find_root_gen_cache,
+				 cache);
+
+	/* Higher level, clean tree and insert the new one */
+	if (level > gen_cache->highest_level) {
+		free_extent_cache_tree(&gen_cache->eb_tree);
+		gen_cache->highest_level = level;
+		/* Fall into the insert routine */
+	}
+
+	/* Same level, insert it into the eb_tree */
+	if (level == gen_cache->highest_level) {
+		ret = add_cache_extent(&gen_cache->eb_tree,
+				       start, nodesize);
+		if (ret < 0 && ret != -EEXIST)
+			return ret;
+		ret = 0;
+	}
+	if (generation == filter->match_gen &&
+	    level == filter->match_level &&
+	    !filter->search_all) {
+		ret = 1;
+		if (match)
+			*match = search_cache_extent(&gen_cache->eb_tree,
+						     start);
+	}
+	return ret;
+}
+
+/*
+ * Check the raw tree block data at @data, the header checks are the same as
+ * read_tree_block() does. A header not matching the filter can be damaged and
+ * the block still found in another mirror, so it's trusted only if the
+ * checksum matches. The checksum is skipped if this is the @last_copy.
+ */
+static int check_raw_block(struct btrfs_fs_info *fs_info,
+			   struct btrfs_find_root_filter *filter,
+			   const u8 *data, u64 bytenr, bool last_copy)
+{
+	const struct btrfs_header *header = (const struct btrfs_header *)data;
+	struct btrfs_fs_devices *fs_devices = fs_info->fs_devices;
+	u32 nodesize = fs_info->nodesize;
+	u16 csum_type = fs_info->csum_type;
+	u16 csum_size = fs_info->csum_size;
+	u8 result[BTRFS_CSUM_SIZE];
+	u32 nritems = btrfs_stack_header_nritems(header);
+	u32 max_nritems;
+	bool fsid_match = false;
+	bool filtered;
+
+	if (btrfs_stack_header_bytenr(header) != bytenr)
+		return BLOCK_BAD;
+	if (header->level >= BTRFS_MAX_LEVEL)
+		return BLOCK_BAD;
+	if (header->level == 0)
+		max_nritems = (nodesize - sizeof(struct btrfs_header)) /
+			      sizeof(struct btrfs_item);
+	else
+		max_nritems = (nodesize - sizeof(struct btrfs_header)) /
+			      sizeof(struct btrfs_key_ptr);
+	if (nritems > max_nritems || (nritems == 0 && header->level != 0))
+		return BLOCK_BAD;
+
+	while (fs_devices) {
+		const u8 *fsid = fs_devices->fsid;
+
+		if (fs_devices == fs_info->fs_devices &&
+		    btrfs_fs_incompat(fs_info, METADATA_UUID))
+			fsid = fs_devices->metadata_uuid;
+		fsid_match = !memcmp(header->fsid, fsid, BTRFS_FSID_SIZE);
+		if (fs_info->ignore_fsid_mismatch || fsid_match)
+			break;
+		fs_devices = fs_devices->seed;
+	}
+	if (!fs_devices)
+		return BLOCK_BAD;
+
+	filtered = btrfs_stack_header_owner(header) != filter->objectid ||
+		   header->level < filter->level ||
+		   btrfs_stack_header_generation(header) < filter->generation;
+	if (filtered && last_copy)
+		return BLOCK_FILTERED;
+
+	if (fs_info->force_csum_type != -1) {
+		csum_type = fs_info->force_csum_type;
+		csum_size = btrfs_csum_type_size(csum_type);
+	}
+	btrfs_csum_data(fs_info, csum_type, data + BTRFS_CSUM_SIZE, result,
+			nodesize - BTRFS_CSUM_SIZE);
+	if (memcmp(data, result, csum_size))
+		return BLOCK_BAD;
+	return filtered ? BLOCK_FILTERED : BLOCK_FOUND;
+}
+
+static int read_logical(struct btrfs_fs_info *fs_info, u8 *buf, u64 logical,
+			u64 len, int mirror)
+{
+	u64 done = 0;
+	int ret;
+
+	while (done < len) {
+		u64 read_len = len - done;
+
+		ret = read_data_from_disk(fs_info, buf + done, logical + done,
+					  &read_len, mirror);
+		if (ret < 0)
+			return ret;
+		done += read_len;
+	}
+	return 0;
+}
+
+static int add_segment_block(struct find_root_segment *seg, u64 bytenr)
+{
+	if (seg->nr_blocks == seg->max_blocks) {
+		u64 *tmp;
+		int max = max(seg->max_blocks * 2, 64);
+
+		tmp = realloc(seg->blocks, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		seg->blocks = tmp;
+		seg->max_blocks = max;
+	}
+	seg->blocks[seg->nr_blocks++] = bytenr;
+	return 0;
+}
+
+/*
+ * Scan the blocks of the segment, the mirrors are tried in turn for the
+ * blocks that were not valid in the previous ones like read_tree_block()
+ * does, but each mirror is read by large buffers.
+ */
+static int scan_segment(struct find_root_segment *seg)
+{
+	struct btrfs_fs_info *fs_info = seg->scan->fs_info;
+	struct btrfs_find_root_filter *filter = seg->scan->filter;
+	u32 nodesize = fs_info->nodesize;
+	u64 end = seg->start + seg->len;
+	u64 cur;
+	bool *pending;
+	u8 *buf;
+	int num_copies;
+	int ret = 0;
+
+	buf = malloc(SCAN_BUFFER_SIZE);
+	pending = calloc(SCAN_BUFFER_SIZE / nodesize, sizeof(bool));
+	if (!buf || !pending) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	num_copies = btrfs_num_copies(fs_info, seg->start, seg->len);
+
+	for (cur = seg->start; cur + nodesize <= end;
+	     cur += SCAN_BUFFER_SIZE) {
+		int nr = min_t(u64, SCAN_BUFFER_SIZE, end - cur) / nodesize;
+		int nr_pending = nr;
+		int mirror;
+		int i;
+
+		for (i = 0; i < nr; i++)
+			pending[i] = true;
+
+		for (mirror = 1; mirror <= num_copies && nr_pending; mirror++) {
+			bool bulk_read;
+
+			bulk_read = !read_logical(fs_info, buf, cur,
+						  (u64)nr * nodesize, mirror);
+			for (i = 0; i < nr; i++) {
+				u64 bytenr = cur + (u64)i * nodesize;
+				u8 *data = buf + (size_t)i * nodesize;
+
+				if (!pending[i])
+					continue;
+				/* Retry the blocks one by one if the bulk read failed */
+				if (!bulk_read && read_logical(fs_info, data,
+							bytenr, nodesize, mirror))
+					continue;
+
+				ret = check_raw_block(fs_info, filter, data,
+						      bytenr,
+						      mirror == num_copies);
+				if (ret == BLOCK_BAD)
+					continue;
+				pending[i] = false;
+				nr_pending--;
+				if (ret == BLOCK_FOUND) {
+					ret = add_segment_block(seg, bytenr);
+					if (ret < 0)
+						goto out;
+				}
+			}
+		}
+		ret = 0;
+		if (__atomic_load_n(&seg->scan->stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+out:
+	free(pending);
+	free(buf);
+	return ret;
+}
+
+static void scan_segment_work_fn(struct btrfs_work *work)
+{
+	struct find_root_segment *seg;
+	struct find_root_scan *scan;
+
+	seg = container_of(work, struct find_root_segment, work);
+	scan = seg->scan;
+	if (!__atomic_load_n(&scan->stop, __ATOMIC_ACQUIRE))
+		seg->ret = scan_segment(seg);
+
+	pthread_mutex_lock(&scan->lock);
+	seg->done = true;
+	pthread_cond_broadcast(&scan->done_cond);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static int next_bg(struct btrfs_fs_info *fs_info,
+		   struct btrfs_find_root_filter *filter,
+		   u64 *chunk_offset, u64 *chunk_size)
+{
+	if (filter->objectid != BTRFS_CHUNK_TREE_OBJECTID)
+		return btrfs_next_bg_metadata(fs_info, chunk_offset, chunk_size);
+	return btrfs_next_bg_system(fs_info, chunk_offset, chunk_size);
+}
+
+/*
+ * Split the block groups to be searched to segments, return the number of
+ * segments or <0 if error happens.
+ */
+static int init_segments(struct find_root_scan *scan)
+{
+	u64 chunk_offset = 0;
+	u64 chunk_size = 0;
+	u64 offset;
+	int nr = 0;
+	int ret;
+
+	while (1) {
+		ret = next_bg(scan->fs_info, scan->filter, &chunk_offset,
+			      &chunk_size);
+		if (ret == -ENOENT)
+			break;
+		if (ret < 0)
+			return ret;
+		nr += DIV_ROUND_UP(chunk_size, SCAN_SEGMENT_SIZE);
+	}
+	if (!nr)
+		return 0;
+
+	scan->segments = calloc(nr, sizeof(struct find_root_segment));
+	if (!scan->segments)
+		return -ENOMEM;
+
+	nr = 0;
+	chunk_offset = 0;
+	while (next_bg(scan->fs_info, scan->filter, &chunk_offset,
+		       &chunk_size) == 0) {
+		for (offset = chunk_offset; offset < chunk_offset + chunk_size;
+		     offset += SCAN_SEGMENT_SIZE) {
+			struct find_root_segment *seg = &scan->segments[nr++];
+
+			seg->scan = scan;
+			seg->start = offset;
+			seg->len = min_t(u64, SCAN_SEGMENT_SIZE,
+					 chunk_offset + chunk_size - offset);
+			btrfs_init_work(&seg->work, scan_segment_work_fn);
+		}
+	}
+	return nr;
+}
+
+/*
+ * Return 0 if iterating all the metadata extents.
+ * Return 1 if found root with given gen/level and set *match to it.
+ * Return <0 if error happens
+ */
+int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
+			   struct btrfs_find_root_filter *filter,
+			   struct cache_tree *result,
+			   struct cache_extent **match)
+{
+	struct find_root_scan scan = {
+		.fs_info = fs_info,
+		.filter = filter,
+	};
+	struct btrfs_workqueue *wq = NULL;
+	int suppress_errors;
+	int nr_segments;
+	int ret = 0;
+	int i;
+	int j;
+
+	suppress_errors = fs_info->suppress_check_block_errors;
+	fs_info->suppress_check_block_errors = 1;
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.done_cond, NULL);
+
+	nr_segments = init_segments(&scan);
+	if (nr_segments <= 0) {
+		ret = nr_segments;
+		goto out;
+	}
+	scan.nr_segments = nr_segments;
+
+	wq = btrfs_alloc_workqueue(filter->nr_threads);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nr_segments; i++)
+		btrfs_queue_work(wq, &scan.segments[i].work);
+
+	/* Add the found blocks in the bytenr order, same as a sequential scan */
+	for (i = 0; i < nr_segments && !ret; i++) {
+		struct find_root_segment *seg = &scan.segments[i];
+
+		pthread_mutex_lock(&scan.lock);
+		while (!seg->done)
+			pthread_cond_wait(&scan.done_cond, &scan.lock);
+		pthread_mutex_unlock(&scan.lock);
+
+		ret = seg->ret;
+		for (j = 0; j < seg->nr_blocks && !ret; j++)
+			ret = add_eb_to_result(fs_info, seg->blocks[j],
+					       result, filter, match);
+		if (ret)
+			__atomic_store_n(&scan.stop, true, __ATOMIC_RELEASE);
+	}
+	btrfs_flush_workqueue(wq);
+
+out:
+	if (wq)
+		btrfs_destroy_workqueue(wq);
+	for (i = 0; i < scan.nr_segments; i++)
+		free(scan.segments[i].blocks);
+	free(scan.segments);
+	pthread_cond_destroy(&scan.done_cond);
+	pthread_mutex_destroy(&scan.lock);
+	fs_info->suppress_check_block_errors = suppress_errors;
+	return ret;
+}
@@ -0,0 +1,295 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#include "kerncompat.h"
+#include "common/io-uring.h"
+#include "common/internal.h"
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+
+static inline unsigned int load_acquire(unsigned int *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned int *p, unsigned int v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static void unmap_rings(struct btrfs_io_uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+	    ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+/*
+ * Set up a ring with at least @entries submission slots.
+ *
+ * Return 0 on success, or -errno if io_uring is not usable (old kernel,
+ * disabled by policy or seccomp), in which case the caller should fall back
+ * to synchronous IO.
+ */
+int btrfs_io_uring_init(struct btrfs_io_uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		ret = -errno;
+		ring->fd = -1;
+		return ret;
+	}
+
+	/* IORING_OP_READ/WRITE appeared together with this feature (v5.6) */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		ret = -EOPNOTSUPP;
+		goto out_close;
+	}
+
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size =
+			max(ring->sq_ring_size, ring->cq_ring_size);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ret = -errno;
+		goto out_close;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ret = -errno;
+			goto out_close;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_close:
+	unmap_rings(ring);
+	close(ring->fd);
+	ring->fd = -1;
+	return ret;
+}
+
+void btrfs_io_uring_exit(struct btrfs_io_uring *ring)
+{
+	int res;
+	u64 user_data;
+
+	if (ring->fd < 0)
+		return;
+	/* The buffers may be freed by the caller right after, drain first */
+	btrfs_io_uring_submit(ring, 0);
+	while (ring->inflight &&
+	       btrfs_io_uring_reap(ring, &user_data, &res, true) > 0)
+		;
+	unmap_rings(ring);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * Queue a read (@rw == READ) or write of @len bytes at @offset of @fd. The
+ * request is not passed to the kernel until btrfs_io_uring_submit().
+ *
+ * Return -EBUSY if the ring is full and completions must be reaped first.
+ */
+int btrfs_io_uring_queue_rw(struct btrfs_io_uring *ring, int rw, int fd,
+			    void *buf, u32 len, u64 offset, u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	unsigned int index;
+
+	if (btrfs_io_uring_full(ring))
+		return -EBUSY;
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = (struct io_uring_sqe *)ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (rw == WRITE) ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	store_release(ring->sq_tail, tail + 1);
+	ring->to_submit++;
+	return 0;
+}
+
+/*
+ * Take back the last queued request that has not been submitted, eg. after a
+ * failed submit, so its buffer is not used by a later submit.
+ *
+ * Return true and fill @user_data if there was such request.
+ */
+bool btrfs_io_uring_unqueue(struct btrfs_io_uring *ring, u64 *user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+
+	if (!ring->to_submit)
+		return false;
+	tail = *ring->sq_tail - 1;
+	sqe = (struct io_uring_sqe *)ring->sqes + (tail & *ring->sq_mask);
+	*user_data = sqe->user_data;
+	store_release(ring->sq_tail, tail);
+	ring->to_submit--;
+	return true;
+}
+
+/*
+ * Pass all queued requests to the kernel and optionally wait until at least
+ * @wait_nr requests have completed.
+ *
+ * Return the number of submitted requests or -errno.
+ */
+int btrfs_io_uring_submit(struct btrfs_io_uring *ring, unsigned int wait_nr)
+{
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int submitted = 0;
+	int ret;
+
+	while (ring->to_submit || wait_nr) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+			      wait_nr, flags, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ring->to_submit -= ret;
+		ring->inflight += ret;
+		submitted += ret;
+		break;
+	}
+	return submitted;
+}
+
+/*
+ * Fetch one completion, waiting for it if @wait is true.
+ *
+ * Return 1 and fill @user_data and @res (bytes transferred or -errno) if a
+ * completion was found, 0 if there is none, or -errno.
+ */
+int btrfs_io_uring_reap(struct btrfs_io_uring *ring, u64 *user_data, int *res,
+			bool wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int ret;
+
+	while (1) {
+		head = *ring->cq_head;
+		if (head != load_acquire(ring->cq_tail))
+			break;
+		if (!wait || !ring->inflight)
+			return 0;
+		ret = btrfs_io_uring_submit(ring, 1);
+		if (ret < 0)
+			return ret;
+	}
+	cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	store_release(ring->cq_head, head + 1);
+	ring->inflight--;
+	return 1;
+}
+
+#else
+
+int btrfs_io_uring_init(struct btrfs_io_uring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	return -EOPNOTSUPP;
+}
+
+void btrfs_io_uring_exit(struct btrfs_io_uring *ring)
+{
+}
+
+int btrfs_io_uring_queue_rw(struct btrfs_io_uring *ring, int rw, int fd,
+			    void *buf, u32 len, u64 offset, u64 user_data)
+{
+	return -EOPNOTSUPP;
+}
+
+bool btrfs_io_uring_unqueue(struct btrfs_io_uring *ring, u64 *user_data)
+{
+	return false;
+}
+
+int btrfs_io_uring_submit(struct btrfs_io_uring *ring, unsigned int wait_nr)
+{
+	return -EOPNOTSUPP;
+}
+
+int btrfs_io_uring_reap(struct btrfs_io_uring *ring, u64 *user_data, int *res,
+			bool wait)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_IO_URING_H__
+#define __BTRFS_IO_URING_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+/*
+ * Minimal io_uring submission/completion ring driven directly by the
+ * syscalls, so there's no dependency on liburing. Only plain reads and writes
+ * are supported. The ring is not thread safe, all calls must be serialized
+ * by the caller.
+ */
+struct btrfs_io_uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	/* Submitted to the kernel but not reaped yet */
+	unsigned int inflight;
+	/* Queued in the SQ ring but not submitted yet */
+	unsigned int to_submit;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	void *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	void *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int btrfs_io_uring_init(struct btrfs_io_uring *ring, unsigned int entries);
+void btrfs_io_uring_exit(struct btrfs_io_uring *ring);
+int btrfs_io_uring_queue_rw(struct btrfs_io_uring *ring, int rw, int fd,
+			    void *buf, u32 len, u64 offset, u64 user_data);
+bool btrfs_io_uring_unqueue(struct btrfs_io_uring *ring, u64 *user_data);
+int btrfs_io_uring_submit(struct btrfs_io_uring *ring, unsigned int wait_nr);
+int btrfs_io_uring_reap(struct btrfs_io_uring *ring, u64 *user_data, int *res,
+			bool wait);
+
+static inline bool btrfs_io_uring_full(const struct btrfs_io_uring *ring)
+{
+	return ring->to_submit >= ring->sq_entries ||
+	       ring->inflight + ring->to_submit >= ring->cq_entries;
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "kerncompat.h"
+#include "common/mem-limit.h"
+#include "common/messages.h"
+#include "common/parse-utils.h"
+#include "common/units.h"
+
+static const char * const mem_type_names[BTRFS_MEM_NR_TYPES] = {
+	[BTRFS_MEM_TREE_BLOCKS]		= "tree blocks",
+	[BTRFS_MEM_READAHEAD]		= "readahead",
+	[BTRFS_MEM_CHECK_EXTENTS]	= "check extent records",
+	[BTRFS_MEM_CHECK_INODES]	= "check inode records",
+	[BTRFS_MEM_CHUNK_RECOVER]	= "chunk recover records",
+	[BTRFS_MEM_RESTORE]		= "restore buffers",
+};
+
+static pthread_once_t mem_init_once = PTHREAD_ONCE_INIT;
+/* Protects the list of shrinkers and serializes the reclaim */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(mem_shrinkers);
+/* Zero means no limit */
+static u64 mem_limit;
+static bool mem_warned;
+
+/* Updated with atomics, the charges come from any thread */
+static u64 mem_usage[BTRFS_MEM_NR_TYPES];
+static u64 mem_peak[BTRFS_MEM_NR_TYPES];
+static u64 mem_total;
+static u64 mem_total_peak;
+
+static void mem_init(void)
+{
+	const char *env = getenv(BTRFS_MEM_LIMIT_ENV);
+	u64 limit;
+
+	if (!env || !env[0])
+		return;
+	/* Runs from the first charge, do not exit the tool on a bad value */
+	if (parse_size_from_string_safe(env, &limit) < 0) {
+		warning("invalid %s value '%s', ignored", BTRFS_MEM_LIMIT_ENV, env);
+		return;
+	}
+	mem_limit = limit;
+}
+
+/* Override the limit set by the environment, 0 removes the limit */
+void btrfs_mem_set_limit(u64 limit)
+{
+	pthread_once(&mem_init_once, mem_init);
+	mem_limit = limit;
+}
+
+u64 btrfs_mem_get_limit(void)
+{
+	pthread_once(&mem_init_once, mem_init);
+	return mem_limit;
+}
+
+static void update_peak(u64 *peak, u64 value)
+{
+	u64 old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+	while (value > old &&
+	       !__atomic_compare_exchange_n(peak, &old, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Account @bytes to @type. This never blocks or reclaims so it can be called
+ * under any lock, callers should call btrfs_mem_reclaim() once they dropped
+ * their locks.
+ */
+void btrfs_mem_charge(enum btrfs_mem_type type, u64 bytes)
+{
+	u64 usage;
+
+	usage = __atomic_add_fetch(&mem_usage[type], bytes, __ATOMIC_RELAXED);
+	update_peak(&mem_peak[type], usage);
+	usage = __atomic_add_fetch(&mem_total, bytes, __ATOMIC_RELAXED);
+	update_peak(&mem_total_peak, usage);
+}
+
+void btrfs_mem_uncharge(enum btrfs_mem_type type, u64 bytes)
+{
+	__atomic_sub_fetch(&mem_usage[type], bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&mem_total, bytes, __ATOMIC_RELAXED);
+}
+
+bool btrfs_mem_over_limit(void)
+{
+	u64 limit = btrfs_mem_get_limit();
+
+	return limit && __atomic_load_n(&mem_total, __ATOMIC_RELAXED) > limit;
+}
+
+/*
+ * Ask the registered caches to shrink if the accounted memory is over the
+ * limit. The usage is brought down to 90% of the limit so the caches are not
+ * shrunk again right on the next allocation.
+ */
+void btrfs_mem_reclaim(void)
+{
+	struct btrfs_mem_shrinker *shrinker;
+	u64 target;
+	u64 total;
+
+	if (!btrfs_mem_over_limit())
+		return;
+	/* Somebody else is already reclaiming */
+	if (pthread_mutex_trylock(&mem_lock))
+		return;
+
+	target = mem_limit / 10 * 9;
+	list_for_each_entry(shrinker, &mem_shrinkers, list) {
+		total = __atomic_load_n(&mem_total, __ATOMIC_RELAXED);
+		if (total <= target)
+			break;
+		shrinker->shrink(shrinker, total - target);
+	}
+
+	total = __atomic_load_n(&mem_total, __ATOMIC_RELAXED);
+	if (total > mem_limit && !mem_warned) {
+		warning("memory limit %s exceeded, caches cannot be shrunk further",
+			pretty_size(mem_limit));
+		mem_warned = true;
+	}
+	pthread_mutex_unlock(&mem_lock);
+}
+
+void btrfs_mem_register_shrinker(struct btrfs_mem_shrinker *shrinker)
+{
+	pthread_mutex_lock(&mem_lock);
+	list_add_tail(&shrinker->list, &mem_shrinkers);
+	pthread_mutex_unlock(&mem_lock);
+}
+
+void btrfs_mem_unregister_shrinker(struct btrfs_mem_shrinker *shrinker)
+{
+	pthread_mutex_lock(&mem_lock);
+	list_del_init(&shrinker->list);
+	pthread_mutex_unlock(&mem_lock);
+}
+
+void btrfs_mem_print_usage(void)
+{
+	int i;
+
+	if (mem_limit)
+		fprintf(stderr, "Peak memory usage (limit %s):\n",
+			pretty_size(mem_limit));
+	else
+		fprintf(stderr, "Peak memory usage:\n");
+	for (i = 0; i < BTRFS_MEM_NR_TYPES; i++) {
+		if (!mem_peak[i])
+			continue;
+		fprintf(stderr, "\t%-24s%s\n", mem_type_names[i],
+			pretty_size(mem_peak[i]));
+	}
+	fprintf(stderr, "\t%-24s%s\n", "total", pretty_size(mem_total_peak));
+}
@@ -0,0 +1,63 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_MEM_LIMIT_H__
+#define __BTRFS_MEM_LIMIT_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include "kernel-lib/list.h"
+
+/* Environment variable with the default memory budget, same syntax as --mem-limit */
+#define BTRFS_MEM_LIMIT_ENV	"BTRFS_PROGS_MEM_LIMIT"
+
+/*
+ * Consumers of memory that are accounted against the global budget. These
+ * are the structures that scale with the filesystem size, small and short
+ * lived allocations are not tracked.
+ */
+enum btrfs_mem_type {
+	BTRFS_MEM_TREE_BLOCKS,
+	BTRFS_MEM_READAHEAD,
+	BTRFS_MEM_CHECK_EXTENTS,
+	BTRFS_MEM_CHECK_INODES,
+	BTRFS_MEM_CHUNK_RECOVER,
+	BTRFS_MEM_RESTORE,
+	BTRFS_MEM_NR_TYPES
+};
+
+/*
+ * Cache that can give back memory when the total usage goes over the limit.
+ * The callback should free at least @bytes if possible and return the number
+ * of bytes actually freed. It's called without any locks held by the caller
+ * of btrfs_mem_reclaim().
+ */
+struct btrfs_mem_shrinker {
+	struct list_head list;
+	u64 (*shrink)(struct btrfs_mem_shrinker *shrinker, u64 bytes);
+};
+
+void btrfs_mem_set_limit(u64 limit);
+u64 btrfs_mem_get_limit(void);
+void btrfs_mem_charge(enum btrfs_mem_type type, u64 bytes);
+void btrfs_mem_uncharge(enum btrfs_mem_type type, u64 bytes);
+bool btrfs_mem_over_limit(void);
+void btrfs_mem_reclaim(void);
+void btrfs_mem_register_shrinker(struct btrfs_mem_shrinker *shrinker);
+void btrfs_mem_unregister_shrinker(struct btrfs_mem_shrinker *shrinker);
+void btrfs_mem_print_usage(void);
+
+#endif
@@ -33,11 +33,14 @@ void __btrfs_warning(const char *fmt, ...)
 {
 	va_list args;
 
+	/* Keep the message in one piece if printed from several threads */
+	flockfile(stderr);
 	fputs(PREFIX_WARNING, stderr);
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
 	fputc('\n', stderr);
+	funlockfile(stderr);
 }
 
 __attribute__ ((format (printf, 1, 2)))
@@ -45,11 +48,13 @@ void __btrfs_error(const char *fmt, ...)
 {
 	va_list args;
 
+	flockfile(stderr);
 	fputs(PREFIX_ERROR, stderr);
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
 	fputc('\n', stderr);
+	funlockfile(stderr);
 }
 
 __attribute__ ((format (printf, 2, 3)))
@@ -60,11 +65,13 @@ int __btrfs_warning_on(int condition, const char *fmt, ...)
 	if (!condition)
 		return 0;
 
+	flockfile(stderr);
 	fputs(PREFIX_WARNING, stderr);
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
 	fputc('\n', stderr);
+	funlockfile(stderr);
 
 	return 1;
 }
@@ -77,11 +84,13 @@ int __btrfs_error_on(int condition, const char *fmt, ...)
 	if (!condition)
 		return 0;
 
+	flockfile(stderr);
 	fputs(PREFIX_ERROR, stderr);
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
 	fputc('\n', stderr);
+	funlockfile(stderr);
 
 	return 1;
 }
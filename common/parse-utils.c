@@ -145,7 +145,7 @@ int parse_range_strict(const char *range, u64 *start, u64 *end)
 	return 1;
 }
 
-u64 parse_size_from_string(const char *s)
+static int parse_size(const char *s, u64 *size, bool verbose)
 {
 	char c;
 	char *endptr;
@@ -153,30 +153,35 @@ u64 parse_size_from_string(const char *s)
 	u64 ret;
 
 	if (!s) {
-		error("size value is empty");
-		exit(1);
+		if (verbose)
+			error("size value is empty");
+		return -EINVAL;
 	}
 	if (s[0] == '-') {
-		error("size value '%s' is less equal than 0", s);
-		exit(1);
+		if (verbose)
+			error("size value '%s' is less equal than 0", s);
+		return -EINVAL;
 	}
 	ret = strtoull(s, &endptr, 10);
 	if (endptr == s) {
-		error("size value '%s' is invalid", s);
-		exit(1);
+		if (verbose)
+			error("size value '%s' is invalid", s);
+		return -EINVAL;
 	}
 	if (endptr[0] && endptr[1]) {
-		error("illegal suffix contains character '%c' in wrong position",
-			endptr[1]);
-		exit(1);
+		if (verbose)
+			error("illegal suffix contains character '%c' in wrong position",
+				endptr[1]);
+		return -EINVAL;
 	}
 	/*
 	 * strtoll returns LLONG_MAX when overflow, if this happens,
 	 * need to call strtoull to get the real size
 	 */
 	if (errno == ERANGE && ret == ULLONG_MAX) {
-		error("size value '%s' is too large for u64", s);
-		exit(1);
+		if (verbose)
+			error("size value '%s' is too large for u64", s);
+		return -EINVAL;
 	}
 	if (endptr[0]) {
 		c = tolower(endptr[0]);
@@ -202,17 +207,34 @@ u64 parse_size_from_string(const char *s)
 		case 'b':
 			break;
 		default:
-			error("unknown size descriptor '%c'", c);
-			exit(1);
+			if (verbose)
+				error("unknown size descriptor '%c'", c);
+			return -EINVAL;
 		}
 	}
 	/* Check whether ret * mult overflow */
 	if (fls64(ret) + fls64(mult) - 1 > 64) {
-		error("size value '%s' is too large for u64", s);
-		exit(1);
+		if (verbose)
+			error("size value '%s' is too large for u64", s);
+		return -EINVAL;
 	}
-	ret *= mult;
-	return ret;
+	*size = ret * mult;
+	return 0;
+}
+
+u64 parse_size_from_string(const char *s)
+{
+	u64 size;
+
+	if (parse_size(s, &size, true))
+		exit(1);
+	return size;
+}
+
+/* Same as parse_size_from_string() but return -EINVAL on invalid input */
+int parse_size_from_string_safe(const char *s, u64 *size)
+{
+	return parse_size(s, size, false);
 }
 
 enum btrfs_csum_type parse_csum_type(const char *s)
@@ -21,6 +21,7 @@
 #include "kernel-shared/ctree.h"
 
 u64 parse_size_from_string(const char *s);
+int parse_size_from_string_safe(const char *s, u64 *size);
 enum btrfs_csum_type parse_csum_type(const char *s);
 
 int parse_u64(const char *str, u64 *result);
@@ -21,6 +21,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/send.h"
 #include "crypto/crc32c.h"
@@ -39,8 +43,22 @@ struct btrfs_send_attribute {
 };
 
 struct btrfs_send_stream {
-	char *read_buf;
-	size_t read_buf_size;
+	/*
+	 * Commands are read ahead into the buffer, or the buffer is the
+	 * mapping of the whole stream file. The attributes point into the
+	 * buffer and are valid until the next command is read.
+	 */
+	char *buf;
+	size_t buf_size;
+	/* Start of the unprocessed data and end of the valid data in buf */
+	size_t buf_pos;
+	size_t buf_end;
+	/* The buffer is mapped, buf_size is the length of the mapping */
+	bool mapped;
+	/* Read more than needed, the stream is not shared with other readers */
+	bool readahead;
+	/* File offset of buf[0] for a mapped buffer */
+	off_t map_offset;
 	int fd;
 
 	int cmd;
@@ -58,44 +76,85 @@ struct btrfs_send_stream {
 } __attribute__((aligned(64)));
 
 /*
- * Read len bytes to buf.
+ * Make len bytes available at sctx->buf + sctx->buf_pos, the unprocessed data
+ * may be moved to the start of the buffer.
  * Return:
  *   0 - success
  * < 0 - negative errno in case of error
  * > 0 - no data read, EOF
  */
-static int read_buf(struct btrfs_send_stream *sctx, char *buf, size_t len)
+static int fill_buf(struct btrfs_send_stream *sctx, size_t len)
 {
+	size_t avail = sctx->buf_end - sctx->buf_pos;
 	int ret;
-	size_t pos = 0;
 
-	while (pos < len) {
+	if (avail >= len)
+		return 0;
+	if (sctx->mapped)
+		goto out_eof;
+
+	if (sctx->buf_pos + len > sctx->buf_size) {
+		memmove(sctx->buf, sctx->buf + sctx->buf_pos, avail);
+		sctx->buf_pos = 0;
+		sctx->buf_end = avail;
+	}
+	if (len > sctx->buf_size) {
+		char *new_buf;
+
+		new_buf = realloc(sctx->buf, len);
+		if (!new_buf) {
+			ret = -ENOMEM;
+			errno = -ret;
+			error_msg(ERROR_MSG_MEMORY, "read buffer for command");
+			return ret;
+		}
+		sctx->buf = new_buf;
+		sctx->buf_size = len;
+	}
+
+	while (avail < len) {
 		ssize_t rbytes;
+		size_t want = len - avail;
 
-		rbytes = read(sctx->fd, buf + pos, len - pos);
+		if (sctx->readahead)
+			want = sctx->buf_size - sctx->buf_end;
+		rbytes = read(sctx->fd, sctx->buf + sctx->buf_end, want);
 		if (rbytes < 0) {
+			if (errno == EINTR)
+				continue;
 			ret = -errno;
 			error("read from stream failed: %m");
-			goto out;
+			return ret;
 		}
-		if (rbytes == 0) {
-			ret = 1;
+		if (rbytes == 0)
 			goto out_eof;
-		}
-		pos += rbytes;
+		sctx->buf_end += rbytes;
+		avail += rbytes;
 	}
-	ret = 0;
+	return 0;
 
 out_eof:
-	if (0 < pos && pos < len) {
-		error("short read from stream: expected %zu read %zu", len, pos);
-		ret = -EIO;
-	} else {
-		sctx->stream_pos += pos;
-	}
+	if (avail == 0)
+		return 1;
+	error("short read from stream: expected %zu read %zu", len, avail);
+	return -EIO;
+}
 
-out:
-	return ret;
+/*
+ * Return pointer to the next len bytes of the stream in buf, valid until the
+ * next call.
+ */
+static int read_buf(struct btrfs_send_stream *sctx, char **buf, size_t len)
+{
+	int ret;
+
+	ret = fill_buf(sctx, len);
+	if (ret)
+		return ret;
+	*buf = sctx->buf + sctx->buf_pos;
+	sctx->buf_pos += len;
+	sctx->stream_pos += len;
+	return 0;
 }
 
 /*
@@ -108,6 +167,7 @@ out:
  */
 static int read_cmd(struct btrfs_send_stream *sctx)
 {
+	static const u8 zero_crc[sizeof(__le32)] = { 0 };
 	int ret;
 	u16 cmd;
 	u32 cmd_len;
@@ -116,11 +176,11 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 	u32 crc;
 	u32 crc2;
 	struct btrfs_cmd_header *cmd_hdr;
-	size_t buf_len;
 
 	memset(sctx->cmd_attrs, 0, sizeof(sctx->cmd_attrs));
 
-	ret = read_buf(sctx, sctx->read_buf, sizeof(*cmd_hdr));
+	/* Peek at the header, the whole command must be in the buffer */
+	ret = fill_buf(sctx, sizeof(*cmd_hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -128,28 +188,9 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		error("unexpected EOF in stream");
 		goto out;
 	}
-
-	cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	cmd_len = le32_to_cpu(cmd_hdr->len);
-	cmd = le16_to_cpu(cmd_hdr->cmd);
-	buf_len = sizeof(*cmd_hdr) + cmd_len;
-	if (sctx->read_buf_size < buf_len) {
-		void *new_read_buf;
-
-		new_read_buf = realloc(sctx->read_buf, buf_len);
-		if (!new_read_buf) {
-			ret = -ENOMEM;
-			errno = -ret;
-			error_msg(ERROR_MSG_MEMORY, "read buffer for command");
-			goto out;
-		}
-		sctx->read_buf = new_read_buf;
-		sctx->read_buf_size = buf_len;
-		/* We need to reset cmd_hdr after realloc of sctx->read_buf */
-		cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	}
-	data = sctx->read_buf + sizeof(*cmd_hdr);
-	ret = read_buf(sctx, data, cmd_len);
+	cmd_hdr = (struct btrfs_cmd_header *)(sctx->buf + sctx->buf_pos);
+	cmd_len = get_unaligned_le32(&cmd_hdr->len);
+	ret = read_buf(sctx, (char **)&cmd_hdr, sizeof(*cmd_hdr) + cmd_len);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -157,13 +198,18 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		error("unexpected EOF in stream");
 		goto out;
 	}
+	data = (char *)(cmd_hdr + 1);
+	cmd = get_unaligned_le16(&cmd_hdr->cmd);
+	crc = get_unaligned_le32(&cmd_hdr->crc);
 
-	crc = le32_to_cpu(cmd_hdr->crc);
-	/* In send, CRC is computed with header crc = 0, replicate that */
-	cmd_hdr->crc = 0;
-
-	crc2 = crc32c(0, (unsigned char*)sctx->read_buf,
-			sizeof(*cmd_hdr) + cmd_len);
+	/*
+	 * In send, CRC is computed with header crc = 0, replicate that without
+	 * writing to the buffer, it can be a read-only mapping.
+	 */
+	crc2 = crc32c(0, (unsigned char *)cmd_hdr,
+		      offsetof(struct btrfs_cmd_header, crc));
+	crc2 = crc32c(crc2, zero_crc, sizeof(zero_crc));
+	crc2 = crc32c(crc2, (unsigned char *)data, cmd_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -181,7 +227,7 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 			ret = -EINVAL;
 			goto out;
 		}
-		tlv_type = le16_to_cpu(*(__le16 *)data);
+		tlv_type = get_unaligned_le16(data);
 
 		if (tlv_type == 0 || tlv_type > BTRFS_SEND_A_MAX) {
 			error("invalid tlv in cmd tlv_type = %hu", tlv_type);
@@ -202,7 +248,7 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 				ret = -EINVAL;
 				goto out;
 			}
-			send_attr->tlv_len = le16_to_cpu(*(__le16 *)data);
+			send_attr->tlv_len = get_unaligned_le16(data);
 			pos += sizeof(__le16);
 			data += sizeof(__le16);
 		}
@@ -585,34 +631,108 @@ out:
 	return ret;
 }
 
+/* Read buffer size for streams that are not mapped */
+#define BTRFS_SEND_STREAM_BUF_SIZE	(SZ_4M)
+
 /*
+ * Prepare reading of send streams from fd. A regular file is mapped, other
+ * files are read in large chunks. The fd must not be read by anything else
+ * until btrfs_send_stream_close(), which leaves the file offset right after
+ * the processed data if the file is seekable.
+ *
+ * If @shared is set, the fd is going to be read by somebody else after the
+ * close, so only the needed data are read from a pipe as there's no way to
+ * give back the rest.
+ */
+struct btrfs_send_stream *btrfs_send_stream_open(int fd, bool shared)
+{
+	struct btrfs_send_stream *sctx;
+	struct stat st;
+	off_t offset;
+
+	sctx = calloc(1, sizeof(*sctx));
+	if (!sctx)
+		return NULL;
+	sctx->fd = fd;
+	sctx->readahead = true;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > offset && st.st_size - offset <= SIZE_MAX) {
+		off_t start = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+		void *map;
+
+		map = mmap(NULL, st.st_size - start, PROT_READ, MAP_PRIVATE,
+			   fd, start);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size - start, MADV_SEQUENTIAL);
+			sctx->buf = map;
+			sctx->buf_size = st.st_size - start;
+			sctx->buf_pos = offset - start;
+			sctx->buf_end = sctx->buf_size;
+			sctx->map_offset = start;
+			sctx->mapped = true;
+			return sctx;
+		}
+	}
+
+	sctx->buf = malloc(BTRFS_SEND_STREAM_BUF_SIZE);
+	if (!sctx->buf) {
+		free(sctx);
+		return NULL;
+	}
+	sctx->buf_size = BTRFS_SEND_STREAM_BUF_SIZE;
+	if (shared && offset < 0)
+		sctx->readahead = false;
+	return sctx;
+}
+
+void btrfs_send_stream_close(struct btrfs_send_stream *sctx)
+{
+	if (!sctx)
+		return;
+	if (sctx->mapped) {
+		lseek(sctx->fd, sctx->map_offset + sctx->buf_pos, SEEK_SET);
+		munmap(sctx->buf, sctx->buf_size);
+	} else {
+		/* Give back what was read ahead, not possible for a pipe */
+		if (sctx->buf_end > sctx->buf_pos)
+			lseek(sctx->fd, -(off_t)(sctx->buf_end - sctx->buf_pos),
+			      SEEK_CUR);
+		free(sctx->buf);
+	}
+	free(sctx);
+}
+
+/*
+ * Process one stream, the following one can be processed by another call.
+ *
  * If max_errors is 0, then don't stop processing the stream if one of the
  * callbacks in btrfs_send_ops structure returns an error. If greater than
  * zero, stop after max_errors errors happened.
  */
-int btrfs_read_and_process_send_stream(int fd,
-				       struct btrfs_send_ops *ops, void *user,
-				       int honor_end_cmd,
-				       u64 max_errors)
+int btrfs_send_stream_process(struct btrfs_send_stream *sctx,
+			      struct btrfs_send_ops *ops, void *user,
+			      int honor_end_cmd, u64 max_errors)
 {
 	int ret;
-	struct btrfs_send_stream sctx;
 	struct btrfs_stream_header hdr;
+	char *buf;
 	u64 errors = 0;
 	int last_err = 0;
 
-	sctx.fd = fd;
-	sctx.ops = ops;
-	sctx.user = user;
-	sctx.stream_pos = 0;
+	sctx->ops = ops;
+	sctx->user = user;
+	sctx->stream_pos = 0;
 
-	ret = read_buf(&sctx, (char*)&hdr, sizeof(hdr));
+	ret = read_buf(sctx, &buf, sizeof(hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
 		ret = -ENODATA;
 		goto out;
 	}
+	memcpy(&hdr, buf, sizeof(hdr));
 
 	if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
 		ret = -EINVAL;
@@ -620,24 +740,16 @@ int btrfs_read_and_process_send_stream(int fd,
 		goto out;
 	}
 
-	sctx.version = le32_to_cpu(hdr.version);
-	if (sctx.version > BTRFS_SEND_STREAM_VERSION) {
+	sctx->version = le32_to_cpu(hdr.version);
+	if (sctx->version > BTRFS_SEND_STREAM_VERSION) {
 		ret = -EINVAL;
 		error("stream version %d not supported, please use newer version",
-				sctx.version);
-		goto out;
-	}
-
-	sctx.read_buf = malloc(BTRFS_SEND_BUF_SIZE_V1);
-	if (!sctx.read_buf) {
-		ret = -ENOMEM;
-		error_msg(ERROR_MSG_MEMORY, "send stream read buffer");
+				sctx->version);
 		goto out;
 	}
-	sctx.read_buf_size = BTRFS_SEND_BUF_SIZE_V1;
 
 	while (1) {
-		ret = read_and_process_cmd(&sctx);
+		ret = read_and_process_cmd(sctx);
 		if (ret < 0) {
 			last_err = ret;
 			errors++;
@@ -649,7 +761,6 @@ int btrfs_read_and_process_send_stream(int fd,
 			break;
 		}
 	}
-	free(sctx.read_buf);
 
 out:
 	if (last_err && !ret)
@@ -657,3 +768,29 @@ out:
 
 	return ret;
 }
+
+/*
+ * Process one stream from fd. Without a way to give back the data read ahead
+ * for a pipe, only the needed data are read from it, use
+ * btrfs_send_stream_open() without @shared to process several streams from a
+ * pipe faster.
+ */
+int btrfs_read_and_process_send_stream(int fd,
+				       struct btrfs_send_ops *ops, void *user,
+				       int honor_end_cmd,
+				       u64 max_errors)
+{
+	struct btrfs_send_stream *sctx;
+	int ret;
+
+	sctx = btrfs_send_stream_open(fd, true);
+	if (!sctx) {
+		error_msg(ERROR_MSG_MEMORY, "send stream read buffer");
+		return -ENOMEM;
+	}
+	ret = btrfs_send_stream_process(sctx, ops, user, honor_end_cmd,
+					max_errors);
+	btrfs_send_stream_close(sctx);
+
+	return ret;
+}
@@ -20,6 +20,7 @@
 #define __BTRFS_SEND_STREAM_H__
 
 #include "kerncompat.h"
+#include <stdbool.h>
 
 struct btrfs_send_ops {
 	int (*subvol)(const char *path, const u8 *uuid, u64 ctransid,
@@ -65,6 +66,13 @@ struct btrfs_send_ops {
 			     int sig_len, char *sig, void *user);
 };
 
+struct btrfs_send_stream;
+
+struct btrfs_send_stream *btrfs_send_stream_open(int fd, bool shared);
+void btrfs_send_stream_close(struct btrfs_send_stream *sctx);
+int btrfs_send_stream_process(struct btrfs_send_stream *sctx,
+			      struct btrfs_send_ops *ops, void *user,
+			      int honor_end_cmd, u64 max_errors);
 int btrfs_read_and_process_send_stream(int fd,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
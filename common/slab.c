@@ -0,0 +1,360 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "kerncompat.h"
+#include "common/slab.h"
+#include "common/internal.h"
+#include "common/messages.h"
+
+/*
+ * Temporary file backing the chunks allocated while the memory budget is
+ * exceeded. The chunks are mapped shared so the kernel can write them back
+ * and drop them from memory instead of running out of memory, at the cost
+ * of IO when they're accessed again.
+ */
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	/* Size of the file, chunks are appended at the end */
+	u64 size;
+	/* Offsets of the chunks that have been freed, reused first */
+	u64 *free_offsets;
+	u32 nr_free;
+	u32 max_free;
+	u64 bytes;
+	u64 peak;
+	bool warned;
+} spill = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+/*
+ * Header at the start of each chunk, followed by the objects. Freed objects
+ * are linked through their first word, objects past @nr_fresh have never
+ * been handed out and are not linked anywhere so a new chunk is not touched
+ * until it's used.
+ */
+struct btrfs_slab_chunk {
+	struct list_head list;
+	void *free;
+	u32 nr_used;
+	u32 nr_fresh;
+	bool spilled;
+	/* Offset in the spill file if @spilled */
+	u64 offset;
+};
+
+#define SLAB_CHUNK_HEADER	round_up(sizeof(struct btrfs_slab_chunk), 64)
+
+static inline u32 objs_per_chunk(struct btrfs_slab *slab)
+{
+	return (BTRFS_SLAB_CHUNK_SIZE - SLAB_CHUNK_HEADER) / slab->obj_size;
+}
+
+static inline struct btrfs_slab_chunk *obj_to_chunk(void *obj)
+{
+	return (struct btrfs_slab_chunk *)((unsigned long)obj &
+					   ~(BTRFS_SLAB_CHUNK_SIZE - 1UL));
+}
+
+static void reset_chunk(struct btrfs_slab_chunk *chunk)
+{
+	chunk->free = NULL;
+	chunk->nr_used = 0;
+	chunk->nr_fresh = 0;
+}
+
+/*
+ * Create the spill file in @dir, it's unlinked right away so it's removed
+ * once we exit no matter how. Must be called only once, before any objects
+ * are allocated.
+ */
+int btrfs_slab_set_spill_dir(const char *dir)
+{
+	char *path;
+	int fd;
+
+	fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+	if (fd < 0) {
+		/* Fallback for filesystems without O_TMPFILE support */
+		if (asprintf(&path, "%s/btrfs-spill.XXXXXX", dir) < 0)
+			return -ENOMEM;
+		fd = mkstemp(path);
+		if (fd >= 0)
+			unlink(path);
+		free(path);
+		if (fd < 0)
+			return -errno;
+	}
+
+	pthread_mutex_lock(&spill.lock);
+	spill.fd = fd;
+	pthread_mutex_unlock(&spill.lock);
+	return 0;
+}
+
+/* Peak number of bytes of objects that had to be stored in the spill file */
+u64 btrfs_slab_spill_peak(void)
+{
+	return spill.peak;
+}
+
+static int get_spill_offset(u64 *offset)
+{
+	u64 *tmp;
+
+	if (spill.nr_free) {
+		*offset = spill.free_offsets[--spill.nr_free];
+		return 0;
+	}
+	/* Make sure there's room to put the offset back */
+	if (spill.size / BTRFS_SLAB_CHUNK_SIZE >= spill.max_free) {
+		tmp = realloc(spill.free_offsets,
+			      (spill.max_free + 64) * sizeof(u64));
+		if (!tmp)
+			return -ENOMEM;
+		spill.free_offsets = tmp;
+		spill.max_free += 64;
+	}
+	if (ftruncate(spill.fd, spill.size + BTRFS_SLAB_CHUNK_SIZE) < 0)
+		return -errno;
+	*offset = spill.size;
+	spill.size += BTRFS_SLAB_CHUNK_SIZE;
+	return 0;
+}
+
+static void put_spill_offset(u64 offset)
+{
+	/* Drop the blocks, the file does not need to keep the garbage */
+	fallocate(spill.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  offset, BTRFS_SLAB_CHUNK_SIZE);
+	spill.free_offsets[spill.nr_free++] = offset;
+}
+
+/*
+ * Map a chunk of the spill file at an address aligned to the chunk size. The
+ * file offsets are aligned but mmap() only guarantees page alignment of the
+ * address, so reserve twice the size and trim it.
+ */
+static struct btrfs_slab_chunk *alloc_spilled_chunk(void)
+{
+	struct btrfs_slab_chunk *chunk = NULL;
+	unsigned long start;
+	unsigned long aligned;
+	void *reserve;
+	void *ptr;
+	u64 offset = 0;
+	int ret;
+
+	pthread_mutex_lock(&spill.lock);
+	if (spill.fd < 0)
+		goto out;
+	ret = get_spill_offset(&offset);
+	if (ret < 0) {
+		if (!spill.warned) {
+			errno = -ret;
+			warning("cannot grow the spill file: %m");
+			spill.warned = true;
+		}
+		goto out;
+	}
+
+	reserve = mmap(NULL, 2 * BTRFS_SLAB_CHUNK_SIZE, PROT_NONE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reserve == MAP_FAILED)
+		goto out_put;
+	start = (unsigned long)reserve;
+	aligned = round_up(start, BTRFS_SLAB_CHUNK_SIZE);
+	ptr = mmap((void *)aligned, BTRFS_SLAB_CHUNK_SIZE,
+		   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, spill.fd,
+		   offset);
+	if (ptr == MAP_FAILED) {
+		munmap(reserve, 2 * BTRFS_SLAB_CHUNK_SIZE);
+		goto out_put;
+	}
+	if (aligned > start)
+		munmap(reserve, aligned - start);
+	munmap((void *)(aligned + BTRFS_SLAB_CHUNK_SIZE),
+	       start + BTRFS_SLAB_CHUNK_SIZE - aligned);
+
+	chunk = ptr;
+	chunk->spilled = true;
+	chunk->offset = offset;
+	spill.bytes += BTRFS_SLAB_CHUNK_SIZE;
+	spill.peak = max(spill.peak, spill.bytes);
+	goto out;
+
+out_put:
+	put_spill_offset(offset);
+out:
+	pthread_mutex_unlock(&spill.lock);
+	return chunk;
+}
+
+static struct btrfs_slab_chunk *alloc_chunk(struct btrfs_slab *slab)
+{
+	struct btrfs_slab_chunk *chunk;
+
+	if (slab->spare) {
+		chunk = slab->spare;
+		slab->spare = NULL;
+		return chunk;
+	}
+
+	/*
+	 * The other caches have been already shrunk when the limit was hit,
+	 * what's left over the limit are objects that cannot be freed.
+	 */
+	if (spill.fd >= 0 && btrfs_mem_over_limit()) {
+		chunk = alloc_spilled_chunk();
+		if (chunk) {
+			reset_chunk(chunk);
+			return chunk;
+		}
+	}
+
+	if (posix_memalign((void **)&chunk, BTRFS_SLAB_CHUNK_SIZE,
+			   BTRFS_SLAB_CHUNK_SIZE))
+		return NULL;
+	reset_chunk(chunk);
+	chunk->spilled = false;
+	btrfs_mem_charge(slab->mem_type, BTRFS_SLAB_CHUNK_SIZE);
+	return chunk;
+}
+
+static void free_chunk(struct btrfs_slab *slab, struct btrfs_slab_chunk *chunk)
+{
+	u64 offset = chunk->offset;
+
+	if (!chunk->spilled) {
+		btrfs_mem_uncharge(slab->mem_type, BTRFS_SLAB_CHUNK_SIZE);
+		free(chunk);
+		return;
+	}
+
+	munmap(chunk, BTRFS_SLAB_CHUNK_SIZE);
+	pthread_mutex_lock(&spill.lock);
+	put_spill_offset(offset);
+	spill.bytes -= BTRFS_SLAB_CHUNK_SIZE;
+	pthread_mutex_unlock(&spill.lock);
+}
+
+void *btrfs_slab_alloc(struct btrfs_slab *slab)
+{
+	struct btrfs_slab_chunk *chunk;
+	bool new_chunk = false;
+	void *obj;
+
+	pthread_mutex_lock(&slab->lock);
+	if (list_empty(&slab->partial)) {
+		new_chunk = !slab->spare;
+		chunk = alloc_chunk(slab);
+		if (!chunk) {
+			pthread_mutex_unlock(&slab->lock);
+			return NULL;
+		}
+		list_add(&chunk->list, &slab->partial);
+	} else {
+		chunk = list_first_entry(&slab->partial, struct btrfs_slab_chunk,
+					 list);
+	}
+
+	if (chunk->free) {
+		obj = chunk->free;
+		chunk->free = *(void **)obj;
+	} else {
+		obj = (char *)chunk + SLAB_CHUNK_HEADER +
+		      (size_t)chunk->nr_fresh * slab->obj_size;
+		chunk->nr_fresh++;
+	}
+	chunk->nr_used++;
+	if (chunk->nr_used == objs_per_chunk(slab))
+		list_move(&chunk->list, &slab->full);
+	pthread_mutex_unlock(&slab->lock);
+
+	/* The reclaim must not be done under our lock */
+	if (new_chunk)
+		btrfs_mem_reclaim();
+	return obj;
+}
+
+void *btrfs_slab_zalloc(struct btrfs_slab *slab)
+{
+	void *obj;
+
+	obj = btrfs_slab_alloc(slab);
+	if (obj)
+		memset(obj, 0, slab->obj_size);
+	return obj;
+}
+
+void btrfs_slab_free(struct btrfs_slab *slab, void *obj)
+{
+	struct btrfs_slab_chunk *chunk;
+
+	if (!obj)
+		return;
+
+	chunk = obj_to_chunk(obj);
+	pthread_mutex_lock(&slab->lock);
+	if (chunk->nr_used == objs_per_chunk(slab))
+		list_move(&chunk->list, &slab->partial);
+	*(void **)obj = chunk->free;
+	chunk->free = obj;
+	chunk->nr_used--;
+	if (chunk->nr_used == 0) {
+		list_del(&chunk->list);
+		if (slab->spare) {
+			free_chunk(slab, chunk);
+		} else {
+			/* Start from the beginning for better locality */
+			reset_chunk(chunk);
+			slab->spare = chunk;
+		}
+	}
+	pthread_mutex_unlock(&slab->lock);
+}
+
+/*
+ * Release all chunks, including the ones with objects still in use. The slab
+ * can be used again afterwards.
+ */
+void btrfs_slab_destroy(struct btrfs_slab *slab)
+{
+	struct btrfs_slab_chunk *chunk;
+	struct btrfs_slab_chunk *tmp;
+
+	pthread_mutex_lock(&slab->lock);
+	list_splice_init(&slab->full, &slab->partial);
+	list_for_each_entry_safe(chunk, tmp, &slab->partial, list) {
+		list_del(&chunk->list);
+		free_chunk(slab, chunk);
+	}
+	if (slab->spare) {
+		free_chunk(slab, slab->spare);
+		slab->spare = NULL;
+	}
+	pthread_mutex_unlock(&slab->lock);
+}
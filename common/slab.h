@@ -0,0 +1,67 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SLAB_H__
+#define __BTRFS_SLAB_H__
+
+#include "kerncompat.h"
+#include <pthread.h>
+#include "kernel-lib/list.h"
+#include "common/mem-limit.h"
+
+/* Objects are carved from naturally aligned chunks of this size */
+#define BTRFS_SLAB_CHUNK_SIZE	(64 * 1024)
+
+/*
+ * Cache of fixed size objects, for structures allocated by the millions
+ * where the per-allocation overhead and scattering of malloc() matter.
+ *
+ * The objects are packed into chunks without any header, the chunk of an
+ * object is found by masking its address. Empty chunks are returned to the
+ * system except one that is kept for reuse. The chunks are accounted to
+ * @mem_type of the global memory budget.
+ *
+ * If a spill directory is set, chunks allocated over the budget are mapped
+ * from a temporary file there and are not accounted.
+ */
+struct btrfs_slab {
+	pthread_mutex_t lock;
+	/* Chunks with at least one free object */
+	struct list_head partial;
+	/* Chunks with all objects in use */
+	struct list_head full;
+	struct btrfs_slab_chunk *spare;
+	u32 obj_size;
+	enum btrfs_mem_type mem_type;
+};
+
+#define BTRFS_SLAB_INIT(name, type, mtype)				\
+{									\
+	.lock = PTHREAD_MUTEX_INITIALIZER,				\
+	.partial = LIST_HEAD_INIT((name).partial),			\
+	.full = LIST_HEAD_INIT((name).full),				\
+	.obj_size = round_up(sizeof(type), sizeof(u64)),		\
+	.mem_type = (mtype),						\
+}
+
+void *btrfs_slab_alloc(struct btrfs_slab *slab);
+void *btrfs_slab_zalloc(struct btrfs_slab *slab);
+void btrfs_slab_free(struct btrfs_slab *slab, void *obj);
+void btrfs_slab_destroy(struct btrfs_slab *slab);
+int btrfs_slab_set_spill_dir(const char *dir);
+u64 btrfs_slab_spill_peak(void);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "kerncompat.h"
+#include "common/workqueue.h"
+#include "common/messages.h"
+#include "common/internal.h"
+
+/*
+ * Number of threads to use when the user did not ask for a specific count,
+ * one per online CPU.
+ */
+int btrfs_default_nr_threads(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nr < 1)
+		return 1;
+	return min_t(long, nr, BTRFS_WORKQUEUE_MAX_THREADS);
+}
+
+static void *worker_thread(void *data)
+{
+	struct btrfs_workqueue *wq = data;
+	struct btrfs_work *work;
+
+	pthread_mutex_lock(&wq->lock);
+	while (1) {
+		while (list_empty(&wq->works) && !wq->stop)
+			pthread_cond_wait(&wq->work_cond, &wq->lock);
+		if (list_empty(&wq->works))
+			break;
+		work = list_first_entry(&wq->works, struct btrfs_work, list);
+		list_del_init(&work->list);
+		wq->nr_running++;
+		pthread_mutex_unlock(&wq->lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&wq->lock);
+		wq->nr_running--;
+		if (list_empty(&wq->works) && !wq->nr_running)
+			pthread_cond_broadcast(&wq->idle_cond);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+/*
+ * Create a workqueue with @nr_threads workers, or the number of online CPUs
+ * if @nr_threads is 0.
+ *
+ * Return NULL if the threads could not be created.
+ */
+struct btrfs_workqueue *btrfs_alloc_workqueue(int nr_threads)
+{
+	struct btrfs_workqueue *wq;
+	int ret;
+	int i;
+
+	if (nr_threads <= 0)
+		nr_threads = btrfs_default_nr_threads();
+	nr_threads = min(nr_threads, BTRFS_WORKQUEUE_MAX_THREADS);
+
+	wq = calloc(1, sizeof(*wq) + nr_threads * sizeof(pthread_t));
+	if (!wq)
+		return NULL;
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->work_cond, NULL);
+	pthread_cond_init(&wq->idle_cond, NULL);
+	INIT_LIST_HEAD(&wq->works);
+
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&wq->threads[i], NULL, worker_thread, wq);
+		if (ret) {
+			errno = ret;
+			error("failed to create worker thread: %m");
+			break;
+		}
+		wq->nr_threads++;
+	}
+	if (!wq->nr_threads) {
+		btrfs_destroy_workqueue(wq);
+		return NULL;
+	}
+	return wq;
+}
+
+void btrfs_queue_work(struct btrfs_workqueue *wq, struct btrfs_work *work)
+{
+	pthread_mutex_lock(&wq->lock);
+	list_add_tail(&work->list, &wq->works);
+	pthread_cond_signal(&wq->work_cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* Wait until all queued work items have finished */
+void btrfs_flush_workqueue(struct btrfs_workqueue *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	while (!list_empty(&wq->works) || wq->nr_running)
+		pthread_cond_wait(&wq->idle_cond, &wq->lock);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* Finish all queued work and release the workqueue */
+void btrfs_destroy_workqueue(struct btrfs_workqueue *wq)
+{
+	int i;
+
+	if (!wq)
+		return;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->stop = true;
+	pthread_cond_broadcast(&wq->work_cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nr_threads; i++)
+		pthread_join(wq->threads[i], NULL);
+
+	pthread_cond_destroy(&wq->idle_cond);
+	pthread_cond_destroy(&wq->work_cond);
+	pthread_mutex_destroy(&wq->lock);
+	free(wq);
+}
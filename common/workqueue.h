@@ -0,0 +1,68 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_WORKQUEUE_H__
+#define __BTRFS_WORKQUEUE_H__
+
+#include "kerncompat.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include "kernel-lib/list.h"
+
+#define BTRFS_WORKQUEUE_MAX_THREADS	64
+
+struct btrfs_work;
+typedef void (*btrfs_work_func_t)(struct btrfs_work *work);
+
+/*
+ * A unit of work, to be embedded into the caller's own structure and
+ * retrieved by container_of() in the work function. The work item is not
+ * touched by the workqueue after the function has been called, so the
+ * function may free it.
+ */
+struct btrfs_work {
+	struct list_head list;
+	btrfs_work_func_t func;
+};
+
+/*
+ * Simple pool of worker threads processing a FIFO of work items.
+ */
+struct btrfs_workqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct list_head works;
+	int nr_threads;
+	int nr_running;
+	bool stop;
+	pthread_t threads[];
+};
+
+static inline void btrfs_init_work(struct btrfs_work *work,
+				   btrfs_work_func_t func)
+{
+	INIT_LIST_HEAD(&work->list);
+	work->func = func;
+}
+
+int btrfs_default_nr_threads(void);
+struct btrfs_workqueue *btrfs_alloc_workqueue(int nr_threads);
+void btrfs_queue_work(struct btrfs_workqueue *wq, struct btrfs_work *work);
+void btrfs_flush_workqueue(struct btrfs_workqueue *wq);
+void btrfs_destroy_workqueue(struct btrfs_workqueue *wq);
+
+#endif
@@ -175,27 +175,27 @@ static inline int convert_check_state(struct btrfs_convert_context *cctx)
 	return cctx->convert_ops->check_state(cctx);
 }
 
+/* Read the extent in large chunks and insert the checksums of each at once */
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
-	u32 blocksize = root->fs_info->sectorsize;
+	u32 buf_size = min_t(u64, num_bytes, SZ_4M);
 	u64 offset;
 	char *buffer;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
+	buffer = malloc(buf_size);
 	if (!buffer)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		ret = read_disk_extent(root, disk_bytenr + offset,
-					blocksize, buffer);
+	for (offset = 0; offset < num_bytes; offset += buf_size) {
+		u32 len = min_t(u64, num_bytes - offset, buf_size);
+
+		ret = read_disk_extent(root, disk_bytenr + offset, len, buffer);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans,
-					    disk_bytenr + num_bytes,
-					    disk_bytenr + offset,
-					    buffer, blocksize);
+		ret = btrfs_csum_file_range(trans, disk_bytenr + offset, buffer,
+					    len);
 		if (ret)
 			break;
 	}
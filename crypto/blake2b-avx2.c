@@ -0,0 +1,199 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Multi-buffer BLAKE2b-256, 4 independent messages of the same length are
+ * hashed at once, each one in a 64bit lane of the AVX2 registers.
+ */
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include <string.h>
+#include "crypto/hash.h"
+
+#if HASH_MANY_AVX2
+
+#include <immintrin.h>
+
+#define LANES		4
+#define BLOCK_SIZE	128
+#define DIGEST_SIZE	32
+
+#define TARGET		__attribute__((target("avx2")))
+
+static const u64 blake2b_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static const u8 blake2b_sigma[12][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+};
+
+#define ADD(a, b)	_mm256_add_epi64((a), (b))
+#define XOR(a, b)	_mm256_xor_si256((a), (b))
+
+static inline TARGET __m256i rotr32(__m256i x)
+{
+	return _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static inline TARGET __m256i rotr24(__m256i x)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+
+	return _mm256_shuffle_epi8(x, mask);
+}
+
+static inline TARGET __m256i rotr16(__m256i x)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+
+	return _mm256_shuffle_epi8(x, mask);
+}
+
+static inline TARGET __m256i rotr63(__m256i x)
+{
+	return XOR(_mm256_srli_epi64(x, 63), ADD(x, x));
+}
+
+/* Transpose 4x4 64bit words, row i becomes column i */
+static inline TARGET void transpose4(__m256i *r)
+{
+	__m256i t0 = _mm256_unpacklo_epi64(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi64(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi64(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi64(r[2], r[3]);
+
+	r[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+	r[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+	r[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+	r[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+#define G(r, i, a, b, c, d)						\
+	do {								\
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * (i)]]);	\
+		d = rotr32(XOR(d, a));					\
+		c = ADD(c, d);						\
+		b = rotr24(XOR(b, c));					\
+		a = ADD(ADD(a, b), m[blake2b_sigma[r][2 * (i) + 1]]);	\
+		d = rotr16(XOR(d, a));					\
+		c = ADD(c, d);						\
+		b = rotr63(XOR(b, c));					\
+	} while (0)
+
+/*
+ * Compress one block of each of the 4 messages at @ptrs, @counter is the
+ * number of bytes hashed including this block.
+ */
+static TARGET void blake2b_compress_x4(__m256i *h, const u8 * const *ptrs,
+				       u64 counter, bool last)
+{
+	__m256i m[16];
+	__m256i v[16];
+	int r;
+	int i;
+
+	for (i = 0; i < 16; i += 4) {
+		int j;
+
+		for (j = 0; j < LANES; j++)
+			m[i + j] = _mm256_loadu_si256((const __m256i *)
+						      (ptrs[j] + i * 8));
+		transpose4(m + i);
+	}
+
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = _mm256_set1_epi64x(blake2b_iv[i]);
+	}
+	v[12] = XOR(v[12], _mm256_set1_epi64x(counter));
+	if (last)
+		v[14] = XOR(v[14], _mm256_set1_epi64x(-1));
+
+	for (r = 0; r < 12; r++) {
+		G(r, 0, v[0], v[4], v[8], v[12]);
+		G(r, 1, v[1], v[5], v[9], v[13]);
+		G(r, 2, v[2], v[6], v[10], v[14]);
+		G(r, 3, v[3], v[7], v[11], v[15]);
+		G(r, 4, v[0], v[5], v[10], v[15]);
+		G(r, 5, v[1], v[6], v[11], v[12]);
+		G(r, 6, v[2], v[7], v[8], v[13]);
+		G(r, 7, v[3], v[4], v[9], v[14]);
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] = XOR(h[i], XOR(v[i], v[i + 8]));
+}
+
+/*
+ * Hash 4 consecutive messages of @length bytes starting at @data, the
+ * 32 byte digests are stored consecutively to @out.
+ */
+TARGET void blake2b_many_avx2_x4(const u8 *data, size_t length, u8 *out)
+{
+	/* The last block is always processed separately, zero padded */
+	u8 tail[LANES][BLOCK_SIZE];
+	const u8 *ptrs[LANES];
+	__m256i h[8];
+	size_t nr_blocks = length ? (length + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+	size_t rest = length - (nr_blocks - 1) * BLOCK_SIZE;
+	size_t blk;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_set1_epi64x(blake2b_iv[i]);
+	/* Parameter block: digest length, no key, fanout and depth 1 */
+	h[0] = XOR(h[0], _mm256_set1_epi64x(0x01010000 | DIGEST_SIZE));
+
+	for (blk = 0; blk < nr_blocks - 1; blk++) {
+		for (i = 0; i < LANES; i++)
+			ptrs[i] = data + i * length + blk * BLOCK_SIZE;
+		blake2b_compress_x4(h, ptrs, (blk + 1) * BLOCK_SIZE, false);
+	}
+
+	for (i = 0; i < LANES; i++) {
+		memset(tail[i], 0, BLOCK_SIZE);
+		memcpy(tail[i], data + i * length + blk * BLOCK_SIZE, rest);
+		ptrs[i] = tail[i];
+	}
+	blake2b_compress_x4(h, ptrs, length, true);
+
+	/* The first 4 words are the 256bit digest, little endian already */
+	transpose4(h);
+	for (i = 0; i < LANES; i++)
+		_mm256_storeu_si256((__m256i *)(out + i * DIGEST_SIZE), h[i]);
+}
+
+#endif
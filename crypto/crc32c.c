@@ -120,6 +120,38 @@ void crc32c_optimization_init(void)
 	if (crc32c_intel_available)
 		crc_function = crc32c_intel;
 }
+
+static inline u64 crc32c_intel_u64(u64 crc, u64 value)
+{
+	/* Not tied to fixed registers so the 3 streams can be interleaved */
+	__asm__("crc32q %1, %0" : "+r"(crc) : "rm"(value));
+	return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but a new one can be
+ * started each cycle, so calculate 3 independent buffers at once to keep
+ * the unit busy. The buffers must be aligned and the length a multiple of 8.
+ */
+static void crc32c_intel_x3(unsigned char const *data, size_t length, u32 *crcs)
+{
+	const u64 *p0 = (const u64 *)data;
+	const u64 *p1 = (const u64 *)(data + length);
+	const u64 *p2 = (const u64 *)(data + 2 * length);
+	u64 crc0 = ~0U;
+	u64 crc1 = ~0U;
+	u64 crc2 = ~0U;
+	size_t i;
+
+	for (i = 0; i < length / 8; i++) {
+		crc0 = crc32c_intel_u64(crc0, p0[i]);
+		crc1 = crc32c_intel_u64(crc1, p1[i]);
+		crc2 = crc32c_intel_u64(crc2, p2[i]);
+	}
+	crcs[0] = crc0;
+	crcs[1] = crc1;
+	crcs[2] = crc2;
+}
 #else
 
 void crc32c_optimization_init(void)
@@ -219,9 +251,35 @@ u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length)
 
 u32 crc32c_le(u32 crc, unsigned char const *data, size_t length)
 {
-	/* Use by-byte access for unaligned buffers */
-	if ((unsigned long)data % sizeof(unsigned long))
-		return __crc32c_le(crc, data, length);
+	size_t head = -(unsigned long)data % sizeof(unsigned long);
+
+	/* Use by-byte access up to the first aligned address */
+	if (head) {
+		if (head > length)
+			head = length;
+		crc = __crc32c_le(crc, data, head);
+		data += head;
+		length -= head;
+	}
 
 	return crc_function(crc, data, length);
 }
+
+/*
+ * Calculate crc32c with seed ~0 of @nr consecutive blocks of @length bytes
+ * starting at @data, the results are stored to @crcs.
+ */
+void crc32c_le_many(unsigned char const *data, size_t length, int nr, u32 *crcs)
+{
+	int i = 0;
+
+#ifdef __x86_64__
+	if (crc_function == crc32c_intel && length % 8 == 0 &&
+	    (unsigned long)data % 8 == 0) {
+		for (; i + 3 <= nr; i += 3)
+			crc32c_intel_x3(data + i * length, length, crcs + i);
+	}
+#endif
+	for (; i < nr; i++)
+		crcs[i] = crc32c_le(~0U, data + i * length, length);
+}
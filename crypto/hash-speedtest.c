@@ -18,6 +18,15 @@
 #include <time.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#if COMPRESSION_LZO
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+#endif
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #if HAVE_LINUX_PERF_EVENT_H == 1 && HAVE_LINUX_HW_BREAKPOINT_H == 1
 #include <linux/perf_event.h>
 #include <linux/hw_breakpoint.h>
@@ -28,7 +37,12 @@
 #include "crypto/crc32c.h"
 #include "crypto/sha.h"
 #include "crypto/blake2.h"
+#include "kernel-lib/sizes.h"
 #include "common/messages.h"
+#include "common/internal.h"
+#include "common/utils.h"
+#include "common/format-output.h"
+#include "cmds/commands.h"
 
 #ifdef __x86_64__
 static const int cycles_supported = 1;
@@ -42,9 +56,6 @@ enum {
 	UNITS_PERF,
 };
 
-const int blocksize = 4096;
-int iterations = 100000;
-
 #ifdef __x86_64__
 static __always_inline unsigned long long rdtsc(void)
 {
@@ -170,38 +181,454 @@ static const char *units_to_str(int units)
 	return "unknown";
 }
 
-int main(int argc, char **argv) {
-	u8 buf[blocksize];
-	u8 hash[32];
-	int idx;
+/*
+ * Decompression of the formats used by restore and receive. The input is
+ * compressed once and decompressed in each iteration.
+ */
+static int compress_zlib(const u8 *in, size_t in_len, u8 *out, size_t *out_len)
+{
+	uLongf len = *out_len;
+
+	if (compress2(out, &len, in, in_len, Z_DEFAULT_COMPRESSION) != Z_OK)
+		return -1;
+	*out_len = len;
+	return 0;
+}
+
+static int decompress_zlib(const u8 *in, size_t in_len, u8 *out, size_t out_len)
+{
+	uLongf len = out_len;
+
+	if (uncompress(out, &len, in, in_len) != Z_OK || len != out_len)
+		return -1;
+	return 0;
+}
+
+#if COMPRESSION_LZO
+static int compress_lzo(const u8 *in, size_t in_len, u8 *out, size_t *out_len)
+{
+	static u8 wrkmem[LZO1X_1_MEM_COMPRESS];
+	lzo_uint len = *out_len;
+
+	if (lzo_init() != LZO_E_OK)
+		return -1;
+	if (lzo1x_1_compress(in, in_len, out, &len, wrkmem) != LZO_E_OK)
+		return -1;
+	*out_len = len;
+	return 0;
+}
+
+static int decompress_lzo(const u8 *in, size_t in_len, u8 *out, size_t out_len)
+{
+	lzo_uint len = out_len;
+
+	if (lzo1x_decompress_safe(in, in_len, out, &len, NULL) != LZO_E_OK ||
+	    len != out_len)
+		return -1;
+	return 0;
+}
+#endif
+
+#if COMPRESSION_ZSTD
+static int compress_zstd(const u8 *in, size_t in_len, u8 *out, size_t *out_len)
+{
+	size_t ret;
+
+	ret = ZSTD_compress(out, *out_len, in, in_len, 3);
+	if (ZSTD_isError(ret))
+		return -1;
+	*out_len = ret;
+	return 0;
+}
+
+static int decompress_zstd(const u8 *in, size_t in_len, u8 *out, size_t out_len)
+{
+	size_t ret;
+
+	ret = ZSTD_decompress(out, out_len, in, in_len);
+	if (ZSTD_isError(ret) || ret != out_len)
+		return -1;
+	return 0;
+}
+#endif
+
+/* Blocks hashed by one call of the bulk variant */
+#define BATCH_BLOCKS		32
+/* Larger than the last level cache so the data are not cached */
+#define COLD_BUFFER_SIZE	SZ_256M
+#define MAX_THREADS		256
+
+static int hash_many_null_nop(const u8 *buf, size_t length, int nr, u8 *out)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		hash_null_nop(buf + i * length, length, out + i * CRYPTO_HASH_SIZE_MAX);
+	return 0;
+}
+
+static int hash_many_null_memcpy(const u8 *buf, size_t length, int nr, u8 *out)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		hash_null_memcpy(buf + i * length, length,
+				 out + i * CRYPTO_HASH_SIZE_MAX);
+	return 0;
+}
+
+struct contestant {
+	char name[16];
+	int (*digest)(const u8 *buf, size_t length, u8 *out);
+	int (*digest_many)(const u8 *buf, size_t length, int nr, u8 *out);
+	int (*compress)(const u8 *in, size_t in_len, u8 *out, size_t *out_len);
+	int (*decompress)(const u8 *in, size_t in_len, u8 *out, size_t out_len);
+	int digest_size;
+};
+
+static const struct contestant contestants[] = {
+	{ .name = "NULL-NOP", .digest = hash_null_nop,
+	  .digest_many = hash_many_null_nop, .digest_size = 32 },
+	{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy,
+	  .digest_many = hash_many_null_memcpy, .digest_size = 32 },
+	{ .name = "CRC32C", .digest = hash_crc32c,
+	  .digest_many = hash_crc32c_many, .digest_size = 4 },
+	{ .name = "XXHASH", .digest = hash_xxhash,
+	  .digest_many = hash_xxhash_many, .digest_size = 8 },
+	{ .name = "SHA256", .digest = hash_sha256,
+	  .digest_many = hash_sha256_many, .digest_size = 32 },
+	{ .name = "BLAKE2", .digest = hash_blake2b,
+	  .digest_many = hash_blake2b_many, .digest_size = 32 },
+	{ .name = "ZLIB", .compress = compress_zlib,
+	  .decompress = decompress_zlib },
+#if COMPRESSION_LZO
+	{ .name = "LZO", .compress = compress_lzo,
+	  .decompress = decompress_lzo },
+#endif
+#if COMPRESSION_ZSTD
+	{ .name = "ZSTD", .compress = compress_zstd,
+	  .decompress = decompress_zstd },
+#endif
+};
+
+/* One measurement */
+struct bench {
+	const struct contestant *c;
+	int blocksize;
+	bool batch;
+	bool cold;
+	int units;
+	/* Shared input: the cold buffer or the compressed data */
+	const u8 *input;
+	size_t input_len;
+	u64 cycles;
+	u64 time;
+	int ret;
+};
+
+struct bench_thread {
+	pthread_t tid;
+	struct bench *bench;
+	int index;
+	int ret;
+};
+
+static int iterations = 100000;
+static int nr_threads = 1;
+
+static int run_hash(struct bench *b, int index)
+{
+	const int nr = b->batch ? BATCH_BLOCKS : 1;
+	const size_t chunk = (size_t)nr * b->blocksize;
+	u8 hash[BATCH_BLOCKS * CRYPTO_HASH_SIZE_MAX];
+	u8 *buf = NULL;
+	size_t pos;
 	int iter;
-	struct contestant {
-		char name[16];
-		int (*digest)(const u8 *buf, size_t length, u8 *out);
-		int digest_size;
-		u64 cycles;
-		u64 time;
-	} contestants[] = {
-		{ .name = "NULL-NOP", .digest = hash_null_nop, .digest_size = 32 },
-		{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy, .digest_size = 32 },
-		{ .name = "CRC32C", .digest = hash_crc32c, .digest_size = 4 },
-		{ .name = "XXHASH", .digest = hash_xxhash, .digest_size = 8 },
-		{ .name = "SHA256", .digest = hash_sha256, .digest_size = 32 },
-		{ .name = "BLAKE2", .digest = hash_blake2b, .digest_size = 32 },
+	int ret = 0;
+	int n;
+	int i;
+
+	if (!b->cold) {
+		buf = malloc(chunk);
+		if (!buf)
+			return -ENOMEM;
+		/* Filled once, so the data stay in the cache */
+		memset(buf, index & 0xFF, chunk);
+	}
+	/* Each thread walks a different part of the cold buffer */
+	pos = (COLD_BUFFER_SIZE / nr_threads * index) / chunk * chunk;
+
+	for (iter = 0; iter < iterations; iter += nr) {
+		const u8 *data;
+
+		n = min(nr, iterations - iter);
+		if (b->cold) {
+			if (pos + chunk > COLD_BUFFER_SIZE)
+				pos = 0;
+			data = b->input + pos;
+			pos += chunk;
+		} else {
+			data = buf;
+		}
+		memset(hash, 0, n * CRYPTO_HASH_SIZE_MAX);
+		if (b->batch) {
+			ret = b->c->digest_many(data, b->blocksize, n, hash);
+		} else {
+			for (i = 0; i < n && ret == 0; i++)
+				ret = b->c->digest(data + (size_t)i * b->blocksize,
+						   b->blocksize, hash);
+		}
+		if (ret < 0)
+			break;
+	}
+	free(buf);
+	return ret;
+}
+
+static int run_decompress(struct bench *b)
+{
+	u8 *buf;
+	int iter;
+	int ret = 0;
+
+	buf = malloc(b->blocksize);
+	if (!buf)
+		return -ENOMEM;
+	for (iter = 0; iter < iterations; iter++) {
+		ret = b->c->decompress(b->input, b->input_len, buf, b->blocksize);
+		if (ret < 0) {
+			ret = -EIO;
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+
+	if (t->bench->c->decompress)
+		t->ret = run_decompress(t->bench);
+	else
+		t->ret = run_hash(t->bench, t->index);
+	return NULL;
+}
+
+static void run_bench(struct bench *b)
+{
+	struct bench_thread threads[MAX_THREADS];
+	u64 start, end;
+	u64 tstart, tend;
+	int i;
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].bench = b;
+		threads[i].index = i;
+		threads[i].ret = 0;
+	}
+
+	tstart = get_time();
+	start = get_cycles(b->units);
+	if (nr_threads == 1) {
+		/* The perf counter is per-thread, run it in ours */
+		bench_thread_fn(&threads[0]);
+	} else {
+		for (i = 0; i < nr_threads; i++) {
+			int ret;
+
+			ret = pthread_create(&threads[i].tid, NULL,
+					     bench_thread_fn, &threads[i]);
+			if (ret) {
+				threads[i].ret = -ret;
+				break;
+			}
+		}
+		while (--i >= 0)
+			pthread_join(threads[i].tid, NULL);
+	}
+	end = get_cycles(b->units);
+	tend = get_time();
+
+	b->cycles = end - start;
+	b->time = tend - tstart;
+	b->ret = 0;
+	for (i = 0; i < nr_threads; i++) {
+		if (threads[i].ret < 0)
+			b->ret = threads[i].ret;
+	}
+}
+
+/*
+ * Semi-compressible data for the decompressors, a mix of words and random
+ * bytes.
+ */
+static void fill_text(u8 *buf, size_t len)
+{
+	static const char * const words[] = {
+		"btrfs ", "subvolume ", "extent ", "checksum ", "inode ",
+		"snapshot ", "0000 ", "\n",
 	};
+	size_t pos = 0;
+
+	srand(1);
+	while (pos < len) {
+		const char *word;
+		size_t wlen;
+
+		if (rand() % 4 == 0) {
+			buf[pos++] = rand();
+			continue;
+		}
+		word = words[rand() % ARRAY_SIZE(words)];
+		wlen = min(strlen(word), len - pos);
+		memcpy(buf + pos, word, wlen);
+		pos += wlen;
+	}
+}
+
+static int prepare_decompress(struct bench *b, u8 **compressed)
+{
+	u8 *plain;
+	size_t len;
+	int ret;
+
+	len = b->blocksize * 2 + 1024;
+	plain = malloc(b->blocksize);
+	*compressed = malloc(len);
+	if (!plain || !*compressed) {
+		free(plain);
+		free(*compressed);
+		*compressed = NULL;
+		return -ENOMEM;
+	}
+	fill_text(plain, b->blocksize);
+	ret = b->c->compress(plain, b->blocksize, *compressed, &len);
+	free(plain);
+	if (ret < 0) {
+		free(*compressed);
+		*compressed = NULL;
+		return -EIO;
+	}
+	b->input = *compressed;
+	b->input_len = len;
+	return 0;
+}
+
+static const struct rowspec bench_rowspec[] = {
+	{ .key = "implementation", .fmt = "%s", .out_text = "implementation", .out_json = "implementation" },
+	{ .key = "name", .fmt = "%s", .out_text = "name", .out_json = "name" },
+	{ .key = "blocksize", .fmt = "%d", .out_text = "blocksize", .out_json = "blocksize" },
+	{ .key = "api", .fmt = "%s", .out_text = "api", .out_json = "api" },
+	{ .key = "cache", .fmt = "%s", .out_text = "cache", .out_json = "cache" },
+	{ .key = "threads", .fmt = "%d", .out_text = "threads", .out_json = "threads" },
+	{ .key = "iterations", .fmt = "%d", .out_text = "iterations", .out_json = "iterations" },
+	{ .key = "units", .fmt = "%s", .out_text = "units", .out_json = "units" },
+	{ .key = "total", .fmt = "%llu", .out_text = "total", .out_json = "total" },
+	{ .key = "per-iteration", .fmt = "%llu", .out_text = "per-iteration", .out_json = "per-iteration" },
+	{ .key = "throughput", .fmt = "%.3f", .out_text = "throughput", .out_json = "mib-per-sec" },
+	ROWSPEC_END
+};
+
+static double bench_throughput(const struct bench *b)
+{
+	double t = (double)b->time / 1000 / 1000 / 1000;
+	double mb = (double)b->blocksize * iterations * nr_threads / 1024 / 1024;
+
+	return t > 0 ? mb / t : 0;
+}
+
+static void print_bench(struct format_ctx *fctx, const struct bench *b)
+{
+	u64 total = (b->units == UNITS_TIME) ? b->time : b->cycles;
+	u64 per_iter = total / iterations;
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(fctx, "name", b->c->name);
+		fmt_print(fctx, "blocksize", b->blocksize);
+		fmt_print(fctx, "api", b->c->decompress ? "decompress" :
+				       (b->batch ? "batch" : "single"));
+		fmt_print(fctx, "cache", b->cold ? "cold" : "warm");
+		fmt_print(fctx, "threads", nr_threads);
+		fmt_print(fctx, "iterations", iterations);
+		fmt_print(fctx, "units", units_to_str(b->units));
+		fmt_print(fctx, "total", total);
+		fmt_print(fctx, "per-iteration", per_iter);
+		fmt_print(fctx, "throughput", bench_throughput(b));
+		fmt_print_end_group(fctx, NULL);
+		return;
+	}
+
+	printf("%12s: %s: %12llu, %s/i %8llu, %12.3f MiB/s\n", b->c->name,
+	       units_to_str(b->units), total, units_to_str(b->units), per_iter,
+	       bench_throughput(b));
+}
+
+static void print_usage(void)
+{
+	printf("usage: hash-speedtest [options] [iterations]\n");
+	printf("\n");
+	printf("Measure the checksum algorithms and decompressors\n");
+	printf("\n");
+	printf("  -c|--cycles            measure CPU cycles (default)\n");
+	printf("  -t|--time              measure time in nanoseconds\n");
+	printf("  -p|--perf              measure CPU cycles by perf event\n");
+	printf("  -b|--blocksize <size>  block size, can be repeated (default 4096)\n");
+	printf("  --all-sizes            all block sizes from 4K to 64K\n");
+	printf("  --batch                also measure the bulk variants\n");
+	printf("  --cold                 also measure with data not in the cache\n");
+	printf("  --decompress           measure also the decompressors\n");
+	printf("  -j|--threads <N>       run the measurements in N threads at once\n");
+	printf("  --all                  all sizes, variants and decompressors\n");
+	printf("  --format <FORMAT>      output format: text (default) or json\n");
+}
+
+int main(int argc, char **argv) {
+	static const int all_sizes[] = { 4096, 8192, 16384, 32768, 65536 };
+	struct format_ctx fctx;
+	int blocksizes[ARRAY_SIZE(all_sizes)];
+	int nr_blocksizes = 0;
+	bool do_batch = false;
+	bool do_cold = false;
+	bool do_decompress = false;
+	u8 *cold_buffer = NULL;
 	int units = UNITS_CYCLES;
+	int bs_idx;
+	int idx;
+	int ret = 0;
+	enum {
+		GETOPT_VAL_ALL_SIZES = 256,
+		GETOPT_VAL_BATCH,
+		GETOPT_VAL_COLD,
+		GETOPT_VAL_DECOMPRESS,
+		GETOPT_VAL_ALL,
+		GETOPT_VAL_FORMAT,
+	};
 
+	btrfs_config_init();
 	optind = 0;
 	while (1) {
 		static const struct option long_options[] = {
 			{ "cycles", no_argument, NULL, 'c' },
 			{ "time", no_argument, NULL, 't' },
 			{ "perf", no_argument, NULL, 'p' },
+			{ "blocksize", required_argument, NULL, 'b' },
+			{ "all-sizes", no_argument, NULL, GETOPT_VAL_ALL_SIZES },
+			{ "batch", no_argument, NULL, GETOPT_VAL_BATCH },
+			{ "cold", no_argument, NULL, GETOPT_VAL_COLD },
+			{ "decompress", no_argument, NULL, GETOPT_VAL_DECOMPRESS },
+			{ "threads", required_argument, NULL, 'j' },
+			{ "all", no_argument, NULL, GETOPT_VAL_ALL },
+			{ "format", required_argument, NULL, GETOPT_VAL_FORMAT },
+			{ "help", no_argument, NULL, 'h' },
 			{ NULL, 0, NULL, 0}
 		};
 		int c;
+		int i;
 
-		c = getopt_long(argc, argv, "ctp", long_options, NULL);
+		c = getopt_long(argc, argv, "ctpb:j:h", long_options, NULL);
 		if (c < 0)
 			break;
 		switch (c) {
@@ -223,67 +650,181 @@ int main(int argc, char **argv) {
 			}
 			units = UNITS_PERF;
 			break;
+		case 'b': {
+			int size = atoi(optarg);
+
+			for (i = 0; i < ARRAY_SIZE(all_sizes); i++)
+				if (all_sizes[i] == size)
+					break;
+			if (i == ARRAY_SIZE(all_sizes)) {
+				error("unsupported block size %s, must be a power of 2 from 4096 to 65536",
+				      optarg);
+				return 1;
+			}
+			if (nr_blocksizes < ARRAY_SIZE(blocksizes))
+				blocksizes[nr_blocksizes++] = size;
+			break;
+		}
+		case GETOPT_VAL_ALL:
+			do_batch = true;
+			do_cold = true;
+			do_decompress = true;
+			/* fallthrough */
+		case GETOPT_VAL_ALL_SIZES:
+			memcpy(blocksizes, all_sizes, sizeof(all_sizes));
+			nr_blocksizes = ARRAY_SIZE(all_sizes);
+			break;
+		case GETOPT_VAL_BATCH:
+			do_batch = true;
+			break;
+		case GETOPT_VAL_COLD:
+			do_cold = true;
+			break;
+		case GETOPT_VAL_DECOMPRESS:
+			do_decompress = true;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1 || nr_threads > MAX_THREADS) {
+				error("number of threads must be from 1 to %d",
+				      MAX_THREADS);
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_FORMAT:
+			if (strcmp(optarg, "json") == 0) {
+				bconf.output_format = CMD_FORMAT_JSON;
+			} else if (strcmp(optarg, "text") == 0) {
+				bconf.output_format = CMD_FORMAT_TEXT;
+			} else {
+				error("unknown output format: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			print_usage();
+			return 0;
 		default:
 			error("unknown option");
 			return 1;
 		}
 	}
 
+	if (units == UNITS_PERF && nr_threads > 1) {
+		error("perf counts only the calling thread, use --time or --cycles with threads");
+		return 1;
+	}
+
 	if (argc - optind >= 1) {
 		iterations = atoi(argv[optind]);
-		if (iterations < 0)
+		if (iterations <= 0)
 			iterations = 1;
 	}
+	if (nr_blocksizes == 0)
+		blocksizes[nr_blocksizes++] = 4096;
 
 	crc32c_optimization_init();
-	memset(buf, 0, 4096);
 
-	printf("Block size:     %d\n", blocksize);
-	printf("Iterations:     %d\n", iterations);
-	printf("Implementation: %s\n", CRYPTOPROVIDER);
-	printf("Units:          %s\n", units_to_desc(units));
-	printf("\n");
+	if (do_cold) {
+		int i;
 
-	for (idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
-		struct contestant *c = &contestants[idx];
-		u64 start, end;
-		u64 tstart, tend;
-		u64 total = 0;
-
-		printf("%12s: ", c->name);
-		fflush(stdout);
-
-		tstart = get_time();
-		start = get_cycles(units);
-		for (iter = 0; iter < iterations; iter++) {
-			memset(buf, iter & 0xFF, blocksize);
-			memset(hash, 0, 32);
-			c->digest(buf, blocksize, hash);
+		cold_buffer = malloc(COLD_BUFFER_SIZE);
+		if (!cold_buffer) {
+			error("not enough memory for the cold cache buffer");
+			return 1;
 		}
-		end = get_cycles(units);
-		tend = get_time();
-		c->cycles = end - start;
-		c->time = tend - tstart;
-
-		if (units == UNITS_CYCLES || units == UNITS_PERF)
-			total = c->cycles;
-		if (units == UNITS_TIME)
-			total = c->time;
-
-		printf("%s: %12llu, %s/i %8llu",
-				units_to_str(units), total,
-				units_to_str(units), total / iterations);
-		if (idx > 0) {
-			float t;
-			float mb;
-
-			t = (float)c->time / 1000 / 1000 / 1000;
-			mb = blocksize * iterations / 1024 / 1024;
-			printf(", %12.3f MiB/s", mb / t);
+		for (i = 0; i < COLD_BUFFER_SIZE; i++)
+			cold_buffer[i] = i * 31 + (i >> 12);
+	}
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_start(&fctx, bench_rowspec, 16, 0);
+		fmt_print(&fctx, "implementation", CRYPTOPROVIDER);
+		fmt_print_start_group(&fctx, "hash-speedtest", JSON_TYPE_ARRAY);
+	} else {
+		printf("Iterations:     %d\n", iterations);
+		printf("Implementation: %s\n", CRYPTOPROVIDER);
+		printf("Units:          %s\n", units_to_desc(units));
+		printf("Threads:        %d\n", nr_threads);
+	}
+
+	for (bs_idx = 0; bs_idx < nr_blocksizes; bs_idx++) {
+		/* Single and batch, warm and cold */
+		int variant;
+
+		for (variant = 0; variant < 4; variant++) {
+			const bool batch = variant & 1;
+			const bool cold = variant & 2;
+
+			if ((batch && !do_batch) || (cold && !do_cold))
+				continue;
+			if (bconf.output_format != CMD_FORMAT_JSON)
+				printf("\nBlock size: %d, %s, %s cache\n",
+				       blocksizes[bs_idx],
+				       batch ? "batch" : "single",
+				       cold ? "cold" : "warm");
+
+			for (idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
+				struct bench b = {
+					.c = &contestants[idx],
+					.blocksize = blocksizes[bs_idx],
+					.batch = batch,
+					.cold = cold,
+					.units = units,
+					.input = cold_buffer,
+				};
+
+				if (b.c->decompress)
+					continue;
+				run_bench(&b);
+				ret = b.ret;
+				if (ret < 0) {
+					errno = -ret;
+					error("%s hashing failed: %m",
+					      b.c->name);
+					goto out;
+				}
+				print_bench(&fctx, &b);
+			}
 		}
-		putchar('\n');
+
+		if (!do_decompress)
+			continue;
+		if (bconf.output_format != CMD_FORMAT_JSON)
+			printf("\nBlock size: %d, decompression\n",
+			       blocksizes[bs_idx]);
+		for (idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
+			struct bench b = {
+				.c = &contestants[idx],
+				.blocksize = blocksizes[bs_idx],
+				.units = units,
+			};
+			u8 *compressed;
+
+			if (!b.c->decompress)
+				continue;
+			ret = prepare_decompress(&b, &compressed);
+			if (ret == 0) {
+				run_bench(&b);
+				ret = b.ret;
+			}
+			free(compressed);
+			if (ret < 0) {
+				errno = -ret;
+				error("%s decompression failed: %m", b.c->name);
+				goto out;
+			}
+			print_bench(&fctx, &b);
+		}
+	}
+
+out:
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_print_end_group(&fctx, "hash-speedtest");
+		fmt_end(&fctx);
 	}
+	free(cold_buffer);
 	perf_finish();
 
-	return 0;
+	return ret ? 1 : 0;
 }
@@ -33,6 +33,7 @@ struct hash_testspec {
 	const struct hash_testvec *testvec;
 	size_t count;
 	int (*hash)(const u8 *buf, size_t length, u8 *out);
+	int (*hash_many)(const u8 *buf, size_t length, int nr, u8 *out);
 };
 
 static const struct hash_testvec crc32c_tv[] = {
@@ -125,25 +126,29 @@ static const struct hash_testspec test_spec[] = {
 		.digest_size = 4,
 		.testvec = crc32c_tv,
 		.count = ARRAY_SIZE(crc32c_tv),
-		.hash = hash_crc32c
+		.hash = hash_crc32c,
+		.hash_many = hash_crc32c_many,
 	}, {
 		.name = "xxhash64",
 		.digest_size = 8,
 		.testvec = xxhash64_tv,
 		.count = ARRAY_SIZE(xxhash64_tv),
-		.hash = hash_xxhash
+		.hash = hash_xxhash,
+		.hash_many = hash_xxhash_many,
 	}, {
 		.name = "sha256",
 		.digest_size = 32,
 		.testvec = sha256_tv,
 		.count = ARRAY_SIZE(sha256_tv),
-		.hash = hash_sha256
+		.hash = hash_sha256,
+		.hash_many = hash_sha256_many,
 	}, {
 		.name = "blake2b",
 		.digest_size = 32,
 		.testvec = blake2b_256_tv,
 		.count = ARRAY_SIZE(blake2b_256_tv),
-		.hash = hash_blake2b
+		.hash = hash_blake2b,
+		.hash_many = hash_blake2b_many,
 	}
 };
 
@@ -181,13 +186,66 @@ int test_hash(const struct hash_testspec *spec)
 	return 0;
 }
 
+/*
+ * The bulk variants must match the single buffer ones for all lengths around
+ * the block sizes and for numbers of buffers not aligned to the number of
+ * lanes of the multi-buffer implementations.
+ */
+int test_hash_many(const struct hash_testspec *spec)
+{
+	static const size_t lengths[] = {
+		0, 1, 55, 56, 63, 64, 111, 112, 127, 128, 129, 4096
+	};
+	const int max_nr = 19;
+	u8 *buf;
+	u8 *many;
+	u8 csum[CRYPTO_HASH_SIZE_MAX];
+	int failed = 0;
+	int i;
+	int nr;
+	int j;
+
+	buf = malloc(max_nr * 4096);
+	many = malloc(max_nr * spec->digest_size);
+	if (!buf || !many) {
+		error("not enough memory");
+		free(buf);
+		free(many);
+		return 1;
+	}
+	for (i = 0; i < max_nr * 4096; i++)
+		buf[i] = rand();
+
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		for (nr = 1; nr <= max_nr; nr++) {
+			spec->hash_many(buf, lengths[i], nr, many);
+			for (j = 0; j < nr; j++) {
+				spec->hash(buf + j * lengths[i], lengths[i], csum);
+				if (memcmp(csum, many + j * spec->digest_size,
+					   spec->digest_size))
+					failed++;
+			}
+		}
+	}
+	if (failed)
+		printf("%s bulk: %d MISMATCHES\n", spec->name, failed);
+	else
+		printf("%s bulk: match\n", spec->name);
+
+	free(buf);
+	free(many);
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
 	int i;
 
+	crc32c_optimization_init();
 	for (i = 0; i < ARRAY_SIZE(test_spec); i++) {
 		printf("TEST: name=%s vectors=%zd\n", test_spec[i].name,
 				test_spec[i].count);
 		test_hash(&test_spec[i]);
+		test_hash_many(&test_spec[i]);
 	}
 
 	return 0;
@@ -14,6 +14,7 @@
  * Boston, MA 021110-1307, USA.
  */
 
+#include <stdbool.h>
 #include "crypto/hash.h"
 #include "crypto/crc32c.h"
 #include "crypto/xxhash.h"
@@ -43,6 +44,90 @@ int hash_xxhash(const u8 *buf, size_t length, u8 *out)
 	return 0;
 }
 
+/*
+ * Bulk variants, the multi-buffer implementations are used if the CPU
+ * supports them, the rest is done one by one.
+ */
+#if HASH_MANY_AVX2
+static bool cpu_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+int hash_crc32c_many(const u8 *buf, size_t length, int nr, u8 *out)
+{
+	u32 crcs[64];
+	int batch;
+	int i;
+
+	while (nr > 0) {
+		batch = nr < ARRAY_SIZE(crcs) ? nr : ARRAY_SIZE(crcs);
+		crc32c_le_many(buf, length, batch, crcs);
+		for (i = 0; i < batch; i++)
+			put_unaligned_le32(~crcs[i], out + i * 4);
+		buf += batch * length;
+		out += batch * 4;
+		nr -= batch;
+	}
+
+	return 0;
+}
+
+int hash_xxhash_many(const u8 *buf, size_t length, int nr, u8 *out)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		hash_xxhash(buf + i * length, length, out + i * 8);
+
+	return 0;
+}
+
+int hash_sha256_many(const u8 *buf, size_t length, int nr, u8 *out)
+{
+	int i = 0;
+	int ret;
+
+#if HASH_MANY_AVX2
+	if (cpu_has_avx2()) {
+		for (; i + 8 <= nr; i += 8)
+			sha256_many_avx2_x8(buf + i * length, length,
+					    out + i * CRYPTO_HASH_SIZE_MAX);
+	}
+#endif
+	for (; i < nr; i++) {
+		ret = hash_sha256(buf + i * length, length,
+				  out + i * CRYPTO_HASH_SIZE_MAX);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+int hash_blake2b_many(const u8 *buf, size_t length, int nr, u8 *out)
+{
+	int i = 0;
+	int ret;
+
+#if HASH_MANY_AVX2
+	if (cpu_has_avx2()) {
+		for (; i + 4 <= nr; i += 4)
+			blake2b_many_avx2_x4(buf + i * length, length,
+					     out + i * CRYPTO_HASH_SIZE_MAX);
+	}
+#endif
+	for (; i < nr; i++) {
+		ret = hash_blake2b(buf + i * length, length,
+				   out + i * CRYPTO_HASH_SIZE_MAX);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
 /*
  * Implementations of cryptographic primitives
  */
@@ -26,4 +26,23 @@ int hash_xxhash(const u8 *buf, size_t length, u8 *out);
 int hash_sha256(const u8 *buf, size_t length, u8 *out);
 int hash_blake2b(const u8 *buf, size_t length, u8 *out);
 
+/*
+ * Hash @nr consecutive blocks of @length bytes starting at @buf, the digests
+ * are stored consecutively to @out, each one takes the digest size of the
+ * algorithm.
+ */
+int hash_crc32c_many(const u8 *buf, size_t length, int nr, u8 *out);
+int hash_xxhash_many(const u8 *buf, size_t length, int nr, u8 *out);
+int hash_sha256_many(const u8 *buf, size_t length, int nr, u8 *out);
+int hash_blake2b_many(const u8 *buf, size_t length, int nr, u8 *out);
+
+/* Multi-buffer implementations, selected at runtime */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HASH_MANY_AVX2		1
+void sha256_many_avx2_x8(const u8 *data, size_t length, u8 *out);
+void blake2b_many_avx2_x4(const u8 *data, size_t length, u8 *out);
+#else
+#define HASH_MANY_AVX2		0
+#endif
+
 #endif
@@ -0,0 +1,201 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Multi-buffer SHA-256, 8 independent messages of the same length are hashed
+ * at once, each one in a 32bit lane of the AVX2 registers.
+ */
+
+#include "kerncompat.h"
+#include <string.h>
+#include "crypto/hash.h"
+
+#if HASH_MANY_AVX2
+
+#include <immintrin.h>
+
+#define LANES		8
+#define BLOCK_SIZE	64
+#define DIGEST_SIZE	32
+
+#define TARGET		__attribute__((target("avx2")))
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const u32 sha256_h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROTR(x, n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)),	\
+					_mm256_slli_epi32((x), 32 - (n)))
+#define ADD(a, b)	_mm256_add_epi32((a), (b))
+#define XOR(a, b)	_mm256_xor_si256((a), (b))
+#define AND(a, b)	_mm256_and_si256((a), (b))
+#define ANDNOT(a, b)	_mm256_andnot_si256((a), (b))
+
+/* Transpose 8x8 32bit words, row i becomes column i */
+static inline TARGET void transpose8(__m256i *r)
+{
+	__m256i t[8];
+	__m256i u[8];
+	int i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+/* Process @nr_blocks blocks of each of the 8 messages at @ptrs */
+static TARGET void sha256_blocks_x8(__m256i *state, const u8 * const *ptrs,
+				    size_t nr_blocks)
+{
+	const __m256i bswap = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i w[16];
+	__m256i s[8];
+	__m256i t1, t2;
+	size_t blk;
+	int i;
+
+	for (blk = 0; blk < nr_blocks; blk++) {
+		for (i = 0; i < LANES; i++) {
+			w[i] = _mm256_loadu_si256((const __m256i *)
+					(ptrs[i] + blk * BLOCK_SIZE));
+			w[i + 8] = _mm256_loadu_si256((const __m256i *)
+					(ptrs[i] + blk * BLOCK_SIZE + 32));
+		}
+		transpose8(w);
+		transpose8(w + 8);
+		for (i = 0; i < 16; i++)
+			w[i] = _mm256_shuffle_epi8(w[i], bswap);
+
+		for (i = 0; i < 8; i++)
+			s[i] = state[i];
+
+		for (i = 0; i < 64; i++) {
+			__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+			__m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+			if (i >= 16) {
+				__m256i w15 = w[(i - 15) & 15];
+				__m256i w2 = w[(i - 2) & 15];
+				__m256i s0, s1;
+
+				s0 = XOR(XOR(ROTR(w15, 7), ROTR(w15, 18)),
+					 _mm256_srli_epi32(w15, 3));
+				s1 = XOR(XOR(ROTR(w2, 17), ROTR(w2, 19)),
+					 _mm256_srli_epi32(w2, 10));
+				w[i & 15] = ADD(ADD(w[i & 15], s0),
+						ADD(w[(i - 7) & 15], s1));
+			}
+
+			t1 = ADD(h, XOR(XOR(ROTR(e, 6), ROTR(e, 11)), ROTR(e, 25)));
+			t1 = ADD(t1, XOR(AND(e, f), ANDNOT(e, g)));
+			t1 = ADD(t1, ADD(_mm256_set1_epi32(sha256_k[i]), w[i & 15]));
+			t2 = XOR(XOR(ROTR(a, 2), ROTR(a, 13)), ROTR(a, 22));
+			t2 = ADD(t2, XOR(XOR(AND(a, b), AND(a, c)), AND(b, c)));
+
+			s[7] = g;
+			s[6] = f;
+			s[5] = e;
+			s[4] = ADD(d, t1);
+			s[3] = c;
+			s[2] = b;
+			s[1] = a;
+			s[0] = ADD(t1, t2);
+		}
+
+		for (i = 0; i < 8; i++)
+			state[i] = ADD(state[i], s[i]);
+	}
+}
+
+/*
+ * Hash 8 consecutive messages of @length bytes starting at @data, the
+ * digests are stored consecutively to @out.
+ */
+TARGET void sha256_many_avx2_x8(const u8 *data, size_t length, u8 *out)
+{
+	const __m256i bswap = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	/* The padding of the last one or two blocks of each message */
+	u8 tail[LANES][2 * BLOCK_SIZE];
+	const u8 *ptrs[LANES];
+	__m256i state[8];
+	size_t full = length / BLOCK_SIZE;
+	size_t rest = length % BLOCK_SIZE;
+	size_t tail_blocks = (rest + 9 > BLOCK_SIZE) ? 2 : 1;
+	u64 bits = (u64)length * 8;
+	int i;
+	int j;
+
+	for (i = 0; i < 8; i++)
+		state[i] = _mm256_set1_epi32(sha256_h0[i]);
+
+	for (i = 0; i < LANES; i++)
+		ptrs[i] = data + i * length;
+	sha256_blocks_x8(state, ptrs, full);
+
+	for (i = 0; i < LANES; i++) {
+		u8 *p = tail[i];
+
+		memset(p, 0, sizeof(tail[i]));
+		memcpy(p, data + i * length + full * BLOCK_SIZE, rest);
+		p[rest] = 0x80;
+		for (j = 0; j < 8; j++)
+			p[tail_blocks * BLOCK_SIZE - 1 - j] = bits >> (8 * j);
+		ptrs[i] = p;
+	}
+	sha256_blocks_x8(state, ptrs, tail_blocks);
+
+	transpose8(state);
+	for (i = 0; i < LANES; i++)
+		_mm256_storeu_si256((__m256i *)(out + i * DIGEST_SIZE),
+				    _mm256_shuffle_epi8(state[i], bswap));
+}
+
+#endif
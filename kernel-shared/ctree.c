@@ -20,6 +20,7 @@
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/print-tree.h"
+#include "kernel-shared/reada.h"
 #include "crypto/crc32c.h"
 #include "common/internal.h"
 #include "common/messages.h"
@@ -473,7 +474,7 @@ int __btrfs_cow_block(struct btrfs_trans_handle *trans,
 	write_extent_buffer(cow, root->fs_info->fs_devices->metadata_uuid,
 			    btrfs_header_fsid(), BTRFS_FSID_SIZE);
 
-	WARN_ON(!(buf->flags & EXTENT_BAD_TRANSID) &&
+	WARN_ON(!extent_buffer_test_flags(buf, EXTENT_BAD_TRANSID) &&
 		btrfs_header_generation(buf) > trans->transid);
 
 	update_ref_for_cow(trans, root, buf, cow);
@@ -498,10 +499,12 @@ int __btrfs_cow_block(struct btrfs_trans_handle *trans,
 		btrfs_free_extent(trans, root, buf->start, buf->len,
 				  0, root->root_key.objectid, level, 0);
 	}
+	pthread_mutex_lock(&root->fs_info->recow_lock);
 	if (!list_empty(&buf->recow)) {
 		list_del_init(&buf->recow);
 		free_extent_buffer(buf);
 	}
+	pthread_mutex_unlock(&root->fs_info->recow_lock);
 	free_extent_buffer(buf);
 	btrfs_mark_buffer_dirty(cow);
 	*cow_ret = cow;
@@ -598,6 +601,7 @@ static void generic_err(const struct extent_buffer *buf, int slot,
 {
 	va_list args;
 
+	flockfile(stderr);
 	fprintf(stderr, "corrupt %s: root=%lld block=%llu slot=%d, ",
 		btrfs_header_level(buf) == 0 ? "leaf": "node",
 		btrfs_header_owner(buf), btrfs_header_bytenr(buf), slot);
@@ -605,6 +609,7 @@ static void generic_err(const struct extent_buffer *buf, int slot,
 	vfprintf(stderr, fmt, args);
 	va_end(args);
 	fprintf(stderr, "\n");
+	funlockfile(stderr);
 }
 
 enum btrfs_tree_block_status
@@ -1239,10 +1244,15 @@ void reada_for_search(struct btrfs_fs_info *fs_info, struct btrfs_path *path,
 	u32 nr;
 	u32 nscan = 0;
 
-	if (level != 1)
+	if (!path->nodes[level])
 		return;
 
-	if (!path->nodes[level])
+	if (path->reada == READA_FORWARD_ALL) {
+		btrfs_reada_children(fs_info, path->nodes[level], slot);
+		return;
+	}
+
+	if (level != 1)
 		return;
 
 	node = path->nodes[level];
@@ -607,7 +607,11 @@ struct btrfs_node {
  * The slots array records the index of the item or block pointer
  * used while walking the tree.
  */
-enum { READA_NONE = 0, READA_BACK, READA_FORWARD };
+/*
+ * READA_FORWARD_ALL reads ahead all the remaining children of each node the
+ * path enters at any level, sorted by disk offset, for full tree traversals.
+ */
+enum { READA_NONE = 0, READA_BACK, READA_FORWARD, READA_FORWARD_ALL };
 struct btrfs_path {
 	struct extent_buffer *nodes[BTRFS_MAX_LEVEL];
 	int slots[BTRFS_MAX_LEVEL];
@@ -646,6 +650,9 @@ struct btrfs_extent_item_v0 {
 			((BTRFS_LEAF_DATA_SIZE(r->fs_info) >> 4) - \
 					sizeof(struct btrfs_item))
 #define BTRFS_MAX_EXTENT_SIZE		128UL * 1024 * 1024
+/* Limits of the data of one compressed extent, on disk and uncompressed */
+#define BTRFS_MAX_COMPRESSED		(128UL * 1024)
+#define BTRFS_MAX_UNCOMPRESSED		(128UL * 1024)
 
 #define BTRFS_EXTENT_FLAG_DATA		(1ULL << 0)
 #define BTRFS_EXTENT_FLAG_TREE_BLOCK	(1ULL << 1)
@@ -1213,6 +1220,8 @@ struct btrfs_fs_info {
 
 	struct rb_root global_roots_tree;
 	struct rb_root fs_root_tree;
+	/* Protects fs_root_tree, the trees can be checked in parallel */
+	pthread_mutex_t fs_root_lock;
 
 	/* the log root tree is a directory of all the other log roots */
 	struct btrfs_root *log_root_tree;
@@ -1245,7 +1254,9 @@ struct btrfs_fs_info {
 	u64 nr_global_roots;
 
 	struct list_head dirty_cowonly_roots;
+	/* Tree blocks read with a bad transid, to be COWed by a transaction */
 	struct list_head recow_ebs;
+	pthread_mutex_t recow_lock;
 
 	struct btrfs_fs_devices *fs_devices;
 	struct list_head space_info;
@@ -1265,6 +1276,7 @@ struct btrfs_fs_info {
 	unsigned int finalize_on_close:1;
 	unsigned int hide_names:1;
 	unsigned int allow_transid_mismatch:1;
+	unsigned int disable_reada:1;
 
 	int transaction_aborted;
 	int force_csum_type;
@@ -1275,6 +1287,9 @@ struct btrfs_fs_info {
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
 
+	/* Asynchronous tree block readahead, set up on first use */
+	struct btrfs_reada *reada;
+
 	/*
 	 * For converting to/from bg tree feature, this records the bytenr
 	 * of the last processed block group item.
@@ -1908,6 +1923,10 @@ BTRFS_SETGET_FUNCS(extent_data_ref_offset, struct btrfs_extent_data_ref,
 		   offset, 64);
 BTRFS_SETGET_FUNCS(extent_data_ref_count, struct btrfs_extent_data_ref,
 		   count, 32);
+BTRFS_SETGET_STACK_FUNCS(stack_extent_data_ref_root,
+			 struct btrfs_extent_data_ref, root, 64);
+BTRFS_SETGET_STACK_FUNCS(stack_extent_data_ref_objectid,
+			 struct btrfs_extent_data_ref, objectid, 64);
 
 BTRFS_SETGET_FUNCS(shared_data_ref_count, struct btrfs_shared_data_ref,
 		   count, 32);
@@ -2615,6 +2634,7 @@ int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 			 u64 num_bytes, u64 empty_size,
 			 u64 hint_byte, u64 search_end,
 			 struct btrfs_key *ins, bool is_data);
+u64 btrfs_max_free_extent(struct btrfs_fs_info *fs_info, u64 flags);
 int btrfs_fix_block_accounting(struct btrfs_trans_handle *trans);
 void btrfs_pin_extent(struct btrfs_fs_info *fs_info, u64 bytenr, u64 num_bytes);
 void btrfs_unpin_extent(struct btrfs_fs_info *fs_info,
@@ -2677,6 +2697,12 @@ int btrfs_record_file_extent(struct btrfs_trans_handle *trans,
 			      struct btrfs_inode_item *inode,
 			      u64 file_pos, u64 disk_bytenr,
 			      u64 num_bytes);
+int btrfs_record_compressed_file_extent(struct btrfs_trans_handle *trans,
+					struct btrfs_root *root, u64 objectid,
+					struct btrfs_inode_item *inode,
+					u64 file_pos, u64 disk_bytenr,
+					u64 disk_num_bytes, u64 ram_bytes,
+					u8 compression);
 int btrfs_remove_block_group(struct btrfs_trans_handle *trans,
 			     u64 bytenr, u64 len);
 void free_excluded_extents(struct btrfs_fs_info *fs_info,
@@ -2909,8 +2935,10 @@ int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 				struct btrfs_root *root, u64 objectid,
 				u64 offset, const char *buffer, size_t size);
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 alloc_end,
-			  u64 bytenr, char *data, size_t len);
+int btrfs_insert_data_csums(struct btrfs_trans_handle *trans, u64 bytenr,
+			    u64 len, const u8 *csums);
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans, u64 bytenr,
+			  const char *data, u64 len);
 
 /* uuid-tree.c, interface for mounted mounted filesystem */
 int btrfs_lookup_uuid_subvol_item(int fd, const u8 *uuid, u64 *subvol_id);
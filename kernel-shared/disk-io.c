@@ -28,6 +28,7 @@
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/transaction.h"
+#include "kernel-shared/reada.h"
 #include "zoned.h"
 #include "crypto/crc32c.h"
 #include "common/utils.h"
@@ -162,6 +163,31 @@ int btrfs_csum_data(struct btrfs_fs_info *fs_info, u16 csum_type, const u8 *data
 	return -1;
 }
 
+/*
+ * Calculate checksums of @nr consecutive blocks of @len bytes at @data, the
+ * checksums are stored to @out packed by the checksum size of @csum_type.
+ * Faster than calling btrfs_csum_data() for each block.
+ */
+int btrfs_csum_data_many(u16 csum_type, const u8 *data, u8 *out, size_t len,
+			 int nr)
+{
+	switch (csum_type) {
+	case BTRFS_CSUM_TYPE_CRC32:
+		return hash_crc32c_many(data, len, nr, out);
+	case BTRFS_CSUM_TYPE_XXHASH:
+		return hash_xxhash_many(data, len, nr, out);
+	case BTRFS_CSUM_TYPE_SHA256:
+		return hash_sha256_many(data, len, nr, out);
+	case BTRFS_CSUM_TYPE_BLAKE2:
+		return hash_blake2b_many(data, len, nr, out);
+	default:
+		fprintf(stderr, "ERROR: unknown csum type: %d\n", csum_type);
+		ASSERT(0);
+	}
+
+	return -1;
+}
+
 static int __csum_tree_block_size(struct extent_buffer *buf, u16 csum_size,
 				  int verify, int silent, u16 csum_type)
 {
@@ -246,7 +272,11 @@ void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	struct btrfs_device *device;
 
 	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
-	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid)) &&
+	if (eb && btrfs_buffer_uptodate(eb, parent_transid))
+		goto out;
+
+	/* Fall back to page cache hint if the block can't be read ahead */
+	if (btrfs_reada_add(fs_info, bytenr) < 0 &&
 	    !btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 0,
 			     NULL)) {
 		device = multi->stripes[0].dev;
@@ -254,7 +284,7 @@ void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 		readahead(device->fd, multi->stripes[0].physical,
 				fs_info->nodesize);
 	}
-
+out:
 	free_extent_buffer(eb);
 	kfree(multi);
 }
@@ -278,7 +308,7 @@ static int verify_parent_transid(struct extent_io_tree *io_tree,
 	       (unsigned long long)parent_transid,
 	       (unsigned long long)btrfs_header_generation(eb));
 	if (ignore) {
-		eb->flags |= EXTENT_BAD_TRANSID;
+		extent_buffer_set_flags(eb, EXTENT_BAD_TRANSID);
 		printk("Ignoring transid failure\n");
 		return 0;
 	}
@@ -321,6 +351,10 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	int ret = 0;
 	unsigned long bytes_left = eb->len;
 
+	/* First try the copy of the default mirror that has been read ahead */
+	if (mirror <= 1 && btrfs_reada_fill_eb(info, eb) == 0)
+		return 0;
+
 	while (bytes_left) {
 		u64 read_len = bytes_left;
 
@@ -338,6 +372,21 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	return 0;
 }
 
+/*
+ * Queue @eb to be COWed by the next transaction, the list holds a reference.
+ * Readers of several threads can get here.
+ */
+static void add_recow_eb(struct btrfs_fs_info *fs_info,
+			 struct extent_buffer *eb)
+{
+	pthread_mutex_lock(&fs_info->recow_lock);
+	if (list_empty(&eb->recow)) {
+		list_add_tail(&eb->recow, &fs_info->recow_ebs);
+		extent_buffer_get(eb);
+	}
+	pthread_mutex_unlock(&fs_info->recow_lock);
+}
+
 struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 		u64 parent_transid)
 {
@@ -370,6 +419,13 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	if (btrfs_buffer_uptodate(eb, parent_transid))
 		return eb;
 
+	/* Parallel readers of the same block must not fill it twice */
+	lock_extent_buffer_read(eb);
+	if (btrfs_buffer_uptodate(eb, parent_transid)) {
+		unlock_extent_buffer_read(eb);
+		return eb;
+	}
+
 	num_copies = btrfs_num_copies(fs_info, eb->start, eb->len);
 	while (1) {
 		ret = read_whole_eb(fs_info, eb, mirror_num);
@@ -377,12 +433,8 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 		    check_tree_block(fs_info, eb) == 0 &&
 		    verify_parent_transid(&fs_info->extent_cache, eb,
 					  parent_transid, ignore) == 0) {
-			if (eb->flags & EXTENT_BAD_TRANSID &&
-			    list_empty(&eb->recow)) {
-				list_add_tail(&eb->recow,
-					      &fs_info->recow_ebs);
-				eb->refs++;
-			}
+			if (extent_buffer_test_flags(eb, EXTENT_BAD_TRANSID))
+				add_recow_eb(fs_info, eb);
 
 			/*
 			 * check_tree_block() is less strict to allow btrfs
@@ -397,6 +449,7 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 				ret = btrfs_check_leaf(fs_info, NULL, eb);
 			if (!ret || candidate_mirror == mirror_num) {
 				btrfs_set_buffer_uptodate(eb);
+				unlock_extent_buffer_read(eb);
 				return eb;
 			}
 			if (candidate_mirror <= 0)
@@ -444,6 +497,7 @@ struct extent_buffer* read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	 * We failed to read this tree block, it be should deleted right now
 	 * to avoid stale cache populate the cache.
 	 */
+	unlock_extent_buffer_read(eb);
 	free_extent_buffer_nocache(eb);
 	return ERR_PTR(ret);
 }
@@ -805,18 +859,23 @@ struct btrfs_root *btrfs_read_fs_root(struct btrfs_fs_info *fs_info,
 
 	BUG_ON(location->objectid == BTRFS_TREE_RELOC_OBJECTID);
 
+	pthread_mutex_lock(&fs_info->fs_root_lock);
 	node = rb_search(&fs_info->fs_root_tree, (void *)&objectid,
 			 btrfs_fs_roots_compare_objectids, NULL);
-	if (node)
-		return container_of(node, struct btrfs_root, rb_node);
+	if (node) {
+		root = container_of(node, struct btrfs_root, rb_node);
+		goto out;
+	}
 
 	root = btrfs_read_fs_root_no_cache(fs_info, location);
 	if (IS_ERR(root))
-		return root;
+		goto out;
 
 	ret = rb_insert(&fs_info->fs_root_tree, &root->rb_node,
 			btrfs_fs_roots_compare_roots);
 	BUG_ON(ret);
+out:
+	pthread_mutex_unlock(&fs_info->fs_root_lock);
 	return root;
 }
 
@@ -832,6 +891,8 @@ FREE_RB_BASED_TREE(global_roots, __free_global_root);
 
 void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 {
+	btrfs_reada_free(fs_info);
+	extent_buffer_cache_unregister_shrinker(&fs_info->extent_cache);
 	if (fs_info->quota_root)
 		free(fs_info->quota_root);
 
@@ -868,6 +929,7 @@ struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 		goto free_all;
 
 	extent_io_tree_init(&fs_info->extent_cache);
+	extent_buffer_cache_register_shrinker(&fs_info->extent_cache);
 	extent_io_tree_init(&fs_info->free_space_cache);
 	extent_io_tree_init(&fs_info->pinned_extents);
 	extent_io_tree_init(&fs_info->extent_ins);
@@ -876,11 +938,13 @@ struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 	fs_info->excluded_extents = NULL;
 
 	fs_info->fs_root_tree = RB_ROOT;
+	pthread_mutex_init(&fs_info->fs_root_lock, NULL);
 	cache_tree_init(&fs_info->mapping_tree.cache_tree);
 
 	INIT_LIST_HEAD(&fs_info->dirty_cowonly_roots);
 	INIT_LIST_HEAD(&fs_info->space_info);
 	INIT_LIST_HEAD(&fs_info->recow_ebs);
+	pthread_mutex_init(&fs_info->recow_lock, NULL);
 
 	if (!writable)
 		fs_info->readonly = 1;
@@ -1343,6 +1407,7 @@ FREE_EXTENT_CACHE_BASED_TREE(mapping_cache, free_map_lookup);
 
 void btrfs_cleanup_all_caches(struct btrfs_fs_info *fs_info)
 {
+	pthread_mutex_lock(&fs_info->recow_lock);
 	while (!list_empty(&fs_info->recow_ebs)) {
 		struct extent_buffer *eb;
 		eb = list_first_entry(&fs_info->recow_ebs,
@@ -1350,6 +1415,7 @@ void btrfs_cleanup_all_caches(struct btrfs_fs_info *fs_info)
 		list_del_init(&eb->recow);
 		free_extent_buffer(eb);
 	}
+	pthread_mutex_unlock(&fs_info->recow_lock);
 	free_mapping_cache_tree(&fs_info->mapping_tree.cache_tree);
 	extent_io_tree_cleanup(&fs_info->extent_cache);
 	extent_io_tree_cleanup(&fs_info->free_space_cache);
@@ -1611,6 +1677,7 @@ out_chunk:
 	btrfs_release_all_roots(fs_info);
 	btrfs_cleanup_all_caches(fs_info);
 out_devices:
+	btrfs_reada_free(fs_info);
 	btrfs_close_devices(fs_devices);
 out:
 	btrfs_free_fs_info(fs_info);
@@ -2246,6 +2313,8 @@ skip_commit:
 	free_fs_roots_tree(&fs_info->fs_root_tree);
 
 	btrfs_release_all_roots(fs_info);
+	/* Readahead IO may be still in flight, finish it before closing */
+	btrfs_reada_free(fs_info);
 	ret = btrfs_close_devices(fs_info->fs_devices);
 	btrfs_cleanup_all_caches(fs_info);
 	btrfs_free_fs_info(fs_info);
@@ -2314,6 +2314,42 @@ error:
 	return ret;
 }
 
+/*
+ * Return the size of the largest free space in the block groups with @flags,
+ * an extent of that size can be reserved without failing on fragmentation.
+ */
+u64 btrfs_max_free_extent(struct btrfs_fs_info *fs_info, u64 flags)
+{
+	struct btrfs_block_group *cache;
+	u64 max_free = 0;
+	u64 next = 0;
+
+	while ((cache = btrfs_lookup_first_block_group(fs_info, next))) {
+		u64 end = cache->start + cache->length;
+		u64 last = cache->start;
+		u64 start;
+		u64 found_end;
+
+		next = end;
+		if (cache->ro || !block_group_bits(cache, flags))
+			continue;
+		if (cache_block_group(fs_info->tree_root, cache))
+			continue;
+		while (!find_first_extent_bit(&fs_info->free_space_cache, last,
+					      &start, &found_end, EXTENT_DIRTY)) {
+			if (start >= end)
+				break;
+			start = max(start, last);
+			found_end = min(found_end + 1, end);
+			max_free = max(max_free, found_end - start);
+			last = found_end;
+			if (last >= end)
+				break;
+		}
+	}
+	return max_free;
+}
+
 int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *root,
 			 u64 num_bytes, u64 empty_size,
@@ -3509,6 +3545,52 @@ next:
 	return 0;
 }
 
+/*
+ * Insert the extent item of a new data extent, its references are added
+ * when the file extents are recorded.
+ */
+static int insert_data_extent_item(struct btrfs_trans_handle *trans,
+				   struct btrfs_root *extent_root,
+				   struct btrfs_path *path,
+				   u64 disk_bytenr, u64 num_bytes)
+{
+	struct extent_buffer *leaf;
+	struct btrfs_extent_item *ei;
+	struct btrfs_key ins_key;
+	int ret;
+
+	ins_key.objectid = disk_bytenr;
+	ins_key.offset = num_bytes;
+	ins_key.type = BTRFS_EXTENT_ITEM_KEY;
+
+	ret = btrfs_insert_empty_item(trans, extent_root, path, &ins_key,
+				      sizeof(*ei));
+	if (ret == 0) {
+		leaf = path->nodes[0];
+		ei = btrfs_item_ptr(leaf, path->slots[0],
+				    struct btrfs_extent_item);
+
+		btrfs_set_extent_refs(leaf, ei, 0);
+		btrfs_set_extent_generation(leaf, ei, trans->transid);
+		btrfs_set_extent_flags(leaf, ei, BTRFS_EXTENT_FLAG_DATA);
+		btrfs_mark_buffer_dirty(leaf);
+
+		ret = btrfs_update_block_group(trans, disk_bytenr, num_bytes,
+					       1, 0);
+		if (ret)
+			return ret;
+	} else if (ret != -EEXIST) {
+		return ret;
+	}
+
+	ret = remove_from_free_space_tree(trans, disk_bytenr, num_bytes);
+	if (ret)
+		return ret;
+
+	btrfs_run_delayed_refs(trans, -1);
+	return 0;
+}
+
 static int __btrfs_record_file_extent(struct btrfs_trans_handle *trans,
 				      struct btrfs_root *root, u64 objectid,
 				      struct btrfs_inode_item *inode,
@@ -3522,7 +3604,6 @@ static int __btrfs_record_file_extent(struct btrfs_trans_handle *trans,
 	struct btrfs_file_extent_item *fi;
 	struct btrfs_key ins_key;
 	struct btrfs_path *path;
-	struct btrfs_extent_item *ei;
 	u64 nbytes;
 	u64 extent_num_bytes;
 	u64 extent_bytenr;
@@ -3576,36 +3657,10 @@ static int __btrfs_record_file_extent(struct btrfs_trans_handle *trans,
 	} else {
 		/* No overlap, create new extent */
 		btrfs_release_path(path);
-		ins_key.objectid = disk_bytenr;
-		ins_key.offset = num_bytes;
-		ins_key.type = BTRFS_EXTENT_ITEM_KEY;
-
-		ret = btrfs_insert_empty_item(trans, extent_root, path,
-					      &ins_key, sizeof(*ei));
-		if (ret == 0) {
-			leaf = path->nodes[0];
-			ei = btrfs_item_ptr(leaf, path->slots[0],
-					    struct btrfs_extent_item);
-
-			btrfs_set_extent_refs(leaf, ei, 0);
-			btrfs_set_extent_generation(leaf, ei, trans->transid);
-			btrfs_set_extent_flags(leaf, ei,
-					       BTRFS_EXTENT_FLAG_DATA);
-			btrfs_mark_buffer_dirty(leaf);
-
-			ret = btrfs_update_block_group(trans, disk_bytenr,
-						       num_bytes, 1, 0);
-			if (ret)
-				goto fail;
-		} else if (ret != -EEXIST) {
-			goto fail;
-		}
-
-		ret = remove_from_free_space_tree(trans, disk_bytenr, num_bytes);
+		ret = insert_data_extent_item(trans, extent_root, path,
+					      disk_bytenr, num_bytes);
 		if (ret)
 			goto fail;
-
-		btrfs_run_delayed_refs(trans, -1);
 		extent_bytenr = disk_bytenr;
 		extent_num_bytes = num_bytes;
 		extent_offset = 0;
@@ -3679,6 +3734,72 @@ int btrfs_record_file_extent(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+/*
+ * Record a compressed file extent, the whole data extent at @disk_bytenr of
+ * @disk_num_bytes holds the @ram_bytes of the file at @file_pos.
+ */
+int btrfs_record_compressed_file_extent(struct btrfs_trans_handle *trans,
+					struct btrfs_root *root, u64 objectid,
+					struct btrfs_inode_item *inode,
+					u64 file_pos, u64 disk_bytenr,
+					u64 disk_num_bytes, u64 ram_bytes,
+					u8 compression)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(root->fs_info,
+							   disk_bytenr);
+	struct extent_buffer *leaf;
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key ins_key;
+	struct btrfs_path *path;
+	int ret;
+
+	ASSERT(objectid >= BTRFS_FIRST_FREE_OBJECTID);
+	ASSERT(ram_bytes <= BTRFS_MAX_UNCOMPRESSED);
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	ret = insert_data_extent_item(trans, extent_root, path, disk_bytenr,
+				      disk_num_bytes);
+	if (ret)
+		goto fail;
+	btrfs_release_path(path);
+
+	ins_key.objectid = objectid;
+	ins_key.offset = file_pos;
+	ins_key.type = BTRFS_EXTENT_DATA_KEY;
+	ret = btrfs_insert_empty_item(trans, root, path, &ins_key,
+				      sizeof(*fi));
+	if (ret)
+		goto fail;
+	leaf = path->nodes[0];
+	fi = btrfs_item_ptr(leaf, path->slots[0],
+			    struct btrfs_file_extent_item);
+	btrfs_set_file_extent_generation(leaf, fi, trans->transid);
+	btrfs_set_file_extent_type(leaf, fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_file_extent_disk_bytenr(leaf, fi, disk_bytenr);
+	btrfs_set_file_extent_disk_num_bytes(leaf, fi, disk_num_bytes);
+	btrfs_set_file_extent_offset(leaf, fi, 0);
+	btrfs_set_file_extent_num_bytes(leaf, fi, ram_bytes);
+	btrfs_set_file_extent_ram_bytes(leaf, fi, ram_bytes);
+	btrfs_set_file_extent_compression(leaf, fi, compression);
+	btrfs_set_file_extent_encryption(leaf, fi, 0);
+	btrfs_set_file_extent_other_encoding(leaf, fi, 0);
+	btrfs_mark_buffer_dirty(leaf);
+
+	btrfs_set_stack_inode_nbytes(inode,
+			btrfs_stack_inode_nbytes(inode) + ram_bytes);
+	btrfs_release_path(path);
+
+	ret = btrfs_inc_extent_ref(trans, root, disk_bytenr, disk_num_bytes,
+				   0, root->root_key.objectid, objectid,
+				   file_pos);
+fail:
+	btrfs_free_path(path);
+	return ret;
+}
+
 
 static int add_excluded_extent(struct btrfs_fs_info *fs_info,
 			       u64 start, u64 num_bytes)
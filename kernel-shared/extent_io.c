@@ -27,20 +27,111 @@
 #include "kernel-shared/extent_io.h"
 #include "kernel-lib/list.h"
 #include "kernel-lib/raid56.h"
+#include "kernel-lib/bitops.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/disk-io.h"
+#include "kernel-shared/reada.h"
 #include "common/utils.h"
 #include "common/device-utils.h"
 #include "common/internal.h"
+#include "common/units.h"
+#include "common/mem-limit.h"
 
 void extent_io_tree_init(struct extent_io_tree *tree)
 {
+	int i;
+
 	cache_tree_init(&tree->state);
-	cache_tree_init(&tree->cache);
-	INIT_LIST_HEAD(&tree->lru);
-	tree->cache_size = 0;
-	tree->max_cache_size = (u64)total_memory() / 4;
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS; i++) {
+		struct extent_buffer_shard *shard = &tree->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		pthread_mutex_init(&shard->read_lock, NULL);
+		cache_tree_init(&shard->cache);
+		INIT_LIST_HEAD(&shard->lru);
+		INIT_LIST_HEAD(&shard->hot);
+		cache_tree_init(&shard->ghost);
+		INIT_LIST_HEAD(&shard->ghost_lru);
+		shard->cache_size = 0;
+		shard->hot_size = 0;
+		shard->ghost_size = 0;
+		memset(&shard->stats, 0, sizeof(shard->stats));
+	}
+	/* With a global memory limit the shrinker keeps the cache in check */
+	tree->max_cache_size = btrfs_mem_get_limit();
+	if (!tree->max_cache_size)
+		tree->max_cache_size = (u64)total_memory() / 4;
+	INIT_LIST_HEAD(&tree->shrinker.list);
+}
+
+static inline unsigned int eb_shard_index(u64 bytenr)
+{
+	return (bytenr >> EXTENT_BUFFER_SHARD_SHIFT) &
+		(EXTENT_BUFFER_CACHE_SHARDS - 1);
+}
+
+static inline struct extent_buffer_shard *eb_shard(struct extent_io_tree *tree,
+						   u64 bytenr)
+{
+	return &tree->shards[eb_shard_index(bytenr)];
+}
+
+/*
+ * Serialize filling @eb from disk against other readers of the same shard,
+ * the caller has to recheck whether the block got uptodate meanwhile.
+ */
+void lock_extent_buffer_read(struct extent_buffer *eb)
+{
+	pthread_mutex_lock(&eb_shard(&eb->fs_info->extent_cache,
+				     eb->start)->read_lock);
+}
+
+void unlock_extent_buffer_read(struct extent_buffer *eb)
+{
+	pthread_mutex_unlock(&eb_shard(&eb->fs_info->extent_cache,
+				       eb->start)->read_lock);
+}
+
+/*
+ * Return the mask of shards that may contain a cached extent buffer
+ * overlapping the range [@bytenr, @bytenr + @len). A cached eb is at most
+ * BTRFS_MAX_METADATA_BLOCKSIZE large, so it can only start in one of the
+ * slices covering [@bytenr - BTRFS_MAX_METADATA_BLOCKSIZE + 1, @bytenr + @len).
+ */
+static u32 eb_shard_mask(u64 bytenr, u32 len)
+{
+	u64 first = bytenr - min_t(u64, bytenr, BTRFS_MAX_METADATA_BLOCKSIZE - 1);
+	u64 last = bytenr + len - 1;
+	u64 slice;
+	u32 mask = 0;
+
+	first >>= EXTENT_BUFFER_SHARD_SHIFT;
+	last >>= EXTENT_BUFFER_SHARD_SHIFT;
+	if (last - first >= EXTENT_BUFFER_CACHE_SHARDS - 1)
+		return (1U << EXTENT_BUFFER_CACHE_SHARDS) - 1;
+	for (slice = first; slice <= last; slice++)
+		mask |= 1U << (slice & (EXTENT_BUFFER_CACHE_SHARDS - 1));
+	return mask;
+}
+
+/* Shards are always locked in ascending order to avoid ABBA deadlocks */
+static void lock_eb_shards(struct extent_io_tree *tree, u32 mask)
+{
+	int i;
+
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS; i++)
+		if (mask & (1U << i))
+			pthread_mutex_lock(&tree->shards[i].lock);
+}
+
+static void unlock_eb_shards(struct extent_io_tree *tree, u32 mask)
+{
+	int i;
+
+	for (i = EXTENT_BUFFER_CACHE_SHARDS - 1; i >= 0; i--)
+		if (mask & (1U << i))
+			pthread_mutex_unlock(&tree->shards[i].lock);
 }
 
 static struct extent_state *alloc_extent_state(void)
@@ -73,26 +164,55 @@ static void free_extent_state_func(struct cache_extent *cache)
 	btrfs_free_extent_state(es);
 }
 
+/*
+ * Evicted block that is only remembered by its location, if it's requested
+ * again soon it's worth keeping in the protected list.
+ */
+struct extent_buffer_ghost {
+	struct cache_extent cache;
+	struct list_head list;
+};
+
+static void free_ghost(struct extent_buffer_shard *shard,
+		       struct extent_buffer_ghost *ghost)
+{
+	remove_cache_extent(&shard->ghost, &ghost->cache);
+	list_del(&ghost->list);
+	shard->ghost_size -= ghost->cache.size;
+	free(ghost);
+}
+
 static void free_extent_buffer_final(struct extent_buffer *eb);
 void extent_io_tree_cleanup(struct extent_io_tree *tree)
 {
 	struct extent_buffer *eb;
+	int i;
 
-	while(!list_empty(&tree->lru)) {
-		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
-		if (eb->refs) {
-			/*
-			 * Reset extent buffer refs to 1, so the
-			 * free_extent_buffer_nocache() can free it for sure.
-			 */
-			eb->refs = 1;
-			fprintf(stderr,
-				"extent buffer leak: start %llu len %u\n",
-				(unsigned long long)eb->start, eb->len);
-			free_extent_buffer_nocache(eb);
-		} else {
-			free_extent_buffer_final(eb);
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS; i++) {
+		struct extent_buffer_shard *shard = &tree->shards[i];
+
+		list_splice_tail_init(&shard->hot, &shard->lru);
+		while(!list_empty(&shard->lru)) {
+			eb = list_entry(shard->lru.next, struct extent_buffer,
+					lru);
+			if (atomic_read(&eb->refs)) {
+				/*
+				 * Reset extent buffer refs to 1, so the
+				 * free_extent_buffer_nocache() can free it for
+				 * sure.
+				 */
+				atomic_set(&eb->refs, 1);
+				fprintf(stderr,
+					"extent buffer leak: start %llu len %u\n",
+					(unsigned long long)eb->start, eb->len);
+				free_extent_buffer_nocache(eb);
+			} else {
+				free_extent_buffer_final(eb);
+			}
 		}
+		while (!list_empty(&shard->ghost_lru))
+			free_ghost(shard, list_first_entry(&shard->ghost_lru,
+					struct extent_buffer_ghost, list));
 	}
 
 	cache_tree_free_extents(&tree->state, free_extent_state_func);
@@ -613,7 +733,7 @@ static struct extent_buffer *__alloc_extent_buffer(struct btrfs_fs_info *info,
 
 	eb->start = bytenr;
 	eb->len = blocksize;
-	eb->refs = 1;
+	atomic_set(&eb->refs, 1);
 	eb->flags = 0;
 	eb->cache_node.start = bytenr;
 	eb->cache_node.size = blocksize;
@@ -639,18 +759,60 @@ struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 	return new;
 }
 
-static void free_extent_buffer_final(struct extent_buffer *eb)
+/* Must be called with the shard of @eb locked */
+static void __free_extent_buffer_final(struct extent_buffer_shard *shard,
+				       struct extent_buffer *eb)
 {
-	BUG_ON(eb->refs);
+	BUG_ON(atomic_read(&eb->refs));
 	list_del_init(&eb->lru);
-	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
-		struct extent_io_tree *tree = &eb->fs_info->extent_cache;
+	remove_cache_extent(&shard->cache, &eb->cache_node);
+	BUG_ON(shard->cache_size < eb->len);
+	shard->cache_size -= eb->len;
+	if (eb->hot)
+		shard->hot_size -= eb->len;
+	btrfs_mem_uncharge(BTRFS_MEM_TREE_BLOCKS, sizeof(*eb) + eb->len);
+	free(eb);
+}
+
+static void free_extent_buffer_final(struct extent_buffer *eb)
+{
+	struct extent_buffer_shard *shard;
 
-		remove_cache_extent(&tree->cache, &eb->cache_node);
-		BUG_ON(tree->cache_size < eb->len);
-		tree->cache_size -= eb->len;
+	if (eb->flags & EXTENT_BUFFER_DUMMY) {
+		BUG_ON(atomic_read(&eb->refs));
+		free(eb);
+		return;
 	}
-	free(eb);
+
+	shard = eb_shard(&eb->fs_info->extent_cache, eb->start);
+	pthread_mutex_lock(&shard->lock);
+	/* Somebody could have found it in the cache in the meantime */
+	if (atomic_read(&eb->refs) == 0)
+		__free_extent_buffer_final(shard, eb);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Drop one reference of @eb, return true if it was the last one. The eb stays
+ * in the cache until it gets trimmed.
+ */
+static bool put_extent_buffer(struct extent_buffer *eb)
+{
+	int refs;
+
+	refs = atomic_dec_return(&eb->refs);
+	BUG_ON(refs < 0);
+	if (refs)
+		return false;
+
+	if (extent_buffer_test_flags(eb, EXTENT_DIRTY)) {
+		warning(
+		"dirty eb leak (aborted trans): start %llu len %u",
+			eb->start, eb->len);
+	}
+	/* Being on fs_info::recow_ebs holds a reference */
+	WARN_ON(!list_empty(&eb->recow));
+	return true;
 }
 
 static void free_extent_buffer_internal(struct extent_buffer *eb, bool free_now)
@@ -658,18 +820,9 @@ static void free_extent_buffer_internal(struct extent_buffer *eb, bool free_now)
 	if (!eb || IS_ERR(eb))
 		return;
 
-	eb->refs--;
-	BUG_ON(eb->refs < 0);
-	if (eb->refs == 0) {
-		if (eb->flags & EXTENT_DIRTY) {
-			warning(
-			"dirty eb leak (aborted trans): start %llu len %u",
-				eb->start, eb->len);
-		}
-		list_del_init(&eb->recow);
-		if (eb->flags & EXTENT_BUFFER_DUMMY || free_now)
-			free_extent_buffer_final(eb);
-	}
+	if (put_extent_buffer(eb) &&
+	    (eb->flags & EXTENT_BUFFER_DUMMY || free_now))
+		free_extent_buffer_final(eb);
 }
 
 void free_extent_buffer(struct extent_buffer *eb)
@@ -682,86 +835,318 @@ void free_extent_buffer_nocache(struct extent_buffer *eb)
 	free_extent_buffer_internal(eb, 1);
 }
 
-struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
-					 u64 bytenr, u32 blocksize)
+/* Must be called with @shard locked */
+static struct extent_buffer *lookup_extent_buffer(
+		struct extent_buffer_shard *shard, u64 bytenr, u32 blocksize)
 {
 	struct extent_buffer *eb = NULL;
 	struct cache_extent *cache;
 
-	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
+	cache = lookup_cache_extent(&shard->cache, bytenr, blocksize);
 	if (cache && cache->start == bytenr &&
 	    cache->size == blocksize) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		/*
+		 * Hits on the probation FIFO are usually correlated (the same
+		 * block looked up several times by one operation), don't let
+		 * them reorder it.
+		 */
+		if (eb->hot)
+			list_move_tail(&eb->lru, &shard->hot);
+		extent_buffer_get(eb);
+		shard->stats.hits++;
 	}
 	return eb;
 }
 
+struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
+					 u64 bytenr, u32 blocksize)
+{
+	struct extent_buffer_shard *shard = eb_shard(tree, bytenr);
+	struct extent_buffer *eb;
+
+	pthread_mutex_lock(&shard->lock);
+	eb = lookup_extent_buffer(shard, bytenr, blocksize);
+	pthread_mutex_unlock(&shard->lock);
+	return eb;
+}
+
+/*
+ * Return the cached extent buffer containing @start or the first one after
+ * it. This has to look into all shards, it's meant for the transaction commit
+ * and not for hot paths.
+ */
 struct extent_buffer *find_first_extent_buffer(struct extent_io_tree *tree,
 					       u64 start)
 {
+	struct extent_buffer_shard *found_shard = NULL;
 	struct extent_buffer *eb = NULL;
-	struct cache_extent *cache;
+	const u32 all = (1U << EXTENT_BUFFER_CACHE_SHARDS) - 1;
+	int i;
 
-	cache = search_cache_extent(&tree->cache, start);
-	if (cache) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+	lock_eb_shards(tree, all);
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS; i++) {
+		struct cache_extent *cache;
+
+		cache = search_cache_extent(&tree->shards[i].cache, start);
+		if (cache && (!eb || cache->start < eb->start)) {
+			eb = container_of(cache, struct extent_buffer,
+					  cache_node);
+			found_shard = &tree->shards[i];
+		}
+	}
+	if (eb) {
+		if (eb->hot)
+			list_move_tail(&eb->lru, &found_shard->hot);
+		extent_buffer_get(eb);
 	}
+	unlock_eb_shards(tree, all);
 	return eb;
 }
 
-static void trim_extent_buffer_cache(struct extent_io_tree *tree)
+/* Must be called with @shard locked */
+static void promote_extent_buffer(struct extent_buffer_shard *shard,
+				  struct extent_buffer *eb)
+{
+	list_move_tail(&eb->lru, &shard->hot);
+	eb->hot = true;
+	shard->hot_size += eb->len;
+	shard->stats.promotions++;
+}
+
+/* Must be called with @shard locked */
+static void remember_evicted(struct extent_buffer_shard *shard,
+			     struct extent_buffer *eb, u64 max_size)
+{
+	struct extent_buffer_ghost *ghost;
+
+	ghost = malloc(sizeof(*ghost));
+	if (!ghost)
+		return;
+	ghost->cache.start = eb->start;
+	ghost->cache.size = eb->len;
+	if (insert_cache_extent(&shard->ghost, &ghost->cache)) {
+		free(ghost);
+		return;
+	}
+	list_add_tail(&ghost->list, &shard->ghost_lru);
+	shard->ghost_size += eb->len;
+	while (shard->ghost_size > max_size)
+		free_ghost(shard, list_first_entry(&shard->ghost_lru,
+				struct extent_buffer_ghost, list));
+}
+
+/*
+ * Evict unused blocks from @shard until its size drops to @target, return the
+ * number of bytes freed. Must be called with @shard locked.
+ */
+static u64 evict_extent_buffers(struct extent_io_tree *tree,
+				struct extent_buffer_shard *shard, u64 target)
 {
 	struct extent_buffer *eb, *tmp;
+	u64 max_size = tree->max_cache_size / EXTENT_BUFFER_CACHE_SHARDS;
+	u64 freed = 0;
+
+	/* Evict from the probation FIFO as long as it's above its share */
+	list_for_each_entry_safe(eb, tmp, &shard->lru, lru) {
+		if (shard->cache_size <= target ||
+		    shard->cache_size - shard->hot_size <= max_size / 4)
+			break;
+		if (atomic_read(&eb->refs))
+			continue;
+		if (extent_buffer_uptodate(eb) && btrfs_header_level(eb) > 0) {
+			promote_extent_buffer(shard, eb);
+			continue;
+		}
+		remember_evicted(shard, eb, max_size / 2);
+		freed += sizeof(*eb) + eb->len;
+		__free_extent_buffer_final(shard, eb);
+		shard->stats.evictions++;
+	}
 
-	list_for_each_entry_safe(eb, tmp, &tree->lru, lru) {
-		if (eb->refs == 0)
-			free_extent_buffer_final(eb);
-		if (tree->cache_size <= ((tree->max_cache_size * 9) / 10))
+	list_for_each_entry_safe(eb, tmp, &shard->hot, lru) {
+		if (shard->cache_size <= target)
 			break;
+		if (atomic_read(&eb->refs))
+			continue;
+		freed += sizeof(*eb) + eb->len;
+		__free_extent_buffer_final(shard, eb);
+		shard->stats.evictions++;
+	}
+	return freed;
+}
+
+/* Must be called with @shard locked */
+static void trim_extent_buffer_cache(struct extent_io_tree *tree,
+				     struct extent_buffer_shard *shard)
+{
+	u64 max_size = tree->max_cache_size / EXTENT_BUFFER_CACHE_SHARDS;
+
+	evict_extent_buffers(tree, shard, (max_size * 9) / 10);
+}
+
+static u64 shrink_extent_buffer_cache(struct btrfs_mem_shrinker *shrinker,
+				      u64 bytes)
+{
+	struct extent_io_tree *tree = container_of(shrinker,
+					struct extent_io_tree, shrinker);
+	u64 per_shard = DIV_ROUND_UP(bytes, EXTENT_BUFFER_CACHE_SHARDS);
+	u64 freed = 0;
+	int i;
+
+	/* Take an even share from all shards first, then whatever is left */
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS * 2 && freed < bytes; i++) {
+		struct extent_buffer_shard *shard;
+		u64 target;
+
+		shard = &tree->shards[i % EXTENT_BUFFER_CACHE_SHARDS];
+		pthread_mutex_lock(&shard->lock);
+		if (i < EXTENT_BUFFER_CACHE_SHARDS)
+			target = shard->cache_size - min(shard->cache_size, per_shard);
+		else
+			target = 0;
+		freed += evict_extent_buffers(tree, shard, target);
+		pthread_mutex_unlock(&shard->lock);
 	}
+	return freed;
+}
+
+/*
+ * Let the cache be shrunk when the global memory limit is hit, only used for
+ * the tree block cache of a filesystem.
+ */
+void extent_buffer_cache_register_shrinker(struct extent_io_tree *tree)
+{
+	tree->shrinker.shrink = shrink_extent_buffer_cache;
+	btrfs_mem_register_shrinker(&tree->shrinker);
+}
+
+void extent_buffer_cache_unregister_shrinker(struct extent_io_tree *tree)
+{
+	if (tree->shrinker.shrink)
+		btrfs_mem_unregister_shrinker(&tree->shrinker);
 }
 
 struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 					  u64 bytenr, u32 blocksize)
 {
 	struct extent_buffer *eb;
+	struct extent_buffer *new;
 	struct extent_io_tree *tree = &fs_info->extent_cache;
-	struct cache_extent *cache;
+	struct extent_buffer_shard *shard = eb_shard(tree, bytenr);
+	struct cache_extent *cache = NULL;
+	u32 mask;
+	int ret;
+	int i;
 
-	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
+	eb = find_extent_buffer(tree, bytenr, blocksize);
+	if (eb)
+		return eb;
+
+	/* Allocate outside of the locks, it's usually going to be inserted */
+	new = __alloc_extent_buffer(fs_info, bytenr, blocksize);
+	if (!new)
+		return NULL;
+
+	/*
+	 * Lock all shards where an overlapping eb could live, as a different
+	 * thread may have raced with us.
+	 */
+	mask = eb_shard_mask(bytenr, blocksize);
+	lock_eb_shards(tree, mask);
+	eb = lookup_extent_buffer(shard, bytenr, blocksize);
+	if (eb) {
+		free(new);
+		goto out;
+	}
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS && !cache; i++) {
+		if (mask & (1U << i))
+			cache = lookup_cache_extent(&tree->shards[i].cache,
+						    bytenr, blocksize);
+	}
+	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		put_extent_buffer(eb);
+		free(new);
+		eb = NULL;
+		goto out;
+	}
+	ret = insert_cache_extent(&shard->cache, &new->cache_node);
+	if (ret) {
+		free(new);
+		goto out;
+	}
+	eb = new;
+	shard->stats.misses++;
+	shard->cache_size += blocksize;
+	btrfs_mem_charge(BTRFS_MEM_TREE_BLOCKS, sizeof(*eb) + blocksize);
+	cache = lookup_cache_extent(&shard->ghost, bytenr, blocksize);
+	if (cache && cache->start == bytenr && cache->size == blocksize) {
+		free_ghost(shard, container_of(cache,
+				struct extent_buffer_ghost, cache));
+		list_add_tail(&eb->lru, &shard->hot);
+		eb->hot = true;
+		shard->hot_size += blocksize;
+		shard->stats.ghost_hits++;
 	} else {
-		int ret;
-
-		if (cache) {
-			eb = container_of(cache, struct extent_buffer,
-					  cache_node);
-			free_extent_buffer(eb);
-		}
-		eb = __alloc_extent_buffer(fs_info, bytenr, blocksize);
-		if (!eb)
-			return NULL;
-		ret = insert_cache_extent(&tree->cache, &eb->cache_node);
-		if (ret) {
-			free(eb);
-			return NULL;
-		}
-		list_add_tail(&eb->lru, &tree->lru);
-		tree->cache_size += blocksize;
-		if (tree->cache_size >= tree->max_cache_size)
-			trim_extent_buffer_cache(tree);
+		list_add_tail(&eb->lru, &shard->lru);
 	}
+	if (shard->cache_size >= tree->max_cache_size / EXTENT_BUFFER_CACHE_SHARDS)
+		trim_extent_buffer_cache(tree, shard);
+out:
+	unlock_eb_shards(tree, mask);
+	btrfs_mem_reclaim();
 	return eb;
 }
 
+void extent_buffer_cache_get_stats(struct extent_io_tree *tree,
+				   struct extent_buffer_cache_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < EXTENT_BUFFER_CACHE_SHARDS; i++) {
+		struct extent_buffer_shard *shard = &tree->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->hits += shard->stats.hits;
+		stats->misses += shard->stats.misses;
+		stats->evictions += shard->stats.evictions;
+		stats->promotions += shard->stats.promotions;
+		stats->ghost_hits += shard->stats.ghost_hits;
+		stats->cache_size += shard->cache_size;
+		stats->hot_size += shard->hot_size;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void btrfs_print_cache_stats(struct btrfs_fs_info *fs_info)
+{
+	struct extent_buffer_cache_stats stats;
+	struct btrfs_reada_stats reada;
+	u64 lookups;
+
+	extent_buffer_cache_get_stats(&fs_info->extent_cache, &stats);
+	lookups = stats.hits + stats.misses;
+	printf("Metadata cache statistics:\n");
+	printf("\tlookups:\t%llu\n", lookups);
+	printf("\thits:\t\t%llu (%.1f%%)\n", stats.hits,
+	       lookups ? stats.hits * 100.0 / lookups : 0.0);
+	printf("\tmisses:\t\t%llu\n", stats.misses);
+	printf("\tghost hits:\t%llu\n", stats.ghost_hits);
+	printf("\tpromotions:\t%llu\n", stats.promotions);
+	printf("\tevictions:\t%llu\n", stats.evictions);
+	printf("\tcached:\t\t%s (protected %s, limit %s)\n",
+	       pretty_size(stats.cache_size), pretty_size(stats.hot_size),
+	       pretty_size(fs_info->extent_cache.max_cache_size));
+
+	btrfs_reada_get_stats(fs_info, &reada);
+	printf("Readahead statistics:\n");
+	printf("\tissued:\t\t%llu\n", reada.issued);
+	printf("\tused:\t\t%llu\n", reada.hits);
+	printf("\tdropped:\t%llu\n", reada.dropped);
+}
+
 /*
  * Allocate a dummy extent buffer which won't be inserted into extent buffer
  * cache.
@@ -1041,8 +1426,8 @@ out:
 int set_extent_buffer_dirty(struct extent_buffer *eb)
 {
 	struct extent_io_tree *tree = &eb->fs_info->extent_cache;
-	if (!(eb->flags & EXTENT_DIRTY)) {
-		eb->flags |= EXTENT_DIRTY;
+	if (!extent_buffer_test_flags(eb, EXTENT_DIRTY)) {
+		extent_buffer_set_flags(eb, EXTENT_DIRTY);
 		set_extent_dirty(tree, eb->start, eb->start + eb->len - 1);
 		extent_buffer_get(eb);
 	}
@@ -1052,8 +1437,8 @@ int set_extent_buffer_dirty(struct extent_buffer *eb)
 int clear_extent_buffer_dirty(struct extent_buffer *eb)
 {
 	struct extent_io_tree *tree = &eb->fs_info->extent_cache;
-	if (eb->flags & EXTENT_DIRTY) {
-		eb->flags &= ~EXTENT_DIRTY;
+	if (extent_buffer_test_flags(eb, EXTENT_DIRTY)) {
+		extent_buffer_clear_flags(eb, EXTENT_DIRTY);
 		clear_extent_dirty(tree, eb->start, eb->start + eb->len - 1);
 		free_extent_buffer(eb);
 	}
@@ -20,7 +20,10 @@
 #define __BTRFS_EXTENT_IO_H__
 
 #include "kerncompat.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include "common/extent-cache.h"
+#include "common/mem-limit.h"
 #include "kernel-lib/list.h"
 
 #define EXTENT_DIRTY		(1U << 0)
@@ -62,12 +65,58 @@ static inline int le_test_bit(int nr, const u8 *addr)
 
 struct btrfs_fs_info;
 
-struct extent_io_tree {
-	struct cache_tree state;
+/*
+ * The extent buffer cache is split into shards, each with its own lock, tree
+ * and LRU, so that lookups of different blocks from several threads rarely
+ * contend. The logical address space is cut into slices of the maximum
+ * nodesize that are assigned to the shards round robin, so a tree block
+ * always belongs to the shard of the slice containing its start.
+ *
+ * Eviction follows the 2Q scheme so that a single pass over a large tree
+ * does not flush the blocks needed by every other lookup. New blocks enter
+ * the probation FIFO (@lru) and stay there when hit again. Blocks that get
+ * requested again shortly after eviction from the FIFO (remembered in the
+ * @ghost tree) enter the protected LRU (@hot), which is only trimmed once
+ * the FIFO is down to a quarter of the cache. Tree nodes are moved to @hot
+ * instead of being evicted from the FIFO, as every path through the tree
+ * goes through them.
+ */
+#define EXTENT_BUFFER_CACHE_SHARDS	16
+#define EXTENT_BUFFER_SHARD_SHIFT	16
+
+struct extent_buffer_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	/* Moved from probation to the protected list */
+	u64 promotions;
+	/* Misses on blocks recently evicted from probation */
+	u64 ghost_hits;
+	u64 cache_size;
+	u64 hot_size;
+};
+
+struct extent_buffer_shard {
+	pthread_mutex_t lock;
+	/* Held while filling a block from disk so it is read only once */
+	pthread_mutex_t read_lock;
 	struct cache_tree cache;
 	struct list_head lru;
+	struct list_head hot;
+	struct cache_tree ghost;
+	struct list_head ghost_lru;
 	u64 cache_size;
+	u64 hot_size;
+	u64 ghost_size;
+	struct extent_buffer_cache_stats stats;
+};
+
+struct extent_io_tree {
+	struct cache_tree state;
+	struct extent_buffer_shard shards[EXTENT_BUFFER_CACHE_SHARDS];
+	/* Limit for all shards together */
 	u64 max_cache_size;
+	struct btrfs_mem_shrinker shrinker;
 };
 
 struct extent_state {
@@ -85,18 +134,39 @@ struct extent_buffer {
 	struct list_head lru;
 	struct list_head recow;
 	u32 len;
-	int refs;
+	atomic_t refs;
+	/* Readers of several threads update it, use the helpers below */
 	u32 flags;
+	/* On the protected LRU of its shard, protected by the shard lock */
+	bool hot;
 	struct btrfs_fs_info *fs_info;
 	char data[] __attribute__((aligned(8)));
 };
 
 static inline void extent_buffer_get(struct extent_buffer *eb)
 {
-	eb->refs++;
+	atomic_inc(&eb->refs);
+}
+
+static inline void extent_buffer_set_flags(struct extent_buffer *eb, u32 bits)
+{
+	__atomic_fetch_or(&eb->flags, bits, __ATOMIC_RELEASE);
+}
+
+static inline void extent_buffer_clear_flags(struct extent_buffer *eb,
+					     u32 bits)
+{
+	__atomic_fetch_and(&eb->flags, ~bits, __ATOMIC_RELEASE);
+}
+
+static inline bool extent_buffer_test_flags(struct extent_buffer *eb, u32 bits)
+{
+	return __atomic_load_n(&eb->flags, __ATOMIC_ACQUIRE) & bits;
 }
 
 void extent_io_tree_init(struct extent_io_tree *tree);
+void lock_extent_buffer_read(struct extent_buffer *eb);
+void unlock_extent_buffer_read(struct extent_buffer *eb);
 void extent_io_tree_cleanup(struct extent_io_tree *tree);
 int set_extent_bits(struct extent_io_tree *tree, u64 start, u64 end, int bits);
 int clear_extent_bits(struct extent_io_tree *tree, u64 start, u64 end, int bits);
@@ -108,13 +178,13 @@ int set_extent_dirty(struct extent_io_tree *tree, u64 start, u64 end);
 int clear_extent_dirty(struct extent_io_tree *tree, u64 start, u64 end);
 static inline int set_extent_buffer_uptodate(struct extent_buffer *eb)
 {
-	eb->flags |= EXTENT_UPTODATE;
+	extent_buffer_set_flags(eb, EXTENT_UPTODATE);
 	return 0;
 }
 
 static inline int clear_extent_buffer_uptodate(struct extent_buffer *eb)
 {
-	eb->flags &= ~EXTENT_UPTODATE;
+	extent_buffer_clear_flags(eb, EXTENT_UPTODATE);
 	return 0;
 }
 
@@ -122,7 +192,7 @@ static inline int extent_buffer_uptodate(struct extent_buffer *eb)
 {
 	if (!eb || IS_ERR(eb))
 		return 0;
-	if (eb->flags & EXTENT_UPTODATE)
+	if (extent_buffer_test_flags(eb, EXTENT_UPTODATE))
 		return 1;
 	return 0;
 }
@@ -140,6 +210,11 @@ struct extent_buffer *alloc_dummy_extent_buffer(struct btrfs_fs_info *fs_info,
 						u64 bytenr, u32 blocksize);
 void free_extent_buffer(struct extent_buffer *eb);
 void free_extent_buffer_nocache(struct extent_buffer *eb);
+void extent_buffer_cache_get_stats(struct extent_io_tree *tree,
+				   struct extent_buffer_cache_stats *stats);
+void btrfs_print_cache_stats(struct btrfs_fs_info *fs_info);
+void extent_buffer_cache_register_shrinker(struct extent_io_tree *tree);
+void extent_buffer_cache_unregister_shrinker(struct extent_io_tree *tree);
 int memcmp_extent_buffer(const struct extent_buffer *eb, const void *ptrv,
 			 unsigned long start, unsigned long len);
 void read_extent_buffer(const struct extent_buffer *eb, void *dst,
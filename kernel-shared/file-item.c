@@ -129,211 +129,182 @@ fail:
 	return err;
 }
 
-static struct btrfs_csum_item *
-btrfs_lookup_csum(struct btrfs_trans_handle *trans,
-		  struct btrfs_root *root,
-		  struct btrfs_path *path,
-		  u64 bytenr, int cow)
+/*
+ * Find the key following the last item of the leaf in @path, from the upper
+ * levels of the path. Returns 1 if the leaf is the last one.
+ */
+static int csum_leaf_next_key(struct btrfs_path *path, struct btrfs_key *key)
 {
-	int ret;
-	struct btrfs_key file_key;
-	struct btrfs_key found_key;
-	struct btrfs_csum_item *item;
-	struct extent_buffer *leaf;
-	u64 csum_offset = 0;
-	u16 csum_type = root->fs_info->csum_type;
-	u16 csum_size = root->fs_info->csum_size;
-	int csums_in_item;
-
-	file_key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
-	file_key.offset = bytenr;
-	file_key.type = BTRFS_EXTENT_CSUM_KEY;
-	ret = btrfs_search_slot(trans, root, &file_key, path, 0, cow);
-	if (ret < 0)
-		goto fail;
-	leaf = path->nodes[0];
+	int level;
 
-	if (leaf->fs_info->force_csum_type != -1) {
-		csum_type = root->fs_info->force_csum_type;
-		csum_size = btrfs_csum_type_size(csum_type);
-	}
+	for (level = 1; level < BTRFS_MAX_LEVEL; level++) {
+		struct extent_buffer *node = path->nodes[level];
+		int slot = path->slots[level] + 1;
 
-	if (ret > 0) {
-		ret = 1;
-		if (path->slots[0] == 0)
-			goto fail;
-		path->slots[0]--;
-		btrfs_item_key_to_cpu(leaf, &found_key, path->slots[0]);
-		if (found_key.type != BTRFS_EXTENT_CSUM_KEY)
-			goto fail;
-
-		csum_offset = (bytenr - found_key.offset) /
-				root->fs_info->sectorsize;
-		csums_in_item = btrfs_item_size(leaf, path->slots[0]);
-		csums_in_item /= csum_size;
-
-		if (csum_offset >= csums_in_item) {
-			ret = -EFBIG;
-			goto fail;
+		if (!node)
+			break;
+		if (slot < btrfs_header_nritems(node)) {
+			btrfs_node_key_to_cpu(node, key, slot);
+			return 0;
 		}
 	}
-	item = btrfs_item_ptr(leaf, path->slots[0], struct btrfs_csum_item);
-	item = (struct btrfs_csum_item *)((unsigned char *)item +
-					  csum_offset * csum_size);
-	return item;
-fail:
-	if (ret > 0)
-		ret = -ENOENT;
-	return ERR_PTR(ret);
+	return 1;
 }
 
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
-			  u64 alloc_end, u64 bytenr, char *data, size_t len)
+/*
+ * Insert the checksums @csums of the sectors of @len bytes at @bytenr, both
+ * must be sector aligned. The checksums are packed by the checksum size.
+ *
+ * The checksums are written a leaf at a time: those already in the tree are
+ * overwritten, the item ending right before the range is extended as far as
+ * the leaf allows and the rest goes to new items filling the gaps up to the
+ * next item.
+ */
+int btrfs_insert_data_csums(struct btrfs_trans_handle *trans, u64 bytenr,
+			    u64 len, const u8 *csums)
 {
-	struct btrfs_root *root = btrfs_csum_root(trans->fs_info, bytenr);
-	int ret = 0;
-	struct btrfs_key file_key;
-	struct btrfs_key found_key;
-	u64 next_offset = (u64)-1;
-	int found_next = 0;
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_root *root = btrfs_csum_root(fs_info, bytenr);
 	struct btrfs_path *path;
-	struct btrfs_csum_item *item;
-	struct extent_buffer *leaf = NULL;
-	u64 csum_offset;
-	u8 csum_result[BTRFS_CSUM_SIZE];
-	u32 sectorsize = root->fs_info->sectorsize;
-	u32 nritems;
-	u32 ins_size;
-	u16 csum_size = root->fs_info->csum_size;
-	u16 csum_type = root->fs_info->csum_type;
+	struct btrfs_key key;
+	struct btrfs_key found_key;
+	struct extent_buffer *leaf;
+	u32 sectorsize = fs_info->sectorsize;
+	u16 csum_size = fs_info->csum_size;
+	u64 nr_csums = len / sectorsize;
+	u64 done = 0;
+	u32 max_csums;
+	int ret = 0;
 
-	if (root->fs_info->force_csum_type != -1) {
-		/* printf("CSUM DATA: offset %llu (%d -> %d)\n", bytenr, csum_type, root->fs_info->force_csum_type); */
-		csum_type = root->fs_info->force_csum_type;
-		csum_size = btrfs_csum_type_size(csum_type);
-	}
+	if (!IS_ALIGNED(bytenr, sectorsize) || !IS_ALIGNED(len, sectorsize))
+		return -EINVAL;
+
+	if (fs_info->force_csum_type != -1)
+		csum_size = btrfs_csum_type_size(fs_info->force_csum_type);
+	max_csums = MAX_CSUM_ITEMS(root, csum_size);
 
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
 
-	file_key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
-	file_key.offset = bytenr;
-	file_key.type = BTRFS_EXTENT_CSUM_KEY;
-
-	item = btrfs_lookup_csum(trans, root, path, bytenr, 1);
-	if (!IS_ERR(item)) {
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	while (done < nr_csums) {
+		u64 left = nr_csums - done;
+		u64 next_offset = (u64)-1;
+		u64 csum_offset = 0;
+		u32 item_csums;
+		u64 nr;
+		int slot;
+
+		key.offset = bytenr + done * sectorsize;
+		ret = btrfs_search_slot(trans, root, &key, path, csum_size, 1);
+		if (ret < 0)
+			goto out;
 		leaf = path->nodes[0];
-		ret = 0;
-		goto found;
-	}
-	ret = PTR_ERR(item);
-	if (ret == -EFBIG) {
-		u32 item_size;
+		slot = path->slots[0];
+		if (ret == 0) {
+			/* An item starts right here, overwrite its checksums */
+			item_csums = btrfs_item_size(leaf, slot) / csum_size;
+			nr = min_t(u64, left, item_csums);
+			goto write;
+		}
 
-		/* printf("item not big enough for bytenr %llu\n", bytenr); */
-		/* we found one, but it isn't big enough yet */
-		leaf = path->nodes[0];
-		item_size = btrfs_item_size(leaf, path->slots[0]);
-		if ((item_size / csum_size) >= MAX_CSUM_ITEMS(root, csum_size)) {
-			/* already at max size, make a new one */
+		if (slot < btrfs_header_nritems(leaf))
+			btrfs_item_key_to_cpu(leaf, &found_key, slot);
+		else if (csum_leaf_next_key(path, &found_key))
+			found_key.objectid = (u64)-1;
+		if (found_key.objectid == BTRFS_EXTENT_CSUM_OBJECTID &&
+		    found_key.type == BTRFS_EXTENT_CSUM_KEY)
+			next_offset = found_key.offset;
+
+		if (slot == 0)
 			goto insert;
-		}
-	} else {
-		int slot = path->slots[0] + 1;
-		/* we didn't find a csum item, insert one */
-		nritems = btrfs_header_nritems(path->nodes[0]);
-		if (path->slots[0] >= nritems - 1) {
-			ret = btrfs_next_leaf(root, path);
-			if (ret == 1)
-				found_next = 1;
-			if (ret != 0)
-				goto insert;
-			slot = 0;
-		}
-		btrfs_item_key_to_cpu(path->nodes[0], &found_key, slot);
+		btrfs_item_key_to_cpu(leaf, &found_key, slot - 1);
 		if (found_key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
-		    found_key.type != BTRFS_EXTENT_CSUM_KEY) {
-			found_next = 1;
+		    found_key.type != BTRFS_EXTENT_CSUM_KEY)
 			goto insert;
-		}
-		next_offset = found_key.offset;
-		found_next = 1;
-		goto insert;
-	}
 
-	/*
-	 * at this point, we know the tree has an item, but it isn't big
-	 * enough yet to put our csum in.  Grow it
-	 */
-	btrfs_release_path(path);
-	ret = btrfs_search_slot(trans, root, &file_key, path,
-				csum_size, 1);
-	if (ret < 0)
-		goto fail;
-	if (ret == 0) {
-		BUG();
-	}
-	if (path->slots[0] == 0) {
-		goto insert;
-	}
-	path->slots[0]--;
-	leaf = path->nodes[0];
-	btrfs_item_key_to_cpu(leaf, &found_key, path->slots[0]);
-	csum_offset = (file_key.offset - found_key.offset) / sectorsize;
-	if (found_key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
-	    found_key.type != BTRFS_EXTENT_CSUM_KEY ||
-	    csum_offset >= MAX_CSUM_ITEMS(root, csum_size)) {
-		goto insert;
-	}
-	if (csum_offset >= btrfs_item_size(leaf, path->slots[0]) /
-	    csum_size) {
-		u32 diff = (csum_offset + 1) * csum_size;
-		diff = diff - btrfs_item_size(leaf, path->slots[0]);
-		if (diff != csum_size)
-			goto insert;
-		ret = btrfs_extend_item(root, path, diff);
-		BUG_ON(ret);
-		goto csum;
-	}
+		csum_offset = (key.offset - found_key.offset) / sectorsize;
+		item_csums = btrfs_item_size(leaf, slot - 1) / csum_size;
+		if (csum_offset < item_csums) {
+			/* Overwrite the tail of the previous item */
+			path->slots[0] = slot - 1;
+			nr = min_t(u64, left, item_csums - csum_offset);
+			goto write;
+		}
+		if (csum_offset == item_csums && item_csums < max_csums) {
+			/* Append to the previous item what fits into the leaf */
+			nr = min_t(u64, left, max_csums - item_csums);
+			nr = min_t(u64, nr, btrfs_leaf_free_space(leaf) / csum_size);
+			nr = min_t(u64, nr, (next_offset - key.offset) / sectorsize);
+			if (nr) {
+				path->slots[0] = slot - 1;
+				ret = btrfs_extend_item(root, path, nr * csum_size);
+				if (ret)
+					goto out;
+				goto write;
+			}
+		}
 
 insert:
-	btrfs_release_path(path);
-	csum_offset = 0;
-	if (found_next) {
-		u64 tmp = min(alloc_end, next_offset);
-		tmp -= file_key.offset;
-		tmp /= sectorsize;
-		tmp = max((u64)1, tmp);
-		tmp = min(tmp, (u64)MAX_CSUM_ITEMS(root, csum_size));
-		ins_size = csum_size * tmp;
-	} else {
-		ins_size = csum_size;
-	}
-	ret = btrfs_insert_empty_item(trans, root, path, &file_key,
-				      ins_size);
-	if (ret < 0)
-		goto fail;
-	if (ret != 0) {
-		WARN_ON(1);
-		goto fail;
+		btrfs_release_path(path);
+		csum_offset = 0;
+		nr = min_t(u64, left, max_csums);
+		nr = min_t(u64, nr, (next_offset - key.offset) / sectorsize);
+		ret = btrfs_insert_empty_item(trans, root, path, &key,
+					      nr * csum_size);
+		if (ret)
+			goto out;
+write:
+		leaf = path->nodes[0];
+		write_extent_buffer(leaf, csums + done * csum_size,
+				    btrfs_item_ptr_offset(leaf, path->slots[0]) +
+				    csum_offset * csum_size, nr * csum_size);
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(path);
+		done += nr;
 	}
-csum:
-	leaf = path->nodes[0];
-	item = btrfs_item_ptr(leaf, path->slots[0], struct btrfs_csum_item);
 	ret = 0;
-	item = (struct btrfs_csum_item *)((unsigned char *)item +
-					  csum_offset * csum_size);
-found:
-	btrfs_csum_data(root->fs_info, csum_type, (u8 *)data, csum_result, len);
-	write_extent_buffer(leaf, csum_result, (unsigned long)item,
-			    csum_size);
-	btrfs_mark_buffer_dirty(path->nodes[0]);
-fail:
+out:
 	btrfs_free_path(path);
 	return ret;
 }
 
+/*
+ * Insert checksums of the sectors in @data of @len bytes that are stored at
+ * @bytenr, all the checksums are calculated in one go.
+ */
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans, u64 bytenr,
+			  const char *data, u64 len)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	u32 sectorsize = fs_info->sectorsize;
+	u16 csum_type = fs_info->csum_type;
+	u16 csum_size = fs_info->csum_size;
+	u8 *csums;
+	int ret;
+
+	if (!IS_ALIGNED(bytenr, sectorsize) || !IS_ALIGNED(len, sectorsize))
+		return -EINVAL;
+	if (!len)
+		return 0;
+
+	if (fs_info->force_csum_type != -1) {
+		csum_type = fs_info->force_csum_type;
+		csum_size = btrfs_csum_type_size(csum_type);
+	}
+
+	csums = malloc(len / sectorsize * csum_size);
+	if (!csums)
+		return -ENOMEM;
+	btrfs_csum_data_many(csum_type, (const u8 *)data, csums, sectorsize,
+			     len / sectorsize);
+	ret = btrfs_insert_data_csums(trans, bytenr, len, csums);
+	free(csums);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
@@ -24,6 +24,7 @@
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/print-tree.h"
+#include "kernel-shared/reada.h"
 #include "kernel-shared/volumes.h"
 #include "common/utils.h"
 
@@ -1478,6 +1479,8 @@ static int search_leftmost_tree_block(struct btrfs_fs_info *fs_info,
 		struct extent_buffer *eb;
 
 		path->slots[i] = 0;
+		if (path->reada)
+			reada_for_search(fs_info, path, i, 0, 0);
 		eb = read_node_slot(fs_info, path->nodes[i], 0);
 		if (!extent_buffer_uptodate(eb)) {
 			ret = -EIO;
@@ -1505,6 +1508,7 @@ static void bfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
 	mode &= ~(BTRFS_PRINT_TREE_DFS);
 
 	btrfs_init_path(&path);
+	path.reada = READA_FORWARD_ALL;
 	/* For path */
 	extent_buffer_get(root_eb);
 	path.nodes[root_level] = root_eb;
@@ -1546,6 +1550,7 @@ static void dfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
 	mode |= BTRFS_PRINT_TREE_DFS;
 	mode &= ~(BTRFS_PRINT_TREE_BFS);
 
+	btrfs_reada_children(fs_info, root_eb, 0);
 	for (i = 0; i < nr; i++) {
 		next = read_tree_block(fs_info, btrfs_node_blockptr(root_eb, i),
 				btrfs_node_ptr_generation(root_eb, i));
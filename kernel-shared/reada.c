@@ -0,0 +1,603 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Asynchronous tree block readahead
+ *
+ * readahead_tree_block() queues the block here instead of just hinting the
+ * page cache. Queued blocks are mapped to their device stripes and submitted
+ * in batches sorted by device offset, either through io_uring or, if that's
+ * not available, by a pool of threads doing plain preads. The raw block
+ * contents are kept until read_tree_block() asks for them, at which point
+ * they are copied into the extent buffer and verified as if they were read
+ * synchronously.
+ *
+ * The engine is only used for read-only filesystems so the buffered copies
+ * can never go stale.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include "kerncompat.h"
+#include "kernel-lib/list.h"
+#include "kernel-lib/list_sort.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/volumes.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/reada.h"
+#include "common/extent-cache.h"
+#include "common/io-uring.h"
+#include "common/mem-limit.h"
+#include "common/workqueue.h"
+#include "common/messages.h"
+#include "common/internal.h"
+
+/* A tree block may be split between stripes of a chunk */
+#define READA_MAX_STRIPES	4
+#define READA_RING_ENTRIES	64
+#define READA_NR_THREADS	4
+
+enum reada_state {
+	READA_PENDING,
+	READA_INFLIGHT,
+	READA_DONE,
+};
+
+struct reada_stripe {
+	int fd;
+	u32 offset;
+	u32 len;
+	u64 physical;
+};
+
+struct reada_block {
+	struct cache_extent cache;
+	/* On btrfs_reada::pending or btrfs_reada::done */
+	struct list_head list;
+	struct btrfs_work work;
+	struct btrfs_reada *reada;
+	enum reada_state state;
+	int error;
+	int nr_stripes;
+	int stripes_pending;
+	struct reada_stripe stripes[READA_MAX_STRIPES];
+	char data[] __attribute__((aligned(16)));
+};
+
+struct btrfs_reada {
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	struct cache_tree blocks;
+	struct list_head pending;
+	/* Completed blocks, oldest first */
+	struct list_head done;
+	int nr_pending;
+	u64 size;
+	u64 max_size;
+
+	bool use_uring;
+	struct btrfs_io_uring ring;
+	struct btrfs_workqueue *wq;
+
+	u64 nr_issued;
+	u64 nr_hits;
+	u64 nr_dropped;
+};
+
+static void free_reada_block(struct btrfs_reada *reada, struct reada_block *block)
+{
+	remove_cache_extent(&reada->blocks, &block->cache);
+	list_del_init(&block->list);
+	reada->size -= block->cache.size;
+	btrfs_mem_uncharge(BTRFS_MEM_READAHEAD,
+			   sizeof(*block) + block->cache.size);
+	free(block);
+}
+
+static void reada_block_done(struct btrfs_reada *reada, struct reada_block *block)
+{
+	block->state = READA_DONE;
+	list_add_tail(&block->list, &reada->done);
+	pthread_cond_broadcast(&reada->done_cond);
+}
+
+static void reada_read_work(struct btrfs_work *work)
+{
+	struct reada_block *block = container_of(work, struct reada_block, work);
+	struct btrfs_reada *reada = block->reada;
+	int error = 0;
+	int i;
+
+	for (i = 0; i < block->nr_stripes; i++) {
+		struct reada_stripe *stripe = &block->stripes[i];
+		ssize_t ret;
+
+		ret = pread(stripe->fd, block->data + stripe->offset,
+			    stripe->len, stripe->physical);
+		if (ret != stripe->len) {
+			error = ret < 0 ? -errno : -EIO;
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&reada->lock);
+	block->error = error;
+	reada_block_done(reada, block);
+	pthread_mutex_unlock(&reada->lock);
+}
+
+/* Process one io_uring completion, must be called with reada->lock held */
+static int reada_reap_one(struct btrfs_reada *reada, bool wait)
+{
+	struct reada_block *block;
+	u64 user_data;
+	int stripe_nr;
+	int res;
+	int ret;
+
+	ret = btrfs_io_uring_reap(&reada->ring, &user_data, &res, wait);
+	if (ret <= 0)
+		return ret;
+
+	stripe_nr = user_data & (READA_MAX_STRIPES - 1);
+	block = (struct reada_block *)(unsigned long)(user_data - stripe_nr);
+	if (res != block->stripes[stripe_nr].len && !block->error)
+		block->error = res < 0 ? res : -EIO;
+	if (--block->stripes_pending == 0)
+		reada_block_done(reada, block);
+	return 1;
+}
+
+/*
+ * Complete the blocks of the requests left queued after a failed submit, with
+ * the error @error. Must be called with reada->lock held.
+ */
+static void reada_fail_queued(struct btrfs_reada *reada, int error)
+{
+	struct reada_block *block;
+	u64 user_data;
+	int stripe_nr;
+
+	while (btrfs_io_uring_unqueue(&reada->ring, &user_data)) {
+		stripe_nr = user_data & (READA_MAX_STRIPES - 1);
+		block = (struct reada_block *)(unsigned long)(user_data - stripe_nr);
+		if (!block->error)
+			block->error = error;
+		if (--block->stripes_pending == 0)
+			reada_block_done(reada, block);
+	}
+}
+
+static int reada_submit_uring(struct btrfs_reada *reada,
+			      struct reada_block *block)
+{
+	int ret;
+	int i;
+
+	block->stripes_pending = block->nr_stripes;
+	for (i = 0; i < block->nr_stripes; i++) {
+		struct reada_stripe *stripe = &block->stripes[i];
+
+		while (1) {
+			ret = btrfs_io_uring_queue_rw(&reada->ring, READ,
+					stripe->fd, block->data + stripe->offset,
+					stripe->len, stripe->physical,
+					(unsigned long)block + i);
+			if (ret != -EBUSY)
+				break;
+			ret = btrfs_io_uring_submit(&reada->ring, 0);
+			if (ret < 0) {
+				reada_fail_queued(reada, ret);
+				break;
+			}
+			ret = reada_reap_one(reada, true);
+			if (ret < 0)
+				break;
+		}
+		if (ret < 0) {
+			/* Stripes already queued will complete the block */
+			block->error = ret;
+			block->stripes_pending -= block->nr_stripes - i;
+			if (block->stripes_pending == 0)
+				reada_block_done(reada, block);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int cmp_reada_block(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct reada_block *ba = list_entry(a, struct reada_block, list);
+	struct reada_block *bb = list_entry(b, struct reada_block, list);
+
+	if (ba->stripes[0].fd != bb->stripes[0].fd)
+		return ba->stripes[0].fd < bb->stripes[0].fd ? -1 : 1;
+	if (ba->stripes[0].physical < bb->stripes[0].physical)
+		return -1;
+	if (ba->stripes[0].physical > bb->stripes[0].physical)
+		return 1;
+	return 0;
+}
+
+/*
+ * Submit all pending blocks in the device offset order, must be called with
+ * reada->lock held.
+ */
+static void reada_submit_pending(struct btrfs_reada *reada)
+{
+	struct reada_block *block;
+	int ret;
+
+	if (list_empty(&reada->pending))
+		return;
+
+	list_sort(NULL, &reada->pending, cmp_reada_block);
+	while (!list_empty(&reada->pending)) {
+		block = list_first_entry(&reada->pending, struct reada_block,
+					 list);
+		list_del_init(&block->list);
+		block->state = READA_INFLIGHT;
+		reada->nr_issued++;
+		if (reada->use_uring)
+			reada_submit_uring(reada, block);
+		else
+			btrfs_queue_work(reada->wq, &block->work);
+	}
+	reada->nr_pending = 0;
+	if (reada->use_uring) {
+		ret = btrfs_io_uring_submit(&reada->ring, 0);
+		/* Can't submit, the queued blocks complete with an error */
+		if (ret < 0)
+			reada_fail_queued(reada, ret);
+	}
+}
+
+static struct btrfs_reada *reada_init(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_reada *reada;
+	int ret;
+
+	reada = calloc(1, sizeof(*reada));
+	if (!reada)
+		return NULL;
+
+	pthread_mutex_init(&reada->lock, NULL);
+	pthread_cond_init(&reada->done_cond, NULL);
+	cache_tree_init(&reada->blocks);
+	INIT_LIST_HEAD(&reada->pending);
+	INIT_LIST_HEAD(&reada->done);
+	reada->max_size = BTRFS_READA_DEFAULT_SIZE;
+	if (btrfs_mem_get_limit())
+		reada->max_size = min_t(u64, reada->max_size,
+					btrfs_mem_get_limit() / 16);
+
+	ret = btrfs_io_uring_init(&reada->ring, READA_RING_ENTRIES);
+	if (ret == 0) {
+		reada->use_uring = true;
+	} else {
+		reada->wq = btrfs_alloc_workqueue(READA_NR_THREADS);
+		if (!reada->wq) {
+			pthread_cond_destroy(&reada->done_cond);
+			pthread_mutex_destroy(&reada->lock);
+			free(reada);
+			return NULL;
+		}
+	}
+	return reada;
+}
+
+static struct reada_block *reada_map_block(struct btrfs_fs_info *fs_info,
+					   u64 bytenr)
+{
+	struct reada_block *block;
+	u32 nodesize = fs_info->nodesize;
+	u32 offset = 0;
+
+	block = malloc(sizeof(*block) + nodesize);
+	if (!block)
+		return NULL;
+	memset(block, 0, sizeof(*block));
+	block->cache.start = bytenr;
+	block->cache.size = nodesize;
+	INIT_LIST_HEAD(&block->list);
+	btrfs_init_work(&block->work, reada_read_work);
+
+	while (offset < nodesize) {
+		struct btrfs_multi_bio *multi = NULL;
+		struct reada_stripe *stripe;
+		struct btrfs_device *device;
+		u64 len = nodesize - offset;
+		int ret;
+
+		if (block->nr_stripes == READA_MAX_STRIPES)
+			goto fail;
+		ret = btrfs_map_block(fs_info, READ, bytenr + offset, &len,
+				      &multi, 0, NULL);
+		if (ret)
+			goto fail;
+		device = multi->stripes[0].dev;
+		if (device->fd <= 0) {
+			kfree(multi);
+			goto fail;
+		}
+		device->total_ios++;
+		stripe = &block->stripes[block->nr_stripes++];
+		stripe->fd = device->fd;
+		stripe->offset = offset;
+		stripe->len = min_t(u64, len, nodesize - offset);
+		stripe->physical = multi->stripes[0].physical;
+		offset += stripe->len;
+		kfree(multi);
+	}
+	return block;
+
+fail:
+	free(block);
+	return NULL;
+}
+
+static struct btrfs_reada *reada_get(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_reada *reada = fs_info->reada;
+
+	if (reada)
+		return reada;
+	if (!fs_info->readonly || fs_info->on_restoring ||
+	    fs_info->disable_reada || btrfs_is_zoned(fs_info))
+		return NULL;
+	reada = reada_init(fs_info);
+	if (!reada) {
+		fs_info->disable_reada = 1;
+		return NULL;
+	}
+	fs_info->reada = reada;
+	return reada;
+}
+
+/* Queue one block without submitting, must be called with reada->lock held */
+static int reada_queue_block(struct btrfs_fs_info *fs_info,
+			     struct btrfs_reada *reada, u64 bytenr)
+{
+	struct reada_block *block;
+	int ret;
+
+	if (lookup_cache_extent(&reada->blocks, bytenr, fs_info->nodesize))
+		return 0;
+
+	/*
+	 * Make room by dropping the blocks nobody asked for, readahead is the
+	 * first thing to give up when over the global memory limit.
+	 */
+	while ((reada->size + fs_info->nodesize > reada->max_size ||
+		btrfs_mem_over_limit()) && !list_empty(&reada->done)) {
+		block = list_first_entry(&reada->done, struct reada_block, list);
+		free_reada_block(reada, block);
+	}
+	if (reada->size + fs_info->nodesize > reada->max_size ||
+	    btrfs_mem_over_limit()) {
+		reada->nr_dropped++;
+		return -EAGAIN;
+	}
+
+	block = reada_map_block(fs_info, bytenr);
+	if (!block)
+		return -EIO;
+	block->reada = reada;
+	block->state = READA_PENDING;
+	ret = insert_cache_extent(&reada->blocks, &block->cache);
+	if (ret) {
+		free(block);
+		return ret;
+	}
+	reada->size += block->cache.size;
+	btrfs_mem_charge(BTRFS_MEM_READAHEAD, sizeof(*block) + block->cache.size);
+	list_add_tail(&block->list, &reada->pending);
+	reada->nr_pending++;
+	return 0;
+}
+
+/*
+ * Queue tree block at @bytenr for asynchronous read.
+ *
+ * Return 0 if the block has been queued or is already known, or <0 if the
+ * readahead engine can't take it and the caller should use other means.
+ */
+int btrfs_reada_add(struct btrfs_fs_info *fs_info, u64 bytenr)
+{
+	struct btrfs_reada *reada = reada_get(fs_info);
+	int ret;
+
+	if (!reada)
+		return -EOPNOTSUPP;
+
+	pthread_mutex_lock(&reada->lock);
+	ret = reada_queue_block(fs_info, reada, bytenr);
+	if (reada->nr_pending >= BTRFS_READA_BATCH)
+		reada_submit_pending(reada);
+	pthread_mutex_unlock(&reada->lock);
+	return ret;
+}
+
+static bool reada_child_cached(struct btrfs_fs_info *fs_info,
+			       struct btrfs_reada *reada,
+			       struct extent_buffer *node, int slot)
+{
+	struct extent_buffer *eb;
+	u64 bytenr = btrfs_node_blockptr(node, slot);
+	bool ret;
+
+	if (reada && lookup_cache_extent(&reada->blocks, bytenr,
+					 fs_info->nodesize))
+		return true;
+	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
+	ret = eb && btrfs_buffer_uptodate(eb, btrfs_node_ptr_generation(node, slot));
+	free_extent_buffer(eb);
+	return ret;
+}
+
+/*
+ * Read ahead all children of @node starting at @slot, so a walker going
+ * through the children in order finds them already read.
+ *
+ * The children are submitted as one batch sorted by the device offset, so
+ * the reads are mostly sequential no matter how the blocks are ordered in
+ * the node. If the first and the last child are cached or queued already,
+ * the whole range is assumed to be done, this makes it cheap to call this
+ * each time the walker moves to the next slot.
+ */
+void btrfs_reada_children(struct btrfs_fs_info *fs_info,
+			  struct extent_buffer *node, int slot)
+{
+	struct btrfs_reada *reada;
+	int nritems = btrfs_header_nritems(node);
+	int i;
+
+	if (btrfs_header_level(node) == 0 || slot >= nritems)
+		return;
+	nritems = min_t(int, nritems, BTRFS_NODEPTRS_PER_EXTENT_BUFFER(node));
+	if (slot >= nritems)
+		return;
+
+	reada = reada_get(fs_info);
+	if (reada)
+		pthread_mutex_lock(&reada->lock);
+	if (reada_child_cached(fs_info, reada, node, slot) &&
+	    reada_child_cached(fs_info, reada, node, nritems - 1))
+		goto out;
+
+	for (i = slot; i < nritems; i++) {
+		u64 bytenr = btrfs_node_blockptr(node, i);
+
+		if (!reada) {
+			readahead_tree_block(fs_info, bytenr,
+					     btrfs_node_ptr_generation(node, i));
+			continue;
+		}
+		if (reada_child_cached(fs_info, reada, node, i))
+			continue;
+		if (reada_queue_block(fs_info, reada, bytenr) == -EAGAIN)
+			break;
+	}
+	if (reada)
+		reada_submit_pending(reada);
+out:
+	if (reada)
+		pthread_mutex_unlock(&reada->lock);
+}
+
+/* Submit all queued readahead blocks without waiting for a full batch */
+void btrfs_reada_kick(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_reada *reada = fs_info->reada;
+
+	if (!reada)
+		return;
+	pthread_mutex_lock(&reada->lock);
+	reada_submit_pending(reada);
+	pthread_mutex_unlock(&reada->lock);
+}
+
+/*
+ * Fill @eb with the contents read ahead, waiting for the IO if it's still in
+ * progress. The block is dropped from the readahead cache afterwards.
+ *
+ * Return 0 if @eb was filled, -ENOENT if the block was not read ahead, or
+ * other <0 if the readahead failed and the block must be read again.
+ */
+int btrfs_reada_fill_eb(struct btrfs_fs_info *fs_info, struct extent_buffer *eb)
+{
+	struct btrfs_reada *reada = fs_info->reada;
+	struct cache_extent *cache;
+	struct reada_block *block;
+	int ret;
+
+	if (!reada)
+		return -ENOENT;
+
+	pthread_mutex_lock(&reada->lock);
+	/* The caller is going to wait for IO, start all the queued blocks too */
+	reada_submit_pending(reada);
+	cache = lookup_cache_extent(&reada->blocks, eb->start, eb->len);
+	if (!cache || cache->start != eb->start || cache->size != eb->len) {
+		ret = -ENOENT;
+		goto out;
+	}
+	block = container_of(cache, struct reada_block, cache);
+	while (block->state != READA_DONE) {
+		if (reada->use_uring) {
+			ret = reada_reap_one(reada, true);
+			if (ret <= 0) {
+				ret = ret ?: -EIO;
+				goto out;
+			}
+		} else {
+			pthread_cond_wait(&reada->done_cond, &reada->lock);
+		}
+	}
+	ret = block->error;
+	if (!ret) {
+		memcpy(eb->data, block->data, eb->len);
+		reada->nr_hits++;
+	}
+	free_reada_block(reada, block);
+out:
+	pthread_mutex_unlock(&reada->lock);
+	return ret;
+}
+
+static void free_reada_block_func(struct cache_extent *cache)
+{
+	btrfs_mem_uncharge(BTRFS_MEM_READAHEAD, sizeof(struct reada_block) +
+			   cache->size);
+	free(container_of(cache, struct reada_block, cache));
+}
+
+void btrfs_reada_get_stats(struct btrfs_fs_info *fs_info,
+			   struct btrfs_reada_stats *stats)
+{
+	struct btrfs_reada *reada = fs_info->reada;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!reada)
+		return;
+	pthread_mutex_lock(&reada->lock);
+	stats->issued = reada->nr_issued;
+	stats->hits = reada->nr_hits;
+	stats->dropped = reada->nr_dropped;
+	pthread_mutex_unlock(&reada->lock);
+}
+
+void btrfs_reada_free(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_reada *reada = fs_info->reada;
+
+	if (!reada)
+		return;
+
+	/* Wait for all IO in flight, the blocks can't be freed before */
+	if (reada->use_uring)
+		btrfs_io_uring_exit(&reada->ring);
+	else
+		btrfs_destroy_workqueue(reada->wq);
+
+	cache_tree_free_extents(&reada->blocks, free_reada_block_func);
+	pthread_cond_destroy(&reada->done_cond);
+	pthread_mutex_destroy(&reada->lock);
+	free(reada);
+	fs_info->reada = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_READA_H__
+#define __BTRFS_READA_H__
+
+#include "kerncompat.h"
+
+struct btrfs_fs_info;
+struct extent_buffer;
+
+/* Number of queued blocks that triggers a submission */
+#define BTRFS_READA_BATCH		32
+/* Default limit of memory used by queued and completed readahead blocks */
+#define BTRFS_READA_DEFAULT_SIZE	(32 * 1024 * 1024)
+
+struct btrfs_reada_stats {
+	/* Blocks read ahead */
+	u64 issued;
+	/* Blocks consumed by a later read of the tree block */
+	u64 hits;
+	/* Blocks not read ahead as the memory limit was reached */
+	u64 dropped;
+};
+
+int btrfs_reada_add(struct btrfs_fs_info *fs_info, u64 bytenr);
+void btrfs_reada_children(struct btrfs_fs_info *fs_info,
+			  struct extent_buffer *node, int slot);
+void btrfs_reada_kick(struct btrfs_fs_info *fs_info);
+int btrfs_reada_fill_eb(struct btrfs_fs_info *fs_info, struct extent_buffer *eb);
+void btrfs_reada_get_stats(struct btrfs_fs_info *fs_info,
+			   struct btrfs_reada_stats *stats);
+void btrfs_reada_free(struct btrfs_fs_info *fs_info);
+
+#endif
@@ -2627,7 +2627,7 @@ static int split_eb_for_raid56(struct btrfs_fs_info *info,
 
 		eb->start = raid_map[i];
 		eb->len = stripe_len;
-		eb->refs = 1;
+		atomic_set(&eb->refs, 1);
 		eb->flags = 0;
 		eb->fs_info = info;
 
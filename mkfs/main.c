@@ -52,6 +52,7 @@
 #include "common/box.h"
 #include "common/units.h"
 #include "common/string-utils.h"
+#include "common/workqueue.h"
 #include "check/qgroup-verify.h"
 #include "mkfs/common.h"
 #include "mkfs/rootdir.h"
@@ -428,6 +429,8 @@ static void print_usage(int ret)
 	printf("\t-b|--byte-count SIZE        set size of each device to SIZE (filesystem size is sum of all device sizes)\n");
 	printf("\t-r|--rootdir DIR            copy files from DIR to the image root directory\n");
 	printf("\t--shrink                    (with --rootdir) shrink the filled filesystem to minimal size\n");
+	printf("\t-j|--threads N              (with --rootdir) read the files in N threads, 0 for the number of CPUs\n");
+	printf("\t--compress ALGO[:LEVEL]     (with --rootdir) compress the files by zlib or zstd\n");
 	printf("\t-K|--nodiscard              do not perform whole device TRIM\n");
 	printf("\t-f|--force                  force overwrite of existing filesystem\n");
 	printf("  general:\n");
@@ -958,6 +961,56 @@ fail:
 	return ret;
 }
 
+/* Parse the compression algorithm and level of --compress, exit on error */
+static void parse_compress(const char *arg, int *type, int *level)
+{
+	char name[16];
+	const char *colon;
+	int max_level;
+	size_t len;
+
+	colon = strchr(arg, ':');
+	len = colon ? colon - arg : strlen(arg);
+	if (len >= sizeof(name))
+		len = sizeof(name) - 1;
+	memcpy(name, arg, len);
+	name[len] = 0;
+
+	*type = parse_compress_type(name);
+	switch (*type) {
+	case BTRFS_COMPRESS_ZLIB:
+		max_level = 9;
+		break;
+	case BTRFS_COMPRESS_LZO:
+		/* The per-sector lzo format has not been verified yet */
+		error("lzo compression is not supported, use zlib or zstd");
+		exit(1);
+	case BTRFS_COMPRESS_ZSTD:
+		if (!COMPRESSION_ZSTD) {
+			error("mkfs.btrfs not compiled with zstd support");
+			exit(1);
+		}
+		max_level = 15;
+		break;
+	default:
+		error("unknown compression type: %s", name);
+		exit(1);
+	}
+
+	/* Same defaults as the kernel */
+	*level = 3;
+	if (colon) {
+		u64 value = arg_strtou64(colon + 1);
+
+		if (value < 1 || value > max_level) {
+			error("invalid compression level %s for %s",
+			      colon + 1, name);
+			exit(1);
+		}
+		*level = value;
+	}
+}
+
 /* Thread callback for device preparation */
 static void *prepare_one_device(void *ctx)
 {
@@ -1025,6 +1078,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	int nr_global_roots = sysconf(_SC_NPROCESSORS_ONLN);
 	char *source_dir = NULL;
 	bool source_dir_set = false;
+	int nr_threads = 1;
+	int compression = BTRFS_COMPRESS_NONE;
+	int compress_level = 0;
 
 	crc32c_optimization_init();
 	btrfs_config_init();
@@ -1036,6 +1092,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			GETOPT_VAL_SHRINK = GETOPT_VAL_FIRST,
 			GETOPT_VAL_CHECKSUM,
 			GETOPT_VAL_GLOBAL_ROOTS,
+			GETOPT_VAL_COMPRESS,
 		};
 		static const struct option long_options[] = {
 			{ "byte-count", required_argument, NULL, 'b' },
@@ -1060,6 +1117,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			{ "quiet", 0, NULL, 'q' },
 			{ "verbose", 0, NULL, 'v' },
 			{ "shrink", no_argument, NULL, GETOPT_VAL_SHRINK },
+			{ "threads", required_argument, NULL, 'j' },
+			{ "compress", required_argument, NULL,
+				GETOPT_VAL_COMPRESS },
 #if EXPERIMENTAL
 			{ "num-global-roots", required_argument, NULL, GETOPT_VAL_GLOBAL_ROOTS },
 #endif
@@ -1067,7 +1127,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			{ NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long(argc, argv, "A:b:fl:n:s:m:d:L:R:O:r:U:VvMKq",
+		c = getopt_long(argc, argv, "A:b:fj:l:n:s:m:d:L:R:O:r:U:VvMKq",
 				long_options, NULL);
 		if (c < 0)
 			break;
@@ -1184,9 +1244,17 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			case GETOPT_VAL_SHRINK:
 				shrink_rootdir = true;
 				break;
+			case 'j':
+				nr_threads = min_t(u64, arg_strtou64(optarg),
+						   BTRFS_WORKQUEUE_MAX_THREADS);
+				break;
 			case GETOPT_VAL_CHECKSUM:
 				csum_type = parse_csum_type(optarg);
 				break;
+			case GETOPT_VAL_COMPRESS:
+				parse_compress(optarg, &compression,
+					       &compress_level);
+				break;
 			case GETOPT_VAL_GLOBAL_ROOTS:
 				nr_global_roots = (int)arg_strtou64(optarg);
 				break;
@@ -1225,6 +1293,10 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		error("the option --shrink must be used with --rootdir");
 		goto error;
 	}
+	if (compression && !source_dir_set) {
+		error("the option --compress must be used with --rootdir");
+		goto error;
+	}
 
 	if (*fs_uuid) {
 		uuid_t dummy_uuid;
@@ -1727,7 +1799,9 @@ raid_groups:
 	}
 
 	if (source_dir_set) {
-		ret = btrfs_mkfs_fill_dir(source_dir, root, bconf.verbose);
+		ret = btrfs_mkfs_fill_dir(source_dir, root, nr_threads,
+					  compression, compress_level,
+					  bconf.verbose);
 		if (ret) {
 			error("error while filling filesystem: %d", ret);
 			goto out;
@@ -29,7 +29,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-lib/sizes.h"
+#include "kernel-lib/bitops.h"
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/volumes.h"
@@ -38,6 +44,7 @@
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/path-utils.h"
+#include "common/workqueue.h"
 #include "mkfs/rootdir.h"
 
 static u32 fs_block_size;
@@ -60,6 +67,178 @@ static u64 index_cnt = 2;
 static u64 ftw_meta_nr_inode;
 static u64 ftw_data_size;
 
+/*
+ * The source files are looked up and read by worker threads while the main
+ * thread inserts the items in the same order as a single threaded traversal:
+ *
+ * - directories are scanned ahead of the inserts, each entry is looked up
+ *   together with its xattrs, symlink target or inline file data
+ * - data extents are reserved right away and filled in batches of sectors
+ *   contiguous on disk, the workers read and checksum them and the main thread
+ *   writes them and inserts the checksums in the reservation order
+ * - with compression, regular files are compressed ahead in chunks of
+ *   BTRFS_MAX_UNCOMPRESSED in the order of the traversal, the main thread
+ *   reserves and writes one extent per chunk once its size is known
+ *
+ * The writes stay in the main thread as it can allocate chunks meanwhile.
+ */
+
+#define ROOTDIR_MAX_EXTENT_SIZE		BTRFS_MAX_EXTENT_SIZE
+/* Data are read, checksummed and written in batches of this size */
+#define ROOTDIR_BATCH_SIZE		SZ_4M
+/* Data read ahead of the writes, at least two batches per thread */
+#define ROOTDIR_MAX_IN_FLIGHT		SZ_64M
+/* Directories scanned ahead of the inserts */
+#define ROOTDIR_SCAN_AHEAD		64
+
+
+/* Compression heuristics, same as the kernel's */
+#define SAMPLING_READ_SIZE		16
+#define SAMPLING_INTERVAL		256
+#define BYTE_SET_THRESHOLD		64
+#define BYTE_CORE_SET_LOW		64
+#define BYTE_CORE_SET_HIGH		200
+#define ENTROPY_LVL_ACEPTABLE		65
+#define ENTROPY_LVL_HIGH		80
+
+struct rootdir_xattr {
+	struct list_head list;
+	int name_len;
+	int value_len;
+	/* The name including the terminating NUL followed by the value */
+	char data[];
+};
+
+/* Directory entry as looked up by a worker */
+struct rootdir_entry {
+	struct stat st;
+	int stat_errno;
+	struct list_head xattrs;
+	/* Errno of llistxattr() or lgetxattr() of @xattr_name */
+	int xattr_errno;
+	char *xattr_name;
+	u64 dir_size;
+	/* Symlink target or inline file data */
+	char *data;
+	ssize_t data_len;
+	int data_errno;
+	bool data_open_failed;
+	/* Set once the file is queued for compression */
+	struct rootdir_cfile *cfile;
+};
+
+struct rootdir_scan {
+	struct btrfs_work work;
+	const char *path;
+	struct dirent **files;
+	struct rootdir_entry *entries;
+	int count;
+	int scan_errno;
+	bool done;
+};
+
+struct rootdir_segment {
+	char *path;
+	u64 file_pos;
+	u32 offset;
+	u32 len;
+};
+
+/* Sectors contiguous on disk, filled from one or more files */
+struct rootdir_batch {
+	struct btrfs_work work;
+	struct list_head list;
+	u64 bytenr;
+	u32 len;
+	struct rootdir_segment *segs;
+	int nr_segs;
+	int max_segs;
+	char *buf;
+	u8 *csums;
+	/* Errno and index of a segment that failed to be read */
+	int err;
+	int err_seg;
+	bool err_open;
+	bool done;
+};
+
+/* State of the compressors, reused by the workers */
+struct rootdir_compress_ctx {
+	struct list_head list;
+	z_stream zlib;
+	bool zlib_ready;
+#if COMPRESSION_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+/* Part of a file compressed into one extent */
+struct rootdir_chunk {
+	struct btrfs_work work;
+	struct rootdir_cfile *cfile;
+	int index;
+	u32 len;
+	/* Compressed data padded to the sectorsize and their checksums */
+	u8 *out;
+	u32 out_len;
+	u8 *csums;
+	int err;
+	bool err_open;
+	bool compressed;
+	/* Queued and accounted in compress_in_flight */
+	bool in_flight;
+	bool done;
+};
+
+/* Regular file stored compressed */
+struct rootdir_cfile {
+	struct list_head list;
+	char *path;
+	int nr_chunks;
+	int nr_queued;
+	/*
+	 * Lowest index of a chunk found incompressible so far, the chunks after
+	 * it are skipped as the rest of the file is not compressed.
+	 */
+	int nocompress;
+	struct rootdir_chunk chunks[];
+};
+
+static struct rootdir_ingest {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_workqueue *wq;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Batch being filled, not queued yet */
+	struct rootdir_batch *batch;
+	/* Queued batches in the order of the reservations */
+	struct list_head pending;
+	u64 in_flight;
+	u64 max_in_flight;
+
+	int compression;
+	int compress_level;
+	/* Idle compressor contexts */
+	struct list_head ctxs;
+	/* Files set up for compression in the order of the traversal */
+	struct list_head cfiles;
+	u64 compress_in_flight;
+	/*
+	 * Next directory entry to set up for compression, a NULL @feed_dir is
+	 * the directory being inserted that has the scan @cur_scan.
+	 */
+	struct list_head *dirs;
+	struct directory_name_entry *feed_dir;
+	int feed_idx;
+	struct rootdir_scan *cur_scan;
+} ingest;
+
+static bool rootdir_is_inline(struct btrfs_fs_info *fs_info, u64 size)
+{
+	return size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) &&
+	       size < fs_info->sectorsize;
+}
+
 static int add_directory_items(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       ino_t parent_inum, const char *name,
@@ -143,8 +322,7 @@ static int fill_inode_item(struct btrfs_trans_handle *trans,
 	}
 	if (S_ISREG(src->st_mode)) {
 		btrfs_set_stack_inode_size(dst, (u64)src->st_size);
-		if (src->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root->fs_info) &&
-		    src->st_size < sectorsize)
+		if (rootdir_is_inline(root->fs_info, src->st_size))
 			btrfs_set_stack_inode_nbytes(dst, src->st_size);
 		else {
 			blocks = src->st_size / sectorsize;
@@ -200,24 +378,985 @@ static u64 calculate_dir_inode_size(const char *dirname)
 	return dir_inode_size;
 }
 
+static void rootdir_complete(bool *done)
+{
+	pthread_mutex_lock(&ingest.lock);
+	*done = true;
+	pthread_cond_broadcast(&ingest.cond);
+	pthread_mutex_unlock(&ingest.lock);
+}
+
+static void rootdir_wait(bool *done)
+{
+	pthread_mutex_lock(&ingest.lock);
+	while (!*done)
+		pthread_cond_wait(&ingest.cond, &ingest.lock);
+	pthread_mutex_unlock(&ingest.lock);
+}
+
+static void rootdir_scan_xattrs(const char *path, struct rootdir_entry *entry)
+{
+	char xattr_list[XATTR_LIST_MAX];
+	char value[XATTR_SIZE_MAX];
+	char *name;
+	char *end;
+	int ret;
+
+	ret = llistxattr(path, xattr_list, XATTR_LIST_MAX);
+	if (ret < 0) {
+		if (errno != ENOTSUP)
+			entry->xattr_errno = errno;
+		return;
+	}
+
+	end = xattr_list + ret;
+	for (name = xattr_list; name < end; name += strlen(name) + 1) {
+		struct rootdir_xattr *xattr;
+		int name_len = strlen(name);
+
+		ret = lgetxattr(path, name, value, XATTR_SIZE_MAX);
+		if (ret < 0) {
+			if (errno == ENOTSUP)
+				return;
+			entry->xattr_errno = errno;
+			entry->xattr_name = strdup(name);
+			return;
+		}
+		xattr = malloc(sizeof(*xattr) + name_len + 1 + ret);
+		if (!xattr) {
+			entry->xattr_errno = ENOMEM;
+			entry->xattr_name = strdup(name);
+			return;
+		}
+		xattr->name_len = name_len;
+		xattr->value_len = ret;
+		memcpy(xattr->data, name, name_len + 1);
+		memcpy(xattr->data + name_len + 1, value, ret);
+		list_add_tail(&xattr->list, &entry->xattrs);
+	}
+}
+
+static void rootdir_read_inline(const char *path, struct rootdir_entry *entry)
+{
+	int fd;
+
+	entry->data_len = -1;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		entry->data_errno = errno;
+		entry->data_open_failed = true;
+		return;
+	}
+	entry->data = calloc(1, entry->st.st_size);
+	if (!entry->data) {
+		entry->data_errno = ENOMEM;
+		goto out;
+	}
+	entry->data_len = pread(fd, entry->data, entry->st.st_size, 0);
+	if (entry->data_len < 0)
+		entry->data_errno = errno;
+out:
+	close(fd);
+}
+
+static void rootdir_scan_entry(const char *dir_path, const char *name,
+			       struct rootdir_entry *entry)
+{
+	char path[PATH_MAX];
+	mode_t mode;
+
+	INIT_LIST_HEAD(&entry->xattrs);
+	if (path_cat_out(path, dir_path, name)) {
+		entry->stat_errno = ENAMETOOLONG;
+		return;
+	}
+	if (lstat(path, &entry->st) < 0) {
+		entry->stat_errno = errno;
+		return;
+	}
+	rootdir_scan_xattrs(path, entry);
+
+	mode = entry->st.st_mode;
+	if (S_ISDIR(mode)) {
+		entry->dir_size = calculate_dir_inode_size(path);
+	} else if (S_ISLNK(mode)) {
+		entry->data = malloc(PATH_MAX);
+		if (!entry->data) {
+			entry->data_len = -1;
+			entry->data_errno = ENOMEM;
+			return;
+		}
+		entry->data_len = readlink(path, entry->data, PATH_MAX);
+		if (entry->data_len <= 0)
+			entry->data_errno = errno;
+		else if (entry->data_len < PATH_MAX)
+			entry->data[entry->data_len] = '\0';
+	} else if (S_ISREG(mode) && entry->st.st_size &&
+		   rootdir_is_inline(ingest.fs_info, entry->st.st_size)) {
+		rootdir_read_inline(path, entry);
+	}
+}
+
+static void rootdir_scan_work_fn(struct btrfs_work *work)
+{
+	struct rootdir_scan *scan = container_of(work, struct rootdir_scan,
+						 work);
+	int i;
+
+	scan->count = scandir(scan->path, &scan->files, directory_select, NULL);
+	if (scan->count < 0) {
+		scan->scan_errno = errno;
+		goto out;
+	}
+	scan->entries = calloc(scan->count + 1, sizeof(*scan->entries));
+	if (!scan->entries) {
+		free_namelist(scan->files, scan->count);
+		scan->count = -1;
+		scan->scan_errno = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < scan->count; i++)
+		rootdir_scan_entry(scan->path, scan->files[i]->d_name,
+				   &scan->entries[i]);
+out:
+	rootdir_complete(&scan->done);
+}
+
+static void rootdir_free_scan(struct rootdir_scan *scan)
+{
+	int i;
+
+	if (!scan)
+		return;
+	for (i = 0; i < scan->count; i++) {
+		struct rootdir_entry *entry = &scan->entries[i];
+
+		while (!list_empty(&entry->xattrs)) {
+			struct rootdir_xattr *xattr;
+
+			xattr = list_first_entry(&entry->xattrs,
+						 struct rootdir_xattr, list);
+			list_del(&xattr->list);
+			free(xattr);
+		}
+		free(entry->xattr_name);
+		free(entry->data);
+	}
+	free(scan->entries);
+	free_namelist(scan->files, scan->count);
+	free(scan);
+}
+
+/* Queue the scans of the directories at the head of @dirs */
+static int rootdir_scan_ahead(struct list_head *dirs)
+{
+	struct directory_name_entry *dir;
+	int nr = 0;
+
+	list_for_each_entry(dir, dirs, list) {
+		if (nr++ >= ROOTDIR_SCAN_AHEAD)
+			break;
+		if (dir->scan)
+			continue;
+		dir->scan = calloc(1, sizeof(*dir->scan));
+		if (!dir->scan)
+			return -ENOMEM;
+		dir->scan->path = dir->path;
+		btrfs_init_work(&dir->scan->work, rootdir_scan_work_fn);
+		btrfs_queue_work(ingest.wq, &dir->scan->work);
+	}
+	return 0;
+}
+
+static int rootdir_read_segment(char *buf, struct rootdir_segment *seg,
+				bool *open_failed)
+{
+	u32 done = 0;
+	int ret = 0;
+	int fd;
+
+	fd = open(seg->path, O_RDONLY);
+	if (fd < 0) {
+		*open_failed = true;
+		return errno;
+	}
+	while (done < seg->len) {
+		ssize_t ret_read;
+
+		ret_read = pread(fd, buf + done, seg->len - done,
+				 seg->file_pos + done);
+		if (ret_read < 0) {
+			ret = errno;
+			break;
+		}
+		/* The file got truncated, the rest reads as zeros */
+		if (ret_read == 0)
+			break;
+		done += ret_read;
+	}
+	memset(buf + done, 0, seg->len - done);
+	close(fd);
+	return ret;
+}
+
+static void rootdir_batch_work_fn(struct btrfs_work *work)
+{
+	struct rootdir_batch *batch = container_of(work, struct rootdir_batch,
+						   work);
+	struct btrfs_fs_info *fs_info = ingest.fs_info;
+	u32 nr_csums = batch->len / fs_info->sectorsize;
+	int i;
+
+	batch->buf = malloc(batch->len);
+	batch->csums = malloc(nr_csums * fs_info->csum_size);
+	if (!batch->buf || !batch->csums) {
+		batch->err = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < batch->nr_segs; i++) {
+		struct rootdir_segment *seg = &batch->segs[i];
+
+		batch->err = rootdir_read_segment(batch->buf + seg->offset, seg,
+						  &batch->err_open);
+		if (batch->err) {
+			batch->err_seg = i;
+			goto out;
+		}
+	}
+	btrfs_csum_data_many(fs_info->csum_type, (u8 *)batch->buf,
+			     batch->csums, fs_info->sectorsize, nr_csums);
+out:
+	rootdir_complete(&batch->done);
+}
+
+static void rootdir_free_batch(struct rootdir_batch *batch)
+{
+	int i;
+
+	if (!batch)
+		return;
+	for (i = 0; i < batch->nr_segs; i++)
+		free(batch->segs[i].path);
+	free(batch->segs);
+	free(batch->buf);
+	free(batch->csums);
+	free(batch);
+}
+
+/* Write the oldest queued batch and insert its checksums */
+static int rootdir_reap_batch(struct btrfs_trans_handle *trans)
+{
+	struct rootdir_batch *batch;
+	int ret;
+
+	batch = list_first_entry(&ingest.pending, struct rootdir_batch, list);
+	rootdir_wait(&batch->done);
+	list_del(&batch->list);
+	ingest.in_flight -= batch->len;
+
+	if (batch->err) {
+		struct rootdir_segment *seg = &batch->segs[batch->err_seg];
+
+		errno = batch->err;
+		if (batch->err_open)
+			error("cannot open %s: %m", seg->path);
+		else
+			error("cannot read %s at offset %llu length %u: %m",
+			      seg->path, seg->file_pos, seg->len);
+		ret = -batch->err;
+		goto out;
+	}
+
+	ret = write_data_to_disk(trans->fs_info, batch->buf, batch->bytenr,
+				 batch->len);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to write bytenr %llu length %u: %m",
+		      batch->bytenr, batch->len);
+		goto out;
+	}
+	ret = btrfs_insert_data_csums(trans, batch->bytenr, batch->len,
+				      batch->csums);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to insert checksums for bytenr %llu length %u: %m",
+		      batch->bytenr, batch->len);
+	}
+out:
+	rootdir_free_batch(batch);
+	return ret;
+}
+
+static int rootdir_queue_batch(struct btrfs_trans_handle *trans)
+{
+	struct rootdir_batch *batch = ingest.batch;
+	int ret;
+
+	if (!batch)
+		return 0;
+	ingest.batch = NULL;
+
+	/*
+	 * Only wait when over the limit so the inserts don't depend on the
+	 * timing of the workers.
+	 */
+	while (!list_empty(&ingest.pending) &&
+	       ingest.in_flight + batch->len > ingest.max_in_flight) {
+		ret = rootdir_reap_batch(trans);
+		if (ret < 0) {
+			rootdir_free_batch(batch);
+			return ret;
+		}
+	}
+	list_add_tail(&batch->list, &ingest.pending);
+	ingest.in_flight += batch->len;
+	btrfs_init_work(&batch->work, rootdir_batch_work_fn);
+	btrfs_queue_work(ingest.wq, &batch->work);
+	return 0;
+}
+
+/* Fill the reserved extent at @bytenr from the file at @path */
+static int rootdir_add_data(struct btrfs_trans_handle *trans,
+			    const char *path, u64 file_pos, u64 bytenr,
+			    u64 len)
+{
+	int ret;
+
+	while (len) {
+		struct rootdir_batch *batch = ingest.batch;
+		struct rootdir_segment *seg;
+		u32 cur;
+
+		if (batch && (batch->bytenr + batch->len != bytenr ||
+			      batch->len == ROOTDIR_BATCH_SIZE)) {
+			ret = rootdir_queue_batch(trans);
+			if (ret < 0)
+				return ret;
+			batch = NULL;
+		}
+		if (!batch) {
+			batch = calloc(1, sizeof(*batch));
+			if (!batch)
+				return -ENOMEM;
+			batch->bytenr = bytenr;
+			ingest.batch = batch;
+		}
+		if (batch->nr_segs == batch->max_segs) {
+			int max_segs = max(8, batch->max_segs * 2);
+
+			seg = realloc(batch->segs, max_segs * sizeof(*seg));
+			if (!seg)
+				return -ENOMEM;
+			batch->segs = seg;
+			batch->max_segs = max_segs;
+		}
+
+		cur = min_t(u64, len, ROOTDIR_BATCH_SIZE - batch->len);
+		seg = &batch->segs[batch->nr_segs];
+		seg->path = strdup(path);
+		if (!seg->path)
+			return -ENOMEM;
+		seg->file_pos = file_pos;
+		seg->offset = batch->len;
+		seg->len = cur;
+		batch->nr_segs++;
+		batch->len += cur;
+
+		file_pos += cur;
+		bytenr += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/* Write all the data and insert their checksums */
+static int rootdir_flush(struct btrfs_trans_handle *trans)
+{
+	int ret;
+
+	ret = rootdir_queue_batch(trans);
+	while (ret == 0 && !list_empty(&ingest.pending))
+		ret = rootdir_reap_batch(trans);
+	return ret;
+}
+
+static bool rootdir_is_done(bool *done)
+{
+	bool ret;
+
+	pthread_mutex_lock(&ingest.lock);
+	ret = *done;
+	pthread_mutex_unlock(&ingest.lock);
+	return ret;
+}
+
+static int cmp_bucket_desc(const void *a, const void *b)
+{
+	u32 ca = *(const u32 *)a;
+	u32 cb = *(const u32 *)b;
+
+	return ca < cb ? 1 : (ca > cb ? -1 : 0);
+}
+
+/*
+ * Guess from samples of the data whether they are worth compressing, like the
+ * kernel does before compressing a range.
+ */
+static bool rootdir_compressible(const u8 *data, u32 len)
+{
+	u8 sample[BTRFS_MAX_UNCOMPRESSED / SAMPLING_INTERVAL *
+		  SAMPLING_READ_SIZE];
+	u32 bucket[256] = { 0 };
+	u32 nr_samples = 0;
+	u32 byte_set = 0;
+	u32 core_sum = 0;
+	u64 entropy_sum = 0;
+	int log_total;
+	u32 i;
+
+	for (i = 0; i + SAMPLING_READ_SIZE <= len; i += SAMPLING_INTERVAL) {
+		memcpy(sample + nr_samples, data + i, SAMPLING_READ_SIZE);
+		nr_samples += SAMPLING_READ_SIZE;
+	}
+	if (!nr_samples)
+		return true;
+
+	/* Repeated patterns */
+	if (memcmp(sample, sample + nr_samples / 2, nr_samples / 2) == 0)
+		return true;
+
+	for (i = 0; i < nr_samples; i++)
+		bucket[sample[i]]++;
+	for (i = 0; i < 256; i++)
+		if (bucket[i])
+			byte_set++;
+	if (byte_set < BYTE_SET_THRESHOLD)
+		return true;
+
+	/* Number of the most common bytes covering 90% of the samples */
+	qsort(bucket, 256, sizeof(bucket[0]), cmp_bucket_desc);
+	for (i = 0; i < BYTE_CORE_SET_HIGH; i++) {
+		core_sum += bucket[i];
+		if (core_sum > nr_samples * 90 / 100)
+			break;
+	}
+	if (i < BYTE_CORE_SET_LOW)
+		return true;
+	if (i >= BYTE_CORE_SET_HIGH)
+		return false;
+
+	/* Shannon entropy in percents of 8 bits, with log2(x^4) precision */
+	log_total = ilog2((u64)nr_samples * nr_samples * nr_samples * nr_samples);
+	for (i = 0; i < 256 && bucket[i]; i++) {
+		u64 p = bucket[i];
+
+		entropy_sum += p * (log_total - ilog2(p * p * p * p));
+	}
+	entropy_sum /= nr_samples;
+	return entropy_sum * 100 / (8 * 4) < ENTROPY_LVL_HIGH;
+}
+
+static struct rootdir_compress_ctx *rootdir_get_ctx(void)
+{
+	struct rootdir_compress_ctx *ctx = NULL;
+
+	pthread_mutex_lock(&ingest.lock);
+	if (!list_empty(&ingest.ctxs)) {
+		ctx = list_first_entry(&ingest.ctxs,
+				       struct rootdir_compress_ctx, list);
+		list_del(&ctx->list);
+	}
+	pthread_mutex_unlock(&ingest.lock);
+	if (ctx)
+		return ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	return ctx;
+}
+
+static void rootdir_put_ctx(struct rootdir_compress_ctx *ctx)
+{
+	pthread_mutex_lock(&ingest.lock);
+	list_add(&ctx->list, &ingest.ctxs);
+	pthread_mutex_unlock(&ingest.lock);
+}
+
+static void rootdir_free_ctx(struct rootdir_compress_ctx *ctx)
+{
+	if (ctx->zlib_ready)
+		deflateEnd(&ctx->zlib);
+#if COMPRESSION_ZSTD
+	ZSTD_freeCCtx(ctx->zstd);
+#endif
+	free(ctx);
+}
+
+/*
+ * The compressors return the length of the compressed data, 0 if they don't
+ * fit in @max_out or a negative errno.
+ */
+static int compress_zlib(struct rootdir_compress_ctx *ctx, const u8 *in,
+			 u32 len, u8 *out, u32 max_out)
+{
+	int ret;
+
+	if (!ctx->zlib_ready) {
+		ret = deflateInit(&ctx->zlib, ingest.compress_level);
+		if (ret != Z_OK)
+			return ret == Z_MEM_ERROR ? -ENOMEM : -EINVAL;
+		ctx->zlib_ready = true;
+	} else {
+		deflateReset(&ctx->zlib);
+	}
+	ctx->zlib.next_in = (u8 *)in;
+	ctx->zlib.avail_in = len;
+	ctx->zlib.next_out = out;
+	ctx->zlib.avail_out = max_out;
+	ret = deflate(&ctx->zlib, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return 0;
+	return max_out - ctx->zlib.avail_out;
+}
+
+static int compress_zstd(struct rootdir_compress_ctx *ctx, const u8 *in,
+			 u32 len, u8 *out, u32 max_out)
+{
+#if COMPRESSION_ZSTD
+	size_t ret;
+
+	if (!ctx->zstd) {
+		ctx->zstd = ZSTD_createCCtx();
+		if (!ctx->zstd)
+			return -ENOMEM;
+	}
+	/*
+	 * The known source size limits the window to 128K, which the kernel
+	 * expects.
+	 */
+	ret = ZSTD_compressCCtx(ctx->zstd, out, max_out, in, len,
+				ingest.compress_level);
+	if (ZSTD_isError(ret))
+		return 0;
+	return ret;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static int rootdir_nocompress(struct rootdir_cfile *cfile)
+{
+	int ret;
+
+	pthread_mutex_lock(&ingest.lock);
+	ret = cfile->nocompress;
+	pthread_mutex_unlock(&ingest.lock);
+	return ret;
+}
+
+static void rootdir_chunk_work_fn(struct btrfs_work *work)
+{
+	struct rootdir_chunk *chunk = container_of(work, struct rootdir_chunk,
+						   work);
+	struct rootdir_cfile *cfile = chunk->cfile;
+	struct btrfs_fs_info *fs_info = ingest.fs_info;
+	u32 sectorsize = fs_info->sectorsize;
+	struct rootdir_compress_ctx *ctx;
+	struct rootdir_segment seg;
+	u8 *buf = NULL;
+	int ret;
+
+	/* An earlier chunk already stopped the compression */
+	if (chunk->index > rootdir_nocompress(cfile))
+		goto out;
+
+	buf = malloc(chunk->len);
+	chunk->out = malloc(chunk->len);
+	ctx = rootdir_get_ctx();
+	if (!buf || !chunk->out || !ctx) {
+		if (ctx)
+			rootdir_put_ctx(ctx);
+		chunk->err = ENOMEM;
+		goto out;
+	}
+	seg.path = cfile->path;
+	seg.file_pos = (u64)chunk->index * BTRFS_MAX_UNCOMPRESSED;
+	seg.offset = 0;
+	seg.len = chunk->len;
+	chunk->err = rootdir_read_segment((char *)buf, &seg, &chunk->err_open);
+	if (chunk->err) {
+		rootdir_put_ctx(ctx);
+		goto out;
+	}
+
+	ret = 0;
+	/* The compressed data have to save at least one sector */
+	if (rootdir_compressible(buf, chunk->len)) {
+		switch (ingest.compression) {
+		case BTRFS_COMPRESS_ZLIB:
+			ret = compress_zlib(ctx, buf, chunk->len, chunk->out,
+					    chunk->len - sectorsize);
+			break;
+		case BTRFS_COMPRESS_ZSTD:
+			ret = compress_zstd(ctx, buf, chunk->len, chunk->out,
+					    chunk->len - sectorsize);
+			break;
+		}
+	}
+	rootdir_put_ctx(ctx);
+	if (ret < 0) {
+		chunk->err = -ret;
+		goto out;
+	}
+	if (ret == 0) {
+		pthread_mutex_lock(&ingest.lock);
+		cfile->nocompress = min(cfile->nocompress, chunk->index);
+		pthread_mutex_unlock(&ingest.lock);
+		goto out;
+	}
+
+	chunk->out_len = round_up(ret, sectorsize);
+	memset(chunk->out + ret, 0, chunk->out_len - ret);
+	chunk->csums = malloc(chunk->out_len / sectorsize * fs_info->csum_size);
+	if (!chunk->csums) {
+		chunk->err = ENOMEM;
+		goto out;
+	}
+	btrfs_csum_data_many(fs_info->csum_type, chunk->out, chunk->csums,
+			     sectorsize, chunk->out_len / sectorsize);
+	chunk->compressed = true;
+out:
+	free(buf);
+	if (!chunk->compressed) {
+		free(chunk->out);
+		chunk->out = NULL;
+	}
+	rootdir_complete(&chunk->done);
+}
+
+static void rootdir_queue_chunk(struct rootdir_chunk *chunk)
+{
+	chunk->cfile->nr_queued++;
+	chunk->in_flight = true;
+	ingest.compress_in_flight += chunk->len;
+	btrfs_init_work(&chunk->work, rootdir_chunk_work_fn);
+	btrfs_queue_work(ingest.wq, &chunk->work);
+}
+
+/* Drop the compressed data of a chunk and let the next ones in */
+static void rootdir_release_chunk(struct rootdir_chunk *chunk)
+{
+	if (!chunk->in_flight)
+		return;
+	rootdir_wait(&chunk->done);
+	free(chunk->out);
+	free(chunk->csums);
+	chunk->out = NULL;
+	chunk->csums = NULL;
+	chunk->in_flight = false;
+	ingest.compress_in_flight -= chunk->len;
+}
+
+static void rootdir_free_cfile(struct rootdir_cfile *cfile)
+{
+	int i;
+
+	for (i = 0; i < cfile->nr_queued; i++)
+		rootdir_release_chunk(&cfile->chunks[i]);
+	list_del(&cfile->list);
+	free(cfile->path);
+	free(cfile);
+}
+
+static struct rootdir_cfile *rootdir_alloc_cfile(const char *path, u64 size)
+{
+	u32 sectorsize = ingest.fs_info->sectorsize;
+	struct rootdir_cfile *cfile;
+	int nr_chunks;
+	int i;
+
+	size = round_up(size, sectorsize);
+	nr_chunks = DIV_ROUND_UP(size, BTRFS_MAX_UNCOMPRESSED);
+	cfile = calloc(1, sizeof(*cfile) + nr_chunks * sizeof(cfile->chunks[0]));
+	if (!cfile)
+		return NULL;
+	cfile->path = strdup(path);
+	if (!cfile->path) {
+		free(cfile);
+		return NULL;
+	}
+	cfile->nr_chunks = nr_chunks;
+	cfile->nocompress = INT_MAX;
+	for (i = 0; i < nr_chunks; i++) {
+		cfile->chunks[i].cfile = cfile;
+		cfile->chunks[i].index = i;
+		cfile->chunks[i].len = min_t(u64, BTRFS_MAX_UNCOMPRESSED,
+				size - (u64)i * BTRFS_MAX_UNCOMPRESSED);
+	}
+	return cfile;
+}
+
+/* Queue the next chunks of @cfile within the limit of the data in flight */
+static void rootdir_queue_chunks(struct rootdir_cfile *cfile)
+{
+	while (cfile->nr_queued < cfile->nr_chunks &&
+	       ingest.compress_in_flight < ingest.max_in_flight &&
+	       cfile->nr_queued <= rootdir_nocompress(cfile))
+		rootdir_queue_chunk(&cfile->chunks[cfile->nr_queued]);
+}
+
+/*
+ * Regular files that are compressed ahead, hardlinks are set up only when
+ * inserted as the other links are skipped.
+ */
+static bool rootdir_want_compress(struct rootdir_entry *entry)
+{
+	return !entry->stat_errno && S_ISREG(entry->st.st_mode) &&
+	       entry->st.st_nlink <= 1 &&
+	       entry->st.st_size > ingest.fs_info->sectorsize;
+}
+
+/*
+ * Set up the next file in the order of the traversal for compression, returns
+ * 1 if there was one, 0 if the next scanned directories are not ready.
+ */
+static int rootdir_feed_next_file(void)
+{
+	while (1) {
+		struct directory_name_entry *dir = ingest.feed_dir;
+		struct rootdir_scan *scan;
+
+		scan = dir ? dir->scan : ingest.cur_scan;
+		if (!scan || !rootdir_is_done(&scan->done))
+			return 0;
+		while (ingest.feed_idx < scan->count) {
+			struct rootdir_entry *entry;
+			struct rootdir_cfile *cfile;
+			char path[PATH_MAX];
+			int i = ingest.feed_idx++;
+
+			entry = &scan->entries[i];
+			if (!rootdir_want_compress(entry))
+				continue;
+			if (path_cat_out(path, scan->path, scan->files[i]->d_name))
+				continue;
+			cfile = rootdir_alloc_cfile(path, entry->st.st_size);
+			if (!cfile)
+				return -ENOMEM;
+			list_add_tail(&cfile->list, &ingest.cfiles);
+			entry->cfile = cfile;
+			return 1;
+		}
+
+		if (!dir) {
+			if (list_empty(ingest.dirs))
+				return 0;
+			dir = list_first_entry(ingest.dirs,
+					struct directory_name_entry, list);
+		} else {
+			if (list_is_last(&dir->list, ingest.dirs))
+				return 0;
+			dir = list_next_entry(dir, list);
+		}
+		ingest.feed_dir = dir;
+		ingest.feed_idx = 0;
+	}
+}
+
+/* Keep the workers busy compressing the files ahead of the inserts */
+static int rootdir_feed(void)
+{
+	int ret;
+
+	if (!ingest.compression)
+		return 0;
+	while (ingest.compress_in_flight < ingest.max_in_flight) {
+		if (!list_empty(&ingest.cfiles))
+			rootdir_queue_chunks(list_last_entry(&ingest.cfiles,
+						struct rootdir_cfile, list));
+		if (ingest.compress_in_flight >= ingest.max_in_flight)
+			break;
+		ret = rootdir_feed_next_file();
+		if (ret <= 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* Start inserting the directory @dir, its scan is done */
+static int rootdir_enter_dir(struct directory_name_entry *dir)
+{
+	if (ingest.feed_dir == dir)
+		ingest.feed_dir = NULL;
+	else if (!ingest.feed_dir)
+		ingest.feed_idx = 0;
+	ingest.cur_scan = dir->scan;
+	return rootdir_feed();
+}
+
+/*
+ * Write the file at @path compressed, from the start up to the first chunk
+ * that does not compress, the rest of the file is left to the caller.
+ */
+static int rootdir_add_compressed(struct btrfs_trans_handle *trans,
+				  struct btrfs_root *root,
+				  struct btrfs_inode_item *btrfs_inode,
+				  u64 objectid, const char *path,
+				  struct rootdir_entry *entry, u64 *file_pos)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct rootdir_cfile *cfile;
+	struct btrfs_key key;
+	int ret = 0;
+	int i;
+
+	/* The file may be inserted before it was reached by the feeding */
+	while (rootdir_want_compress(entry) && !entry->cfile) {
+		ret = rootdir_feed_next_file();
+		if (ret < 0)
+			return ret;
+		ASSERT(ret > 0);
+	}
+	cfile = entry->cfile;
+	if (!cfile) {
+		cfile = rootdir_alloc_cfile(path, entry->st.st_size);
+		if (!cfile)
+			return -ENOMEM;
+		list_add(&cfile->list, &ingest.cfiles);
+	}
+
+	for (i = 0; i < cfile->nr_chunks; i++) {
+		struct rootdir_chunk *chunk = &cfile->chunks[i];
+
+		if (i == cfile->nr_queued)
+			rootdir_queue_chunk(chunk);
+		rootdir_queue_chunks(cfile);
+		ret = rootdir_feed();
+		if (ret < 0)
+			goto out;
+
+		rootdir_wait(&chunk->done);
+		if (chunk->err) {
+			errno = chunk->err;
+			if (chunk->err_open)
+				error("cannot open %s: %m", path);
+			else
+				error("cannot compress %s at offset %llu length %u: %m",
+				      path, *file_pos, chunk->len);
+			ret = -chunk->err;
+			goto out;
+		}
+		if (!chunk->compressed)
+			break;
+
+		ret = btrfs_reserve_extent(trans, root, chunk->out_len, 0, 0,
+					   (u64)-1, &key, 1);
+		if (ret)
+			goto out;
+		ret = write_data_to_disk(fs_info, chunk->out, key.objectid,
+					 chunk->out_len);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to write bytenr %llu length %u: %m",
+			      key.objectid, chunk->out_len);
+			goto out;
+		}
+		ret = btrfs_insert_data_csums(trans, key.objectid,
+					      chunk->out_len, chunk->csums);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to insert checksums for bytenr %llu length %u: %m",
+			      key.objectid, chunk->out_len);
+			goto out;
+		}
+		ret = btrfs_record_compressed_file_extent(trans, root, objectid,
+				btrfs_inode, *file_pos, key.objectid,
+				chunk->out_len, chunk->len, ingest.compression);
+		if (ret)
+			goto out;
+		*file_pos += chunk->len;
+		rootdir_release_chunk(chunk);
+	}
+out:
+	entry->cfile = NULL;
+	rootdir_free_cfile(cfile);
+	if (ret == 0)
+		ret = rootdir_feed();
+	return ret;
+}
+
+static int rootdir_ingest_init(struct btrfs_fs_info *fs_info, int nr_threads,
+			       int compression, int compress_level,
+			       struct list_head *dirs)
+{
+	ingest.fs_info = fs_info;
+	ingest.batch = NULL;
+	ingest.in_flight = 0;
+	INIT_LIST_HEAD(&ingest.pending);
+	ingest.compression = compression;
+	ingest.compress_level = compress_level;
+	INIT_LIST_HEAD(&ingest.ctxs);
+	INIT_LIST_HEAD(&ingest.cfiles);
+	ingest.compress_in_flight = 0;
+	ingest.dirs = dirs;
+	ingest.feed_dir = NULL;
+	ingest.feed_idx = 0;
+	ingest.cur_scan = NULL;
+	pthread_mutex_init(&ingest.lock, NULL);
+	pthread_cond_init(&ingest.cond, NULL);
+	ingest.wq = btrfs_alloc_workqueue(nr_threads);
+	if (!ingest.wq)
+		return -ENOMEM;
+	ingest.max_in_flight = max_t(u64, ROOTDIR_MAX_IN_FLIGHT,
+			2ULL * ingest.wq->nr_threads * ROOTDIR_BATCH_SIZE);
+	return 0;
+}
+
+static void rootdir_ingest_exit(void)
+{
+	btrfs_destroy_workqueue(ingest.wq);
+	ingest.wq = NULL;
+	rootdir_free_batch(ingest.batch);
+	ingest.batch = NULL;
+	while (!list_empty(&ingest.pending)) {
+		struct rootdir_batch *batch;
+
+		batch = list_first_entry(&ingest.pending, struct rootdir_batch,
+					 list);
+		list_del(&batch->list);
+		rootdir_free_batch(batch);
+	}
+	while (!list_empty(&ingest.cfiles))
+		rootdir_free_cfile(list_first_entry(&ingest.cfiles,
+					struct rootdir_cfile, list));
+	while (!list_empty(&ingest.ctxs)) {
+		struct rootdir_compress_ctx *ctx;
+
+		ctx = list_first_entry(&ingest.ctxs,
+				       struct rootdir_compress_ctx, list);
+		list_del(&ctx->list);
+		rootdir_free_ctx(ctx);
+	}
+	pthread_mutex_destroy(&ingest.lock);
+	pthread_cond_destroy(&ingest.cond);
+}
+
 static int add_inode_items(struct btrfs_trans_handle *trans,
 			   struct btrfs_root *root,
-			   struct stat *st, const char *name,
+			   struct stat *st, u64 dir_size,
 			   u64 self_objectid,
 			   struct btrfs_inode_item *inode_ret)
 {
 	int ret;
 	struct btrfs_inode_item btrfs_inode;
 	u64 objectid;
-	u64 inode_size = 0;
 
 	fill_inode_item(trans, root, &btrfs_inode, st);
 	objectid = self_objectid;
 
-	if (S_ISDIR(st->st_mode)) {
-		inode_size = calculate_dir_inode_size(name);
-		btrfs_set_stack_inode_size(&btrfs_inode, inode_size);
-	}
+	if (S_ISDIR(st->st_mode))
+		btrfs_set_stack_inode_size(&btrfs_inode, dir_size);
 
 	ret = btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
 
@@ -227,49 +1366,32 @@ static int add_inode_items(struct btrfs_trans_handle *trans,
 
 static int add_xattr_item(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 objectid,
-			  const char *file_name)
+			  const char *file_name, struct rootdir_entry *entry)
 {
-	int ret;
-	int cur_name_len;
-	char xattr_list[XATTR_LIST_MAX];
-	char *xattr_list_end;
-	char *cur_name;
-	char cur_value[XATTR_SIZE_MAX];
-
-	ret = llistxattr(file_name, xattr_list, XATTR_LIST_MAX);
-	if (ret < 0) {
-		if (errno == ENOTSUP)
-			return 0;
-		error("getting a list of xattr failed for %s: %m", file_name);
-		return ret;
-	}
-	if (ret == 0)
-		return ret;
-
-	xattr_list_end = xattr_list + ret;
-	cur_name = xattr_list;
-	while (cur_name < xattr_list_end) {
-		cur_name_len = strlen(cur_name);
-
-		ret = lgetxattr(file_name, cur_name, cur_value, XATTR_SIZE_MAX);
-		if (ret < 0) {
-			if (errno == ENOTSUP)
-				return 0;
-			error("getting a xattr value failed for %s attr %s: %m",
-				file_name, cur_name);
-			return ret;
-		}
+	struct rootdir_xattr *xattr;
+	int ret = 0;
 
-		ret = btrfs_insert_xattr_item(trans, root, cur_name,
-					      cur_name_len, cur_value,
-					      ret, objectid);
+	list_for_each_entry(xattr, &entry->xattrs, list) {
+		ret = btrfs_insert_xattr_item(trans, root, xattr->data,
+					      xattr->name_len,
+					      xattr->data + xattr->name_len + 1,
+					      xattr->value_len, objectid);
 		if (ret) {
 			errno = -ret;
 			error("inserting a xattr item failed for %s: %m",
 					file_name);
 		}
+	}
 
-		cur_name += cur_name_len + 1;
+	if (entry->xattr_errno) {
+		errno = entry->xattr_errno;
+		if (entry->xattr_name)
+			error("getting a xattr value failed for %s attr %s: %m",
+				file_name, entry->xattr_name);
+		else
+			error("getting a list of xattr failed for %s: %m",
+				file_name);
+		return -1;
 	}
 
 	return ret;
@@ -277,165 +1399,112 @@ static int add_xattr_item(struct btrfs_trans_handle *trans,
 
 static int add_symbolic_link(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
-			     u64 objectid, const char *path_name)
+			     u64 objectid, const char *path_name,
+			     struct rootdir_entry *entry)
 {
-	int ret;
-	char buf[PATH_MAX];
-
-	ret = readlink(path_name, buf, sizeof(buf));
-	if (ret <= 0) {
+	if (entry->data_len <= 0) {
+		errno = entry->data_errno;
 		error("readlink failed for %s: %m", path_name);
-		goto fail;
+		return -1;
 	}
-	if (ret >= sizeof(buf)) {
+	if (entry->data_len >= PATH_MAX) {
 		error("symlink too long for %s", path_name);
-		ret = -1;
-		goto fail;
+		return -1;
 	}
 
-	buf[ret] = '\0'; /* readlink does not do it for us */
-	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-					 buf, ret + 1);
-fail:
-	return ret;
+	return btrfs_insert_inline_extent(trans, root, objectid, 0,
+					  entry->data, entry->data_len + 1);
 }
 
 static int add_file_items(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root,
 			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
-			  struct stat *st, const char *path_name)
+			  struct stat *st, const char *dir_path,
+			  const char *path_name, struct rootdir_entry *entry)
 {
-	int ret = -1;
-	ssize_t ret_read;
-	u64 bytes_read = 0;
+	int ret;
 	struct btrfs_key key;
-	int blocks;
 	u32 sectorsize = root->fs_info->sectorsize;
-	u64 first_block = 0;
 	u64 file_pos = 0;
 	u64 cur_bytes;
 	u64 total_bytes;
-	struct extent_buffer *eb = NULL;
-	int fd;
+	char path[PATH_MAX];
 
 	if (st->st_size == 0)
 		return 0;
 
-	fd = open(path_name, O_RDONLY);
-	if (fd == -1) {
-		error("cannot open %s: %m", path_name);
-		return ret;
-	}
-
-	blocks = st->st_size / sectorsize;
-	if (st->st_size % sectorsize)
-		blocks += 1;
-
-	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root->fs_info) &&
-	    st->st_size < sectorsize) {
-		char *buffer = malloc(st->st_size);
-
-		if (!buffer) {
-			ret = -ENOMEM;
-			goto end;
+	if (rootdir_is_inline(root->fs_info, st->st_size)) {
+		if (entry->data_len < 0) {
+			errno = entry->data_errno;
+			if (entry->data_open_failed)
+				error("cannot open %s: %m", path_name);
+			else
+				error("cannot read %s at offset 0 length %llu: %m",
+				      path_name, (unsigned long long)st->st_size);
+			return -1;
 		}
 
-		ret_read = pread64(fd, buffer, st->st_size, bytes_read);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %llu length %llu: %m",
-				path_name, bytes_read, (unsigned long long)st->st_size);
-			free(buffer);
-			goto end;
-		}
+		return btrfs_insert_inline_extent(trans, root, objectid, 0,
+						  entry->data, st->st_size);
+	}
 
-		ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-						 buffer, st->st_size);
-		free(buffer);
-		goto end;
+	ret = path_cat_out(path, dir_path, path_name);
+	if (ret < 0) {
+		error("invalid path: %s/%s", dir_path, path_name);
+		return ret;
 	}
 
 	/* round up our st_size to the FS blocksize */
-	total_bytes = (u64)blocks * sectorsize;
+	total_bytes = round_up(st->st_size, sectorsize);
 
-	/*
-	 * do our IO in extent buffers so it can work
-	 * against any raid type
-	 */
-	eb = calloc(1, sizeof(*eb) + sectorsize);
-	if (!eb) {
-		ret = -ENOMEM;
-		goto end;
+	if (ingest.compression && total_bytes > sectorsize) {
+		ret = rootdir_add_compressed(trans, root, btrfs_inode, objectid,
+					     path, entry, &file_pos);
+		if (ret)
+			return ret;
+		total_bytes -= file_pos;
 	}
 
-again:
-
 	/*
-	 * keep our extent size at 1MB max, this makes it easier to work inside
-	 * the tiny block groups created during mkfs
+	 * The extents are only reserved and recorded here, the data are copied
+	 * by the workers in batches and written before the commit.
 	 */
-	cur_bytes = min(total_bytes, (u64)SZ_1M);
-	ret = btrfs_reserve_extent(trans, root, cur_bytes, 0, 0, (u64)-1,
-				   &key, 1);
-	if (ret)
-		goto end;
-
-	first_block = key.objectid;
-	bytes_read = 0;
-
-	while (bytes_read < cur_bytes) {
-
-		memset(eb->data, 0, sectorsize);
-
-		ret_read = pread64(fd, eb->data, sectorsize, file_pos +
-				   bytes_read);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %llu length %u: %m",
-				path_name, file_pos + bytes_read, sectorsize);
-			goto end;
-		}
-
-		eb->start = first_block + bytes_read;
-		eb->len = sectorsize;
-		eb->fs_info = root->fs_info;
-
+	while (total_bytes) {
+		cur_bytes = min(total_bytes, (u64)ROOTDIR_MAX_EXTENT_SIZE);
 		/*
-		 * we're doing the csum before we record the extent, but
-		 * that's ok
+		 * Large extents are limited by the free space left in the
+		 * block groups, which can be tiny during mkfs. Don't go below
+		 * 1M which may also need a new chunk.
 		 */
-		ret = btrfs_csum_file_block(trans,
-				first_block + bytes_read + sectorsize,
-				first_block + bytes_read,
-				eb->data, sectorsize);
-		if (ret)
-			goto end;
-
-		ret = write_and_map_eb(root->fs_info, eb);
-		if (ret) {
-			error("failed to write %s", path_name);
-			goto end;
+		if (cur_bytes > SZ_1M) {
+			u64 max_free = btrfs_max_free_extent(root->fs_info,
+						BTRFS_BLOCK_GROUP_DATA);
+
+			cur_bytes = min(cur_bytes,
+					round_down(max_free, sectorsize));
+			cur_bytes = max(cur_bytes,
+					min(total_bytes, (u64)SZ_1M));
 		}
+		ret = btrfs_reserve_extent(trans, root, cur_bytes, 0, 0,
+					   (u64)-1, &key, 1);
+		if (ret)
+			return ret;
 
-		bytes_read += sectorsize;
-	}
-
-	if (bytes_read) {
 		ret = btrfs_record_file_extent(trans, root, objectid,
-				btrfs_inode, file_pos, first_block, cur_bytes);
+				btrfs_inode, file_pos, key.objectid, cur_bytes);
 		if (ret)
-			goto end;
-
-	}
+			return ret;
 
-	file_pos += cur_bytes;
-	total_bytes -= cur_bytes;
+		ret = rootdir_add_data(trans, path, file_pos, key.objectid,
+				       cur_bytes);
+		if (ret)
+			return ret;
 
-	if (total_bytes)
-		goto again;
+		file_pos += cur_bytes;
+		total_bytes -= cur_bytes;
+	}
 
-end:
-	free(eb);
-	close(fd);
-	return ret;
+	return 0;
 }
 
 static int traverse_directory(struct btrfs_trans_handle *trans,
@@ -447,8 +1516,9 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	struct btrfs_inode_item cur_inode;
 	struct btrfs_inode_item *inode_item;
 	int count, i, dir_index_cnt;
-	struct dirent **files;
-	struct stat st;
+	struct rootdir_scan *scan;
+	struct rootdir_entry *entry;
+	struct stat *st;
 	struct directory_name_entry *dir_entry, *parent_dir_entry;
 	struct dirent *cur_file;
 	ino_t parent_inum, cur_inum;
@@ -464,6 +1534,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	if (!dir_entry)
 		return -ENOMEM;
 	dir_entry->dir_name = dir_name;
+	dir_entry->scan = NULL;
 	dir_entry->path = realpath(dir_name, NULL);
 	if (!dir_entry->path) {
 		error("realpath failed for %s: %m", dir_name);
@@ -475,6 +1546,12 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	dir_entry->inum = parent_inum;
 	list_add_tail(&dir_entry->list, &dir_head->list);
 
+	ret = rootdir_scan_ahead(&dir_head->list);
+	if (ret < 0) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		goto out;
+	}
+
 	btrfs_init_path(&path);
 
 	root_dir_key.objectid = btrfs_root_dirid(&root->root_item);
@@ -483,7 +1560,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	ret = btrfs_lookup_inode(trans, root, &path, &root_dir_key, 1);
 	if (ret) {
 		error("failed to lookup root dir: %d", ret);
-		goto fail_no_dir;
+		goto out;
 	}
 
 	leaf = path.nodes[0];
@@ -504,26 +1581,29 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 
 		parent_inum = parent_dir_entry->inum;
 		parent_dir_name = parent_dir_entry->dir_name;
-		if (chdir(parent_dir_entry->path)) {
-			error("chdir failed for %s: %m",
-				parent_dir_name);
-			ret = -1;
-			goto fail_no_files;
-		}
-
-		count = scandir(parent_dir_entry->path, &files,
-				directory_select, NULL);
+		scan = parent_dir_entry->scan;
+		rootdir_wait(&scan->done);
+		count = scan->count;
 		if (count == -1) {
+			errno = scan->scan_errno;
 			error("scandir failed for %s: %m",
 				parent_dir_name);
 			ret = -1;
 			goto fail;
 		}
+		ret = rootdir_enter_dir(parent_dir_entry);
+		if (ret < 0) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			goto fail;
+		}
 
 		for (i = 0; i < count; i++) {
-			cur_file = files[i];
+			cur_file = scan->files[i];
+			entry = &scan->entries[i];
+			st = &entry->st;
 
-			if (lstat(cur_file->d_name, &st) == -1) {
+			if (entry->stat_errno) {
+				errno = entry->stat_errno;
 				error("lstat failed for %s: %m",
 					cur_file->d_name);
 				ret = -1;
@@ -536,26 +1616,26 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 			 * BTRFS_FIRST_FREE_OBJECTID, which will screw up
 			 * backref code.
 			 */
-			cur_inum = st.st_ino + BTRFS_FIRST_FREE_OBJECTID;
+			cur_inum = st->st_ino + BTRFS_FIRST_FREE_OBJECTID;
 			ret = add_directory_items(trans, root,
 						  cur_inum, parent_inum,
 						  cur_file->d_name,
-						  &st, &dir_index_cnt);
+						  st, &dir_index_cnt);
 			if (ret) {
 				error("unable to add directory items for %s: %d",
 					cur_file->d_name, ret);
 				goto fail;
 			}
 
-			ret = add_inode_items(trans, root, &st,
-					      cur_file->d_name, cur_inum,
+			ret = add_inode_items(trans, root, st,
+					      entry->dir_size, cur_inum,
 					      &cur_inode);
 			if (ret == -EEXIST) {
-				if (st.st_nlink <= 1) {
+				if (st->st_nlink <= 1) {
 					error(
 			"item %s already exists but has wrong st_nlink %lu <= 1",
 						cur_file->d_name,
-						(unsigned long)st.st_nlink);
+						(unsigned long)st->st_nlink);
 					goto fail;
 				}
 				ret = 0;
@@ -568,7 +1648,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 			}
 
 			ret = add_xattr_item(trans, root,
-					     cur_inum, cur_file->d_name);
+					     cur_inum, cur_file->d_name, entry);
 			if (ret) {
 				error("unable to add xattr items for %s: %d",
 					cur_file->d_name, ret);
@@ -576,7 +1656,7 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 					goto fail;
 			}
 
-			if (S_ISDIR(st.st_mode)) {
+			if (S_ISDIR(st->st_mode)) {
 				char tmp[PATH_MAX];
 
 				dir_entry = malloc(sizeof(*dir_entry));
@@ -584,36 +1664,44 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 					ret = -ENOMEM;
 					goto fail;
 				}
-				dir_entry->dir_name = cur_file->d_name;
 				if (path_cat_out(tmp, parent_dir_entry->path,
 							cur_file->d_name)) {
 					error("invalid path: %s/%s",
 							parent_dir_entry->path,
 							cur_file->d_name);
+					free(dir_entry);
 					ret = -EINVAL;
 					goto fail;
 				}
 				dir_entry->path = strdup(tmp);
 				if (!dir_entry->path) {
 					error_msg(ERROR_MSG_MEMORY, NULL);
+					free(dir_entry);
 					ret = -ENOMEM;
 					goto fail;
 				}
+				/* The name is the last component of the path */
+				dir_entry->dir_name = dir_entry->path +
+					strlen(dir_entry->path) -
+					strlen(cur_file->d_name);
+				dir_entry->scan = NULL;
 				dir_entry->inum = cur_inum;
 				list_add_tail(&dir_entry->list,
 					      &dir_head->list);
-			} else if (S_ISREG(st.st_mode)) {
+			} else if (S_ISREG(st->st_mode)) {
 				ret = add_file_items(trans, root, &cur_inode,
-						     cur_inum, &st,
-						     cur_file->d_name);
+						     cur_inum, st,
+						     parent_dir_entry->path,
+						     cur_file->d_name, entry);
 				if (ret) {
 					error("unable to add file items for %s: %d",
 						cur_file->d_name, ret);
 					goto fail;
 				}
-			} else if (S_ISLNK(st.st_mode)) {
+			} else if (S_ISLNK(st->st_mode)) {
 				ret = add_symbolic_link(trans, root,
-						cur_inum, cur_file->d_name);
+						cur_inum, cur_file->d_name,
+						entry);
 				if (ret) {
 					error("unable to add symlink for %s: %d",
 						cur_file->d_name, ret);
@@ -622,7 +1710,14 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 			}
 		}
 
-		free_namelist(files, count);
+		ret = rootdir_scan_ahead(&dir_head->list);
+		if (ret < 0) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			goto fail;
+		}
+
+		ingest.cur_scan = NULL;
+		rootdir_free_scan(scan);
 		free(parent_dir_entry->path);
 		free(parent_dir_entry);
 
@@ -630,11 +1725,12 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 
 	} while (!list_empty(&dir_head->list));
 
+	ret = rootdir_flush(trans);
 out:
 	return !!ret;
 fail:
-	free_namelist(files, count);
-fail_no_files:
+	rootdir_free_scan(parent_dir_entry->scan);
+	free(parent_dir_entry->path);
 	free(parent_dir_entry);
 	goto out;
 fail_no_dir:
@@ -643,6 +1739,7 @@ fail_no_dir:
 }
 
 int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root,
+			int nr_threads, int compression, int compress_level,
 			bool verbose)
 {
 	int ret;
@@ -660,19 +1757,36 @@ int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root,
 
 	INIT_LIST_HEAD(&dir_head.list);
 
+	ret = rootdir_ingest_init(root->fs_info, nr_threads, compression,
+				  compress_level, &dir_head.list);
+	if (ret < 0) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		goto out;
+	}
+
 	trans = btrfs_start_transaction(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
 		error_msg(ERROR_MSG_START_TRANS, "%m");
-		goto fail;
-}
+		rootdir_ingest_exit();
+		goto out;
+	}
+
+	if (compression == BTRFS_COMPRESS_ZSTD) {
+		struct btrfs_super_block *super = root->fs_info->super_copy;
+		u64 flags = btrfs_super_incompat_flags(super);
+
+		flags |= BTRFS_FEATURE_INCOMPAT_COMPRESS_ZSTD;
+		btrfs_set_super_incompat_flags(super, flags);
+	}
 
 	ret = traverse_directory(trans, root, source_dir, &dir_head);
 	if (ret) {
 		error("unable to traverse directory %s: %d", source_dir, ret);
 		goto fail;
 	}
+	rootdir_ingest_exit();
 	ret = btrfs_commit_transaction(trans, root);
 	if (ret) {
 		errno = -ret;
@@ -696,11 +1810,13 @@ fail:
 	 * Since we have already hit some problem, the return value doesn't
 	 * matter now.
 	 */
+	rootdir_ingest_exit();
 	btrfs_commit_transaction(trans, root);
 	while (!list_empty(&dir_head.list)) {
 		dir_entry = list_entry(dir_head.list.next,
 				       struct directory_name_entry, list);
 		list_del(&dir_entry->list);
+		rootdir_free_scan(dir_entry->scan);
 		free(dir_entry->path);
 		free(dir_entry);
 	}
@@ -767,8 +1883,8 @@ u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 	 *
 	 * And finally, allow metadata usage to increase with data size.
 	 * Follow the old kernel 8:1 data:meta ratio.
-	 * This is especially important for --rootdir, as the file extent size
-	 * upper limit is 1M, instead of 128M in kernel.
+	 * This is especially important for --rootdir, as the file extents are
+	 * limited by the free space in the small data block groups.
 	 * This can bump meta usage easily.
 	 */
 	meta_size = ftw_meta_nr_inode * (PATH_MAX * 3 + sectorsize) +
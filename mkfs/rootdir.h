@@ -28,15 +28,18 @@
 
 struct btrfs_fs_info;
 struct btrfs_root;
+struct rootdir_scan;
 
 struct directory_name_entry {
 	const char *dir_name;
 	char *path;
 	ino_t inum;
+	struct rootdir_scan *scan;
 	struct list_head list;
 };
 
 int btrfs_mkfs_fill_dir(const char *source_dir, struct btrfs_root *root,
+			int nr_threads, int compression, int compress_level,
 			bool verbose);
 u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 			u64 meta_profile, u64 data_profile);
@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# Verify that check with several threads (--threads) reports the same as the
+# serial check. The original mode keeps the order of the messages, the lowmem
+# mode checks the trees in parallel and only the set of messages is the same.
+# It also checks the ranges of a tree after a damaged part, which the serial
+# check does not reach, so on a damaged filesystem it can find more.
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+
+setup_root_helper
+prepare_test_dev
+
+# The address of a backref in the output differs between runs
+filter_output()
+{
+	sed -e 's/ back 0x[0-9a-f]*$//'
+}
+
+# The space totals of the summary
+filter_totals()
+{
+	grep -v -e '^found ' -e '^total ' -e '^btree space waste' \
+		-e '^file data blocks allocated' -e '^ referenced'
+}
+
+check_threads()
+{
+	local image="$1"
+	local mode="$2"
+	local serial
+	local parallel
+	local ret_serial
+	local ret_parallel
+
+	serial=$(run_mayfail_stdout "$TOP/btrfs" check --mode "$mode" "$image")
+	ret_serial=$?
+	parallel=$(run_mayfail_stdout "$TOP/btrfs" check --mode "$mode" \
+		--threads 4 "$image")
+	ret_parallel=$?
+
+	if [ "$ret_serial" != "$ret_parallel" ]; then
+		_fail "$mode mode: exit code $ret_parallel with threads, $ret_serial without"
+	fi
+	serial=$(echo "$serial" | filter_output)
+	parallel=$(echo "$parallel" | filter_output)
+	if [ "$mode" = "lowmem" ]; then
+		serial=$(echo "$serial" | sort)
+		parallel=$(echo "$parallel" | sort)
+		if [ "$ret_serial" != 0 ]; then
+			serial=$(echo "$serial" | filter_totals)
+			parallel=$(echo "$parallel" | filter_totals)
+			# Only what the serial check found must be there
+			parallel=$(comm -12 <(echo "$serial") <(echo "$parallel"))
+		fi
+	fi
+	if [ "$serial" != "$parallel" ]; then
+		_log "serial check output:"
+		_log "$serial"
+		_log "parallel check output:"
+		_log "$parallel"
+		_fail "$mode mode: different output with threads"
+	fi
+}
+
+check_image()
+{
+	check_threads "$1" original
+	check_threads "$1" lowmem
+}
+
+# Images with the various kinds of references and with errors
+for dir in 001-bad-file-extent-bytenr 007-bad-offset-snapshots \
+	   014-no-extent-info 020-extent-ref-cases \
+	   038-missing-one-file-extent; do
+	check_all_images "$TEST_TOP/fsck-tests/$dir"
+done
+
+# Enough files for more than one level of the fs tree, so the lowmem mode
+# splits it into ranges
+tmp=$(_mktemp_dir check-threads)
+for i in $(seq 10); do
+	mkdir "$tmp/dir$i"
+	for j in $(seq 100); do
+		head -c 5000 /dev/urandom > "$tmp/dir$i/file$j"
+	done
+done
+run_check_mkfs_test_dev --rootdir "$tmp"
+rm -rf -- "$tmp"
+check_image "$TEST_DEV"
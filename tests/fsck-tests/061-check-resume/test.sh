@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Verify that check continued by --resume from any point saved by --checkpoint
+# reports the same as a check without a checkpoint. The phases done before
+# the resume print only whether they found errors, the following phases use
+# the results saved with them.
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+check_prereq btrfs-corrupt-block
+
+setup_root_helper
+prepare_test_dev
+
+# Print the output without the lines of the phases done before the resume,
+# the stdout part only from the summary on
+filter_output()
+{
+	local skip="$1"
+
+	awk -v skip=" $skip " '
+	/^\[[0-9]\/7\]/ {
+		phase = substr($1, 2, 1)
+		sub(/\.\.\. done before resume$/, "")
+		print
+		next
+	}
+	/^Opening filesystem/ { phase = -1 }
+	/^found / { phase = 0 }
+	phase == -1 { next }
+	index(skip, " " phase " ") && !/^ERROR: errors found in / { next }
+	{ print }' | sed -e 's/ back 0x[0-9a-f]*$//'
+}
+
+check_resume()
+{
+	local image="$1"
+	local mode="$2"
+	local checkpoint
+	local tmp
+	local full
+	local resumed
+	local ret_full
+	local ret_resumed
+	local cuts
+	local skip
+
+	checkpoint=$(mktemp --tmpdir btrfs-progs-checkpoint.XXXXXX)
+	tmp=$(mktemp --tmpdir btrfs-progs-checkpoint.XXXXXX)
+	full=$(run_mayfail_stdout "$TOP/btrfs" check --mode "$mode" \
+		--checkpoint "$checkpoint" "$image")
+	ret_full=$?
+
+	# The header has 4 lines, then one line per finished phase or subvolume,
+	# each followed by the lines of its state. Cut the file before each of
+	# them and at the end, as it could be saved.
+	cuts=$(grep -n -e '^phase ' -e '^root ' "$checkpoint" | cut -d: -f1)
+	if [ -z "$cuts" ]; then
+		_fail "$mode mode: no progress saved to the checkpoint"
+	fi
+	cuts="$(echo $cuts) $(($(wc -l < "$checkpoint") + 1))"
+	for i in $cuts; do
+		head -n $((i - 1)) "$checkpoint" > "$tmp"
+		resumed=$(run_mayfail_stdout "$TOP/btrfs" check --mode "$mode" \
+			--resume "$tmp" "$image")
+		ret_resumed=$?
+		if [ "$ret_full" != "$ret_resumed" ]; then
+			_fail "$mode mode: exit code $ret_resumed after resume from line $i, $ret_full without"
+		fi
+		skip=$(echo "$resumed" | sed -n -e 's/^\[\([0-9]\)\/7\].*done before resume$/\1/p')
+		skip=$(echo $skip)
+		if [ "$(echo "$full" | filter_output "$skip")" != \
+		     "$(echo "$resumed" | filter_output "$skip")" ]; then
+			_log "check output:"
+			_log "$full"
+			_log "resumed check output:"
+			_log "$resumed"
+			_fail "$mode mode: different output after resume from line $i"
+		fi
+	done
+	rm -f -- "$checkpoint" "$tmp"
+}
+
+check_image()
+{
+	check_resume "$1" original
+	check_resume "$1" lowmem
+}
+
+check_all_images "$TEST_TOP/fsck-tests/001-bad-file-extent-bytenr"
+
+# Errors found only by the root refs check, from the records collected while
+# walking the fs roots
+image=$(extract_image "$TEST_TOP/fsck-tests/020-extent-ref-cases/shared_data_ref.img")
+run_check "$INTERNAL_BIN/btrfs-corrupt-block" -r 1 -d 257,144,5 "$image"
+check_image "$image"
+rm -f -- "$image"
+
+tmp=$(_mktemp_dir check-resume)
+for i in $(seq 5); do
+	mkdir "$tmp/dir$i"
+	for j in $(seq 100); do
+		head -c 5000 /dev/urandom > "$tmp/dir$i/file$j"
+	done
+done
+run_check_mkfs_test_dev --rootdir "$tmp"
+rm -rf -- "$tmp"
+check_image "$TEST_DEV"
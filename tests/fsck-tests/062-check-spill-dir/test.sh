@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Verify that check with the records spilled to disk (--spill-dir) reports the
+# same as the check with all records in memory
+
+source "$TEST_TOP/common"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+
+setup_root_helper
+prepare_test_dev
+
+spill_dir=$(_mktemp_dir check-spill-dir)
+
+# Drop the memory usage report, and the address of a backref that differs
+# between runs
+filter_output()
+{
+	grep -v -e '^Peak memory usage' -e '^	' \
+		-e '^records spilled to disk: ' \
+		-e '^WARNING: memory limit .* exceeded' |
+	sed -e 's/ back 0x[0-9a-f]*$//'
+}
+
+check_spill()
+{
+	local image="$1"
+	local limit="$2"
+	local plain
+	local spilled
+	local ret_plain
+	local ret_spilled
+
+	plain=$(run_mayfail_stdout "$TOP/btrfs" check "$image")
+	ret_plain=$?
+	spilled=$(run_mayfail_stdout "$TOP/btrfs" check --mem-limit "$limit" \
+		--spill-dir "$spill_dir" "$image")
+	ret_spilled=$?
+
+	if ! echo "$spilled" | grep -q '^records spilled to disk: [1-9]'; then
+		_fail "no records spilled to disk with limit $limit"
+	fi
+	if [ -n "$(ls -A "$spill_dir")" ]; then
+		_fail "spill file not deleted"
+	fi
+	if [ "$ret_plain" != "$ret_spilled" ]; then
+		_fail "exit code $ret_spilled with spill dir, $ret_plain without"
+	fi
+	if [ "$(echo "$plain" | filter_output)" != \
+	     "$(echo "$spilled" | filter_output)" ]; then
+		_log "check output:"
+		_log "$plain"
+		_log "check output with spill dir:"
+		_log "$spilled"
+		_fail "different output with spill dir"
+	fi
+}
+
+check_image()
+{
+	check_spill "$1" 4K
+}
+
+# Images with the various kinds of references and with errors
+for dir in 001-bad-file-extent-bytenr 020-extent-ref-cases \
+	   038-missing-one-file-extent; do
+	check_all_images "$TEST_TOP/fsck-tests/$dir"
+done
+
+tmp=$(_mktemp_dir check-spill-dir)
+for i in $(seq 5); do
+	mkdir "$tmp/dir$i"
+	for j in $(seq 100); do
+		head -c 5000 /dev/urandom > "$tmp/dir$i/file$j"
+	done
+done
+run_check_mkfs_test_dev --rootdir "$tmp"
+rm -rf -- "$tmp"
+check_spill "$TEST_DEV" 256K
+
+rmdir -- "$spill_dir"
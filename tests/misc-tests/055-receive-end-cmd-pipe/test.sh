@@ -0,0 +1,44 @@
+#!/bin/bash
+# Receive two streams sent through one pipe by two 'receive -e' processes, the
+# first one must not consume data past its end of stream
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+run_check $SUDO_HELPER mkdir "$TEST_MNT/src" "$TEST_MNT/dst1" "$TEST_MNT/dst2"
+for i in 1 2; do
+	run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/src/subv$i"
+	for j in `seq 4`; do
+		run_check $SUDO_HELPER dd if=/dev/urandom \
+			of="$TEST_MNT/src/subv$i/file$j" bs=1M count=1
+	done
+	run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r \
+		"$TEST_MNT/src/subv$i" "$TEST_MNT/src/snap$i"
+done
+
+_mktemp_local send1.stream
+_mktemp_local send2.stream
+run_check $SUDO_HELPER "$TOP/btrfs" send -f send1.stream "$TEST_MNT/src/snap1"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f send2.stream "$TEST_MNT/src/snap2"
+
+cat send1.stream send2.stream | {
+	run_check $SUDO_HELPER "$TOP/btrfs" receive -e "$TEST_MNT/dst1"
+	run_check $SUDO_HELPER "$TOP/btrfs" receive -e "$TEST_MNT/dst2"
+} || _fail "receiving two streams from one pipe failed"
+
+for i in 1 2; do
+	run_check $SUDO_HELPER diff -r "$TEST_MNT/src/snap$i" \
+		"$TEST_MNT/dst$i/snap$i"
+done
+
+run_check_umount_test_dev
+
+rm -f send1.stream send2.stream
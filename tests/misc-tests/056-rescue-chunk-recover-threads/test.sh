@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Verify that chunk-recover scanning the device in several threads (-j) finds
+# and writes the same chunks as the scan in one thread
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir chunk-recover)
+image="$tmp/image"
+
+# Run chunk-recover on a copy of the test device, the output without the
+# progress of the scan is saved to $tmp/output.$1 and the result to
+# $tmp/image.$1
+recover()
+{
+	local jobs="$1"
+
+	run_check cp --sparse=always "$TEST_DEV" "$image"
+	run_check_stdout $SUDO_HELPER "$TOP/btrfs" -v rescue chunk-recover -y \
+		-j "$jobs" "$image" | tr '\r' '\n' | grep -v '^Scanning' \
+		> "$tmp/output.$jobs"
+	run_check mv -- "$image" "$image.$jobs"
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$image.$jobs"
+}
+
+recover_threads()
+{
+	recover 1
+	recover 4
+
+	if ! diff -u "$tmp/output.1" "$tmp/output.4" >> "$RESULTS"; then
+		_fail "different chunks found with threads"
+	fi
+	if ! cmp "$image.1" "$image.4" >> "$RESULTS" 2>&1; then
+		_fail "different chunk tree written with threads"
+	fi
+	rm -f -- "$tmp/output.1" "$tmp/output.4" "$image.1" "$image.4"
+}
+
+# Enough data for several chunks of each type
+mkdir "$tmp/root"
+for i in $(seq 5); do
+	mkdir "$tmp/root/dir$i"
+	for j in $(seq 100); do
+		head -c 5000 /dev/urandom > "$tmp/root/dir$i/file$j"
+	done
+done
+run_check_mkfs_test_dev -m single --rootdir "$tmp/root"
+rm -rf -- "$tmp/root"
+recover_threads
+
+run_check_mkfs_test_dev -d dup -m dup
+recover_threads
+
+rmdir -- "$tmp"
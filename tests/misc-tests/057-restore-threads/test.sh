@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# Verify that restore reading the data in several threads (-j) and through
+# io_uring restores the same files as the restore in one thread. Data shared by
+# several files are cloned or copied in the target where possible, otherwise
+# written again, the contents must be the same in all cases.
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir restore)
+
+# Restore $1 in one thread, with -j 4 and with -j 4 --io-uring, and compare
+# the results
+restore_threads()
+{
+	local image="$1"
+	local ret
+	local ret_threads
+
+	run_check rm -rf -- "$tmp/restore"
+	run_check mkdir "$tmp/restore"
+	run_mayfail "$TOP/btrfs" restore "$image" "$tmp/restore"
+	ret=$?
+
+	for opts in "-j 4" "-j 4 --io-uring"; do
+		run_check rm -rf -- "$tmp/restore-threads"
+		run_check mkdir "$tmp/restore-threads"
+		run_mayfail "$TOP/btrfs" restore $opts "$image" \
+			"$tmp/restore-threads"
+		ret_threads=$?
+		if [ "$ret" != "$ret_threads" ]; then
+			_fail "exit code $ret_threads with $opts, $ret without"
+		fi
+		run_check diff -r "$tmp/restore" "$tmp/restore-threads"
+	done
+	run_check rm -rf -- "$tmp/restore-threads"
+}
+
+check_image()
+{
+	restore_threads "$1"
+}
+
+# Images with data shared by several files
+check_all_images "$TEST_TOP/fsck-tests/020-extent-ref-cases"
+
+# Files of various sizes, hard links and compressed data, compared also with
+# the source
+run_check mkdir -p "$tmp/src/dir"
+for i in $(seq 100); do
+	head -c $((i * 3000)) /dev/urandom > "$tmp/src/dir/file$i"
+done
+seq 1 200000 > "$tmp/src/text"
+run_check dd if=/dev/urandom of="$tmp/src/large" bs=1M count=8
+run_check ln "$tmp/src/text" "$tmp/src/dir/link"
+touch "$tmp/src/empty"
+
+for opts in "" "--compress zlib"; do
+	run_check_mkfs_test_dev --rootdir "$tmp/src" $opts
+	restore_threads "$TEST_DEV"
+	run_check diff -r "$tmp/src" "$tmp/restore"
+done
+
+rm -rf -- "$tmp"
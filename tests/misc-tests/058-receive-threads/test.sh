@@ -0,0 +1,75 @@
+#!/bin/bash
+# Receive a full and an incremental stream in one thread, with several threads
+# (-j) and through io_uring, the received subvolumes must be the same
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+src="$TEST_MNT/src"
+run_check $SUDO_HELPER mkdir "$TEST_MNT/dst1" "$TEST_MNT/dst2" "$TEST_MNT/dst3"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$src"
+run_check $SUDO_HELPER mkdir "$src/dir1" "$src/dir2"
+for i in `seq 20`; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$src/dir1/file$i" \
+		bs=64K count=$i
+done
+run_check $SUDO_HELPER dd if=/dev/urandom of="$src/large" bs=1M count=16
+run_check $SUDO_HELPER cp --reflink=always "$src/large" "$src/dir2/clone"
+run_check $SUDO_HELPER ln "$src/dir1/file1" "$src/dir2/link"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" \
+	"$TEST_MNT/snap1"
+
+# Renames, overwrites and deletes for the incremental stream, with the
+# directories changed while their files are written
+run_check $SUDO_HELPER mv "$src/dir1" "$src/dir2/dir1"
+for i in `seq 1 2 20`; do
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$src/dir2/dir1/file$i" \
+		bs=4K count=8 seek=$i conv=notrunc
+done
+for i in `seq 2 4 20`; do
+	run_check $SUDO_HELPER rm -f "$src/dir2/dir1/file$i"
+done
+run_check $SUDO_HELPER truncate -s 1M "$src/large"
+run_check $SUDO_HELPER mv "$src/dir2/clone" "$src/clone"
+run_check $SUDO_HELPER mkdir "$src/dir3"
+run_check $SUDO_HELPER dd if=/dev/urandom of="$src/dir3/new" bs=1M count=4
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$src" \
+	"$TEST_MNT/snap2"
+
+_mktemp_local send1.stream
+_mktemp_local send2.stream
+run_check $SUDO_HELPER "$TOP/btrfs" send -f send1.stream "$TEST_MNT/snap1"
+run_check $SUDO_HELPER "$TOP/btrfs" send -p "$TEST_MNT/snap1" -f send2.stream \
+	"$TEST_MNT/snap2"
+
+receive()
+{
+	local dst="$1"
+	shift
+
+	run_check $SUDO_HELPER "$TOP/btrfs" receive "$@" -f send1.stream "$dst"
+	run_check $SUDO_HELPER "$TOP/btrfs" receive "$@" -f send2.stream "$dst"
+}
+
+receive "$TEST_MNT/dst1"
+receive "$TEST_MNT/dst2" -j 4
+receive "$TEST_MNT/dst3" --io-uring
+
+for i in 1 2 3; do
+	for snap in snap1 snap2; do
+		run_check $SUDO_HELPER diff -r "$TEST_MNT/$snap" \
+			"$TEST_MNT/dst$i/$snap"
+	done
+done
+
+run_check_umount_test_dev
+
+rm -f send1.stream send2.stream
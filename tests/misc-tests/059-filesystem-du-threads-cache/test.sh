@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# btrfs fi du with several threads (-j) and with the results from --cache must
+# print the same as without, also after the sharing of the files changed
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_global_prereq xfs_io
+setup_root_helper
+prepare_test_dev
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+_mktemp_local du.cache
+
+# Compare the output with several threads and with the cache, which is used
+# twice to get results stored by the previous run
+check_du()
+{
+	local expected
+	local output
+
+	expected=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" filesystem du \
+		--raw "$TEST_MNT")
+	output=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" filesystem du \
+		--raw -j 4 "$TEST_MNT")
+	[ "$expected" = "$output" ] || _fail "different output with -j 4"
+	for i in 1 2; do
+		output=$(run_check_stdout $SUDO_HELPER "$TOP/btrfs" filesystem du \
+			--raw --cache du.cache "$TEST_MNT")
+		[ "$expected" = "$output" ] || _fail "different output with cache, run $i"
+	done
+}
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+run_check $SUDO_HELPER mkdir "$TEST_MNT/subv/dir"
+for i in `seq 20`; do
+	run_check $SUDO_HELPER dd if=/dev/urandom \
+		of="$TEST_MNT/subv/dir/file$i" bs=16K count=$i
+done
+# A file with a clone of its own extent and one shared with another file
+run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/file" \
+	bs=1M count=1
+run_check $SUDO_HELPER xfs_io -c "reflink $TEST_MNT/subv/file 0 1M 1M" \
+	"$TEST_MNT/subv/file"
+run_check $SUDO_HELPER cp --reflink=always "$TEST_MNT/subv/dir/file20" \
+	"$TEST_MNT/subv/clone"
+run_check $SUDO_HELPER "$TOP/btrfs" filesystem sync "$TEST_MNT"
+check_du
+
+# All files become shared without changing
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot "$TEST_MNT/subv" \
+	"$TEST_MNT/snap"
+run_check $SUDO_HELPER "$TOP/btrfs" filesystem sync "$TEST_MNT"
+check_du
+
+# Part of the files become exclusive again
+for i in `seq 1 2 20`; do
+	run_check $SUDO_HELPER dd if=/dev/urandom \
+		of="$TEST_MNT/snap/dir/file$i" bs=16K count=$i conv=notrunc
+done
+run_check $SUDO_HELPER "$TOP/btrfs" filesystem sync "$TEST_MNT"
+check_du
+
+rm -f du.cache
+
+run_check_umount_test_dev
@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Verify that btrfs-find-root finds the tree root if the owner in the header of
+# the first copy is damaged and only the second copy is valid
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq btrfs-map-logical
+check_prereq btrfs-find-root
+check_global_prereq dd
+
+prepare_test_dev
+
+run_check_mkfs_test_dev -m dup
+root=$(run_check_stdout "$TOP/btrfs" inspect-internal dump-super "$TEST_DEV" |
+	awk '$1 == "root" { print $2 }')
+physical=$(run_check_stdout "$TOP/btrfs-map-logical" -l "$root" "$TEST_DEV" |
+	awk '$1 == "mirror" && $2 == 1 { print $6 }')
+[ -n "$physical" ] || _fail "cannot map the tree root $root"
+
+# The owner is at offset 88 of the header
+printf '\x07' | run_check dd of="$TEST_DEV" bs=1 seek=$((physical + 88)) \
+	conv=notrunc
+
+run_check_stdout "$INTERNAL_BIN/btrfs-find-root" "$TEST_DEV" |
+	grep -q "Found tree root at $root " ||
+	_fail "tree root not found with a damaged first copy"
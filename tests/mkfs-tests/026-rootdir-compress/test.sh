@@ -0,0 +1,48 @@
+#!/bin/bash
+# Check that mkfs.btrfs --rootdir --compress writes valid compressed extents,
+# the files are read back by restore and compared with the source
+
+source "$TEST_TOP/common"
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_global_prereq seq
+check_global_prereq dd
+
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir)
+
+run_check mkdir -p "$tmp/src/dir"
+seq 1 200000 > "$tmp/src/text"
+seq 1 1000 > "$tmp/src/dir/small"
+run_check dd if=/dev/urandom of="$tmp/src/random" bs=64K count=8
+cat "$tmp/src/text" "$tmp/src/random" "$tmp/src/text" > "$tmp/src/dir/mixed"
+run_check ln "$tmp/src/text" "$tmp/src/dir/link"
+
+# The lzo format is not written by mkfs
+run_mustfail "lzo compression accepted" \
+	"$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" --compress lzo "$TEST_DEV"
+
+for algo in zlib zlib:9 zstd zstd:15; do
+	# zlib is always built in, zstd is optional
+	if [ "${algo%%:*}" != "zlib" ] &&
+	   "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" --compress "$algo" \
+		"$TEST_DEV" 2>&1 |
+	   grep -q "not compiled with ${algo%%:*} support"; then
+		_log "skip compression $algo, not supported by the build"
+		continue
+	fi
+	run_check "$TOP/mkfs.btrfs" -f --rootdir "$tmp/src" -j 2 \
+		--compress "$algo" "$TEST_DEV"
+	run_check "$TOP/btrfs" check --check-data-csum "$TEST_DEV"
+	run_check rm -rf -- "$tmp/restore"
+	run_check mkdir "$tmp/restore"
+	run_check "$TOP/btrfs" restore "$TEST_DEV" "$tmp/restore"
+	run_check diff -r "$tmp/src" "$tmp/restore"
+	run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t fs "$TEST_DEV" |
+		grep -q "compression [123]" ||
+		_fail "no compressed extents with $algo"
+done
+
+rm -rf -- "$tmp"
@@ -0,0 +1,389 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Measure the send stream parser, a recorded stream (eg. from
+ * 'btrfs send -f') is replayed to callbacks that do nothing.
+ *
+ * Usage:
+ *
+ * $ ./send-stream-speedtest [-p] <stream> [iterations]
+ *
+ * The stream file is read directly, or with -p fed through a pipe like
+ * 'btrfs send | btrfs receive' does. All the streams in the file are
+ * processed in each iteration.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "kernel-lib/sizes.h"
+#include "crypto/crc32c.h"
+#include "common/messages.h"
+#include "common/send-stream.h"
+#include "common/utils.h"
+
+static u64 nr_cmds;
+static u64 data_bytes;
+
+static int op_subvol(const char *path, const u8 *uuid, u64 ctransid,
+		     void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+		       const u8 *parent_uuid, u64 parent_ctransid, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_path(const char *path, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_path2(const char *path, const char *path2, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_write(const char *path, const void *data, u64 offset, u64 len,
+		    void *user)
+{
+	nr_cmds++;
+	data_bytes += len;
+	return 0;
+}
+
+static int op_clone(const char *path, u64 offset, u64 len,
+		    const u8 *clone_uuid, u64 clone_ctransid,
+		    const char *clone_path, u64 clone_offset, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_set_xattr(const char *path, const char *name, const void *data,
+			int len, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_remove_xattr(const char *path, const char *name, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_u64(const char *path, u64 value, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_utimes(const char *path, struct timespec *at,
+		     struct timespec *mt, struct timespec *ct, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_update_extent(const char *path, u64 offset, u64 len, void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_encoded_write(const char *path, const void *data, u64 offset,
+			    u64 len, u64 unencoded_file_len, u64 unencoded_len,
+			    u64 unencoded_offset, u32 compression,
+			    u32 encryption, void *user)
+{
+	nr_cmds++;
+	data_bytes += len;
+	return 0;
+}
+
+static int op_fallocate(const char *path, int mode, u64 offset, u64 len,
+			void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static int op_enable_verity(const char *path, u8 algorithm, u32 block_size,
+			    int salt_len, char *salt, int sig_len, char *sig,
+			    void *user)
+{
+	nr_cmds++;
+	return 0;
+}
+
+static struct btrfs_send_ops null_send_ops = {
+	.subvol = op_subvol,
+	.snapshot = op_snapshot,
+	.mkfile = op_path,
+	.mkdir = op_path,
+	.mknod = op_mknod,
+	.mkfifo = op_path,
+	.mksock = op_path,
+	.symlink = op_path2,
+	.rename = op_path2,
+	.link = op_path2,
+	.unlink = op_path,
+	.rmdir = op_path,
+	.write = op_write,
+	.clone = op_clone,
+	.set_xattr = op_set_xattr,
+	.remove_xattr = op_remove_xattr,
+	.truncate = op_u64,
+	.chmod = op_u64,
+	.chown = op_chown,
+	.utimes = op_utimes,
+	.update_extent = op_update_extent,
+	.encoded_write = op_encoded_write,
+	.fallocate = op_fallocate,
+	.fileattr = op_u64,
+	.enable_verity = op_enable_verity,
+};
+
+struct feeder {
+	int in_fd;
+	int out_fd;
+};
+
+/* Write the whole stream file to the pipe */
+static void *feed_pipe(void *arg)
+{
+	struct feeder *feeder = arg;
+	static char buf[SZ_1M];
+	ssize_t ret;
+
+	while ((ret = read(feeder->in_fd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+
+		while (ret > 0) {
+			ssize_t written = write(feeder->out_fd, p, ret);
+
+			if (written < 0)
+				goto out;
+			p += written;
+			ret -= written;
+		}
+	}
+out:
+	close(feeder->out_fd);
+	return NULL;
+}
+
+/* Process all streams from fd like receive does */
+static int process_streams(int fd, bool use_pipe)
+{
+	struct btrfs_send_stream *stream = NULL;
+	int ret;
+
+	if (use_pipe) {
+		stream = btrfs_send_stream_open(fd, false);
+		if (!stream)
+			return -ENOMEM;
+	}
+	do {
+		if (stream)
+			ret = btrfs_send_stream_process(stream, &null_send_ops,
+							NULL, 0, 1);
+		else
+			ret = btrfs_read_and_process_send_stream(fd,
+						&null_send_ops, NULL, 0, 1);
+	} while (ret == 0);
+	btrfs_send_stream_close(stream);
+
+	/* End of the last stream */
+	if (ret == -ENODATA)
+		ret = 0;
+	return ret;
+}
+
+static int run_iteration(const char *filename, bool use_pipe)
+{
+	struct feeder feeder;
+	pthread_t thread;
+	int fds[2];
+	int fd;
+	int ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		error("cannot open %s: %m", filename);
+		return -errno;
+	}
+	if (!use_pipe) {
+		ret = process_streams(fd, false);
+		close(fd);
+		return ret;
+	}
+
+	if (pipe(fds) < 0) {
+		ret = -errno;
+		error("cannot create pipe: %m");
+		close(fd);
+		return ret;
+	}
+	feeder.in_fd = fd;
+	feeder.out_fd = fds[1];
+	ret = pthread_create(&thread, NULL, feed_pipe, &feeder);
+	if (ret) {
+		error("cannot create thread: %m");
+		close(fds[0]);
+		close(fds[1]);
+		close(fd);
+		return -ret;
+	}
+	ret = process_streams(fds[0], true);
+	/* Let the feeder finish on a parse error */
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	close(fd);
+	return ret;
+}
+
+static void print_usage(void)
+{
+	printf("usage: send-stream-speedtest [options] <stream> [iterations]\n");
+	printf("\n");
+	printf("Measure the send stream parser on a recorded stream\n");
+	printf("\n");
+	printf("  -p|--pipe      read the stream through a pipe\n");
+	printf("  -h|--help      print this help\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	struct stat st;
+	const char *filename;
+	bool use_pipe = false;
+	u64 nsecs;
+	double secs;
+	int iterations = 10;
+	int i;
+	int ret;
+
+	crc32c_optimization_init();
+	while (1) {
+		static const struct option long_options[] = {
+			{ "pipe", no_argument, NULL, 'p' },
+			{ "help", no_argument, NULL, 'h' },
+			{ NULL, 0, NULL, 0 }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "ph", long_options, NULL);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'p':
+			use_pipe = true;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		print_usage();
+		return 1;
+	}
+	filename = argv[optind++];
+	if (optind < argc)
+		iterations = atoi(argv[optind]);
+	if (iterations <= 0) {
+		error("invalid number of iterations");
+		return 1;
+	}
+
+	if (stat(filename, &st) < 0) {
+		error("cannot access %s: %m", filename);
+		return 1;
+	}
+	/* A parse error closes the pipe while the feeder still writes */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Warm up the page cache, also verifies the stream */
+	ret = run_iteration(filename, use_pipe);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot process stream %s: %m", filename);
+		return 1;
+	}
+	nr_cmds = 0;
+	data_bytes = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		ret = run_iteration(filename, use_pipe);
+		if (ret < 0)
+			return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	nsecs = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+		end.tv_nsec - start.tv_nsec;
+	secs = (double)nsecs / 1000000000.0;
+	if (secs == 0.0)
+		secs = 1e-9;
+
+	printf("Input:        %s\n", use_pipe ? "pipe" : "file");
+	printf("Iterations:   %d\n", iterations);
+	printf("Stream size:  %llu\n", (u64)st.st_size);
+	printf("Commands:     %llu per iteration\n", nr_cmds / iterations);
+	printf("Data:         %llu per iteration\n", data_bytes / iterations);
+	printf("Time:         %.3f s\n", secs);
+	printf("Throughput:   %.3f MiB/s, %.0f commands/s\n",
+	       (double)st.st_size * iterations / secs / SZ_1M,
+	       (double)nr_cmds / secs);
+
+	return 0;
+}